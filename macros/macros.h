@@ -3,6 +3,8 @@
 
 #define ARRAY_SIZE(x)     (sizeof(x) / sizeof(*x))
 
+#define CACHE_LINE_SIZE   64
+
 #define MAX(x, y)         (((x) > (y)) ? (x) : (y))
 #define MIN(x, y)         (((x) < (y)) ? (x) : (y))
 #define IS_POWER_2(x)     (((x) & ((x) - 1)) == 0)
@@ -3,18 +3,26 @@
 #include <string.h>
 #include <stdio.h>
 #include <signal.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include "net/udp_distributor.h"
+#include "net/handover.h"
 #include "net/socket_filter.h"
+#include "net/fanout_filter.h"
+#include "net/cpu_affinity.h"
 #include "macros/macros.h"
 
 struct reception {
   unsigned ifindex;
-  size_t ring_size;
+  size_t ring_size; // 0: not specified.
 };
 
 struct interface {
-  size_t ring_size;
+  size_t ring_size; // 0: not specified.
+
+  // Number of TX ring buffers (workers and helpers with destinations on the
+  // interface, the TX thread or the shared one).
+  size_t nrings;
 
   char name[IF_NAMESIZE];
   unsigned ifindex;
@@ -24,6 +32,41 @@ struct interface {
   uint8_t addr6[sizeof(struct in6_addr)];
 };
 
+struct fragments {
+  net::udp_distributor::fragment_mode mode;
+  size_t ndatagrams;
+  unsigned timeout;
+};
+
+struct elastic {
+  size_t min_workers; // 0: no elastic scaling.
+  unsigned scale_up;
+  unsigned scale_down;
+  bool release_memory;
+};
+
+struct traffic_class {
+  net::socket_filter filter;
+
+  size_t ring_size; // 0: same as the RX ring buffer.
+  size_t weight;
+};
+
+// DSCPs of a priority class of the TX scheduler (for parse_port_list()).
+struct dscp_list {
+  net::tx_scheduler::priority_class& c;
+
+  bool port(unsigned dscp)
+  {
+    return c.dscp(dscp);
+  }
+
+  bool port_range(unsigned from, unsigned to)
+  {
+    return c.dscp_range(from, to);
+  }
+};
+
 struct destination {
   unsigned ifindex;
 
@@ -33,10 +76,58 @@ struct destination {
   socklen_t addrlen;
 
   in_port_t port;
+
+  // Rate limit (if `limited` is set).
+  bool limited;
+  net::rate_limiter::parameters limit;
+
+  // Direct server return.
+  bool dsr;
+
+  // Other links (TX interface and ethernet address of the next hop).
+  struct {
+    unsigned ifindex;
+    uint8_t macaddr[ETHER_ADDR_LEN];
+  } links[net::worker::max_links - 1];
+
+  size_t nlinks;
+};
+
+struct mirror {
+  unsigned ifindex;
+
+  size_t snaplen; // 0: whole frame.
+  int vlan; // -1: untagged.
+};
+
+// Values of the options which are processed after parsing the command
+// line (the destinations and the mirror ports need the TX interfaces, the
+// steering rules are parsed again when they are reloaded).
+struct deferred_options {
+  const char** dest_values;
+  struct destination* dests;
+
+  const char** mirror_values;
+  struct mirror* mirrors;
+
+  const char** rules;
+  size_t nrules;
 };
 
+static int distribute(int argc,
+                      const char** argv,
+                      struct interface* interfaces,
+                      struct deferred_options& deferred);
+
 static void usage(const char* program);
 
+// Wait for a signal, with elastic scaling the load is evaluated
+// periodically meanwhile.
+static bool wait_signal(const sigset_t& set,
+                        bool elastic,
+                        net::udp_distributor& udp_distributor,
+                        int& sig);
+
 static bool parse_reception(const char* s, struct reception& reception);
 static bool parse_interface(const char* s, struct interface& interface);
 static bool parse_destination(const char* s,
@@ -44,7 +135,62 @@ static bool parse_destination(const char* s,
                               size_t ninterfaces,
                               struct destination& dest);
 
-static bool parse_port_list(const char* s, net::socket_filter& filter);
+static bool parse_rate_limit(const char* s,
+                             net::rate_limiter::parameters& limit);
+
+static bool parse_link(const char* s,
+                       const struct interface* interfaces,
+                       size_t ninterfaces,
+                       unsigned& ifindex,
+                       uint8_t* macaddr);
+
+static bool parse_mirror(const char* s,
+                         const struct interface* interfaces,
+                         size_t ninterfaces,
+                         struct mirror& mirror);
+
+static bool parse_class(const char* s, struct traffic_class& c);
+static bool parse_tx_class(const char* s,
+                           net::tx_scheduler::priority_class& c);
+
+static bool ring_sizes(const struct destination* dests,
+                       size_t ndests,
+                       const struct mirror* mirrors,
+                       size_t nmirrors,
+                       net::udp_distributor::type type,
+                       size_t nworkers,
+                       size_t budget,
+                       struct reception& reception,
+                       struct traffic_class* classes,
+                       size_t nclasses,
+                       struct interface* interfaces,
+                       size_t ninterfaces,
+                       size_t nhelpers,
+                       bool single_tx_ring);
+
+static bool place_workers(net::udp_distributor& udp_distributor,
+                          unsigned ifindex,
+                          size_t nworkers,
+                          bool auto_cpus,
+                          const cpu_set_t& cpus);
+
+static bool parse_fanout(const char* s, int& fanout);
+static bool parse_fragments(const char* s, struct fragments& fragments);
+static bool parse_elastic(const char* s, struct elastic& elastic);
+static bool parse_steering_rule(const char* s, net::fanout_filter& filter);
+static bool load_steering(const char* const* rules,
+                          size_t nrules,
+                          const char* filename,
+                          net::fanout_filter& filter);
+
+template<typename filter_t>
+static bool parse_port_list(const char* s, filter_t& filter);
+
+static bool parse_workers(const char* s,
+                          size_t len,
+                          size_t& first,
+                          size_t& count);
+
 static bool parse_interface_name(const char* s, size_t len, unsigned& ifindex);
 static bool parse_mac_address(const char* s, size_t len, uint8_t* macaddr);
 static bool parse_ipv4_address(const char* s, size_t len, uint8_t* addr);
@@ -63,21 +209,159 @@ static bool parse_number(const char* s,
 static int hex2bin(char c);
 
 int main(int argc, const char** argv)
+{
+  // Count interfaces for TX, destinations, mirror ports and steering rules.
+  size_t n = 0, ndests = 0, nmirrors = 0, nrules = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcasecmp(argv[i], "--tx") == 0) {
+      n++;
+    } else if (strcasecmp(argv[i], "--dest") == 0) {
+      ndests++;
+    } else if (strcasecmp(argv[i], "--mirror") == 0) {
+      nmirrors++;
+    } else if (strcasecmp(argv[i], "--steer") == 0) {
+      nrules++;
+    }
+  }
+
+  struct interface* interfaces = nullptr;
+  if ((n > 0) &&
+      ((interfaces = reinterpret_cast<struct interface*>(
+                       malloc(n * sizeof(struct interface))
+                     )) == nullptr)) {
+    fprintf(stderr, "Error allocating memory.\n");
+    return -1;
+  }
+
+  struct deferred_options deferred;
+  deferred.dest_values = reinterpret_cast<const char**>(
+                           calloc(ndests + 1, sizeof(const char*))
+                         );
+
+  deferred.dests = reinterpret_cast<struct destination*>(
+                     calloc(ndests + 1, sizeof(struct destination))
+                   );
+
+  deferred.mirror_values = reinterpret_cast<const char**>(
+                             calloc(nmirrors + 1, sizeof(const char*))
+                           );
+
+  deferred.mirrors = reinterpret_cast<struct mirror*>(
+                       calloc(nmirrors + 1, sizeof(struct mirror))
+                     );
+
+  deferred.rules = reinterpret_cast<const char**>(
+                     calloc(nrules + 1, sizeof(const char*))
+                   );
+
+  deferred.nrules = 0;
+
+  int ret = -1;
+
+  if ((deferred.dest_values) &&
+      (deferred.dests) &&
+      (deferred.mirror_values) &&
+      (deferred.mirrors) &&
+      (deferred.rules)) {
+    ret = distribute(argc, argv, interfaces, deferred);
+  } else {
+    fprintf(stderr, "Error allocating memory.\n");
+  }
+
+  free(deferred.rules);
+  free(deferred.mirrors);
+  free(deferred.mirror_values);
+  free(deferred.dests);
+  free(deferred.dest_values);
+
+  if (interfaces) {
+    free(interfaces);
+  }
+
+  return ret;
+}
+
+int distribute(int argc,
+               const char** argv,
+               struct interface* interfaces,
+               struct deferred_options& deferred)
 {
   net::udp_distributor::type type = net::udp_distributor::type::load_balancer;
 
   struct reception reception;
   reception.ifindex = 0;
 
-  struct interface interfaces[net::worker::max_interfaces];
   size_t ninterfaces = 0;
 
   size_t ndests = 0;
 
+  size_t nmirrors = 0;
+
   net::socket_filter filter;
 
+  struct traffic_class classes[net::udp_distributor::max_classes];
+  size_t nclasses = 0;
+
   size_t nworkers = net::udp_distributor::default_workers;
 
+  struct fragments fragments;
+  fragments.mode = net::udp_distributor::fragment_mode::discard;
+  fragments.ndatagrams = net::ipv4_reassembler::default_datagrams;
+  fragments.timeout = net::ipv4_reassembler::default_timeout;
+
+  // Number of destination addresses of the IPv4 fragments.
+  size_t nfragment_addresses = 0;
+
+  int fanout = PACKET_FANOUT_HASH;
+
+  bool defrag = false;
+
+  // Steering rules (PACKET_FANOUT_CBPF).
+  bool steering = false;
+  const char* steering_file = nullptr;
+
+  // CPUs of the workers (automatic placement if `auto_cpus` is set).
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  bool auto_cpus = false;
+
+  // CPU of the control thread (-1: any).
+  int control_cpu = -1;
+
+  // Memory budget for all the ring buffers (0: no budget).
+  size_t budget = 0;
+
+  // UNIX socket for the hot upgrade (packet sockets handed over from the
+  // running process to the new one).
+  const char* takeover = nullptr;
+
+  // Number of frames per queue of the TX threads (0: no TX threads).
+  size_t tx_queue = 0;
+
+  // Priority classes of the TX scheduler (none: no TX scheduler).
+  net::tx_scheduler::priority_class tx_classes[net::tx_scheduler::max_classes];
+  size_t ntx_classes = 0;
+
+  // One TX ring buffer per interface shared by the workers?
+  bool shared_tx = false;
+
+  // One hardware TX queue per worker?
+  bool queue_tx = false;
+
+  // Number of helpers per worker (broadcaster).
+  size_t nhelpers = 0;
+
+  // Work stealing between the workers (and with flow affinity?).
+  bool stealing = false;
+  bool flow_affinity = false;
+
+  // Elastic scaling of the number of active workers.
+  struct elastic elastic;
+  elastic.min_workers = 0;
+  elastic.scale_up = net::udp_distributor::default_scale_up;
+  elastic.scale_down = net::udp_distributor::default_scale_down;
+  elastic.release_memory = false;
+
   int i = 1;
 
   while (i < argc) {
@@ -96,19 +380,11 @@ int main(int argc, const char** argv)
     } else if (strcasecmp(argv[i], "--tx") == 0) {
       // If not the last argument...
       if (i + 1 < argc) {
-        if (ninterfaces < net::worker::max_interfaces) {
-          if (parse_interface(argv[i + 1], interfaces[ninterfaces])) {
-            ninterfaces++;
+        if (parse_interface(argv[i + 1], interfaces[ninterfaces])) {
+          ninterfaces++;
 
-            i += 2;
-          } else {
-            return -1;
-          }
+          i += 2;
         } else {
-          fprintf(stderr,
-                  "Cannot define more interfaces (%zu).\n",
-                  ninterfaces);
-
           return -1;
         }
       } else {
@@ -119,7 +395,18 @@ int main(int argc, const char** argv)
       // If not the last argument...
       if (i + 1 < argc) {
         // Process it later.
-        ndests++;
+        deferred.dest_values[ndests++] = argv[i + 1];
+
+        i += 2;
+      } else {
+        usage(argv[0]);
+        return -1;
+      }
+    } else if (strcasecmp(argv[i], "--mirror") == 0) {
+      // If not the last argument...
+      if (i + 1 < argc) {
+        // Process it later.
+        deferred.mirror_values[nmirrors++] = argv[i + 1];
 
         i += 2;
       } else {
@@ -147,6 +434,20 @@ int main(int argc, const char** argv)
       // If not the last argument...
       if (i + 1 < argc) {
         if (parse_port_list(argv[i + 1], filter)) {
+          // The ports of the default traffic class cannot belong to another
+          // traffic class.
+          for (size_t j = 0; j < nclasses; j++) {
+            if (filter.overlaps(classes[j].filter)) {
+              fprintf(stderr,
+                      "The ports '%s' overlap the ports of traffic class "
+                      "%zu.\n",
+                      argv[i + 1],
+                      j + 1);
+
+              return -1;
+            }
+          }
+
           i += 2;
         } else {
           fprintf(stderr, "Invalid port list or too many ports defined.\n");
@@ -156,324 +457,2156 @@ int main(int argc, const char** argv)
         usage(argv[0]);
         return -1;
       }
-    } else if (strcasecmp(argv[i], "--number-workers") == 0) {
+    } else if (strcasecmp(argv[i], "--class") == 0) {
       // If not the last argument...
       if (i + 1 < argc) {
-        if (parse_number(argv[i + 1],
-                         net::udp_distributor::min_workers,
-                         net::udp_distributor::max_workers,
-                         nworkers)) {
+        if (nclasses < net::udp_distributor::max_classes) {
+          if (parse_class(argv[i + 1], classes[nclasses])) {
+            // A port belongs to one traffic class only.
+            if (classes[nclasses].filter.overlaps(filter)) {
+              fprintf(stderr,
+                      "The ports of traffic class '%s' overlap the ports of "
+                      "the default traffic class (--ports).\n",
+                      argv[i + 1]);
+
+              return -1;
+            }
+
+            for (size_t j = 0; j < nclasses; j++) {
+              if (classes[nclasses].filter.overlaps(classes[j].filter)) {
+                fprintf(stderr,
+                        "The ports of traffic class '%s' overlap the ports "
+                        "of traffic class %zu.\n",
+                        argv[i + 1],
+                        j + 1);
+
+                return -1;
+              }
+            }
+
+            nclasses++;
+
+            i += 2;
+          } else {
+            return -1;
+          }
+        } else {
+          fprintf(stderr,
+                  "Cannot define more traffic classes (%zu).\n",
+                  nclasses);
+
+          return -1;
+        }
+      } else {
+        usage(argv[0]);
+        return -1;
+      }
+    } else if (strcasecmp(argv[i], "--fanout") == 0) {
+      // If not the last argument...
+      if (i + 1 < argc) {
+        if (parse_fanout(argv[i + 1], fanout)) {
           i += 2;
         } else {
-          fprintf(stderr, "Invalid number of workers '%s'.\n", argv[i + 1]);
+          fprintf(stderr, "Invalid fanout mode '%s'.\n", argv[i + 1]);
           return -1;
         }
       } else {
         usage(argv[0]);
         return -1;
       }
-    } else {
-      usage(argv[0]);
-      return -1;
-    }
-  }
+    } else if (strcasecmp(argv[i], "--steer") == 0) {
+      // If not the last argument...
+      if (i + 1 < argc) {
+        // Process it later.
+        deferred.rules[deferred.nrules++] = argv[i + 1];
+        steering = true;
 
-  if ((reception.ifindex > 0) && (ninterfaces > 0) && (ndests > 0)) {
-    struct sock_fprog fprog;
-    if (filter.compile(fprog)) {
-      // Check destinations.
-      i = 1;
-
-      while (i < argc) {
-        if (strcasecmp(argv[i], "--dest") == 0) {
-          // Just check if the destination is valid.
-          struct destination dest;
-          if (!parse_destination(argv[i + 1],
-                                 interfaces,
-                                 ninterfaces,
-                                 dest)) {
+        i += 2;
+      } else {
+        usage(argv[0]);
+        return -1;
+      }
+    } else if (strcasecmp(argv[i], "--steering-file") == 0) {
+      // If not the last argument...
+      if (i + 1 < argc) {
+        // Process it later.
+        steering = true;
+        steering_file = argv[i + 1];
+
+        i += 2;
+      } else {
+        usage(argv[0]);
+        return -1;
+      }
+    } else if (strcasecmp(argv[i], "--fragments") == 0) {
+      // If not the last argument...
+      if (i + 1 < argc) {
+        if (parse_fragments(argv[i + 1], fragments)) {
+          i += 2;
+        } else {
+          return -1;
+        }
+      } else {
+        usage(argv[0]);
+        return -1;
+      }
+    } else if (strcasecmp(argv[i], "--fragment-address") == 0) {
+      // If not the last argument...
+      if (i + 1 < argc) {
+        struct in_addr addr;
+        if (inet_pton(AF_INET, argv[i + 1], &addr) == 1) {
+          if (filter.fragment_address(addr)) {
+            nfragment_addresses++;
+            i += 2;
+          } else {
+            fprintf(stderr, "Too many destination addresses of fragments.\n");
             return -1;
           }
+        } else {
+          fprintf(stderr, "Invalid IPv4 address '%s'.\n", argv[i + 1]);
+          return -1;
+        }
+      } else {
+        usage(argv[0]);
+        return -1;
+      }
+    } else if (strcasecmp(argv[i], "--defrag") == 0) {
+      defrag = true;
+      i++;
+    } else if (strcasecmp(argv[i], "--memory-budget") == 0) {
+      // If not the last argument...
+      if (i + 1 < argc) {
+        if (parse_size(argv[i + 1],
+                       net::ring_buffer::min_size,
+                       SIZE_MAX,
+                       budget)) {
+          i += 2;
+        } else {
+          fprintf(stderr, "Invalid memory budget '%s'.\n", argv[i + 1]);
+          return -1;
+        }
+      } else {
+        usage(argv[0]);
+        return -1;
+      }
+    } else if (strcasecmp(argv[i], "--cpus") == 0) {
+      // If not the last argument...
+      if (i + 1 < argc) {
+        if (strcasecmp(argv[i + 1], "auto") == 0) {
+          auto_cpus = true;
+        } else if (net::cpu_affinity::parse(argv[i + 1], cpus)) {
+          auto_cpus = false;
+        } else {
+          fprintf(stderr, "Invalid CPU list '%s'.\n", argv[i + 1]);
+          return -1;
         }
 
         i += 2;
+      } else {
+        usage(argv[0]);
+        return -1;
+      }
+    } else if (strcasecmp(argv[i], "--control-cpu") == 0) {
+      // If not the last argument...
+      if (i + 1 < argc) {
+        uint64_t cpu;
+        if (parse_number(argv[i + 1], 0, CPU_SETSIZE - 1, cpu)) {
+          control_cpu = static_cast<int>(cpu);
+          i += 2;
+        } else {
+          fprintf(stderr, "Invalid CPU '%s'.\n", argv[i + 1]);
+          return -1;
+        }
+      } else {
+        usage(argv[0]);
+        return -1;
+      }
+    } else if (strcasecmp(argv[i], "--takeover") == 0) {
+      // If not the last argument...
+      if (i + 1 < argc) {
+        takeover = argv[i + 1];
+        i += 2;
+      } else {
+        usage(argv[0]);
+        return -1;
       }
-
-      // Block signals SIGINT and SIGTERM.
-      sigset_t set;
-      sigemptyset(&set);
-      sigaddset(&set, SIGINT);
-      sigaddset(&set, SIGTERM);
-      if (pthread_sigmask(SIG_BLOCK, &set, NULL) == 0) {
-        if ((nworkers > ndests) &&
-            (type == net::udp_distributor::type::load_balancer)) {
-          nworkers = ndests;
+    } else if (strcasecmp(argv[i], "--tx-threads") == 0) {
+      // If not the last argument...
+      if (i + 1 < argc) {
+        if ((parse_number(argv[i + 1],
+                          net::spsc_queue::min_frames,
+                          net::spsc_queue::max_frames,
+                          tx_queue)) &&
+            (IS_POWER_2(tx_queue))) {
+          i += 2;
+        } else {
+          fprintf(stderr, "Invalid queue length '%s'.\n", argv[i + 1]);
+          return -1;
         }
+      } else {
+        usage(argv[0]);
+        return -1;
+      }
+    } else if (strcasecmp(argv[i], "--tx-class") == 0) {
+      // If not the last argument...
+      if (i + 1 < argc) {
+        if (ntx_classes < net::tx_scheduler::max_classes) {
+          if (parse_tx_class(argv[i + 1], tx_classes[ntx_classes])) {
+            ntx_classes++;
 
-        // Create UDP distributor.
-        net::udp_distributor udp_distributor;
-        if (udp_distributor.create(type,
-                                   reception.ring_size,
-                                   reception.ifindex,
-                                   &fprog,
-                                   PACKET_FANOUT_HASH,
-                                   nworkers)) {
-          // Add interfaces.
-          for (size_t i = 0; i < ninterfaces; i++) {
-            if (!udp_distributor.add_interface(interfaces[i].ring_size,
-                                               interfaces[i].ifindex,
-                                               interfaces[i].macaddr,
-                                               interfaces[i].addr4,
-                                               interfaces[i].addr6)) {
-              fprintf(stderr,
-                      "Error adding interface '%s'.\n",
-                      interfaces[i].name);
-
-              return -1;
-            }
+            i += 2;
+          } else {
+            return -1;
           }
+        } else {
+          fprintf(stderr,
+                  "Cannot define more TX priority classes (%zu).\n",
+                  ntx_classes);
+
+          return -1;
+        }
+      } else {
+        usage(argv[0]);
+        return -1;
+      }
+    } else if (strcasecmp(argv[i], "--tx-ring") == 0) {
+      // If not the last argument...
+      if (i + 1 < argc) {
+        if (strcasecmp(argv[i + 1], "per-worker") == 0) {
+          shared_tx = false;
+          queue_tx = false;
+        } else if (strcasecmp(argv[i + 1], "shared") == 0) {
+          shared_tx = true;
+          queue_tx = false;
+        } else if (strcasecmp(argv[i + 1], "per-queue") == 0) {
+          shared_tx = false;
+          queue_tx = true;
+        } else {
+          fprintf(stderr, "Invalid TX ring mode '%s'.\n", argv[i + 1]);
+          return -1;
+        }
+
+        i += 2;
+      } else {
+        usage(argv[0]);
+        return -1;
+      }
+    } else if (strcasecmp(argv[i], "--broadcast-helpers") == 0) {
+      // If not the last argument...
+      if (i + 1 < argc) {
+        if (parse_number(argv[i + 1], 0, net::worker::max_helpers, nhelpers)) {
+          i += 2;
+        } else {
+          fprintf(stderr, "Invalid number of helpers '%s'.\n", argv[i + 1]);
+          return -1;
+        }
+      } else {
+        usage(argv[0]);
+        return -1;
+      }
+    } else if (strcasecmp(argv[i], "--work-stealing") == 0) {
+      // If not the last argument...
+      if (i + 1 < argc) {
+        if (strcasecmp(argv[i + 1], "off") == 0) {
+          stealing = false;
+          flow_affinity = false;
+        } else if (strcasecmp(argv[i + 1], "on") == 0) {
+          stealing = true;
+          flow_affinity = false;
+        } else if (strcasecmp(argv[i + 1], "flow-affinity") == 0) {
+          stealing = true;
+          flow_affinity = true;
+        } else {
+          fprintf(stderr, "Invalid work stealing mode '%s'.\n", argv[i + 1]);
+          return -1;
+        }
+
+        i += 2;
+      } else {
+        usage(argv[0]);
+        return -1;
+      }
+    } else if (strcasecmp(argv[i], "--elastic") == 0) {
+      // If not the last argument...
+      if (i + 1 < argc) {
+        if (parse_elastic(argv[i + 1], elastic)) {
+          i += 2;
+        } else {
+          return -1;
+        }
+      } else {
+        usage(argv[0]);
+        return -1;
+      }
+    } else if (strcasecmp(argv[i], "--number-workers") == 0) {
+      // If not the last argument...
+      if (i + 1 < argc) {
+        if (parse_number(argv[i + 1],
+                         net::udp_distributor::min_workers,
+                         net::udp_distributor::max_workers,
+                         nworkers)) {
+          i += 2;
+        } else {
+          fprintf(stderr, "Invalid number of workers '%s'.\n", argv[i + 1]);
+          return -1;
+        }
+      } else {
+        usage(argv[0]);
+        return -1;
+      }
+    } else {
+      usage(argv[0]);
+      return -1;
+    }
+  }
+
+  if ((tx_queue > 0) && (shared_tx)) {
+    fprintf(stderr, "The TX threads don't use shared TX ring buffers.\n");
+    return -1;
+  }
+
+  if ((ntx_classes > 0) && (tx_queue == 0)) {
+    fprintf(stderr, "The TX priority classes require --tx-threads.\n");
+    return -1;
+  }
+
+  // The non-first fragments don't carry the UDP header, they are accepted
+  // by destination address.
+  if ((fragments.mode != net::udp_distributor::fragment_mode::discard) &&
+      (nfragment_addresses == 0)) {
+    fprintf(stderr, "Accepting IPv4 fragments requires --fragment-address.\n");
+    return -1;
+  }
+
+  if (queue_tx) {
+    if (tx_queue > 0) {
+      fprintf(stderr, "The TX threads don't use one TX queue per worker.\n");
+      return -1;
+    }
+
+    if ((!auto_cpus) && (CPU_COUNT(&cpus) == 0)) {
+      fprintf(stderr, "One TX queue per worker requires --cpus.\n");
+      return -1;
+    }
+  }
+
+  if (nhelpers > 0) {
+    if (type != net::udp_distributor::type::broadcaster) {
+      fprintf(stderr, "The helpers are only available for the broadcaster.\n");
+      return -1;
+    }
+
+    if (fragments.mode == net::udp_distributor::fragment_mode::reassemble) {
+      fprintf(stderr, "The helpers cannot reassemble IPv4 fragments.\n");
+      return -1;
+    }
+  }
+
+  // No more load balancer workers than destinations (unless the workers
+  // only mirror).
+  if ((ndests > 0) &&
+      (nworkers > ndests) &&
+      (type == net::udp_distributor::type::load_balancer)) {
+    nworkers = ndests;
+  }
+
+  if (elastic.min_workers > 0) {
+    // Each destination of the load balancer belongs to one worker, parking
+    // it would silence the destination.
+    if (type != net::udp_distributor::type::broadcaster) {
+      fprintf(stderr,
+              "Elastic scaling is only available for the broadcaster.\n");
+      return -1;
+    }
+
+    if (elastic.min_workers > nworkers) {
+      fprintf(stderr,
+              "The minimum number of workers (%zu) is greater than the number "
+              "of workers (%zu).\n",
+              elastic.min_workers,
+              nworkers);
+
+      return -1;
+    }
+
+    // The steering rules select the worker by its position in the fanout
+    // group.
+    if (steering) {
+      fprintf(stderr,
+              "Elastic scaling cannot be combined with steering rules.\n");
+      return -1;
+    }
+  }
+
+  if (stealing) {
+    if (nworkers < 2) {
+      fprintf(stderr, "Work stealing needs at least 2 workers.\n");
+      return -1;
+    }
+
+    if (nhelpers > 0) {
+      fprintf(stderr,
+              "Work stealing cannot be combined with the helpers.\n");
+      return -1;
+    }
+
+    // A stolen batch is sent to the destinations of the worker which takes
+    // it: the destinations of a load balancer worker are its own.
+    if (type != net::udp_distributor::type::broadcaster) {
+      fprintf(stderr,
+              "Work stealing is only available for the broadcaster.\n");
+      return -1;
+    }
+
+    // The fragments of a datagram would be sent by different workers.
+    if (fragments.mode != net::udp_distributor::fragment_mode::discard) {
+      fprintf(stderr,
+              "Work stealing cannot be combined with IPv4 fragments.\n");
+      return -1;
+    }
+  }
+
+  if ((reception.ifindex > 0) &&
+      (ninterfaces > 0) &&
+      ((ndests > 0) || (nmirrors > 0))) {
+    // Accept IPv4 fragments? (only in the default traffic class).
+    filter.fragments(fragments.mode !=
+                     net::udp_distributor::fragment_mode::discard);
+
+    // The default traffic class receives the ports which don't belong to
+    // any other traffic class.
+    if (nclasses > 0) {
+      if (filter.count() == 0) {
+        filter.port_range(1, 65535);
+      }
+
+      for (size_t i = 0; i < nclasses; i++) {
+        if (!filter.remove_port_ranges(classes[i].filter)) {
+          fprintf(stderr, "Too many ports defined.\n");
+          return -1;
+        }
+      }
+
+      if (filter.count() == 0) {
+        fprintf(stderr,
+                "No ports left for the default traffic class.\n");
+
+        return -1;
+      }
+    }
+
+    struct sock_fprog fprog;
+    if (filter.compile(fprog)) {
+      // Parse destinations and mirror ports.
+      for (size_t j = 0; j < ndests; j++) {
+        if (!parse_destination(deferred.dest_values[j],
+                               interfaces,
+                               ninterfaces,
+                               deferred.dests[j])) {
+          return -1;
+        }
+      }
+
+      for (size_t j = 0; j < nmirrors; j++) {
+        if (!parse_mirror(deferred.mirror_values[j],
+                          interfaces,
+                          ninterfaces,
+                          deferred.mirrors[j])) {
+          return -1;
+        }
+      }
+
+      // Block signals SIGINT, SIGTERM, SIGUSR1, SIGHUP and SIGIO.
+      sigset_t set;
+      sigemptyset(&set);
+      sigaddset(&set, SIGINT);
+      sigaddset(&set, SIGTERM);
+      sigaddset(&set, SIGUSR1);
+      sigaddset(&set, SIGHUP);
+      sigaddset(&set, SIGIO);
+      if (pthread_sigmask(SIG_BLOCK, &set, NULL) == 0) {
+        // Load steering rules.
+        net::fanout_filter steering_filter;
+        struct sock_fprog steering_fprog;
+
+        if (steering) {
+          if ((!load_steering(deferred.rules,
+                              deferred.nrules,
+                              steering_file,
+                              steering_filter)) ||
+              (!steering_filter.compile(nworkers, steering_fprog))) {
+            fprintf(stderr, "Error compiling steering rules.\n");
+            return -1;
+          }
+
+          // The steering rules replace the fanout mode (not the flags).
+          fanout = PACKET_FANOUT_CBPF | (fanout & ~0xff);
+        }
+
+        // Calculate the sizes of the ring buffers.
+        if (!ring_sizes(deferred.dests,
+                        ndests,
+                        deferred.mirrors,
+                        nmirrors,
+                        type,
+                        nworkers,
+                        budget,
+                        reception,
+                        classes,
+                        nclasses,
+                        interfaces,
+                        ninterfaces,
+                        nhelpers,
+                        (tx_queue > 0) || (shared_tx))) {
+          return -1;
+        }
+
+        net::udp_distributor udp_distributor;
+
+        // Place workers (before creating them, so their memory is allocated
+        // on their NUMA nodes).
+        if ((auto_cpus) || (CPU_COUNT(&cpus) > 0)) {
+          if (!place_workers(udp_distributor,
+                             reception.ifindex,
+                             nworkers,
+                             auto_cpus,
+                             cpus)) {
+            return -1;
+          }
+        }
+
+        // Create UDP distributor.
+        if (udp_distributor.create(type,
+                                   reception.ring_size,
+                                   reception.ifindex,
+                                   &fprog,
+                                   defrag ?
+                                     fanout | PACKET_FANOUT_FLAG_DEFRAG :
+                                     fanout,
+                                   nworkers)) {
+          // Add traffic classes.
+          for (size_t i = 0; i < nclasses; i++) {
+            struct sock_fprog class_fprog;
+            if ((!classes[i].filter.compile(class_fprog)) ||
+                (!udp_distributor.add_class(classes[i].ring_size,
+                                            &class_fprog,
+                                            classes[i].weight))) {
+              fprintf(stderr, "Error adding traffic class %zu.\n", i + 1);
+              return -1;
+            }
+          }
+
+          // Add helpers (before setting up the handling of IPv4 fragments).
+          if ((nhelpers > 0) && (!udp_distributor.helpers(nhelpers))) {
+            fprintf(stderr, "Error adding the helpers.\n");
+            return -1;
+          }
+
+          // Set up handling of IPv4 fragments.
+          if (!udp_distributor.fragments(fragments.mode,
+                                         fragments.ndatagrams,
+                                         fragments.timeout)) {
+            fprintf(stderr, "Error setting up handling of IPv4 fragments.\n");
+            return -1;
+          }
+
+          // Scale the number of active workers with the load.
+          if ((elastic.min_workers > 0) &&
+              (!udp_distributor.elastic(elastic.min_workers,
+                                        elastic.scale_up,
+                                        elastic.scale_down,
+                                        elastic.release_memory))) {
+            fprintf(stderr, "Error enabling elastic scaling.\n");
+            return -1;
+          }
+
+          // Let the idle workers take batches from the busy ones.
+          if ((stealing) && (!udp_distributor.work_stealing(flow_affinity))) {
+            fprintf(stderr, "Error enabling work stealing.\n");
+            return -1;
+          }
+
+          // Attach steering program.
+          if ((steering) && (!udp_distributor.steer(&steering_fprog))) {
+            fprintf(stderr, "Error attaching steering program.\n");
+            return -1;
+          }
+
+          // Send through one TX thread per interface.
+          if ((tx_queue > 0) && (!udp_distributor.tx_threads(tx_queue))) {
+            fprintf(stderr, "Error enabling the TX threads.\n");
+            return -1;
+          }
+
+          // Schedule the frames of the TX threads by priority class.
+          if ((ntx_classes > 0) &&
+              (!udp_distributor.tx_classes(
+                                  tx_classes,
+                                  ntx_classes,
+                                  net::tx_scheduler::default_frames
+                                ))) {
+            fprintf(stderr, "Error enabling the TX scheduler.\n");
+            return -1;
+          }
+
+          // Share one TX ring buffer per interface among the workers.
+          if ((shared_tx) && (!udp_distributor.shared_tx_rings())) {
+            fprintf(stderr, "Error enabling the shared TX ring buffers.\n");
+            return -1;
+          }
+
+          // Add interfaces.
+          for (size_t i = 0; i < ninterfaces; i++) {
+            if (!udp_distributor.add_interface(interfaces[i].ring_size,
+                                               interfaces[i].ifindex,
+                                               interfaces[i].macaddr,
+                                               interfaces[i].addr4,
+                                               interfaces[i].addr6)) {
+              fprintf(stderr,
+                      "Error adding interface '%s'.\n",
+                      interfaces[i].name);
+
+              return -1;
+            }
+          }
+
+          // Send through one hardware TX queue per worker.
+          if ((queue_tx) && (!udp_distributor.tx_queues())) {
+            fprintf(stderr,
+                    "Error mapping the workers to the TX queues (XPS).\n");
+
+            return -1;
+          }
+
+          // Add destinations.
+          for (size_t j = 0; j < ndests; j++) {
+            const struct destination& dest = deferred.dests[j];
+
+            // Add destination.
+            if (!udp_distributor.add_destination(dest.ifindex,
+                                                 dest.macaddr,
+                                                 dest.addr,
+                                                 dest.addrlen,
+                                                 dest.port,
+                                                 dest.limited ?
+                                                   &dest.limit :
+                                                   nullptr,
+                                                 dest.dsr)) {
+              fprintf(stderr, "Error adding destination.\n");
+              return -1;
+            }
+
+            // Add the other links of the destination.
+            for (size_t k = 0; k < dest.nlinks; k++) {
+              if (!udp_distributor.add_link(dest.links[k].ifindex,
+                                            dest.links[k].macaddr)) {
+                fprintf(stderr, "Error adding link.\n");
+                return -1;
+              }
+            }
+          }
+
+          // Add mirror ports.
+          for (size_t j = 0; j < nmirrors; j++) {
+            const struct mirror& mirror = deferred.mirrors[j];
+            if (!udp_distributor.add_mirror(mirror.ifindex,
+                                            mirror.snaplen,
+                                            mirror.vlan)) {
+              fprintf(stderr, "Error adding mirror port.\n");
+              return -1;
+            }
+          }
+
+          // Connect to the running process (if any).
+          int takeover_fd = -1;
+          if ((takeover) &&
+              ((takeover_fd = net::handover::connect(takeover)) == -1) &&
+              (errno != ENOENT) &&
+              (errno != ECONNREFUSED)) {
+            fprintf(stderr, "Error connecting to '%s'.\n", takeover);
+            return -1;
+          }
+
+          bool started;
+          if (takeover_fd != -1) {
+            // Take over the packet sockets of the running process and
+            // start UDP distributor.
+            started = udp_distributor.take_over(takeover_fd);
+
+            close(takeover_fd);
+
+            if (started) {
+              printf("Packet sockets taken over from the running process.\n");
+            }
+          } else {
+            // Start UDP distributor.
+            started = udp_distributor.start();
+          }
+
+          if (started) {
+            // Show the locked memory of the ring buffers and the time spent
+            // creating them.
+            udp_distributor.show_ring_buffers();
+            udp_distributor.show_setup_times();
+
+            // Pin the control thread (after starting the workers, so they
+            // don't inherit its affinity).
+            if (control_cpu >= 0) {
+              cpu_set_t set;
+              CPU_ZERO(&set);
+              CPU_SET(control_cpu, &set);
+
+              if (pthread_setaffinity_np(pthread_self(),
+                                         sizeof(cpu_set_t),
+                                         &set) != 0) {
+                fprintf(stderr,
+                        "Error setting the CPU of the control thread.\n");
+
+                udp_distributor.stop();
+
+                return -1;
+              }
+
+              printf("Control thread: CPU %d.\n", control_cpu);
+            }
+
+            // Listen for the next upgrade.
+            int listener = -1;
+            if ((takeover) &&
+                ((listener = net::handover::listen(takeover)) == -1)) {
+              fprintf(stderr, "Error listening on '%s'.\n", takeover);
+
+              udp_distributor.stop();
+
+              return -1;
+            }
+
+            bool handed_over = false;
+            bool running = true;
+
+            // Wait for signal to arrive (SIGUSR1 shows the statistics,
+            // SIGHUP reloads the steering rules, SIGIO: new process).
+            do {
+              int sig;
+              if (wait_signal(set,
+                              elastic.min_workers > 0,
+                              udp_distributor,
+                              sig)) {
+                if (sig == SIGIO) {
+                  int fd;
+                  while ((running) &&
+                         (listener != -1) &&
+                         ((fd = net::handover::accept(listener)) != -1)) {
+                    if (udp_distributor.hand_over(fd)) {
+                      printf("Packet sockets handed over to the new "
+                             "process.\n");
+
+                      handed_over = true;
+                      running = false;
+                    } else {
+                      fprintf(stderr,
+                              "Error handing over the packet sockets, "
+                              "resuming.\n");
+
+                      if (!udp_distributor.start()) {
+                        fprintf(stderr, "Error resuming UDP distributor.\n");
+                        running = false;
+                      }
+                    }
+
+                    close(fd);
+                  }
+                } else if (sig == SIGUSR1) {
+                  // The packet sockets belong to the new process after the
+                  // handover.
+                  if (!handed_over) {
+                    udp_distributor.show_statistics();
+                  }
+                } else if (sig == SIGHUP) {
+                  if (steering) {
+                    if ((load_steering(deferred.rules,
+                                       deferred.nrules,
+                                       steering_file,
+                                       steering_filter)) &&
+                        (steering_filter.compile(nworkers, steering_fprog)) &&
+                        (udp_distributor.steer(&steering_fprog))) {
+                      printf("Steering rules reloaded.\n");
+                    } else {
+                      fprintf(stderr,
+                              "Error reloading steering rules, keeping the "
+                              "previous ones.\n");
+                    }
+                  }
+                } else {
+                  running = false;
+                }
+              }
+            } while (running);
+
+            if (listener != -1) {
+              close(listener);
+
+              // The socket belongs to the new process after the handover.
+              if (!handed_over) {
+                unlink(takeover);
+              }
+            }
+
+            udp_distributor.stop();
+
+            // The statistics of the packet sockets are reset when read, and
+            // they belong to the new process after the handover.
+            if (!handed_over) {
+              udp_distributor.show_statistics();
+            }
+
+            printf("Exiting...\n");
+
+            return 0;
+          } else {
+            fprintf(stderr, "Error starting UDP distributor.\n");
+          }
+        } else {
+          fprintf(stderr, "Error creating UDP distributor.\n");
+        }
+      } else {
+        fprintf(stderr,
+                "Error blocking signals SIGINT, SIGTERM, SIGUSR1, SIGHUP and "
+                "SIGIO.\n");
+      }
+    } else {
+      fprintf(stderr, "Error compiling socket filter.\n");
+    }
+  } else {
+    usage(argv[0]);
+  }
+
+  return -1;
+}
+
+void usage(const char* program)
+{
+  fprintf(stderr, "Usage: %s <parameters>\n", program);
+  fprintf(stderr, "\n");
+
+  fprintf(stderr, "Parameters:\n");
+
+  fprintf(stderr,
+          "  [Mandatory] --rx <interface-name>[,<ring-size>]\n"
+          "    Ring size in bytes, KiB (K), MiB (M) or GiB (G)\n"
+          "    (%llu MB .. %llu GB, default: %llu MB)\n",
+          net::ring_buffer::min_size / (1024ULL * 1024ULL),
+          net::ring_buffer::max_size / (1024ULL * 1024ULL * 1024ULL),
+          net::ring_buffer::default_size / (1024ULL * 1024ULL));
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Mandatory] --tx <interface-name>,<mac-address>,<ipv4-address>,"
+          "<ipv6-address>[,<ring-size>]\n"
+          "    <mac-address> ::= <hex><hex>:<hex><hex>:<hex><hex>:<hex><hex>:"
+          "<hex><hex>:<hex><hex>\n");
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Mandatory] --dest <interface-name>,<mac-address>|\"auto\","
+          "<ip-address>,<port>[,<option>]*\n"
+          "    \"auto\": ethernet address of the multicast group "
+          "<ip-address>\n"
+          "    <option> ::= <rate-limit>|\"dsr\"|<link>\n"
+          "    <rate-limit> ::= <packets-per-second>:<bytes-per-second>"
+          "[:<burst>[:\"drop\"|\"pace\"]]\n"
+          "    Bytes per second in bytes, KiB (K), MiB (M) or GiB (G), "
+          "0: no limit\n"
+          "    <burst> ::= %zu .. %zu packets (default: %zu)\n"
+          "    (default: \"drop\")\n"
+          "    <link> ::= \"link=\"<interface-name>\"/\"<mac-address>\n"
+          "    Other link to the destination (up to %zu), the flows are "
+          "spread over\n"
+          "    the links and moved to the other ones when a link loses "
+          "carrier or\n"
+          "    its TX ring stalls\n",
+          net::rate_limiter::min_burst,
+          net::rate_limiter::max_burst,
+          net::rate_limiter::default_burst,
+          net::worker::max_links - 1);
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --mirror <interface-name>[,<snap-length>"
+          "[,<vlan-id>]]\n"
+          "    Mirror port (up to %zu): the frames received are sent byte "
+          "for byte,\n"
+          "    truncated to <snap-length> bytes (%zu .. 65535, 0: whole "
+          "frame) and\n"
+          "    tagged with <vlan-id> (0 .. %u), --dest is optional with "
+          "mirror ports\n",
+          net::worker::max_mirrors,
+          sizeof(struct ether_header),
+          net::worker::max_vlan);
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --type \"load-balancer\" | \"broadcaster\" "
+          "(default: \"load-balancer\")\n");
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --ports <port-definition>[,<port-definition>]*\n"
+          "    <port-definition> ::= <port>|<port-range>\n"
+          "    <port> ::= 1 .. 65535\n"
+          "    <port-range> ::= <port>\"-\"<port>\n");
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --class <port-definition>[,<port-definition>]*"
+          "[:<ring-size>[:<weight>]]\n"
+          "    Traffic class with its own RX ring buffer (up to %zu), the "
+          "other ports\n"
+          "    are received in the default traffic class\n"
+          "    <ring-size> (default: same as --rx)\n"
+          "    <weight> ::= %zu .. %zu (default: %zu)\n",
+          net::udp_distributor::max_classes,
+          net::worker::min_weight,
+          net::worker::max_weight,
+          net::worker::default_weight);
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --fanout <fanout-mode>[,\"rollover\"]\n"
+          "    <fanout-mode> ::= \"hash\" | \"lb\" | \"cpu\" | \"qm\" | "
+          "\"rnd\" | \"rollover\"\n"
+          "    (default: \"hash\")\n");
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --steer <workers>:<port-definition>"
+          "[,<port-definition>]*[:<source-prefix>]\n"
+          "  [Optional] --steer <workers>:default\n"
+          "    <workers> ::= <worker>|<worker>\"-\"<worker>\n"
+          "    <source-prefix> ::= <ip-address>\"/\"<prefix-length>\n");
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --steering-file <filename>\n"
+          "    File with one steering rule per line (reloaded on SIGHUP)\n");
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --fragments \"discard\" | "
+          "\"reassemble\"[,<number-datagrams>[,<timeout>]] | \"forward\"\n"
+          "    (default: \"discard\")\n"
+          "    <number-datagrams> ::= %zu .. %zu (default: %zu)\n"
+          "    <timeout> ::= %u .. %u seconds (default: %u)\n",
+          net::ipv4_reassembler::min_datagrams,
+          net::ipv4_reassembler::max_datagrams,
+          net::ipv4_reassembler::default_datagrams,
+          net::ipv4_reassembler::min_timeout,
+          net::ipv4_reassembler::max_timeout,
+          net::ipv4_reassembler::default_timeout);
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --fragment-address <ipv4-address> (up to %zu times, "
+          "mandatory\n"
+          "    with --fragments \"reassemble\" | \"forward\")\n"
+          "    Destination address of the IPv4 fragments accepted\n",
+          net::socket_filter::max_fragment_addresses);
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --defrag\n"
+          "    Let the kernel defragment the packets before the fanout "
+          "(PACKET_FANOUT_FLAG_DEFRAG)\n");
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --memory-budget <size>\n"
+          "    Memory for all the ring buffers, shared by the ring buffers "
+          "whose size\n"
+          "    is not specified\n");
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --cpus <cpu-list> | \"auto\"\n"
+          "    CPUs the workers run on (\"auto\": the CPUs which service the "
+          "IRQs of the\n"
+          "    RX queues or, at least, the CPUs of the NUMA node of the "
+          "reception\n"
+          "    interface)\n"
+          "    <cpu-list> ::= <cpu-definition>[,<cpu-definition>]*\n"
+          "    <cpu-definition> ::= <cpu>|<cpu>\"-\"<cpu>\n");
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --control-cpu <cpu>\n"
+          "    CPU the control thread (signals, statistics) runs on\n");
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --takeover <socket>\n"
+          "    UNIX socket for the hot upgrade: take over the packet sockets "
+          "of the\n"
+          "    running process (if any) and wait for the next process\n");
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --tx-threads <queue-length>\n"
+          "    Send through one TX thread per interface, fed by a queue of "
+          "<queue-length>\n"
+          "    frames per worker (%zu .. %zu, power of 2)\n",
+          net::spsc_queue::min_frames,
+          net::spsc_queue::max_frames);
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --tx-class <tx-class-definition> "
+          "(up to %zu times, requires --tx-threads)\n"
+          "    Priority class of the TX scheduler of the TX threads (in "
+          "decreasing order\n"
+          "    of priority, deficit round robin between the flows of a "
+          "class)\n"
+          "    <tx-class-definition> ::= [<port-definition>[,"
+          "<port-definition>]*]\n"
+          "                              [\"/\"<dscp-definition>[,"
+          "<dscp-definition>]*]\n"
+          "                              [\":\"<queue-length>]\n"
+          "    <dscp-definition> ::= <dscp>|<dscp>\"-\"<dscp>\n"
+          "    <queue-length>: frames (%zu .. %zu, default: %zu)\n",
+          net::tx_scheduler::max_classes,
+          net::tx_scheduler::min_frames,
+          net::tx_scheduler::max_frames,
+          net::tx_scheduler::default_frames);
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --tx-ring \"per-worker\" | \"shared\" | "
+          "\"per-queue\" (default: \"per-worker\")\n"
+          "    \"shared\": one TX ring buffer per interface shared by the "
+          "workers\n"
+          "    \"per-queue\": each worker sends through its own hardware TX "
+          "queue (XPS,\n"
+          "    requires --cpus)\n");
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --broadcast-helpers <number-helpers> "
+          "(0 .. %zu, default: 0)\n"
+          "    Helper threads per worker (broadcaster), the destinations are "
+          "split among\n"
+          "    the worker and its helpers\n",
+          net::worker::max_helpers);
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --elastic <min-workers>[,<scale-up>,<scale-down>"
+          "[,\"release-memory\"]]\n"
+          "    Start <min-workers> workers and add or park workers (up to "
+          "<number-workers>)\n"
+          "    when their load crosses <scale-up> or <scale-down> percent "
+          "(default: %u, %u),\n"
+          "    broadcaster only\n",
+          net::udp_distributor::default_scale_up,
+          net::udp_distributor::default_scale_down);
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --work-stealing \"off\" | \"on\" | "
+          "\"flow-affinity\" (default: \"off\")\n"
+          "    The idle workers take batches of packets from the workers "
+          "which fall\n"
+          "    behind (\"flow-affinity\": the packets of a flow are sent in "
+          "order),\n"
+          "    broadcaster only\n");
+
+  fprintf(stderr, "\n");
+
+  fprintf(stderr,
+          "  [Optional] --number-workers <number-workers> "
+          "(%zu .. %zu, default: %zu)\n",
+          net::udp_distributor::min_workers,
+          net::udp_distributor::max_workers,
+          net::udp_distributor::default_workers);
+
+  fprintf(stderr, "\n");
+}
+
+bool parse_reception(const char* s, struct reception& reception)
+{
+  // Format:
+  // <interface-name>[,<ring-size>]
+
+  const char* ptr;
+  if ((ptr = strchr(s, ',')) != nullptr) {
+    if (parse_interface_name(s, ptr - s, reception.ifindex)) {
+      if (parse_size(ptr + 1,
+                     net::ring_buffer::min_size,
+                     net::ring_buffer::max_size,
+                     reception.ring_size)) {
+        return true;
+      }
+    }
+  } else {
+    if (parse_interface_name(s, strlen(s), reception.ifindex)) {
+      reception.ring_size = 0;
+      return true;
+    }
+  }
+
+  fprintf(stderr, "Invalid reception definition '%s'.\n", s);
+
+  return false;
+}
+
+bool parse_interface(const char* s, struct interface& interface)
+{
+  // Format:
+  // <interface-name>,<mac-address>,<ipv4-address>,<ipv6-address>[,<ring-size>]
+
+  const char* const begin = s;
+
+  const char* ptr;
+  if ((ptr = strchr(s, ',')) != nullptr) {
+    size_t len = ptr - s;
+    if (parse_interface_name(s, len, interface.ifindex)) {
+      // Save name.
+      memcpy(interface.name, s, len);
+      interface.name[len] = 0;
+
+      s = ptr + 1;
+
+      if ((ptr = strchr(s, ',')) != nullptr) {
+        if (parse_mac_address(s, ptr - s, interface.macaddr)) {
+          s = ptr + 1;
+
+          if ((ptr = strchr(s, ',')) != nullptr) {
+            if (parse_ipv4_address(s, ptr - s, interface.addr4)) {
+              s = ptr + 1;
+
+              if ((ptr = strchr(s, ',')) != nullptr) {
+                if (parse_ipv6_address(s, ptr - s, interface.addr6)) {
+                  if (parse_size(ptr + 1,
+                                 net::ring_buffer::min_size,
+                                 net::ring_buffer::max_size,
+                                 interface.ring_size)) {
+                    return true;
+                  }
+                }
+              } else {
+                if (parse_ipv6_address(s, strlen(s), interface.addr6)) {
+                  interface.ring_size = 0;
+                  return true;
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  fprintf(stderr, "Invalid interface definition '%s'.\n", begin);
+
+  return false;
+}
+
+bool parse_destination(const char* s,
+                       const struct interface* interfaces,
+                       size_t ninterfaces,
+                       struct destination& dest)
+{
+  // Format:
+  // <interface-name>,<mac-address>|"auto",<ip-address>,<port>[,<option>]*
+  // <option> ::= <rate-limit>|"dsr"|<link>
+  // <link> ::= "link="<interface-name>"/"<mac-address>
+
+  const char* const begin = s;
+
+  dest.limited = false;
+  dest.dsr = false;
+  dest.nlinks = 0;
+
+  const char* ptr;
+  if ((ptr = strchr(s, ',')) != nullptr) {
+    size_t len = ptr - s;
+    if (parse_interface_name(s, len, dest.ifindex)) {
+      // Search interface.
+      for (size_t i = 0; i < ninterfaces; i++) {
+        if (dest.ifindex == interfaces[i].ifindex) {
+          s = ptr + 1;
+
+          if ((ptr = strchr(s, ',')) != nullptr) {
+            // "auto": ethernet address of the multicast group.
+            bool multicast = ((ptr - s == 4) &&
+                              (strncasecmp(s, "auto", 4) == 0));
+
+            if ((multicast) ||
+                (parse_mac_address(s, ptr - s, dest.macaddr))) {
+              s = ptr + 1;
+
+              if ((ptr = strchr(s, ',')) != nullptr) {
+                if ((parse_address(s, ptr - s, dest.addr, dest.addrlen)) &&
+                    ((!multicast) ||
+                     (net::worker::multicast_macaddr(dest.addr,
+                                                     dest.addrlen,
+                                                     dest.macaddr)))) {
+                  s = ptr + 1;
+
+                  char port[8];
+                  size_t len;
+                  if ((ptr = strchr(s, ',')) != nullptr) {
+                    len = ptr - s;
+                  } else {
+                    len = strlen(s);
+                  }
+
+                  if (len < sizeof(port)) {
+                    memcpy(port, s, len);
+                    port[len] = 0;
+
+                    uint64_t n;
+                    if (parse_number(port, 1, 65535, n)) {
+                      dest.port = static_cast<in_port_t>(n);
+
+                      // Options.
+                      while (ptr) {
+                        s = ptr + 1;
+
+                        char option[128];
+                        if ((ptr = strchr(s, ',')) != nullptr) {
+                          len = ptr - s;
+                        } else {
+                          len = strlen(s);
+                        }
+
+                        if (len >= sizeof(option)) {
+                          break;
+                        }
+
+                        memcpy(option, s, len);
+                        option[len] = 0;
+
+                        if (strcasecmp(option, "dsr") == 0) {
+                          dest.dsr = true;
+                        } else if ((strncasecmp(option, "link=", 5) == 0) &&
+                                   (dest.nlinks < ARRAY_SIZE(dest.links))) {
+                          if (!parse_link(option + 5,
+                                          interfaces,
+                                          ninterfaces,
+                                          dest.links[dest.nlinks].ifindex,
+                                          dest.links[dest.nlinks].macaddr)) {
+                            fprintf(stderr,
+                                    "Invalid destination definition '%s'.\n",
+                                    begin);
+
+                            return false;
+                          }
+
+                          dest.nlinks++;
+                        } else if ((!dest.limited) &&
+                                   (parse_rate_limit(option, dest.limit))) {
+                          dest.limited = true;
+                        } else {
+                          fprintf(stderr,
+                                  "Invalid destination definition '%s'.\n",
+                                  begin);
+
+                          return false;
+                        }
+                      }
+
+                      if (!ptr) {
+                        return true;
+                      }
+                    }
+                  }
+                }
+              }
+            }
+          }
+
+          fprintf(stderr, "Invalid destination definition '%s'.\n", begin);
+          return false;
+        }
+      }
+
+      fprintf(stderr,
+              "Interface '%.*s' not defined in the interface list.\n",
+              static_cast<int>(len),
+              begin);
+
+      return false;
+    }
+  }
+
+  fprintf(stderr, "Invalid destination definition '%s'.\n", begin);
+
+  return false;
+}
+
+bool parse_link(const char* s,
+                const struct interface* interfaces,
+                size_t ninterfaces,
+                unsigned& ifindex,
+                uint8_t* macaddr)
+{
+  // Format:
+  // <interface-name>"/"<mac-address>
+
+  const char* ptr;
+  if (((ptr = strchr(s, '/')) != nullptr) &&
+      (parse_interface_name(s, ptr - s, ifindex)) &&
+      (parse_mac_address(ptr + 1, strlen(ptr + 1), macaddr))) {
+    // Search interface.
+    for (size_t i = 0; i < ninterfaces; i++) {
+      if (ifindex == interfaces[i].ifindex) {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+bool parse_rate_limit(const char* s, net::rate_limiter::parameters& limit)
+{
+  // Format:
+  // <packets-per-second>:<bytes-per-second>[:<burst>[:"drop"|"pace"]]
+
+  const char* const begin = s;
+
+  limit.burst = net::rate_limiter::default_burst;
+  limit.mode = net::rate_limiter::mode::drop;
+
+  // Split the fields.
+  char fields[4][32];
+  size_t nfields = 0;
+
+  do {
+    const char* ptr = strchr(s, ':');
+    size_t len = ptr ? static_cast<size_t>(ptr - s) : strlen(s);
+
+    if ((nfields == ARRAY_SIZE(fields)) || (len >= sizeof(fields[0]))) {
+      fprintf(stderr, "Invalid rate limit '%s'.\n", begin);
+      return false;
+    }
+
+    memcpy(fields[nfields], s, len);
+    fields[nfields++][len] = 0;
+
+    s = ptr ? ptr + 1 : nullptr;
+  } while (s);
+
+  uint64_t burst;
+  if ((nfields >= 2) &&
+      (parse_number(fields[0], 0, 1000000000ULL, limit.packets)) &&
+      (parse_size(fields[1], 0, 16ULL * 1000000000ULL, limit.bytes)) &&
+      ((limit.packets > 0) || (limit.bytes > 0)) &&
+      ((nfields < 3) ||
+       (parse_number(fields[2],
+                     net::rate_limiter::min_burst,
+                     net::rate_limiter::max_burst,
+                     burst)))) {
+    if (nfields >= 3) {
+      limit.burst = static_cast<size_t>(burst);
+    }
+
+    if (nfields == 4) {
+      if (strcasecmp(fields[3], "pace") == 0) {
+        limit.mode = net::rate_limiter::mode::pace;
+      } else if (strcasecmp(fields[3], "drop") != 0) {
+        fprintf(stderr, "Invalid rate limit '%s'.\n", begin);
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  fprintf(stderr, "Invalid rate limit '%s'.\n", begin);
+
+  return false;
+}
+
+bool parse_mirror(const char* s,
+                  const struct interface* interfaces,
+                  size_t ninterfaces,
+                  struct mirror& mirror)
+{
+  // Format:
+  // <interface-name>[,<snap-length>[,<vlan-id>]]
+
+  const char* const begin = s;
+
+  mirror.snaplen = 0;
+  mirror.vlan = -1;
+
+  const char* ptr = strchr(s, ',');
+  size_t namelen = ptr ? static_cast<size_t>(ptr - s) : strlen(s);
+
+  if (parse_interface_name(s, namelen, mirror.ifindex)) {
+    // Search interface.
+    for (size_t i = 0; i < ninterfaces; i++) {
+      if (mirror.ifindex == interfaces[i].ifindex) {
+        if (!ptr) {
+          return true;
+        }
+
+        s = ptr + 1;
+
+        char snaplen[32];
+        size_t len;
+        if ((ptr = strchr(s, ',')) != nullptr) {
+          len = ptr - s;
+        } else {
+          len = strlen(s);
+        }
+
+        if (len < sizeof(snaplen)) {
+          memcpy(snaplen, s, len);
+          snaplen[len] = 0;
+
+          uint64_t n;
+          if ((parse_number(snaplen, 0, 65535, n)) &&
+              ((n == 0) || (n >= sizeof(struct ether_header)))) {
+            mirror.snaplen = static_cast<size_t>(n);
+
+            uint64_t vlan;
+            if (!ptr) {
+              return true;
+            } else if (parse_number(ptr + 1,
+                                    0,
+                                    net::worker::max_vlan,
+                                    vlan)) {
+              mirror.vlan = static_cast<int>(vlan);
+              return true;
+            }
+          }
+        }
+
+        fprintf(stderr, "Invalid mirror port definition '%s'.\n", begin);
+        return false;
+      }
+    }
+
+    fprintf(stderr,
+            "Interface '%.*s' not defined in the interface list.\n",
+            static_cast<int>(namelen),
+            begin);
+
+    return false;
+  }
+
+  fprintf(stderr, "Invalid mirror port definition '%s'.\n", begin);
+
+  return false;
+}
+
+bool parse_class(const char* s, struct traffic_class& c)
+{
+  // Format:
+  // <port-definition>[,<port-definition>]*[:<ring-size>[:<weight>]]
+
+  const char* const begin = s;
+
+  c.filter.clear();
+  c.ring_size = 0;
+  c.weight = net::worker::default_weight;
+
+  char ports[1024];
+
+  const char* ptr;
+  if ((ptr = strchr(s, ':')) != nullptr) {
+    size_t len = ptr - s;
+    if (len < sizeof(ports)) {
+      memcpy(ports, s, len);
+      ports[len] = 0;
+
+      if (parse_port_list(ports, c.filter)) {
+        s = ptr + 1;
+
+        char size[32];
+        if ((ptr = strchr(s, ':')) != nullptr) {
+          len = ptr - s;
+          if (len < sizeof(size)) {
+            memcpy(size, s, len);
+            size[len] = 0;
+
+            uint64_t weight;
+            if ((parse_size(size,
+                            net::ring_buffer::min_size,
+                            net::ring_buffer::max_size,
+                            c.ring_size)) &&
+                (parse_number(ptr + 1,
+                              net::worker::min_weight,
+                              net::worker::max_weight,
+                              weight))) {
+              c.weight = static_cast<size_t>(weight);
+              return true;
+            }
+          }
+        } else if (parse_size(s,
+                              net::ring_buffer::min_size,
+                              net::ring_buffer::max_size,
+                              c.ring_size)) {
+          return true;
+        }
+      }
+    }
+  } else if (parse_port_list(s, c.filter)) {
+    return true;
+  }
+
+  fprintf(stderr, "Invalid traffic class definition '%s'.\n", begin);
+
+  return false;
+}
+
+bool parse_tx_class(const char* s, net::tx_scheduler::priority_class& c)
+{
+  // Format:
+  // [<port-definition>[,<port-definition>]*]
+  // ["/"<dscp-definition>[,<dscp-definition>]*][":"<queue-length>]
+
+  const char* const begin = s;
+
+  c.clear();
+
+  // End of the ports and of the DSCPs.
+  const char* end;
+  if ((end = strchr(s, ':')) == nullptr) {
+    end = s + strlen(s);
+  }
+
+  const char* slash = reinterpret_cast<const char*>(memchr(s, '/', end - s));
+
+  char list[1024];
+
+  // Ports (there must be ports or DSCPs).
+  size_t len = (slash ? slash : end) - s;
+  if ((len < sizeof(list)) && ((len > 0) || (slash))) {
+    memcpy(list, s, len);
+    list[len] = 0;
+
+    if ((len == 0) || (parse_port_list(list, c))) {
+      // DSCPs.
+      bool valid = true;
+      if (slash) {
+        len = end - (slash + 1);
+        if ((valid = ((len > 0) && (len < sizeof(list))))) {
+          memcpy(list, slash + 1, len);
+          list[len] = 0;
+
+          struct dscp_list dscps{c};
+          valid = parse_port_list(list, dscps);
+        }
+      }
+
+      // Queue length.
+      if ((valid) &&
+          ((*end != ':') ||
+           (parse_number(end + 1,
+                         net::tx_scheduler::min_frames,
+                         net::tx_scheduler::max_frames,
+                         c.frames)))) {
+        return true;
+      }
+    }
+  }
+
+  fprintf(stderr, "Invalid TX priority class definition '%s'.\n", begin);
+
+  return false;
+}
+
+bool ring_sizes(const struct destination* dests,
+                size_t ndests,
+                const struct mirror* mirrors,
+                size_t nmirrors,
+                net::udp_distributor::type type,
+                size_t nworkers,
+                size_t budget,
+                struct reception& reception,
+                struct traffic_class* classes,
+                size_t nclasses,
+                struct interface* interfaces,
+                size_t ninterfaces,
+                size_t nhelpers,
+                bool single_tx_ring)
+{
+  // Count TX ring buffers (workers and helpers which have destinations on
+  // each interface, all the workers for a mirror port or, with TX threads
+  // or shared TX ring buffers, one per interface with destinations or
+  // mirror ports).
+  for (size_t j = 0; j < ninterfaces; j++) {
+    bool used[net::udp_distributor::max_workers *
+              (net::worker::max_helpers + 1)];
+    memset(used, 0, sizeof(used));
+
+    interfaces[j].nrings = 0;
+
+    for (size_t n = 0; n < ndests; n++) {
+      const struct destination& dest = dests[n];
+
+      size_t first, count;
+      net::udp_distributor::destination_workers(type,
+                                                n,
+                                                nworkers,
+                                                first,
+                                                count);
+
+      // Worker or helper which sends to the destination.
+      size_t m = net::udp_distributor::destination_member(n, nhelpers);
+
+      // Does the destination have a link on the interface?
+      bool linked = (dest.ifindex == interfaces[j].ifindex);
+      for (size_t l = 0; l < dest.nlinks; l++) {
+        if (dest.links[l].ifindex == interfaces[j].ifindex) {
+          linked = true;
+        }
+      }
+
+      if (linked) {
+        if (single_tx_ring) {
+          // The ring buffer of the TX thread or the shared one.
+          interfaces[j].nrings = 1;
+        } else {
+          for (size_t k = first; k < first + count; k++) {
+            size_t idx = (k * (nhelpers + 1)) + m;
+
+            if (!used[idx]) {
+              used[idx] = true;
+              interfaces[j].nrings++;
+            }
+          }
+        }
+      }
+    }
+
+    for (size_t n = 0; n < nmirrors; n++) {
+      const struct mirror& mirror = mirrors[n];
+
+      if (mirror.ifindex == interfaces[j].ifindex) {
+        if (single_tx_ring) {
+          interfaces[j].nrings = 1;
+        } else {
+          // Each worker mirrors the frames it receives.
+          for (size_t k = 0; k < nworkers; k++) {
+            size_t idx = k * (nhelpers + 1);
+
+            if (!used[idx]) {
+              used[idx] = true;
+              interfaces[j].nrings++;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  size_t size;
+
+  if (budget > 0) {
+    // Memory of the ring buffers whose size has been specified and number
+    // of ring buffers whose size has not been specified.
+    size_t fixed = 0;
+    size_t nrings = 0;
+
+    if (reception.ring_size > 0) {
+      fixed += nworkers * reception.ring_size;
+    } else {
+      nrings += nworkers;
+    }
+
+    for (size_t j = 0; j < nclasses; j++) {
+      // Traffic classes without ring size use the size of the RX ring
+      // buffer.
+      if (classes[j].ring_size > 0) {
+        fixed += nworkers * classes[j].ring_size;
+      } else if (reception.ring_size > 0) {
+        fixed += nworkers * reception.ring_size;
+      } else {
+        nrings += nworkers;
+      }
+    }
 
-          // Add destinations.
-          i = 1;
-
-          while (i < argc) {
-            if (strcasecmp(argv[i], "--dest") == 0) {
-              struct destination dest;
-              parse_destination(argv[i + 1], interfaces, ninterfaces, dest);
-
-              // Add destination.
-              if (!udp_distributor.add_destination(dest.ifindex,
-                                                   dest.macaddr,
-                                                   dest.addr,
-                                                   dest.addrlen,
-                                                   dest.port)) {
-                fprintf(stderr, "Error adding destination.\n");
-                return -1;
-              }
-            }
+    for (size_t j = 0; j < ninterfaces; j++) {
+      if (interfaces[j].ring_size > 0) {
+        fixed += interfaces[j].nrings * interfaces[j].ring_size;
+      } else {
+        nrings += interfaces[j].nrings;
+      }
+    }
 
-            i += 2;
-          }
+    if (fixed > budget) {
+      fprintf(stderr,
+              "The ring buffers (%zu MB) exceed the memory budget (%zu MB).\n",
+              fixed / (1024 * 1024),
+              budget / (1024 * 1024));
 
-          // Start UDP distributor.
-          if (udp_distributor.start()) {
-            // Wait for signal to arrive.
-            int sig;
-            while (sigwait(&set, &sig) != 0);
+      return false;
+    }
 
-            udp_distributor.stop();
+    // The ring buffers whose size has not been specified share the rest of
+    // the budget.
+    if (nrings > 0) {
+      if ((size = (budget - fixed) / nrings) < net::ring_buffer::min_size) {
+        fprintf(stderr,
+                "The memory budget is too small (%zu ring buffers without "
+                "size).\n",
+                nrings);
 
-            printf("Exiting...\n");
+        return false;
+      }
 
-            return 0;
-          } else {
-            fprintf(stderr, "Error starting UDP distributor.\n");
-          }
-        } else {
-          fprintf(stderr, "Error creating UDP distributor.\n");
-        }
-      } else {
-        fprintf(stderr, "Error blocking signals SIGINT and SIGTERM.\n");
+      if (size > net::ring_buffer::max_size) {
+        size = net::ring_buffer::max_size;
       }
     } else {
-      fprintf(stderr, "Error compiling socket filter.\n");
+      size = net::ring_buffer::default_size;
     }
   } else {
-    usage(argv[0]);
+    size = net::ring_buffer::default_size;
   }
 
-  return -1;
-}
+  if (reception.ring_size == 0) {
+    reception.ring_size = size;
+  }
 
-void usage(const char* program)
-{
-  fprintf(stderr, "Usage: %s <parameters>\n", program);
-  fprintf(stderr, "\n");
+  for (size_t j = 0; j < nclasses; j++) {
+    if (classes[j].ring_size == 0) {
+      classes[j].ring_size = reception.ring_size;
+    }
+  }
 
-  fprintf(stderr, "Parameters:\n");
+  for (size_t j = 0; j < ninterfaces; j++) {
+    if (interfaces[j].ring_size == 0) {
+      interfaces[j].ring_size = size;
+    }
+  }
 
-  fprintf(stderr,
-          "  [Mandatory] --rx <interface-name>[,<ring-size>]\n"
-          "    Ring size in bytes, KiB (K), MiB (M) or GiB (G)\n"
-          "    (%llu MB .. %llu GB, default: %llu MB)\n",
-          net::ring_buffer::min_size / (1024ULL * 1024ULL),
-          net::ring_buffer::max_size / (1024ULL * 1024ULL * 1024ULL),
-          net::ring_buffer::default_size / (1024ULL * 1024ULL));
+  return true;
+}
 
-  fprintf(stderr, "\n");
+bool place_workers(net::udp_distributor& udp_distributor,
+                   unsigned ifindex,
+                   size_t nworkers,
+                   bool auto_cpus,
+                   const cpu_set_t& cpus)
+{
+  net::cpu_affinity::placement placements[net::udp_distributor::max_workers];
+  int workers_cpus[net::udp_distributor::max_workers];
 
-  fprintf(stderr,
-          "  [Mandatory] --tx <interface-name>,<mac-address>,<ipv4-address>,"
-          "<ipv6-address>[,<ring-size>]\n"
-          "    <mac-address> ::= <hex><hex>:<hex><hex>:<hex><hex>:<hex><hex>:"
-          "<hex><hex>:<hex><hex>\n");
+  if (auto_cpus) {
+    if (!net::cpu_affinity::place(ifindex, nworkers, placements)) {
+      fprintf(stderr, "Error placing workers.\n");
+      return false;
+    }
+  } else {
+    // Check that the process is allowed to run on the CPUs.
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == 0) {
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if ((CPU_ISSET(cpu, &cpus)) && (!CPU_ISSET(cpu, &allowed))) {
+          fprintf(stderr, "CPU %d not available.\n", cpu);
+          return false;
+        }
+      }
+    }
 
-  fprintf(stderr, "\n");
+    // Worker `i` runs on the CPU `i` of the list (modulo the number of
+    // CPUs).
+    for (int cpu = 0, n = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &cpus)) {
+        for (size_t i = n; i < nworkers; i += CPU_COUNT(&cpus)) {
+          placements[i].cpu = cpu;
+          placements[i].node = net::cpu_affinity::node(cpu);
+          placements[i].why = net::cpu_affinity::reason::any;
+        }
 
-  fprintf(stderr,
-          "  [Mandatory] --dest <interface-name>,<mac-address>,<ip-address>,"
-          "<port>\n");
+        n++;
+      }
+    }
+  }
 
-  fprintf(stderr, "\n");
+  // Show placement.
+  for (size_t i = 0; i < nworkers; i++) {
+    const net::cpu_affinity::placement* p = placements + i;
 
-  fprintf(stderr,
-          "  [Optional] --type \"load-balancer\" | \"broadcaster\" "
-          "(default: \"load-balancer\")\n");
+    workers_cpus[i] = p->cpu;
 
-  fprintf(stderr, "\n");
+    switch (p->why) {
+      case net::cpu_affinity::reason::irq:
+        printf("Worker %zu: CPU %d (RX queue %u, IRQ %u",
+               i,
+               p->cpu,
+               p->queue,
+               p->irq);
 
-  fprintf(stderr,
-          "  [Optional] --ports <port-definition>[,<port-definition>]*\n"
-          "    <port-definition> ::= <port>|<port-range>\n"
-          "    <port> ::= 1 .. 65535\n"
-          "    <port-range> ::= <port>\"-\"<port>\n");
+        break;
+      case net::cpu_affinity::reason::numa_node:
+        printf("Worker %zu: CPU %d (NUMA node of the interface", i, p->cpu);
+        break;
+      default:
+        printf("Worker %zu: CPU %d (", i, p->cpu);
+        break;
+    }
 
-  fprintf(stderr, "\n");
+    if (p->node >= 0) {
+      printf("%sNUMA node %d).\n",
+             (p->why == net::cpu_affinity::reason::any) ? "" : ", ",
+             p->node);
+    } else {
+      printf("%sNUMA node unknown).\n",
+             (p->why == net::cpu_affinity::reason::any) ? "" : ", ");
+    }
+  }
 
-  fprintf(stderr,
-          "  [Optional] --number-workers <number-workers> "
-          "(%zu .. %zu, default: %zu)\n",
-          net::udp_distributor::min_workers,
-          net::udp_distributor::max_workers,
-          net::udp_distributor::default_workers);
+  if (!udp_distributor.affinity(workers_cpus, nworkers)) {
+    fprintf(stderr, "Error setting the CPUs of the workers.\n");
+    return false;
+  }
 
-  fprintf(stderr, "\n");
+  return true;
 }
 
-bool parse_reception(const char* s, struct reception& reception)
+bool parse_fanout(const char* s, int& fanout)
 {
   // Format:
-  // <interface-name>[,<ring-size>]
+  // <fanout-mode>[,"rollover"]
+
+  static const struct {
+    const char* name;
+    int mode;
+  } modes[] = {
+    {"hash", PACKET_FANOUT_HASH},
+    {"lb", PACKET_FANOUT_LB},
+    {"cpu", PACKET_FANOUT_CPU},
+    {"qm", PACKET_FANOUT_QM},
+    {"rnd", PACKET_FANOUT_RND},
+    {"rollover", PACKET_FANOUT_ROLLOVER}
+  };
+
+  const char* ptr = strchr(s, ',');
+  size_t len = ptr ? static_cast<size_t>(ptr - s) : strlen(s);
+
+  for (size_t i = 0; i < ARRAY_SIZE(modes); i++) {
+    if ((strncasecmp(s, modes[i].name, len) == 0) &&
+        (!modes[i].name[len])) {
+      if (!ptr) {
+        fanout = modes[i].mode;
+        return true;
+      }
 
-  const char* ptr;
-  if ((ptr = strchr(s, ',')) != nullptr) {
-    if (parse_interface_name(s, ptr - s, reception.ifindex)) {
-      if (parse_size(ptr + 1,
-                     net::ring_buffer::min_size,
-                     net::ring_buffer::max_size,
-                     reception.ring_size)) {
+      // Fall back to other sockets when the selected one is full (it doesn't
+      // make sense for the rollover mode).
+      if ((strcasecmp(ptr + 1, "rollover") == 0) &&
+          (modes[i].mode != PACKET_FANOUT_ROLLOVER)) {
+        fanout = modes[i].mode | PACKET_FANOUT_FLAG_ROLLOVER;
         return true;
       }
+
+      return false;
     }
-  } else {
-    if (parse_interface_name(s, strlen(s), reception.ifindex)) {
-      reception.ring_size = net::ring_buffer::default_size;
+  }
+
+  return false;
+}
+
+bool parse_fragments(const char* s, struct fragments& fragments)
+{
+  // Format:
+  // "discard" | "reassemble"[,<number-datagrams>[,<timeout>]] | "forward"
+
+  const char* const begin = s;
+
+  if (strcasecmp(s, "discard") == 0) {
+    fragments.mode = net::udp_distributor::fragment_mode::discard;
+    return true;
+  } else if (strcasecmp(s, "forward") == 0) {
+    fragments.mode = net::udp_distributor::fragment_mode::forward;
+    return true;
+  } else if (strncasecmp(s, "reassemble", 10) == 0) {
+    s += 10;
+
+    if (!*s) {
+      fragments.mode = net::udp_distributor::fragment_mode::reassemble;
       return true;
+    } else if (*s == ',') {
+      s++;
+
+      char number[32];
+      const char* ptr;
+      if ((ptr = strchr(s, ',')) != nullptr) {
+        size_t len = ptr - s;
+        if (len < sizeof(number)) {
+          memcpy(number, s, len);
+          number[len] = 0;
+
+          uint64_t ndatagrams, timeout;
+          if ((parse_number(number,
+                            net::ipv4_reassembler::min_datagrams,
+                            net::ipv4_reassembler::max_datagrams,
+                            ndatagrams)) &&
+              (parse_number(ptr + 1,
+                            net::ipv4_reassembler::min_timeout,
+                            net::ipv4_reassembler::max_timeout,
+                            timeout))) {
+            fragments.mode = net::udp_distributor::fragment_mode::reassemble;
+            fragments.ndatagrams = static_cast<size_t>(ndatagrams);
+            fragments.timeout = static_cast<unsigned>(timeout);
+
+            return true;
+          }
+        }
+      } else {
+        uint64_t ndatagrams;
+        if (parse_number(s,
+                         net::ipv4_reassembler::min_datagrams,
+                         net::ipv4_reassembler::max_datagrams,
+                         ndatagrams)) {
+          fragments.mode = net::udp_distributor::fragment_mode::reassemble;
+          fragments.ndatagrams = static_cast<size_t>(ndatagrams);
+
+          return true;
+        }
+      }
     }
   }
 
-  fprintf(stderr, "Invalid reception definition '%s'.\n", s);
+  fprintf(stderr, "Invalid fragments definition '%s'.\n", begin);
 
   return false;
 }
 
-bool parse_interface(const char* s, struct interface& interface)
+bool wait_signal(const sigset_t& set,
+                 bool elastic,
+                 net::udp_distributor& udp_distributor,
+                 int& sig)
+{
+  if (!elastic) {
+    return (sigwait(&set, &sig) == 0);
+  }
+
+  struct timespec interval;
+  interval.tv_sec = net::udp_distributor::scale_interval;
+  interval.tv_nsec = 0;
+
+  do {
+    if ((sig = sigtimedwait(&set, nullptr, &interval)) != -1) {
+      return true;
+    } else if (errno == EAGAIN) {
+      udp_distributor.scale();
+    } else {
+      return false;
+    }
+  } while (true);
+}
+
+bool parse_elastic(const char* s, struct elastic& elastic)
 {
   // Format:
-  // <interface-name>,<mac-address>,<ipv4-address>,<ipv6-address>[,<ring-size>]
+  // <min-workers>[,<scale-up>,<scale-down>[,"release-memory"]]
 
   const char* const begin = s;
 
-  const char* ptr;
-  if ((ptr = strchr(s, ',')) != nullptr) {
-    size_t len = ptr - s;
-    if (parse_interface_name(s, len, interface.ifindex)) {
-      // Save name.
-      memcpy(interface.name, s, len);
-      interface.name[len] = 0;
+  // Split the fields.
+  char fields[4][32];
+  size_t nfields = 0;
 
-      s = ptr + 1;
+  do {
+    const char* end;
+    if ((end = strchr(s, ',')) == nullptr) {
+      end = s + strlen(s);
+    }
 
-      if ((ptr = strchr(s, ',')) != nullptr) {
-        if (parse_mac_address(s, ptr - s, interface.macaddr)) {
-          s = ptr + 1;
+    size_t len = end - s;
+    if ((nfields == ARRAY_SIZE(fields)) || (len >= sizeof(fields[0]))) {
+      fprintf(stderr, "Invalid elastic scaling definition '%s'.\n", begin);
+      return false;
+    }
 
-          if ((ptr = strchr(s, ',')) != nullptr) {
-            if (parse_ipv4_address(s, ptr - s, interface.addr4)) {
-              s = ptr + 1;
+    memcpy(fields[nfields], s, len);
+    fields[nfields++][len] = 0;
 
-              if ((ptr = strchr(s, ',')) != nullptr) {
-                if (parse_ipv6_address(s, ptr - s, interface.addr6)) {
-                  if (parse_size(ptr + 1,
-                                 net::ring_buffer::min_size,
-                                 net::ring_buffer::max_size,
-                                 interface.ring_size)) {
-                    return true;
-                  }
-                }
-              } else {
-                if (parse_ipv6_address(s, strlen(s), interface.addr6)) {
-                  interface.ring_size = net::ring_buffer::default_size;
-                  return true;
-                }
-              }
-            }
-          }
-        }
-      }
+    s = *end ? end + 1 : end;
+  } while (*s);
+
+  uint64_t min_workers, scale_up, scale_down;
+  if ((nfields != 2) &&
+      (parse_number(fields[0],
+                    net::udp_distributor::min_workers,
+                    net::udp_distributor::max_workers,
+                    min_workers))) {
+    if (nfields == 1) {
+      elastic.min_workers = static_cast<size_t>(min_workers);
+      return true;
+    } else if ((parse_number(fields[1], 1, 100, scale_up)) &&
+               (parse_number(fields[2], 0, scale_up - 1, scale_down)) &&
+               ((nfields == 3) ||
+                (strcasecmp(fields[3], "release-memory") == 0))) {
+      elastic.min_workers = static_cast<size_t>(min_workers);
+      elastic.scale_up = static_cast<unsigned>(scale_up);
+      elastic.scale_down = static_cast<unsigned>(scale_down);
+      elastic.release_memory = (nfields == 4);
+
+      return true;
     }
   }
 
-  fprintf(stderr, "Invalid interface definition '%s'.\n", begin);
+  fprintf(stderr, "Invalid elastic scaling definition '%s'.\n", begin);
 
   return false;
 }
 
-bool parse_destination(const char* s,
-                       const struct interface* interfaces,
-                       size_t ninterfaces,
-                       struct destination& dest)
+bool parse_steering_rule(const char* s, net::fanout_filter& filter)
 {
   // Format:
-  // <interface-name>,<mac-address>,<ip-address>,<port>
+  // <workers>:<port-definition>[,<port-definition>]*[:<source-prefix>]
+  // <workers>:default
 
   const char* const begin = s;
 
   const char* ptr;
-  if ((ptr = strchr(s, ',')) != nullptr) {
-    size_t len = ptr - s;
-    if (parse_interface_name(s, len, dest.ifindex)) {
-      // Search interface.
-      for (size_t i = 0; i < ninterfaces; i++) {
-        if (dest.ifindex == interfaces[i].ifindex) {
-          s = ptr + 1;
-
-          if ((ptr = strchr(s, ',')) != nullptr) {
-            if (parse_mac_address(s, ptr - s, dest.macaddr)) {
-              s = ptr + 1;
+  if ((ptr = strchr(s, ':')) != nullptr) {
+    size_t first, count;
+    if (parse_workers(s, ptr - s, first, count)) {
+      s = ptr + 1;
 
-              if ((ptr = strchr(s, ',')) != nullptr) {
-                if (parse_address(s, ptr - s, dest.addr, dest.addrlen)) {
-                  uint64_t port;
-                  if (parse_number(ptr + 1, 1, 65535, port)) {
-                    dest.port = static_cast<in_port_t>(port);
-                    return true;
-                  }
-                }
-              }
-            }
-          }
+      if (strcasecmp(s, "default") == 0) {
+        filter.default_workers(first, count);
+        return true;
+      }
 
-          fprintf(stderr, "Invalid destination definition '%s'.\n", begin);
+      char ports[1024];
+      size_t len;
+
+      // If there is a source prefix...
+      if ((ptr = strchr(s, ':')) != nullptr) {
+        const char* slash;
+        uint64_t prefixlen;
+        uint8_t addr[sizeof(struct in6_addr)];
+        socklen_t addrlen;
+
+        if (((slash = strchr(ptr + 1, '/')) != nullptr) &&
+            (parse_address(ptr + 1, slash - (ptr + 1), addr, addrlen)) &&
+            (parse_number(slash + 1,
+                          0,
+                          (addrlen == sizeof(struct in_addr)) ? 32 : 128,
+                          prefixlen)) &&
+            (filter.add_rule(first,
+                             count,
+                             addr,
+                             addrlen,
+                             static_cast<unsigned>(prefixlen)))) {
+          len = ptr - s;
+        } else {
+          fprintf(stderr, "Invalid steering rule '%s'.\n", begin);
           return false;
         }
+      } else if (filter.add_rule(first, count)) {
+        len = strlen(s);
+      } else {
+        fprintf(stderr, "Too many steering rules.\n");
+        return false;
       }
 
-      fprintf(stderr,
-              "Interface '%.*s' not defined in the interface list.\n",
-              static_cast<int>(len),
-              begin);
+      if (len < sizeof(ports)) {
+        memcpy(ports, s, len);
+        ports[len] = 0;
 
-      return false;
+        if (parse_port_list(ports, filter)) {
+          return true;
+        }
+      }
     }
   }
 
-  fprintf(stderr, "Invalid destination definition '%s'.\n", begin);
+  fprintf(stderr, "Invalid steering rule '%s'.\n", begin);
 
   return false;
 }
 
-bool parse_port_list(const char* s, net::socket_filter& filter)
+bool load_steering(const char* const* rules,
+                   size_t nrules,
+                   const char* filename,
+                   net::fanout_filter& filter)
+{
+  filter.clear();
+
+  // Rules from the command line.
+  for (size_t i = 0; i < nrules; i++) {
+    if (!parse_steering_rule(rules[i], filter)) {
+      return false;
+    }
+  }
+
+  // Rules from the file.
+  if (filename) {
+    FILE* file;
+    if ((file = fopen(filename, "r")) != nullptr) {
+      char line[1024];
+
+      while (fgets(line, sizeof(line), file)) {
+        // Skip leading white spaces.
+        const char* begin = line;
+        while (IS_WHITE_SPACE(*begin)) {
+          begin++;
+        }
+
+        // Strip trailing white spaces and new line.
+        char* end = line + strlen(line);
+        while ((end > begin) &&
+               ((IS_WHITE_SPACE(*(end - 1))) ||
+                (*(end - 1) == '\n') ||
+                (*(end - 1) == '\r'))) {
+          end--;
+        }
+
+        *end = 0;
+
+        // Skip empty lines and comments.
+        if ((*begin) && (*begin != '#')) {
+          if (!parse_steering_rule(begin, filter)) {
+            fclose(file);
+            return false;
+          }
+        }
+      }
+
+      fclose(file);
+    } else {
+      fprintf(stderr, "Error opening steering file '%s'.\n", filename);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+template<typename filter_t>
+bool parse_port_list(const char* s, filter_t& filter)
 {
   unsigned from = 0;
   unsigned to = 0;
@@ -564,6 +2697,46 @@ bool parse_port_list(const char* s, net::socket_filter& filter)
   }
 }
 
+bool parse_workers(const char* s, size_t len, size_t& first, size_t& count)
+{
+  // Format:
+  // <worker>|<worker>"-"<worker>
+
+  char buf[32];
+  if ((len > 0) && (len < sizeof(buf))) {
+    memcpy(buf, s, len);
+    buf[len] = 0;
+
+    uint64_t from, to;
+
+    char* dash;
+    if ((dash = strchr(buf, '-')) != nullptr) {
+      *dash = 0;
+
+      if ((parse_number(buf, 0, net::udp_distributor::max_workers - 1, from)) &&
+          (parse_number(dash + 1,
+                        from,
+                        net::udp_distributor::max_workers - 1,
+                        to))) {
+        first = static_cast<size_t>(from);
+        count = static_cast<size_t>(to - from + 1);
+
+        return true;
+      }
+    } else if (parse_number(buf,
+                            0,
+                            net::udp_distributor::max_workers - 1,
+                            from)) {
+      first = static_cast<size_t>(from);
+      count = 1;
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
 bool parse_interface_name(const char* s, size_t len, unsigned& ifindex)
 {
   if ((len > 0) && (len < IF_NAMESIZE)) {
@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <net/if.h>
+#include "net/cpu_affinity.h"
+#include "macros/macros.h"
+
+bool net::cpu_affinity::place(unsigned ifindex,
+                              size_t nworkers,
+                              struct placement* placements)
+{
+  char ifname[IF_NAMESIZE];
+  if (!if_indextoname(ifindex, ifname)) {
+    return false;
+  }
+
+  // CPUs the process is allowed to run on.
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) < 0) {
+    return false;
+  }
+
+  // CPUs of the NUMA node of the interface.
+  cpu_set_t local;
+  int ifnode = interface_node(ifname);
+  if ((ifnode >= 0) && (node_cpus(ifnode, local))) {
+    CPU_AND(&local, &local, &allowed);
+  } else {
+    CPU_ZERO(&local);
+  }
+
+  size_t nqueues = rx_queues(ifname);
+
+  size_t nlocal = 0;
+  size_t nany = 0;
+
+  // For each worker...
+  for (size_t i = 0; i < nworkers; i++) {
+    struct placement* p = placements + i;
+
+    // Search the CPU which services the IRQ of the RX queue.
+    if (nqueues > 0) {
+      unsigned queue = static_cast<unsigned>(i % nqueues);
+      unsigned irq;
+      cpu_set_t set;
+
+      if ((rx_queue_irq(ifname, queue, irq)) && (irq_cpus(irq, set))) {
+        CPU_AND(&set, &set, &allowed);
+
+        if (CPU_COUNT(&set) > 0) {
+          p->cpu = pick(set, 0);
+          p->node = node(p->cpu);
+          p->why = reason::irq;
+          p->queue = queue;
+          p->irq = irq;
+
+          continue;
+        }
+      }
+    }
+
+    if (CPU_COUNT(&local) > 0) {
+      p->cpu = pick(local, nlocal++);
+      p->node = ifnode;
+      p->why = reason::numa_node;
+    } else {
+      p->cpu = pick(allowed, nany++);
+      p->node = node(p->cpu);
+      p->why = reason::any;
+    }
+  }
+
+  return true;
+}
+
+bool net::cpu_affinity::parse(const char* s, cpu_set_t& set)
+{
+  CPU_ZERO(&set);
+
+  do {
+    unsigned from = 0;
+    const char* begin = s;
+    while (IS_DIGIT(*s)) {
+      if ((from = (from * 10) + (*s - '0')) >= CPU_SETSIZE) {
+        return false;
+      }
+
+      s++;
+    }
+
+    if (s == begin) {
+      return false;
+    }
+
+    unsigned to = from;
+    if (*s == '-') {
+      begin = ++s;
+
+      to = 0;
+      while (IS_DIGIT(*s)) {
+        if ((to = (to * 10) + (*s - '0')) >= CPU_SETSIZE) {
+          return false;
+        }
+
+        s++;
+      }
+
+      if ((s == begin) || (to < from)) {
+        return false;
+      }
+    }
+
+    for (unsigned cpu = from; cpu <= to; cpu++) {
+      CPU_SET(cpu, &set);
+    }
+
+    if (!*s) {
+      return true;
+    }
+  } while (*s++ == ',');
+
+  return false;
+}
+
+int net::cpu_affinity::node(int cpu)
+{
+  char dirname[PATH_MAX];
+  snprintf(dirname, sizeof(dirname), "/sys/devices/system/cpu/cpu%d", cpu);
+
+  DIR* dir;
+  if ((dir = opendir(dirname)) != nullptr) {
+    int n = -1;
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+      if ((strncmp(entry->d_name, "node", 4) == 0) &&
+          (IS_DIGIT(entry->d_name[4]))) {
+        n = atoi(entry->d_name + 4);
+        break;
+      }
+    }
+
+    closedir(dir);
+
+    return n;
+  }
+
+  return -1;
+}
+
+bool net::cpu_affinity::irq_cpus(unsigned irq, cpu_set_t& set)
+{
+  char filename[PATH_MAX];
+  char line[1024];
+
+  // The effective affinity is the one in use (not available in all the
+  // kernels).
+  snprintf(filename,
+           sizeof(filename),
+           "/proc/irq/%u/effective_affinity_list",
+           irq);
+
+  if ((read_line(filename, line, sizeof(line))) && (parse(line, set))) {
+    return true;
+  }
+
+  snprintf(filename, sizeof(filename), "/proc/irq/%u/smp_affinity_list", irq);
+
+  return ((read_line(filename, line, sizeof(line))) && (parse(line, set)));
+}
+
+bool net::cpu_affinity::node_cpus(int node, cpu_set_t& set)
+{
+  char filename[PATH_MAX];
+  snprintf(filename,
+           sizeof(filename),
+           "/sys/devices/system/node/node%d/cpulist",
+           node);
+
+  char line[1024];
+  return ((read_line(filename, line, sizeof(line))) && (parse(line, set)));
+}
+
+int net::cpu_affinity::interface_node(const char* ifname)
+{
+  char filename[PATH_MAX];
+  snprintf(filename,
+           sizeof(filename),
+           "/sys/class/net/%s/device/numa_node",
+           ifname);
+
+  char line[32];
+  if (read_line(filename, line, sizeof(line))) {
+    return atoi(line);
+  }
+
+  return -1;
+}
+
+size_t net::cpu_affinity::rx_queues(const char* ifname)
+{
+  char dirname[PATH_MAX];
+  snprintf(dirname, sizeof(dirname), "/sys/class/net/%s/queues", ifname);
+
+  size_t nqueues = 0;
+
+  DIR* dir;
+  if ((dir = opendir(dirname)) != nullptr) {
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+      if (strncmp(entry->d_name, "rx-", 3) == 0) {
+        nqueues++;
+      }
+    }
+
+    closedir(dir);
+  }
+
+  return nqueues;
+}
+
+bool net::cpu_affinity::rx_queue_irq(const char* ifname,
+                                     unsigned queue,
+                                     unsigned& irq)
+{
+  FILE* file;
+  if ((file = fopen("/proc/interrupts", "r")) == nullptr) {
+    return false;
+  }
+
+  size_t ifnamelen = strlen(ifname);
+
+  // Number of IRQs of the interface found so far.
+  unsigned n = 0;
+
+  char line[4096];
+  while (fgets(line, sizeof(line), file)) {
+    // Skip lines which don't start with an IRQ number (header, NMI, ...).
+    unsigned num;
+    if (sscanf(line, " %u:", &num) != 1) {
+      continue;
+    }
+
+    // Strip trailing white spaces and new line.
+    char* end = line + strlen(line);
+    while ((end > line) &&
+           ((IS_WHITE_SPACE(*(end - 1))) ||
+            (*(end - 1) == '\n') ||
+            (*(end - 1) == '\r'))) {
+      end--;
+    }
+
+    *end = 0;
+
+    // The name of the IRQ is the last field.
+    const char* name = end;
+    while ((name > line) && (!IS_WHITE_SPACE(*(name - 1)))) {
+      name--;
+    }
+
+    // The name should contain "<interface-name>-" ("eth0-TxRx-0",
+    // "i40e-eth0-TxRx-0", ...).
+    const char* ptr = name;
+    while (((ptr = strstr(ptr, ifname)) != nullptr) &&
+           (((ptr > name) && (*(ptr - 1) != '-')) ||
+            (ptr[ifnamelen] != '-'))) {
+      ptr++;
+    }
+
+    if (!ptr) {
+      continue;
+    }
+
+    // Skip TX-only IRQs.
+    const char* suffix = ptr + ifnamelen + 1;
+    if ((strcasestr(suffix, "tx")) && (!strcasestr(suffix, "rx"))) {
+      continue;
+    }
+
+    // The RX queue is the trailing number (if any), otherwise the IRQs are
+    // assumed to be in the order of the RX queues.
+    const char* digits = end;
+    while ((digits > suffix) && (IS_DIGIT(*(digits - 1)))) {
+      digits--;
+    }
+
+    unsigned q = (digits < end) ? static_cast<unsigned>(atoi(digits)) : n;
+
+    n++;
+
+    if (q == queue) {
+      fclose(file);
+
+      irq = num;
+      return true;
+    }
+  }
+
+  fclose(file);
+
+  return false;
+}
+
+bool net::cpu_affinity::read_line(const char* filename,
+                                  char* line,
+                                  size_t size)
+{
+  FILE* file;
+  if ((file = fopen(filename, "r")) != nullptr) {
+    if (fgets(line, size, file)) {
+      fclose(file);
+
+      // Strip trailing new line.
+      size_t len = strlen(line);
+      while ((len > 0) &&
+             ((line[len - 1] == '\n') || (line[len - 1] == '\r'))) {
+        line[--len] = 0;
+      }
+
+      return (len > 0);
+    }
+
+    fclose(file);
+  }
+
+  return false;
+}
+
+int net::cpu_affinity::pick(const cpu_set_t& set, size_t n)
+{
+  n %= CPU_COUNT(&set);
+
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &set)) {
+      if (n-- == 0) {
+        return cpu;
+      }
+    }
+  }
+
+  return -1;
+}
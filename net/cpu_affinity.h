@@ -0,0 +1,72 @@
+#ifndef NET_CPU_AFFINITY_H
+#define NET_CPU_AFFINITY_H
+
+#include <stdlib.h>
+#include <sched.h>
+
+namespace net {
+  // Placement of the workers on the CPUs which service the RX queues of the
+  // reception interface.
+  //
+  // Worker `i` is placed on the CPU which handles the IRQ of the RX queue
+  // `i % number-rx-queues` (/proc/interrupts, /proc/irq/<irq>/); when the IRQ
+  // of the RX queue cannot be found (or the CPU is not usable), the worker is
+  // placed on a CPU of the NUMA node of the interface or, as last resort, on
+  // any CPU.
+  class cpu_affinity {
+    public:
+      enum class reason {
+        irq,
+        numa_node,
+        any
+      };
+
+      struct placement {
+        int cpu;
+        int node; // -1 if unknown.
+
+        reason why;
+
+        // RX queue and IRQ (only when `why` is reason::irq).
+        unsigned queue;
+        unsigned irq;
+      };
+
+      // Place workers.
+      static bool place(unsigned ifindex,
+                        size_t nworkers,
+                        struct placement* placements);
+
+      // Parse CPU list (<cpu>|<cpu>"-"<cpu>[,<cpu>|<cpu>"-"<cpu>]*).
+      static bool parse(const char* s, cpu_set_t& set);
+
+      // Get the NUMA node of the CPU (-1 if unknown).
+      static int node(int cpu);
+
+    private:
+      // Get the CPUs which service the IRQ.
+      static bool irq_cpus(unsigned irq, cpu_set_t& set);
+
+      // Get the CPUs of the NUMA node.
+      static bool node_cpus(int node, cpu_set_t& set);
+
+      // Get the NUMA node of the interface.
+      static int interface_node(const char* ifname);
+
+      // Get the number of RX queues of the interface.
+      static size_t rx_queues(const char* ifname);
+
+      // Search the IRQ of the RX queue of the interface.
+      static bool rx_queue_irq(const char* ifname,
+                               unsigned queue,
+                               unsigned& irq);
+
+      // Read the first line of a file.
+      static bool read_line(const char* filename, char* line, size_t size);
+
+      // Pick the CPU `n` of the set (modulo the number of CPUs).
+      static int pick(const cpu_set_t& set, size_t n);
+  };
+}
+
+#endif // NET_CPU_AFFINITY_H
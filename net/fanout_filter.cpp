@@ -0,0 +1,455 @@
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include "net/fanout_filter.h"
+
+void net::fanout_filter::clear()
+{
+  _M_nrules = 0;
+
+  _M_default_first = 0;
+  _M_default_count = 0;
+
+  _M_nfilters = 0;
+}
+
+bool net::fanout_filter::add_rule(size_t first,
+                                  size_t count,
+                                  const void* prefix,
+                                  socklen_t addrlen,
+                                  unsigned prefixlen)
+{
+  if ((_M_nrules < max_rules) && (count > 0)) {
+    struct rule* r = _M_rules + _M_nrules;
+
+    switch (addrlen) {
+      case 0:
+        r->family = AF_UNSPEC;
+        r->prefixlen = 0;
+
+        break;
+      case sizeof(struct in_addr):
+        if (prefixlen > 32) {
+          return false;
+        }
+
+        r->family = AF_INET;
+        r->prefixlen = prefixlen;
+
+        memcpy(r->prefix, prefix, addrlen);
+
+        break;
+      case sizeof(struct in6_addr):
+        if (prefixlen > 128) {
+          return false;
+        }
+
+        r->family = AF_INET6;
+        r->prefixlen = prefixlen;
+
+        memcpy(r->prefix, prefix, addrlen);
+
+        break;
+      default:
+        return false;
+    }
+
+    r->first = first;
+    r->count = count;
+
+    r->nportranges = 0;
+
+    _M_nrules++;
+
+    return true;
+  }
+
+  return false;
+}
+
+bool net::fanout_filter::port_range(in_port_t from, in_port_t to)
+{
+  if ((_M_nrules > 0) && (from > 0) && (from <= to)) {
+    struct rule* r = _M_rules + _M_nrules - 1;
+
+    if (r->nportranges < max_port_ranges) {
+      r->portranges[r->nportranges].from = from;
+      r->portranges[r->nportranges].to = to;
+
+      r->nportranges++;
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool net::fanout_filter::compile(size_t nworkers, struct sock_fprog& fprog)
+{
+  // Clear filters.
+  _M_nfilters = 0;
+
+  // If the default workers have not been set, use all the workers.
+  if (_M_default_count == 0) {
+    _M_default_first = 0;
+    _M_default_count = nworkers;
+  }
+
+  // Check that the workers exist.
+  if (_M_default_first + _M_default_count > nworkers) {
+    return false;
+  }
+
+  for (size_t i = 0; i < _M_nrules; i++) {
+    if ((_M_rules[i].first + _M_rules[i].count > nworkers) ||
+        (_M_rules[i].nportranges == 0)) {
+      return false;
+    }
+  }
+
+  // The fanout program runs before the ethernet header is pushed back, so
+  // the offsets are relative to the network header.
+
+  // A <- protocol (ethernet type).
+  stmt(BPF_LD + BPF_H + BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL);
+
+  jump(BPF_JMP + BPF_JEQ + BPF_K, ETHERTYPE_IP, 0, 1);
+
+  size_t ipv4 = _M_nfilters;
+  stmt(BPF_JMP + BPF_JA, 0);
+
+  jump(BPF_JMP + BPF_JEQ + BPF_K, ETHERTYPE_IPV6, 0, 1);
+
+  size_t ipv6 = _M_nfilters;
+  stmt(BPF_JMP + BPF_JA, 0);
+
+  // Neither IPv4 nor IPv6 (it will be discarded by the socket filter).
+  stmt(BPF_RET + BPF_K, 0);
+
+  // IPv4.
+  _M_filters[ipv4].k = _M_nfilters - ipv4 - 1;
+
+  if (!compile(AF_INET)) {
+    return false;
+  }
+
+  // IPv6.
+  _M_filters[ipv6].k = _M_nfilters - ipv6 - 1;
+
+  if (!compile(AF_INET6)) {
+    return false;
+  }
+
+  fprog.filter = _M_filters;
+  fprog.len = static_cast<unsigned short>(_M_nfilters);
+
+  return true;
+}
+
+bool net::fanout_filter::compile(int family)
+{
+  static const uint32_t ipv4_addresses[] = {
+    offsetof(struct iphdr, saddr),
+    offsetof(struct iphdr, daddr)
+  };
+
+  static const uint32_t ipv6_addresses[] = {
+    offsetof(struct ip6_hdr, ip6_src),
+    offsetof(struct ip6_hdr, ip6_src) + 4,
+    offsetof(struct ip6_hdr, ip6_src) + 8,
+    offsetof(struct ip6_hdr, ip6_src) + 12,
+    offsetof(struct ip6_hdr, ip6_dst),
+    offsetof(struct ip6_hdr, ip6_dst) + 4,
+    offsetof(struct ip6_hdr, ip6_dst) + 8,
+    offsetof(struct ip6_hdr, ip6_dst) + 12
+  };
+
+  size_t fragments = 0;
+
+  if (family == AF_INET) {
+    // A <- protocol.
+    stmt(BPF_LD + BPF_B + BPF_ABS, offsetof(struct iphdr, protocol));
+
+    // Not UDP (it will be discarded by the socket filter).
+    jump(BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_UDP, 1, 0);
+    stmt(BPF_RET + BPF_K, 0);
+
+    // A <- flags + fragment offset.
+    stmt(BPF_LD + BPF_H + BPF_ABS, offsetof(struct iphdr, frag_off));
+
+    // Fragments don't carry the UDP header (except the first one), hash them
+    // by the addresses and send them to the default workers, so all the
+    // fragments of a datagram go to the same worker.
+    size_t jset = _M_nfilters;
+    jump(BPF_JMP + BPF_JSET + BPF_K, 0x3fff, 0, 0);
+
+    // X <- 0.
+    stmt(BPF_LDX + BPF_W + BPF_IMM, 0);
+
+    if (!hash(ipv4_addresses, 2)) {
+      return false;
+    }
+
+    fragments = _M_nfilters;
+    stmt(BPF_JMP + BPF_JA, 0);
+
+    _M_filters[jset].jf = _M_nfilters - jset - 1;
+
+    // X <- IPv4 header length.
+    stmt(BPF_LDX + BPF_B + BPF_MSH, 0);
+
+    // A <- source port + destination port.
+    stmt(BPF_LD + BPF_W + BPF_IND, 0);
+  } else {
+    // A <- next header.
+    stmt(BPF_LD + BPF_B + BPF_ABS, offsetof(struct ip6_hdr, ip6_nxt));
+
+    // Not UDP (it will be discarded by the socket filter).
+    jump(BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_UDP, 1, 0);
+    stmt(BPF_RET + BPF_K, 0);
+
+    // A <- source port + destination port.
+    stmt(BPF_LD + BPF_W + BPF_ABS, sizeof(struct ip6_hdr));
+  }
+
+  // M[hash] <- source port + destination port.
+  stmt(BPF_ST, mem_hash);
+
+  // M[port] <- destination port.
+  stmt(BPF_ALU + BPF_AND + BPF_K, 0xffff);
+  stmt(BPF_ST, mem_port);
+
+  // M[addr] <- source address.
+  for (size_t i = 0; i < ((family == AF_INET) ? 1 : 4); i++) {
+    stmt(BPF_LD + BPF_W + BPF_ABS,
+         (family == AF_INET) ? ipv4_addresses[0] : ipv6_addresses[i]);
+
+    stmt(BPF_ST, mem_addr + i);
+  }
+
+  // Hash addresses and ports.
+  stmt(BPF_LDX + BPF_W + BPF_MEM, mem_hash);
+
+  if (!((family == AF_INET) ? hash(ipv4_addresses, 2) :
+                              hash(ipv6_addresses, 8))) {
+    return false;
+  }
+
+  // For each rule...
+  for (size_t i = 0; i < _M_nrules; i++) {
+    const struct rule* r = _M_rules + i;
+
+    if ((r->family != AF_UNSPEC) && (r->family != family)) {
+      continue;
+    }
+
+    size_t start = _M_nfilters;
+
+    size_t nexts[4];
+    size_t nnexts = 0;
+
+    // Check source prefix.
+    for (size_t w = 0; (w << 5) < r->prefixlen; w++) {
+      size_t bits = r->prefixlen - (w << 5);
+
+      uint32_t mask = (bits >= 32) ? 0xffffffff : ~(0xffffffff >> bits);
+
+      uint32_t word;
+      memcpy(&word, r->prefix + (w << 2), sizeof(uint32_t));
+
+      stmt(BPF_LD + BPF_MEM, mem_addr + w);
+
+      if (mask != 0xffffffff) {
+        stmt(BPF_ALU + BPF_AND + BPF_K, mask);
+      }
+
+      nexts[nnexts++] = _M_nfilters;
+      jump(BPF_JMP + BPF_JEQ + BPF_K, ntohl(word) & mask, 0, 0);
+    }
+
+    // A <- destination port.
+    stmt(BPF_LD + BPF_MEM, mem_port);
+
+    size_t matches[max_port_ranges];
+
+    for (size_t j = 0; j < r->nportranges; j++) {
+      if (r->portranges[j].from == r->portranges[j].to) {
+        matches[j] = _M_nfilters;
+        jump(BPF_JMP + BPF_JEQ + BPF_K, r->portranges[j].from, 0, 0);
+      } else {
+        jump(BPF_JMP + BPF_JGE + BPF_K, r->portranges[j].from, 0, 1);
+
+        matches[j] = _M_nfilters;
+        jump(BPF_JMP + BPF_JGT + BPF_K, r->portranges[j].to, 0, 0);
+      }
+    }
+
+    // No match, skip worker selection.
+    size_t next = _M_nfilters;
+    stmt(BPF_JMP + BPF_JA, 0);
+
+    size_t match = _M_nfilters;
+
+    if (!select(r->first, r->count)) {
+      return false;
+    }
+
+    // The conditional jumps have 8-bit offsets.
+    if (_M_nfilters - start > 0xff) {
+      return false;
+    }
+
+    _M_filters[next].k = _M_nfilters - next - 1;
+
+    for (size_t j = 0; j < nnexts; j++) {
+      _M_filters[nexts[j]].jf = _M_nfilters - nexts[j] - 1;
+    }
+
+    for (size_t j = 0; j < r->nportranges; j++) {
+      if (r->portranges[j].from == r->portranges[j].to) {
+        _M_filters[matches[j]].jt = match - matches[j] - 1;
+      } else {
+        _M_filters[matches[j]].jf = match - matches[j] - 1;
+      }
+    }
+  }
+
+  // Default workers.
+  if (fragments != 0) {
+    _M_filters[fragments].k = _M_nfilters - fragments - 1;
+  }
+
+  return select(_M_default_first, _M_default_count);
+}
+
+bool net::fanout_filter::select(size_t first, size_t count)
+{
+  if (count == 1) {
+    return stmt(BPF_RET + BPF_K, first);
+  }
+
+  // A <- first + (hash % count).
+  stmt(BPF_LD + BPF_MEM, mem_hash);
+  stmt(BPF_ALU + BPF_MOD + BPF_K, count);
+
+  if (first > 0) {
+    stmt(BPF_ALU + BPF_ADD + BPF_K, first);
+  }
+
+  return stmt(BPF_RET + BPF_A, 0);
+}
+
+bool net::fanout_filter::hash(const uint32_t* offsets, size_t noffsets)
+{
+  // X contains the initial value.
+  for (size_t i = 0; i < noffsets; i++) {
+    stmt(BPF_LD + BPF_W + BPF_ABS, offsets[i]);
+    stmt(BPF_ALU + BPF_XOR + BPF_X, 0);
+    stmt(BPF_MISC + BPF_TAX, 0);
+  }
+
+  // M[hash] <- (X * golden ratio) >> 16.
+  stmt(BPF_MISC + BPF_TXA, 0);
+  stmt(BPF_ALU + BPF_MUL + BPF_K, 0x9e3779b1);
+  stmt(BPF_ALU + BPF_RSH + BPF_K, 16);
+
+  return stmt(BPF_ST, mem_hash);
+}
+
+void net::fanout_filter::print() const
+{
+  static const int widths[] = {8, 16};
+
+  for (size_t i = 0; i < _M_nfilters; i++) {
+    const sock_filter* f = _M_filters + i;
+
+    printf("(%03zu) ", i);
+
+    switch (f->code) {
+      case BPF_LD | BPF_W | BPF_ABS:
+        printf("%-*s [%u]\n", widths[0], "ld", f->k);
+        break;
+      case BPF_LD | BPF_H | BPF_ABS:
+        printf("%-*s [%u]\n", widths[0], "ldh", f->k);
+        break;
+      case BPF_LD | BPF_B | BPF_ABS:
+        printf("%-*s [%u]\n", widths[0], "ldb", f->k);
+        break;
+      case BPF_LD | BPF_W | BPF_IND:
+        printf("%-*s [x + %u]\n", widths[0], "ld", f->k);
+        break;
+      case BPF_LD | BPF_MEM:
+        printf("%-*s M[%u]\n", widths[0], "ld", f->k);
+        break;
+      case BPF_LDX | BPF_W | BPF_IMM:
+        printf("%-*s #%u\n", widths[0], "ldx", f->k);
+        break;
+      case BPF_LDX | BPF_W | BPF_MEM:
+        printf("%-*s M[%u]\n", widths[0], "ldx", f->k);
+        break;
+      case BPF_LDX | BPF_B | BPF_MSH:
+        printf("%-*s 4*([%u]&0xf)\n", widths[0], "ldxb", f->k);
+        break;
+      case BPF_ST:
+        printf("%-*s M[%u]\n", widths[0], "st", f->k);
+        break;
+      case BPF_ALU | BPF_AND | BPF_K:
+        printf("%-*s #0x%x\n", widths[0], "and", f->k);
+        break;
+      case BPF_ALU | BPF_MOD | BPF_K:
+        printf("%-*s #%u\n", widths[0], "mod", f->k);
+        break;
+      case BPF_ALU | BPF_ADD | BPF_K:
+        printf("%-*s #%u\n", widths[0], "add", f->k);
+        break;
+      case BPF_ALU | BPF_MUL | BPF_K:
+        printf("%-*s #0x%x\n", widths[0], "mul", f->k);
+        break;
+      case BPF_ALU | BPF_RSH | BPF_K:
+        printf("%-*s #%u\n", widths[0], "rsh", f->k);
+        break;
+      case BPF_ALU | BPF_XOR | BPF_X:
+        printf("%-*s x\n", widths[0], "xor");
+        break;
+      case BPF_MISC | BPF_TAX:
+        printf("%s\n", "tax");
+        break;
+      case BPF_MISC | BPF_TXA:
+        printf("%s\n", "txa");
+        break;
+      case BPF_JMP | BPF_JA:
+        printf("%-*s %zu\n", widths[0], "ja", i + 1 + f->k);
+        break;
+      case BPF_JMP | BPF_JGE | BPF_K:
+      case BPF_JMP | BPF_JEQ | BPF_K:
+      case BPF_JMP | BPF_JGT | BPF_K:
+      case BPF_JMP | BPF_JSET | BPF_K:
+        printf("%-*s #0x%-*x%s%-3zu%s%zu\n",
+               widths[0],
+               (BPF_OP(f->code) == BPF_JGE) ? "jge" :
+               (BPF_OP(f->code) == BPF_JEQ) ? "jeq" :
+               (BPF_OP(f->code) == BPF_JGT) ? "jgt" :
+                                              "jset",
+               widths[1],
+               f->k,
+               "jt ",
+               i + 1 + f->jt,
+               "jf ",
+               i + 1 + f->jf);
+
+        break;
+      case BPF_RET | BPF_K:
+        printf("%-*s #%u\n", widths[0], "ret", f->k);
+        break;
+      case BPF_RET | BPF_A:
+        printf("%-*s a\n", widths[0], "ret");
+        break;
+    }
+  }
+}
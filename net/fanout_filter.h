@@ -0,0 +1,174 @@
+#ifndef NET_FANOUT_FILTER_H
+#define NET_FANOUT_FILTER_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/filter.h>
+
+namespace net {
+  // Classic BPF program for PACKET_FANOUT_CBPF which selects the worker
+  // based on the destination port and (optionally) the source prefix of the
+  // UDP datagrams.
+  //
+  // Each rule maps a set of port ranges (and optionally a source prefix) to
+  // a group of workers; the datagrams matching the rule are spread among the
+  // workers of the group by flow hash. The datagrams which don't match any
+  // rule (and the IPv4 fragments) are spread among the default workers.
+  class fanout_filter {
+    public:
+      static const size_t max_rules = 32;
+      static const size_t max_port_ranges = 16; // Per rule.
+
+      // Constructor.
+      fanout_filter();
+
+      // Destructor.
+      ~fanout_filter();
+
+      // Clear.
+      void clear();
+
+      // Set default workers.
+      void default_workers(size_t first, size_t count);
+
+      // Add rule (the ports are added with port() and port_range()).
+      bool add_rule(size_t first, size_t count);
+
+      bool add_rule(size_t first,
+                    size_t count,
+                    const void* prefix,
+                    socklen_t addrlen,
+                    unsigned prefixlen);
+
+      // Add port to the last rule.
+      bool port(in_port_t p);
+
+      // Add port range to the last rule.
+      bool port_range(in_port_t from, in_port_t to);
+
+      // Number of rules.
+      size_t count() const;
+
+      // Compile.
+      bool compile(size_t nworkers, struct sock_fprog& fprog);
+
+      // Print.
+      void print() const;
+
+    private:
+      static const size_t max_filters = BPF_MAXINSNS;
+
+      // Scratch memory.
+      static const uint32_t mem_port = 0;
+      static const uint32_t mem_addr = 1; // 1 .. 4.
+      static const uint32_t mem_hash = 5;
+
+      struct portrange {
+        in_port_t from;
+        in_port_t to;
+      };
+
+      struct rule {
+        size_t first;
+        size_t count;
+
+        // AF_UNSPEC (no prefix), AF_INET or AF_INET6.
+        int family;
+        uint8_t prefix[sizeof(struct in6_addr)];
+        unsigned prefixlen;
+
+        portrange portranges[max_port_ranges];
+        size_t nportranges;
+      };
+
+      rule _M_rules[max_rules];
+      size_t _M_nrules;
+
+      size_t _M_default_first;
+      size_t _M_default_count;
+
+      struct sock_filter _M_filters[max_filters];
+      size_t _M_nfilters;
+
+      // Compile rules for the address family.
+      bool compile(int family);
+
+      // Compile worker selection.
+      bool select(size_t first, size_t count);
+
+      // Compile hash of the words at the offsets.
+      bool hash(const uint32_t* offsets, size_t noffsets);
+
+      // Add socket filter.
+      bool stmt(uint16_t code, uint32_t k);
+      bool jump(uint16_t code, uint32_t k, uint8_t jt, uint8_t jf);
+  };
+
+  inline fanout_filter::fanout_filter()
+  {
+    clear();
+  }
+
+  inline fanout_filter::~fanout_filter()
+  {
+  }
+
+  inline void fanout_filter::default_workers(size_t first, size_t count)
+  {
+    _M_default_first = first;
+    _M_default_count = count;
+  }
+
+  inline bool fanout_filter::add_rule(size_t first, size_t count)
+  {
+    return add_rule(first, count, nullptr, 0, 0);
+  }
+
+  inline bool fanout_filter::port(in_port_t p)
+  {
+    return port_range(p, p);
+  }
+
+  inline size_t fanout_filter::count() const
+  {
+    return _M_nrules;
+  }
+
+  inline bool fanout_filter::stmt(uint16_t code, uint32_t k)
+  {
+    if (_M_nfilters < max_filters) {
+      struct sock_filter* f = _M_filters + _M_nfilters++;
+
+      f->code = code;
+      f->k = k;
+      f->jt = 0;
+      f->jf = 0;
+
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  inline bool fanout_filter::jump(uint16_t code,
+                                  uint32_t k,
+                                  uint8_t jt,
+                                  uint8_t jf)
+  {
+    if (_M_nfilters < max_filters) {
+      struct sock_filter* f = _M_filters + _M_nfilters++;
+
+      f->code = code;
+      f->k = k;
+      f->jt = jt;
+      f->jf = jf;
+
+      return true;
+    } else {
+      return false;
+    }
+  }
+}
+
+#endif // NET_FANOUT_FILTER_H
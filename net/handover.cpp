@@ -0,0 +1,185 @@
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "net/handover.h"
+
+// Build UNIX socket address.
+static bool socket_address(const char* path, struct sockaddr_un& addr);
+
+int net::handover::listen(const char* path)
+{
+  struct sockaddr_un addr;
+  if (socket_address(path, addr)) {
+    int fd;
+    if ((fd = socket(AF_UNIX,
+                     SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     0)) != -1) {
+      // Remove the socket of the previous process (if any).
+      unlink(path);
+
+      // Send SIGIO to the process when a connection arrives.
+      if ((bind(fd,
+                reinterpret_cast<const struct sockaddr*>(&addr),
+                static_cast<socklen_t>(sizeof(struct sockaddr_un))) == 0) &&
+          (::listen(fd, 1) == 0) &&
+          (fcntl(fd, F_SETOWN, getpid()) == 0) &&
+          (fcntl(fd, F_SETFL, O_NONBLOCK | O_ASYNC) == 0)) {
+        return fd;
+      }
+
+      close(fd);
+    }
+  }
+
+  return -1;
+}
+
+int net::handover::connect(const char* path)
+{
+  struct sockaddr_un addr;
+  if (socket_address(path, addr)) {
+    int fd;
+    if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) != -1) {
+      if (::connect(fd,
+                    reinterpret_cast<const struct sockaddr*>(&addr),
+                    static_cast<socklen_t>(sizeof(struct sockaddr_un))) == 0) {
+        return fd;
+      }
+
+      int error = errno;
+      close(fd);
+      errno = error;
+    }
+  } else {
+    errno = EINVAL;
+  }
+
+  return -1;
+}
+
+int net::handover::accept(int listener)
+{
+  return accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+}
+
+bool net::handover::send(int fd,
+                         const void* buf,
+                         size_t len,
+                         const int* fds,
+                         size_t nfds)
+{
+  if (nfds <= max_fds) {
+    union {
+      struct cmsghdr cmsghdr;
+      char buf[CMSG_SPACE(max_fds * sizeof(int))];
+    } control;
+
+    struct iovec iov;
+    iov.iov_base = const_cast<void*>(buf);
+    iov.iov_len = len;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (nfds > 0) {
+      msg.msg_control = control.buf;
+      msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+
+      memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+
+    return (sendmsg(fd, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(len));
+  }
+
+  return false;
+}
+
+bool net::handover::receive(int fd,
+                            void* buf,
+                            size_t len,
+                            int* fds,
+                            size_t& nfds,
+                            int ms)
+{
+  nfds = 0;
+
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  if (poll(&pfd, 1, ms) != 1) {
+    return false;
+  }
+
+  union {
+    struct cmsghdr cmsghdr;
+    char buf[CMSG_SPACE(max_fds * sizeof(int))];
+  } control;
+
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = len;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(struct msghdr));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  ssize_t ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  if (ret < 0) {
+    return false;
+  }
+
+  // Collect the descriptors.
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+       cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+      size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+      memcpy(fds + nfds, CMSG_DATA(cmsg), n * sizeof(int));
+      nfds += n;
+    }
+  }
+
+  // If the message is not complete...
+  if ((static_cast<size_t>(ret) != len) ||
+      ((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0)) {
+    for (size_t i = 0; i < nfds; i++) {
+      close(fds[i]);
+    }
+
+    nfds = 0;
+
+    return false;
+  }
+
+  return true;
+}
+
+bool socket_address(const char* path, struct sockaddr_un& addr)
+{
+  size_t len = strlen(path);
+  if ((len > 0) && (len < sizeof(addr.sun_path))) {
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, len);
+
+    return true;
+  }
+
+  return false;
+}
@@ -0,0 +1,47 @@
+#ifndef NET_HANDOVER_H
+#define NET_HANDOVER_H
+
+#include <stdlib.h>
+
+namespace net {
+  // Transfer of the packet sockets between two processes through a UNIX
+  // socket (SOCK_SEQPACKET), the descriptors are passed with SCM_RIGHTS.
+  class handover {
+    public:
+      // Maximum number of descriptors per message.
+      static const size_t max_fds = 64;
+
+      // Time to wait for a message (milliseconds).
+      static const int timeout = 10000;
+
+      // Listen on the UNIX socket (the file is replaced if it exists), SIGIO
+      // is sent to the process when a connection arrives.
+      static int listen(const char* path);
+
+      // Connect to the UNIX socket, returns -1 with `errno` set to ENOENT or
+      // ECONNREFUSED when there is no process listening on it.
+      static int connect(const char* path);
+
+      // Accept connection (don't wait), the connection is blocking.
+      static int accept(int listener);
+
+      // Send message with descriptors.
+      static bool send(int fd,
+                       const void* buf,
+                       size_t len,
+                       const int* fds,
+                       size_t nfds);
+
+      // Receive message of `len` bytes with up to `max_fds` descriptors
+      // (waits up to `ms` milliseconds, -1: until a message arrives or the
+      // peer closes the connection).
+      static bool receive(int fd,
+                          void* buf,
+                          size_t len,
+                          int* fds,
+                          size_t& nfds,
+                          int ms = timeout);
+  };
+}
+
+#endif // NET_HANDOVER_H
@@ -0,0 +1,359 @@
+#include <string.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "net/ipv4_reassembler.h"
+#include "net/numa.h"
+
+void net::ipv4_reassembler::clear()
+{
+  if (_M_arena) {
+    munmap(_M_arena, _M_arena_size);
+    _M_arena = nullptr;
+  }
+
+  if (_M_buckets) {
+    free(_M_buckets);
+    _M_buckets = nullptr;
+  }
+
+  if (_M_datagrams) {
+    free(_M_datagrams);
+    _M_datagrams = nullptr;
+  }
+
+  _M_ndatagrams = 0;
+  _M_nbuckets = 0;
+
+  _M_free = none;
+
+  _M_oldest = none;
+  _M_newest = none;
+}
+
+bool net::ipv4_reassembler::create(size_t ndatagrams, unsigned timeout)
+{
+  // Sanity checks.
+  if ((ndatagrams >= min_datagrams) &&
+      (ndatagrams <= max_datagrams) &&
+      (timeout >= min_timeout) &&
+      (timeout <= max_timeout)) {
+    clear();
+
+    // Number of buckets (power of 2).
+    size_t nbuckets = 1;
+    while (nbuckets < ndatagrams) {
+      nbuckets <<= 1;
+    }
+
+    size_t size = buffer_size + (bitmap_size * sizeof(uint64_t));
+
+    // The arena is not populated, the pages are faulted in on first use.
+    void* arena;
+    if ((arena = mmap(nullptr,
+                      ndatagrams * size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1,
+                      0)) != MAP_FAILED) {
+      _M_arena = arena;
+      _M_arena_size = ndatagrams * size;
+
+      if (((_M_datagrams = reinterpret_cast<datagram*>(
+                             malloc(ndatagrams * sizeof(datagram))
+                           )) != nullptr) &&
+          ((_M_buckets = reinterpret_cast<uint32_t*>(
+                           malloc(nbuckets * sizeof(uint32_t))
+                         )) != nullptr)) {
+        uint8_t* buf = reinterpret_cast<uint8_t*>(arena);
+
+        for (size_t i = 0; i < ndatagrams; i++) {
+          _M_datagrams[i].buf = buf;
+          _M_datagrams[i].bitmap = reinterpret_cast<uint64_t*>(buf +
+                                                               buffer_size);
+
+          _M_datagrams[i].next = (i + 1 < ndatagrams) ?
+                                   static_cast<uint32_t>(i + 1) :
+                                   none;
+
+          buf += size;
+        }
+
+        for (size_t i = 0; i < nbuckets; i++) {
+          _M_buckets[i] = none;
+        }
+
+        _M_ndatagrams = ndatagrams;
+        _M_nbuckets = nbuckets;
+
+        _M_free = 0;
+
+        _M_timeout = timeout;
+
+        return true;
+      }
+
+      clear();
+    }
+  }
+
+  return false;
+}
+
+bool net::ipv4_reassembler::add(const void* pkt,
+                                size_t pktlen,
+                                uint64_t now,
+                                const void*& dgram,
+                                size_t& len)
+{
+  const uint8_t* ip = reinterpret_cast<const uint8_t*>(pkt) +
+                      sizeof(struct ether_header);
+
+  const struct iphdr* iphdr = reinterpret_cast<const struct iphdr*>(ip);
+
+  size_t iphdrlen = iphdr->ihl << 2;
+  size_t totlen = ntohs(iphdr->tot_len);
+
+  // Sanity checks.
+  if ((iphdrlen < sizeof(struct iphdr)) ||
+      (totlen <= iphdrlen) ||
+      (sizeof(struct ether_header) + totlen > pktlen)) {
+    return false;
+  }
+
+  uint16_t frag_off = ntohs(iphdr->frag_off);
+
+  size_t offset = (frag_off & 0x1fff) << 3;
+  size_t fraglen = totlen - iphdrlen;
+  bool more_fragments = ((frag_off & IP_MF) != 0);
+
+  // All the fragments but the last one must be a multiple of 8 bytes.
+  if (((more_fragments) && ((fraglen & 0x07) != 0)) ||
+      (offset + fraglen > max_payload)) {
+    return false;
+  }
+
+  // Search datagram.
+  uint32_t bucket;
+  uint32_t idx = search(iphdr->saddr,
+                        iphdr->daddr,
+                        iphdr->id,
+                        iphdr->protocol,
+                        bucket);
+
+  if (idx == none) {
+    // Allocate a new datagram (evicting the oldest one if needed).
+    idx = allocate(bucket);
+
+    struct datagram* d = _M_datagrams + idx;
+
+    d->saddr = iphdr->saddr;
+    d->daddr = iphdr->daddr;
+    d->id = iphdr->id;
+    d->protocol = iphdr->protocol;
+
+    d->expires = now + _M_timeout;
+
+    d->hdrlen = 0;
+    d->len = 0;
+    d->end = 0;
+    d->units = 0;
+    d->fragments = 0;
+
+    memset(d->bitmap, 0, bitmap_size * sizeof(uint64_t));
+  }
+
+  struct datagram* d = _M_datagrams + idx;
+
+  d->fragments++;
+
+  // The reassembled datagram (with the IPv4 header of the first fragment)
+  // must fit in `tot_len`.
+  size_t hdrlen = (offset == 0) ?
+                    iphdrlen :
+                    ((d->hdrlen != 0) ?
+                       d->hdrlen - sizeof(struct ether_header) :
+                       sizeof(struct iphdr));
+
+  size_t end = (offset + fraglen > d->end) ? offset + fraglen : d->end;
+
+  if (hdrlen + end > 0xffff) {
+    release(idx);
+    return false;
+  }
+
+  // If this is the last fragment...
+  if (!more_fragments) {
+    size_t l = offset + fraglen;
+
+    // If the last fragment has already been received with a different
+    // length or some fragment has been received beyond the end...
+    if (((d->len != 0) && (d->len != l)) || (d->end > l)) {
+      release(idx);
+      return false;
+    }
+
+    d->len = l;
+  } else if ((d->len != 0) && (offset + fraglen > d->len)) {
+    release(idx);
+    return false;
+  }
+
+  // If this is the first fragment...
+  if (offset == 0) {
+    d->hdrlen = sizeof(struct ether_header) + iphdrlen;
+
+    // Copy ethernet and IPv4 header.
+    memcpy(d->buf + header_room - d->hdrlen, pkt, d->hdrlen);
+  }
+
+  // Copy payload.
+  memcpy(d->buf + header_room + offset, ip + iphdrlen, fraglen);
+
+  if (offset + fraglen > d->end) {
+    d->end = offset + fraglen;
+  }
+
+  // Mark 8-byte units as received.
+  for (size_t unit = offset >> 3, last = (offset + fraglen + 7) >> 3;
+       unit < last;
+       unit++) {
+    uint64_t mask = static_cast<uint64_t>(1) << (unit & 63);
+
+    if ((d->bitmap[unit >> 6] & mask) == 0) {
+      d->bitmap[unit >> 6] |= mask;
+      d->units++;
+    }
+  }
+
+  // If the datagram is not complete yet...
+  if ((d->hdrlen == 0) ||
+      (d->len == 0) ||
+      (d->units != ((d->len + 7) >> 3))) {
+    return false;
+  }
+
+  // Fix IPv4 header.
+  uint8_t* begin = d->buf + header_room - d->hdrlen;
+
+  struct iphdr* hdr = reinterpret_cast<struct iphdr*>(
+                        begin + sizeof(struct ether_header)
+                      );
+
+  hdr->tot_len = htons(static_cast<uint16_t>((hdr->ihl << 2) + d->len));
+  hdr->frag_off = 0;
+  hdr->check = 0;
+
+  dgram = begin;
+  len = d->hdrlen + d->len;
+
+  // The buffer stays untouched until the next call to add().
+  release(idx);
+
+  return true;
+}
+
+void net::ipv4_reassembler::expire(uint64_t now)
+{
+  while ((_M_oldest != none) && (_M_datagrams[_M_oldest].expires <= now)) {
+    discard(_M_oldest);
+  }
+}
+
+void net::ipv4_reassembler::memory(size_t* nodes) const
+{
+  if (_M_arena) {
+    numa::memory(_M_arena, _M_arena_size, nodes);
+    numa::memory(_M_datagrams, _M_ndatagrams * sizeof(datagram), nodes);
+    numa::memory(_M_buckets, _M_nbuckets * sizeof(uint32_t), nodes);
+  }
+}
+
+uint32_t net::ipv4_reassembler::search(uint32_t saddr,
+                                       uint32_t daddr,
+                                       uint16_t id,
+                                       uint8_t protocol,
+                                       uint32_t& bucket) const
+{
+  bucket = hash(saddr, daddr, id, protocol) & (_M_nbuckets - 1);
+
+  for (uint32_t idx = _M_buckets[bucket];
+       idx != none;
+       idx = _M_datagrams[idx].next) {
+    const struct datagram* d = _M_datagrams + idx;
+
+    if ((d->saddr == saddr) &&
+        (d->daddr == daddr) &&
+        (d->id == id) &&
+        (d->protocol == protocol)) {
+      return idx;
+    }
+  }
+
+  return none;
+}
+
+uint32_t net::ipv4_reassembler::allocate(uint32_t bucket)
+{
+  // If there are no free datagrams...
+  if (_M_free == none) {
+    // Evict the oldest datagram.
+    discard(_M_oldest);
+  }
+
+  uint32_t idx = _M_free;
+  struct datagram* d = _M_datagrams + idx;
+
+  _M_free = d->next;
+
+  // Insert in the hash bucket.
+  d->next = _M_buckets[bucket];
+  _M_buckets[bucket] = idx;
+
+  // Append to the list of datagrams ordered by age.
+  d->older = _M_newest;
+  d->newer = none;
+
+  if (_M_newest != none) {
+    _M_datagrams[_M_newest].newer = idx;
+  } else {
+    _M_oldest = idx;
+  }
+
+  _M_newest = idx;
+
+  return idx;
+}
+
+void net::ipv4_reassembler::release(uint32_t idx)
+{
+  struct datagram* d = _M_datagrams + idx;
+
+  // Remove from the hash bucket.
+  uint32_t* prev = _M_buckets + (hash(d->saddr,
+                                      d->daddr,
+                                      d->id,
+                                      d->protocol) & (_M_nbuckets - 1));
+
+  while (*prev != idx) {
+    prev = &_M_datagrams[*prev].next;
+  }
+
+  *prev = d->next;
+
+  // Remove from the list of datagrams ordered by age.
+  if (d->older != none) {
+    _M_datagrams[d->older].newer = d->newer;
+  } else {
+    _M_oldest = d->newer;
+  }
+
+  if (d->newer != none) {
+    _M_datagrams[d->newer].older = d->older;
+  } else {
+    _M_newest = d->older;
+  }
+
+  // Add to the list of free datagrams.
+  d->next = _M_free;
+  _M_free = idx;
+}
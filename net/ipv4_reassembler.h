@@ -0,0 +1,215 @@
+#ifndef NET_IPV4_REASSEMBLER_H
+#define NET_IPV4_REASSEMBLER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+
+namespace net {
+  class ipv4_reassembler {
+    public:
+      static const size_t min_datagrams = 1;
+      static const size_t max_datagrams = 64 * 1024;
+      static const size_t default_datagrams = 256;
+
+      static const unsigned min_timeout = 1; // Seconds.
+      static const unsigned max_timeout = 120; // Seconds.
+      static const unsigned default_timeout = 30; // Seconds.
+
+      // Constructor.
+      ipv4_reassembler();
+
+      // Destructor.
+      ~ipv4_reassembler();
+
+      // Clear.
+      void clear();
+
+      // Create.
+      bool create(size_t ndatagrams, unsigned timeout);
+
+      // Add fragment.
+      // Returns true when the datagram has been reassembled. In that case,
+      // `dgram` points to the complete frame (ethernet header included),
+      // which is valid until the next call to add().
+      bool add(const void* pkt,
+               size_t pktlen,
+               uint64_t now,
+               const void*& dgram,
+               size_t& len);
+
+      // Expire datagrams.
+      void expire(uint64_t now);
+
+      // Number of datagrams (and of their fragments) which expired or were
+      // evicted without completing.
+      uint64_t expired() const;
+      uint64_t expired_fragments() const;
+
+      // Add the memory of the reassembler to its NUMA node.
+      void memory(size_t* nodes) const;
+
+    private:
+      // Maximum size of the IPv4 header.
+      static const size_t max_header = 15 << 2;
+
+      // Maximum size of the payload of an IPv4 datagram.
+      static const size_t max_payload = 0xffff - sizeof(struct iphdr);
+
+      // Space reserved for the ethernet and the IPv4 header.
+      static const size_t header_room = sizeof(struct ether_header) +
+                                        max_header;
+
+      // Size of the bitmap of received 8-byte units.
+      static const size_t bitmap_size = (((max_payload + 7) >> 3) + 63) >> 6;
+
+      // Size of the buffer of each datagram.
+      static const size_t buffer_size = (header_room + max_payload + 63) & ~63;
+
+      static const uint32_t none = UINT32_MAX;
+
+      struct datagram {
+        // Key.
+        uint32_t saddr;
+        uint32_t daddr;
+        uint16_t id;
+        uint8_t protocol;
+
+        // Expiration time.
+        uint64_t expires;
+
+        // Length of the ethernet + IPv4 header of the first fragment
+        // (0 if the first fragment has not been received yet).
+        size_t hdrlen;
+
+        // Length of the payload (0 if the last fragment has not been received
+        // yet).
+        size_t len;
+
+        // Highest offset received.
+        size_t end;
+
+        // Number of 8-byte units received.
+        size_t units;
+
+        // Number of fragments received.
+        size_t fragments;
+
+        uint8_t* buf;
+        uint64_t* bitmap;
+
+        // Next datagram in the hash bucket.
+        uint32_t next;
+
+        // Previous and next datagram in the list of datagrams ordered by age.
+        uint32_t older;
+        uint32_t newer;
+      };
+
+      datagram* _M_datagrams;
+      size_t _M_ndatagrams;
+
+      uint32_t* _M_buckets;
+      size_t _M_nbuckets;
+
+      // Arena for the buffers and the bitmaps.
+      void* _M_arena;
+      size_t _M_arena_size;
+
+      // Free datagrams.
+      uint32_t _M_free;
+
+      // Oldest and newest datagram in use.
+      uint32_t _M_oldest;
+      uint32_t _M_newest;
+
+      unsigned _M_timeout;
+
+      // Statistics.
+      uint64_t _M_expired;
+      uint64_t _M_expired_fragments;
+
+      // Search datagram.
+      uint32_t search(uint32_t saddr,
+                      uint32_t daddr,
+                      uint16_t id,
+                      uint8_t protocol,
+                      uint32_t& bucket) const;
+
+      // Allocate datagram.
+      uint32_t allocate(uint32_t bucket);
+
+      // Release datagram.
+      void release(uint32_t idx);
+
+      // Release datagram which didn't complete (counted as expired).
+      void discard(uint32_t idx);
+
+      // Hash.
+      static uint32_t hash(uint32_t saddr,
+                           uint32_t daddr,
+                           uint16_t id,
+                           uint8_t protocol);
+
+      // Disable copy constructor and assignment operator.
+      ipv4_reassembler(const ipv4_reassembler&) = delete;
+      ipv4_reassembler& operator=(const ipv4_reassembler&) = delete;
+  };
+
+  inline ipv4_reassembler::ipv4_reassembler()
+    : _M_datagrams(nullptr),
+      _M_ndatagrams(0),
+      _M_buckets(nullptr),
+      _M_nbuckets(0),
+      _M_arena(nullptr),
+      _M_arena_size(0),
+      _M_free(none),
+      _M_oldest(none),
+      _M_newest(none),
+      _M_timeout(default_timeout),
+      _M_expired(0),
+      _M_expired_fragments(0)
+  {
+  }
+
+  inline ipv4_reassembler::~ipv4_reassembler()
+  {
+    clear();
+  }
+
+  inline uint64_t ipv4_reassembler::expired() const
+  {
+    return __atomic_load_n(&_M_expired, __ATOMIC_RELAXED);
+  }
+
+  inline uint64_t ipv4_reassembler::expired_fragments() const
+  {
+    return __atomic_load_n(&_M_expired_fragments, __ATOMIC_RELAXED);
+  }
+
+  inline void ipv4_reassembler::discard(uint32_t idx)
+  {
+    _M_expired++;
+    _M_expired_fragments += _M_datagrams[idx].fragments;
+
+    release(idx);
+  }
+
+  inline uint32_t ipv4_reassembler::hash(uint32_t saddr,
+                                         uint32_t daddr,
+                                         uint16_t id,
+                                         uint8_t protocol)
+  {
+    uint32_t h = saddr * 0x9e3779b1;
+    h ^= daddr + 0x7f4a7c15 + (h << 6) + (h >> 2);
+    h ^= ((static_cast<uint32_t>(id) << 8) | protocol) +
+         0x7f4a7c15 +
+         (h << 6) +
+         (h >> 2);
+
+    return h;
+  }
+}
+
+#endif // NET_IPV4_REASSEMBLER_H
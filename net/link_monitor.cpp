@@ -0,0 +1,227 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include "net/link_monitor.h"
+
+net::link_monitor::~link_monitor()
+{
+  stop();
+
+  if (_M_fd != -1) {
+    close(_M_fd);
+  }
+
+  if (_M_interfaces) {
+    free(_M_interfaces);
+  }
+}
+
+bool net::link_monitor::create(size_t max_interfaces)
+{
+  if (_M_fd != -1) {
+    return true;
+  }
+
+  if (max_interfaces == 0) {
+    return false;
+  }
+
+  // Allocate the table of interfaces.
+  if ((_M_interfaces = reinterpret_cast<struct interface*>(
+                         calloc(max_interfaces, sizeof(struct interface))
+                       )) == nullptr) {
+    return false;
+  }
+
+  _M_max_interfaces = max_interfaces;
+
+  // Create netlink socket.
+  if ((_M_fd = socket(AF_NETLINK,
+                      SOCK_RAW | SOCK_CLOEXEC,
+                      NETLINK_ROUTE)) != -1) {
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(struct sockaddr_nl));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_LINK;
+
+    // Set the size of the receive buffer and bind.
+    int size = receive_buffer;
+    if ((setsockopt(_M_fd,
+                    SOL_SOCKET,
+                    SO_RCVBUF,
+                    &size,
+                    static_cast<socklen_t>(sizeof(int))) == 0) &&
+        (bind(_M_fd,
+              reinterpret_cast<const struct sockaddr*>(&addr),
+              static_cast<socklen_t>(sizeof(struct sockaddr_nl))) == 0)) {
+      return true;
+    }
+
+    close(_M_fd);
+    _M_fd = -1;
+  }
+
+  free(_M_interfaces);
+  _M_interfaces = nullptr;
+
+  _M_max_interfaces = 0;
+
+  return false;
+}
+
+const bool* net::link_monitor::watch(unsigned ifindex)
+{
+  // Search interface.
+  for (size_t i = 0; i < _M_ninterfaces; i++) {
+    if (ifindex == _M_interfaces[i].ifindex) {
+      return &_M_interfaces[i].running;
+    }
+  }
+
+  if ((_M_fd == -1) || (_M_ninterfaces == _M_max_interfaces)) {
+    return nullptr;
+  }
+
+  // Get the current state of the interface.
+  bool r;
+  if (!state(ifindex, r)) {
+    return nullptr;
+  }
+
+  struct interface* iface = _M_interfaces + _M_ninterfaces++;
+
+  iface->ifindex = ifindex;
+  iface->running = r;
+
+  return &iface->running;
+}
+
+bool net::link_monitor::start()
+{
+  if (_M_running) {
+    return true;
+  }
+
+  if (_M_fd == -1) {
+    return false;
+  }
+
+  _M_running = true;
+
+  if (pthread_create(&_M_thread, nullptr, run, this) == 0) {
+    return true;
+  }
+
+  _M_running = false;
+
+  return false;
+}
+
+void net::link_monitor::stop()
+{
+  if (_M_running) {
+    __atomic_store_n(&_M_running, false, __ATOMIC_RELAXED);
+    pthread_join(_M_thread, nullptr);
+  }
+}
+
+void net::link_monitor::update(unsigned ifindex, bool running)
+{
+  // Search interface.
+  for (size_t i = 0; i < _M_ninterfaces; i++) {
+    if (ifindex == _M_interfaces[i].ifindex) {
+      __atomic_store_n(&_M_interfaces[i].running, running, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+}
+
+void net::link_monitor::reload()
+{
+  // For each interface...
+  for (size_t i = 0; i < _M_ninterfaces; i++) {
+    // An interface whose state cannot be read (deleted) cannot send.
+    bool r;
+    if (!state(_M_interfaces[i].ifindex, r)) {
+      r = false;
+    }
+
+    __atomic_store_n(&_M_interfaces[i].running, r, __ATOMIC_RELAXED);
+  }
+}
+
+bool net::link_monitor::state(unsigned ifindex, bool& running)
+{
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(struct ifreq));
+  if (!if_indextoname(ifindex, ifr.ifr_name)) {
+    return false;
+  }
+
+  int fd;
+  if ((fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1) {
+    return false;
+  }
+
+  int ret = ioctl(fd, SIOCGIFFLAGS, &ifr);
+
+  close(fd);
+
+  if (ret != 0) {
+    return false;
+  }
+
+  running = ((ifr.ifr_flags & (IFF_UP | IFF_RUNNING)) ==
+             (IFF_UP | IFF_RUNNING));
+
+  return true;
+}
+
+void net::link_monitor::run()
+{
+  uint8_t buf[16 * 1024];
+
+  struct pollfd pfd;
+  pfd.fd = _M_fd;
+  pfd.events = POLLIN;
+
+  while (__atomic_load_n(&_M_running, __ATOMIC_RELAXED)) {
+    if (poll(&pfd, 1, poll_timeout) <= 0) {
+      continue;
+    }
+
+    ssize_t len;
+    if ((len = recv(_M_fd, buf, sizeof(buf), MSG_DONTWAIT)) <= 0) {
+      // If the receive buffer overflowed, notifications have been lost.
+      if ((len < 0) && (errno == ENOBUFS)) {
+        reload();
+      }
+
+      continue;
+    }
+
+    // For each message...
+    for (const struct nlmsghdr* nlh = reinterpret_cast<struct nlmsghdr*>(buf);
+         NLMSG_OK(nlh, static_cast<size_t>(len));
+         nlh = NLMSG_NEXT(nlh, len)) {
+      if ((nlh->nlmsg_type == RTM_NEWLINK) ||
+          (nlh->nlmsg_type == RTM_DELLINK)) {
+        const struct ifinfomsg* ifi = reinterpret_cast<struct ifinfomsg*>(
+                                        NLMSG_DATA(nlh)
+                                      );
+
+        // A deleted interface cannot send anymore.
+        update(static_cast<unsigned>(ifi->ifi_index),
+               (nlh->nlmsg_type == RTM_NEWLINK) &&
+               ((ifi->ifi_flags & (IFF_UP | IFF_RUNNING)) ==
+                (IFF_UP | IFF_RUNNING)));
+      }
+    }
+  }
+}
@@ -0,0 +1,98 @@
+#ifndef NET_LINK_MONITOR_H
+#define NET_LINK_MONITOR_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+namespace net {
+  // Thread which follows the carrier of the interfaces through netlink
+  // (RTM_NEWLINK / RTM_DELLINK notifications): each interface watched has
+  // a flag which tells whether it can send (up and running), the workers
+  // read it without locks.
+  class link_monitor {
+    public:
+      // Constructor.
+      link_monitor();
+
+      // Destructor.
+      ~link_monitor();
+
+      // Create for up to `max_interfaces` interfaces (the netlink socket is
+      // bound before reading the state of the interfaces, so no change is
+      // missed).
+      bool create(size_t max_interfaces);
+
+      // Watch interface, returns the flag of the interface (null on error).
+      const bool* watch(unsigned ifindex);
+
+      // Start.
+      bool start();
+
+      // Stop.
+      void stop();
+
+    private:
+      // Time to wait for notifications before checking whether the thread
+      // has been stopped (milliseconds).
+      static const int poll_timeout = 100;
+
+      // Size of the receive buffer of the netlink socket (bytes, a burst of
+      // notifications which overflows it is recovered by reading the state
+      // of all the interfaces again).
+      static const int receive_buffer = 1024 * 1024;
+
+      struct interface {
+        unsigned ifindex;
+
+        // Is the interface up and running?
+        bool running;
+      };
+
+      // The workers point to the flags, so the table is not reallocated.
+      struct interface* _M_interfaces;
+      size_t _M_ninterfaces;
+      size_t _M_max_interfaces;
+
+      // Netlink socket (RTMGRP_LINK).
+      int _M_fd;
+
+      pthread_t _M_thread;
+
+      bool _M_running;
+
+      // Set the state of the interface (if watched).
+      void update(unsigned ifindex, bool running);
+
+      // Read the state of all the interfaces (after losing notifications).
+      void reload();
+
+      // Read the state of the interface (`running`: is it up and running?).
+      static bool state(unsigned ifindex, bool& running);
+
+      // Run.
+      static void* run(void* arg);
+      void run();
+
+      // Disable copy constructor and assignment operator.
+      link_monitor(const link_monitor&) = delete;
+      link_monitor& operator=(const link_monitor&) = delete;
+  };
+
+  inline link_monitor::link_monitor()
+    : _M_interfaces(nullptr),
+      _M_ninterfaces(0),
+      _M_max_interfaces(0),
+      _M_fd(-1),
+      _M_running(false)
+  {
+  }
+
+  inline void* link_monitor::run(void* arg)
+  {
+    reinterpret_cast<link_monitor*>(arg)->run();
+    return nullptr;
+  }
+}
+
+#endif // NET_LINK_MONITOR_H
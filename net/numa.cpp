@@ -0,0 +1,74 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "net/numa.h"
+
+bool net::numa::preferred_node(int node)
+{
+  if (node < 0) {
+    return (syscall(SYS_set_mempolicy, MPOL_DEFAULT, nullptr, 0) == 0);
+  }
+
+  if (static_cast<size_t>(node) < max_nodes) {
+    unsigned long mask[(max_nodes + (8 * sizeof(unsigned long)) - 1) /
+                       (8 * sizeof(unsigned long))] = {0};
+
+    mask[node / (8 * sizeof(unsigned long))] |=
+      1UL << (node % (8 * sizeof(unsigned long)));
+
+    return (syscall(SYS_set_mempolicy,
+                    MPOL_PREFERRED,
+                    mask,
+                    max_nodes + 1) == 0);
+  }
+
+  return false;
+}
+
+void net::numa::memory(const void* buf, size_t len, size_t* nodes)
+{
+  static const size_t max_pages = 1024;
+
+  size_t pagesize = static_cast<size_t>(getpagesize());
+
+  uintptr_t begin = reinterpret_cast<uintptr_t>(buf) & ~(pagesize - 1);
+  uintptr_t end = reinterpret_cast<uintptr_t>(buf) + len;
+
+  void* pages[max_pages];
+  int status[max_pages];
+
+  while (begin < end) {
+    size_t npages = 0;
+    while ((npages < max_pages) && (begin < end)) {
+      pages[npages++] = reinterpret_cast<void*>(begin);
+      begin += pagesize;
+    }
+
+    // Query the NUMA node of the pages (without moving them).
+    if (syscall(SYS_move_pages,
+                0,
+                npages,
+                pages,
+                nullptr,
+                status,
+                0) == 0) {
+      for (size_t i = 0; i < npages; i++) {
+        // Negative status: page not present.
+        if ((status[i] >= 0) && (static_cast<size_t>(status[i]) < max_nodes)) {
+          nodes[status[i]] += pagesize;
+        }
+      }
+    }
+  }
+}
+
+void net::numa::show_memory(const size_t* nodes)
+{
+  for (size_t i = 0; i < max_nodes; i++) {
+    if (nodes[i] > 0) {
+      printf("%zu KB on NUMA node %zu.\n", nodes[i] / 1024, i);
+    }
+  }
+}
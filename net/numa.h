@@ -0,0 +1,58 @@
+#ifndef NET_NUMA_H
+#define NET_NUMA_H
+
+#include <stdlib.h>
+
+namespace net {
+  class numa {
+    public:
+      static const size_t max_nodes = 64;
+
+      // Set the preferred NUMA node for the memory allocated by the calling
+      // thread (-1: default policy).
+      // The pages of the packet rings are allocated by the kernel when the
+      // ring is set up, so this has to be done before creating the ring.
+      static bool preferred_node(int node);
+
+      // Add the memory of the pages of the buffer which are present to their
+      // NUMA node (`nodes` has `max_nodes` elements).
+      static void memory(const void* buf, size_t len, size_t* nodes);
+
+      // Show memory per NUMA node.
+      static void show_memory(const size_t* nodes);
+
+      // Set the preferred NUMA node while in scope.
+      class scoped_node {
+        public:
+          // Constructor.
+          scoped_node(int node);
+
+          // Destructor.
+          ~scoped_node();
+
+        private:
+          int _M_node;
+
+          // Disable copy constructor and assignment operator.
+          scoped_node(const scoped_node&) = delete;
+          scoped_node& operator=(const scoped_node&) = delete;
+      };
+  };
+
+  inline numa::scoped_node::scoped_node(int node)
+    : _M_node(node)
+  {
+    if (_M_node >= 0) {
+      preferred_node(_M_node);
+    }
+  }
+
+  inline numa::scoped_node::~scoped_node()
+  {
+    if (_M_node >= 0) {
+      preferred_node(-1);
+    }
+  }
+}
+
+#endif // NET_NUMA_H
@@ -0,0 +1,367 @@
+#ifndef NET_RATE_LIMITER_H
+#define NET_RATE_LIMITER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "net/timer_wheel.h"
+#include "net/numa.h"
+#include "macros/macros.h"
+
+namespace net {
+  // Rate limit of a destination: a token bucket for the packets and another
+  // one for the bytes (single thread). The frames over the limit are either
+  // dropped or paced: they are copied to the queue of the limiter and sent,
+  // in order, when the timer of the limiter expires.
+  class rate_limiter {
+    public:
+      enum class mode {
+        drop,
+        pace
+      };
+
+      // Number of frames of the queue (pacing).
+      static const size_t queue_frames = 1024;
+
+      // Burst (packets).
+      static const size_t min_burst = 1;
+      static const size_t max_burst = 64 * 1024;
+      static const size_t default_burst = 32;
+
+      struct parameters {
+        // Packets per second (0: no limit).
+        uint64_t packets;
+
+        // Bytes per second (0: no limit).
+        uint64_t bytes;
+
+        // Number of packets (of maximum length for the byte limit) which
+        // can be sent back to back.
+        size_t burst;
+
+        enum mode mode;
+      };
+
+      // Constructor.
+      rate_limiter();
+
+      // Destructor.
+      ~rate_limiter();
+
+      // Create (the clock is the one of `wheel`, the longest frame has
+      // `max_frame_length` bytes).
+      bool create(const struct parameters& params,
+                  size_t max_frame_length,
+                  timer_wheel* wheel);
+
+      // Can a frame of `len` bytes be sent now? (the frames waiting in the
+      // queue go first). The tokens are taken if so.
+      bool admit(size_t len);
+
+      // Hold frame over the limit (`owner` is passed to the handler of the
+      // timer). Returns false if the frame has been dropped.
+      bool hold(const struct iovec* iov,
+                size_t iovcnt,
+                size_t len,
+                void* owner);
+
+      // Get the first frame of the queue if it can be sent now (the tokens
+      // are taken).
+      bool front(struct iovec& frame);
+
+      // Remove the first frame of the queue, after front().
+      void pop();
+
+      // Set the timer for the first frame of the queue (if any).
+      void schedule(void* owner);
+
+      // Number of frames dropped (over the limit or queue full).
+      uint64_t drops() const;
+
+      // Number of frames paced.
+      uint64_t paced() const;
+
+      // Get size of the queue.
+      size_t size() const;
+
+      // Add the memory of the queue to its NUMA node.
+      void memory(size_t* nodes) const;
+
+    private:
+      // Tokens are kept in billionths, so a bucket is refilled by its rate
+      // times the elapsed nanoseconds.
+      static const uint64_t scale = 1000000000ULL;
+
+      struct bucket {
+        // Tokens per second (0: no limit).
+        uint64_t rate;
+
+        // Size of the bucket and tokens (billionths).
+        uint64_t depth;
+        uint64_t tokens;
+
+        // Time to fill the bucket up from empty (nanoseconds).
+        uint64_t fill_time;
+
+        // Last refill (nanoseconds).
+        uint64_t last;
+      };
+
+      struct bucket _M_packets;
+      struct bucket _M_bytes;
+
+      enum mode _M_mode;
+
+      timer_wheel* _M_wheel;
+      struct timer_wheel::timer _M_timer;
+
+      // Queue of the frames paced (each slot: length + frame).
+      uint8_t* _M_slots;
+      size_t _M_slot_size;
+
+      size_t _M_head;
+      size_t _M_tail;
+
+      uint64_t _M_drops;
+      uint64_t _M_paced;
+
+      // Initialize bucket.
+      static void init(struct bucket& b, uint64_t rate, uint64_t size);
+
+      // Refill bucket.
+      static void refill(struct bucket& b, uint64_t now);
+
+      // Time until the bucket has `cost` tokens (nanoseconds).
+      static uint64_t wait(const struct bucket& b, uint64_t cost);
+
+      // Take the tokens for a frame of `len` bytes (if there are enough).
+      bool take(size_t len, uint64_t now);
+
+      // Get the length of the frame in a slot.
+      uint32_t& length(size_t idx);
+
+      // Disable copy constructor and assignment operator.
+      rate_limiter(const rate_limiter&) = delete;
+      rate_limiter& operator=(const rate_limiter&) = delete;
+  };
+
+  inline rate_limiter::rate_limiter()
+    : _M_mode(mode::drop),
+      _M_wheel(nullptr),
+      _M_slots(nullptr),
+      _M_slot_size(0),
+      _M_head(0),
+      _M_tail(0),
+      _M_drops(0),
+      _M_paced(0)
+  {
+    _M_timer.pending = false;
+  }
+
+  inline rate_limiter::~rate_limiter()
+  {
+    if (_M_slots) {
+      free(_M_slots);
+    }
+  }
+
+  inline bool rate_limiter::create(const struct parameters& params,
+                                   size_t max_frame_length,
+                                   timer_wheel* wheel)
+  {
+    // Sanity checks.
+    if (((params.packets > 0) || (params.bytes > 0)) &&
+        (params.packets <= scale) &&
+        (params.bytes <= scale * 16) &&
+        (params.burst >= min_burst) &&
+        (params.burst <= max_burst) &&
+        (max_frame_length > 0) &&
+        (max_frame_length <= UINT16_MAX)) {
+      if (params.mode == mode::pace) {
+        // Slot: length + frame (cache aligned).
+        size_t slot_size = (sizeof(uint32_t) + max_frame_length +
+                            CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+
+        void* buf;
+        if (posix_memalign(&buf,
+                           CACHE_LINE_SIZE,
+                           queue_frames * slot_size) != 0) {
+          return false;
+        }
+
+        _M_slots = reinterpret_cast<uint8_t*>(buf);
+        _M_slot_size = slot_size;
+      }
+
+      init(_M_packets, params.packets, params.burst);
+      init(_M_bytes, params.bytes, params.burst * max_frame_length);
+
+      _M_mode = params.mode;
+      _M_wheel = wheel;
+
+      return true;
+    }
+
+    return false;
+  }
+
+  inline bool rate_limiter::admit(size_t len)
+  {
+    return ((_M_head == _M_tail) && (take(len, _M_wheel->now())));
+  }
+
+  inline bool rate_limiter::hold(const struct iovec* iov,
+                                 size_t iovcnt,
+                                 size_t len,
+                                 void* owner)
+  {
+    // If the frames over the limit are dropped or the queue is full...
+    if ((_M_mode == mode::drop) ||
+        (_M_head - _M_tail == queue_frames) ||
+        (len + sizeof(uint32_t) > _M_slot_size)) {
+      _M_drops++;
+      return false;
+    }
+
+    size_t idx = _M_head & (queue_frames - 1);
+
+    // Copy frame.
+    uint8_t* data = _M_slots + (idx * _M_slot_size) + sizeof(uint32_t);
+    for (size_t i = 0; i < iovcnt; i++) {
+      memcpy(data, iov[i].iov_base, iov[i].iov_len);
+      data += iov[i].iov_len;
+    }
+
+    length(idx) = static_cast<uint32_t>(len);
+
+    _M_head++;
+    _M_paced++;
+
+    schedule(owner);
+
+    return true;
+  }
+
+  inline bool rate_limiter::front(struct iovec& frame)
+  {
+    if (_M_head != _M_tail) {
+      size_t idx = _M_tail & (queue_frames - 1);
+
+      if (take(length(idx), _M_wheel->now())) {
+        frame.iov_base = _M_slots + (idx * _M_slot_size) + sizeof(uint32_t);
+        frame.iov_len = length(idx);
+
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  inline void rate_limiter::pop()
+  {
+    _M_tail++;
+  }
+
+  inline void rate_limiter::schedule(void* owner)
+  {
+    if ((_M_head != _M_tail) && (!_M_timer.pending)) {
+      uint64_t now = _M_wheel->now();
+
+      refill(_M_packets, now);
+      refill(_M_bytes, now);
+
+      // The frame can be sent when both buckets have enough tokens.
+      uint64_t cost = length(_M_tail & (queue_frames - 1)) * scale;
+
+      _M_timer.data = owner;
+
+      _M_wheel->add(&_M_timer,
+                    now + MAX(wait(_M_packets, scale), wait(_M_bytes, cost)));
+    }
+  }
+
+  inline uint64_t rate_limiter::drops() const
+  {
+    return __atomic_load_n(&_M_drops, __ATOMIC_RELAXED);
+  }
+
+  inline uint64_t rate_limiter::paced() const
+  {
+    return __atomic_load_n(&_M_paced, __ATOMIC_RELAXED);
+  }
+
+  inline size_t rate_limiter::size() const
+  {
+    return _M_slots ? queue_frames * _M_slot_size : 0;
+  }
+
+  inline void rate_limiter::memory(size_t* nodes) const
+  {
+    if (_M_slots) {
+      numa::memory(_M_slots, size(), nodes);
+    }
+  }
+
+  inline void rate_limiter::init(struct bucket& b,
+                                 uint64_t rate,
+                                 uint64_t size)
+  {
+    b.rate = rate;
+    b.depth = size * scale;
+    b.tokens = b.depth;
+    b.fill_time = (rate > 0) ? (b.depth + rate - 1) / rate : 0;
+    b.last = 0;
+  }
+
+  inline void rate_limiter::refill(struct bucket& b, uint64_t now)
+  {
+    uint64_t elapsed = now - b.last;
+
+    if (elapsed >= b.fill_time) {
+      b.tokens = b.depth;
+    } else {
+      b.tokens = MIN(b.tokens + (b.rate * elapsed), b.depth);
+    }
+
+    b.last = now;
+  }
+
+  inline uint64_t rate_limiter::wait(const struct bucket& b, uint64_t cost)
+  {
+    return ((b.rate > 0) && (b.tokens < cost)) ?
+             (cost - b.tokens + b.rate - 1) / b.rate :
+             0;
+  }
+
+  inline bool rate_limiter::take(size_t len, uint64_t now)
+  {
+    uint64_t cost = len * scale;
+
+    refill(_M_packets, now);
+    refill(_M_bytes, now);
+
+    if (((_M_packets.rate == 0) || (_M_packets.tokens >= scale)) &&
+        ((_M_bytes.rate == 0) || (_M_bytes.tokens >= cost))) {
+      if (_M_packets.rate > 0) {
+        _M_packets.tokens -= scale;
+      }
+
+      if (_M_bytes.rate > 0) {
+        _M_bytes.tokens -= cost;
+      }
+
+      return true;
+    }
+
+    return false;
+  }
+
+  inline uint32_t& rate_limiter::length(size_t idx)
+  {
+    return *reinterpret_cast<uint32_t*>(_M_slots + (idx * _M_slot_size));
+  }
+}
+
+#endif // NET_RATE_LIMITER_H
@@ -3,10 +3,13 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <poll.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <netinet/if_ether.h>
 #include <arpa/inet.h>
 #include "net/ring_buffer.h"
+#include "net/numa.h"
 
 void net::ring_buffer::clear()
 {
@@ -30,8 +33,21 @@ void net::ring_buffer::clear()
     _M_tx_frames = nullptr;
   }
 
+  if (_M_holds) {
+    free(_M_holds);
+    _M_holds = nullptr;
+  }
+
+  if (_M_shared) {
+    free(_M_shared);
+    _M_shared = nullptr;
+  }
+
   _M_rx_idx = 0;
   _M_tx_idx = 0;
+
+  _M_packets = 0;
+  _M_drops = 0;
 }
 
 bool net::ring_buffer::create(tpacket_versions version,
@@ -48,17 +64,11 @@ bool net::ring_buffer::create(tpacket_versions version,
         (setup_ring(version, t, ring_size)) &&
         (mmap_ring(t)) &&
         (bind_ring(ifindex, fprog))) {
-      if ((t != type::tx) && (fanout_size > 0)) {
-        // Create fanout group.
-        int optval = (fanout << 16) | fanout_id;
-
-        if (setsockopt(_M_fd,
-                       SOL_PACKET,
-                       PACKET_FANOUT,
-                       &optval,
-                       sizeof(int)) < 0) {
-          return false;
-        }
+      // Create fanout group.
+      if ((t != type::tx) &&
+          (fanout_size > 0) &&
+          (!this->fanout(fanout, fanout_id))) {
+        return false;
       }
 
       _M_version = version;
@@ -71,6 +81,125 @@ bool net::ring_buffer::create(tpacket_versions version,
   return false;
 }
 
+bool net::ring_buffer::fanout(int fanout, uint16_t fanout_id)
+{
+  int optval = (fanout << 16) | fanout_id;
+
+  return (setsockopt(_M_fd,
+                     SOL_PACKET,
+                     PACKET_FANOUT,
+                     &optval,
+                     sizeof(int)) == 0);
+}
+
+bool net::ring_buffer::fanout_in_use(uint16_t fanout_id, bool& in_use)
+{
+  // A socket which is not bound to an interface creates the group if
+  // there is none (it is released when the socket is closed), and it cannot
+  // join the groups of the RX ring buffers (bound) nor a group of another
+  // mode, so it tries two modes.
+  static const int modes[] = {PACKET_FANOUT_HASH, PACKET_FANOUT_LB};
+
+  for (size_t i = 0; i < ARRAY_SIZE(modes); i++) {
+    int fd;
+    if ((fd = socket(PF_PACKET,
+                     SOCK_RAW | SOCK_CLOEXEC,
+                     htons(ETH_P_ALL))) == -1) {
+      return false;
+    }
+
+    int optval = (modes[i] << 16) | fanout_id;
+
+    int ret = setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &optval, sizeof(int));
+
+    close(fd);
+
+    if (ret != 0) {
+      in_use = true;
+      return true;
+    }
+  }
+
+  in_use = false;
+
+  return true;
+}
+
+bool net::ring_buffer::filter(const struct sock_fprog* fprog)
+{
+  if (fprog) {
+    return (setsockopt(_M_fd,
+                       SOL_SOCKET,
+                       SO_ATTACH_FILTER,
+                       fprog,
+                       sizeof(struct sock_fprog)) == 0);
+  }
+
+  int optval = 0;
+
+  return (setsockopt(_M_fd,
+                     SOL_SOCKET,
+                     SO_DETACH_FILTER,
+                     &optval,
+                     sizeof(int)) == 0);
+}
+
+bool net::ring_buffer::fanout_data(const struct sock_fprog* fprog)
+{
+  // The program is shared by all the sockets of the fanout group and can be
+  // replaced at any time.
+  return (setsockopt(_M_fd,
+                     SOL_PACKET,
+                     PACKET_FANOUT_DATA,
+                     fprog,
+                     sizeof(struct sock_fprog)) == 0);
+}
+
+void net::ring_buffer::get_state(struct state& st) const
+{
+  st.version = _M_version;
+  st.t = _M_type;
+  st.ring_size = (_M_type != type::rxtx) ? _M_ring_size : _M_ring_size / 2;
+  st.rx_idx = _M_rx_idx;
+  st.tx_idx = _M_tx_idx;
+}
+
+bool net::ring_buffer::adopt(int fd, const struct state& st)
+{
+  clear();
+
+  _M_fd = fd;
+
+  // Check packet version.
+  int optval;
+  socklen_t optlen = static_cast<socklen_t>(sizeof(int));
+  if ((getsockopt(_M_fd, SOL_PACKET, PACKET_VERSION, &optval, &optlen) < 0) ||
+      (optval != static_cast<int>(st.version))) {
+    return false;
+  }
+
+  // Calculate the geometry of the ring (as it was set up).
+  if (st.version == TPACKET_V3) {
+    struct tpacket_req3 req;
+    config_v3(st.t, st.ring_size, req);
+  } else {
+    struct tpacket_req req;
+    config_v1_v2(st.version, st.ring_size, req);
+  }
+
+  if ((st.rx_idx < _M_count) && (st.tx_idx < _M_count) && (mmap_ring(st.t))) {
+    _M_version = st.version;
+    _M_type = st.t;
+
+    _M_rx_idx = st.rx_idx;
+    _M_tx_idx = st.tx_idx;
+
+    return true;
+  }
+
+  return false;
+}
+
 bool net::ring_buffer::show_statistics()
 {
   if (_M_version == TPACKET_V3) {
@@ -82,8 +211,16 @@ bool net::ring_buffer::show_statistics()
                    PACKET_STATISTICS,
                    &stats,
                    &optlen) == 0) {
-      printf("%u packets received.\n", stats.tp_packets);
-      printf("%u packets dropped by kernel.\n", stats.tp_drops);
+      _M_packets += stats.tp_packets;
+      _M_drops += stats.tp_drops;
+
+      printf("%llu packets received.\n",
+             static_cast<unsigned long long>(_M_packets));
+
+      printf("%llu packets dropped by kernel.\n",
+             static_cast<unsigned long long>(_M_drops));
+
+      show_rollover_statistics();
 
       return true;
     }
@@ -96,8 +233,16 @@ bool net::ring_buffer::show_statistics()
                    PACKET_STATISTICS,
                    &stats,
                    &optlen) == 0) {
-      printf("%u packets received.\n", stats.tp_packets);
-      printf("%u packets dropped by kernel.\n", stats.tp_drops);
+      _M_packets += stats.tp_packets;
+      _M_drops += stats.tp_drops;
+
+      printf("%llu packets received.\n",
+             static_cast<unsigned long long>(_M_packets));
+
+      printf("%llu packets dropped by kernel.\n",
+             static_cast<unsigned long long>(_M_drops));
+
+      show_rollover_statistics();
 
       return true;
     }
@@ -106,6 +251,43 @@ bool net::ring_buffer::show_statistics()
   return false;
 }
 
+void net::ring_buffer::memory(size_t* nodes) const
+{
+  if (_M_buf != MAP_FAILED) {
+    numa::memory(_M_buf, _M_ring_size, nodes);
+  }
+
+  if (_M_rx_frames) {
+    numa::memory(_M_rx_frames, _M_count * sizeof(struct iovec), nodes);
+  }
+
+  if (_M_tx_frames) {
+    numa::memory(_M_tx_frames, _M_count * sizeof(struct iovec), nodes);
+  }
+}
+
+void net::ring_buffer::show_rollover_statistics()
+{
+  struct tpacket_rollover_stats stats;
+  socklen_t optlen = static_cast<socklen_t>(
+                       sizeof(struct tpacket_rollover_stats)
+                     );
+
+  // The statistics are only available if the socket is in a fanout group
+  // with rollover.
+  if (getsockopt(_M_fd,
+                 SOL_PACKET,
+                 PACKET_ROLLOVER_STATS,
+                 &stats,
+                 &optlen) == 0) {
+    printf("%llu packets rolled over to other sockets "
+           "(%llu huge flows, %llu failed).\n",
+           static_cast<unsigned long long>(stats.tp_all),
+           static_cast<unsigned long long>(stats.tp_huge),
+           static_cast<unsigned long long>(stats.tp_failed));
+  }
+}
+
 bool net::ring_buffer::setup_socket(tpacket_versions version, type t)
 {
   // Create socket.
@@ -201,9 +383,12 @@ bool net::ring_buffer::mmap_ring(type t)
     // Allocate frames.
 
     if (t != type::tx) {
-      if ((_M_rx_frames = reinterpret_cast<struct iovec*>(
-                            malloc(_M_count * sizeof(struct iovec))
-                          )) != nullptr) {
+      if (((_M_rx_frames = reinterpret_cast<struct iovec*>(
+                             malloc(_M_count * sizeof(struct iovec))
+                           )) != nullptr) &&
+          ((_M_holds = reinterpret_cast<uint32_t*>(
+                         calloc(_M_count, sizeof(uint32_t))
+                       )) != nullptr)) {
         uint8_t* buf = reinterpret_cast<uint8_t*>(_M_buf);
 
         for (size_t i = 0; i < _M_count; i++) {
@@ -296,11 +481,13 @@ void net::ring_buffer::config_v1_v2(tpacket_versions version,
 
   if (version == TPACKET_V1) {
     _M_recv = &ring_buffer::recv_v1;
+    _M_recv_nowait = &ring_buffer::recv_v1;
     _M_send = &ring_buffer::send_v1;
     _M_sendv = &ring_buffer::sendv_v1;
     _M_sendmmsg = &ring_buffer::sendmmsg_v1;
   } else {
     _M_recv = &ring_buffer::recv_v2;
+    _M_recv_nowait = &ring_buffer::recv_v2;
     _M_send = &ring_buffer::send_v2;
     _M_sendv = &ring_buffer::sendv_v2;
     _M_sendmmsg = &ring_buffer::sendmmsg_v2;
@@ -336,6 +523,7 @@ void net::ring_buffer::config_v3(type t,
   _M_size = block_size;
 
   _M_recv = &ring_buffer::recv_v3;
+  _M_recv_nowait = &ring_buffer::recv_v3;
   _M_send = &ring_buffer::send_v3;
   _M_sendv = &ring_buffer::sendv_v3;
   _M_sendmmsg = &ring_buffer::sendmmsg_v3;
@@ -352,112 +540,163 @@ bool net::ring_buffer::discard_packet_loss()
                      sizeof(int)) == 0);
 }
 
-bool net::ring_buffer::recv_v1()
+bool net::ring_buffer::next(struct batch& b, size_t max_blocks)
 {
-  struct tpacket_hdr* hdr = reinterpret_cast<struct tpacket_hdr*>(
-                              _M_rx_frames[_M_rx_idx].iov_base
-                            );
+  b.npkts = 0;
+  b.nblocks = 0;
 
-  // If there is a new packet...
-  if ((hdr->tp_status & TP_STATUS_USER) == TP_STATUS_USER) {
-    // Process packet.
-    _M_fnpacket(reinterpret_cast<const uint8_t*>(hdr) + hdr->tp_mac,
-                hdr->tp_snaplen,
-                _M_user);
+  max_blocks = MIN(max_blocks, batch_blocks);
 
-    // Mark frame as free.
-    hdr->tp_status = TP_STATUS_KERNEL;
+  while (b.nblocks < max_blocks) {
+    struct tpacket_block_desc* block_desc =
+                               reinterpret_cast<struct tpacket_block_desc*>(
+                                 _M_rx_frames[_M_rx_idx].iov_base
+                               );
 
-    __sync_synchronize();
+    // If there isn't a new block (or it is still held since the previous
+    // round of the ring)...
+    if (((__atomic_load_n(&block_desc->hdr.bh1.block_status,
+                          __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) ||
+        (__atomic_load_n(&_M_holds[_M_rx_idx], __ATOMIC_ACQUIRE) != 0)) {
+      break;
+    }
 
-    _M_rx_idx = (_M_rx_idx + 1) % _M_count;
+    uint32_t num_pkts = block_desc->hdr.bh1.num_pkts;
 
-    return true;
-  } else {
-    return false;
-  }
-}
+    // If the packets of the block don't fit in the batch...
+    if (b.npkts + num_pkts > batch_packets) {
+      break;
+    }
 
-bool net::ring_buffer::recv_v2()
-{
-  struct tpacket2_hdr* hdr = reinterpret_cast<struct tpacket2_hdr*>(
-                               _M_rx_frames[_M_rx_idx].iov_base
-                             );
+    // The block is held until the batch is released (the packets can be
+    // held longer).
+    _M_holds[_M_rx_idx] = 1;
 
-  // If there is a new packet...
-  if ((hdr->tp_status & TP_STATUS_USER) == TP_STATUS_USER) {
-    // Process packet.
-    _M_fnpacket(reinterpret_cast<const uint8_t*>(hdr) + hdr->tp_mac,
-                hdr->tp_snaplen,
-                _M_user);
+    const struct tpacket3_hdr* hdr =
+                               reinterpret_cast<const struct tpacket3_hdr*>(
+                                 reinterpret_cast<const uint8_t*>(block_desc) +
+                                 block_desc->hdr.bh1.offset_to_first_pkt
+                               );
 
-    // Mark frame as free.
-    hdr->tp_status = TP_STATUS_KERNEL;
+    // Add the packets of the block (the whole block has been filled by the
+    // kernel before it set its status).
+    for (uint32_t i = 0; i < num_pkts; i++) {
+      size_t n = b.npkts++;
 
-    __sync_synchronize();
+      b.pkts[n].iov_base = const_cast<uint8_t*>(
+                             reinterpret_cast<const uint8_t*>(hdr) + hdr->tp_mac
+                           );
 
-    _M_rx_idx = (_M_rx_idx + 1) % _M_count;
+      b.pkts[n].iov_len = hdr->tp_snaplen;
 
-    return true;
-  } else {
-    return false;
+      b.rxhash[n] = hdr->hv1.tp_rxhash;
+      b.status[n] = hdr->tp_status;
+      b.vlan_tci[n] = hdr->hv1.tp_vlan_tci;
+      b.sec[n] = hdr->tp_sec;
+      b.nsec[n] = hdr->tp_nsec;
+
+      hdr = reinterpret_cast<const struct tpacket3_hdr*>(
+              reinterpret_cast<const uint8_t*>(hdr) + hdr->tp_next_offset
+            );
+    }
+
+    b.blocks[b.nblocks] = _M_rx_idx;
+    b.ends[b.nblocks++] = b.npkts;
+
+    if (++_M_rx_idx == _M_count) {
+      _M_rx_idx = 0;
+    }
   }
+
+  return (b.nblocks > 0);
 }
 
-bool net::ring_buffer::recv_v3()
+double net::ring_buffer::fill() const
 {
-  static const size_t max_pkts = 1024;
+  if ((!_M_rx_frames) || (_M_version != TPACKET_V3) || (_M_count == 0)) {
+    return 0.0;
+  }
 
-  struct tpacket_block_desc* block_desc =
-                             reinterpret_cast<struct tpacket_block_desc*>(
-                               _M_rx_frames[_M_rx_idx].iov_base
-                             );
+  size_t nblocks = 0;
 
-  // If there is a new block...
-  if ((block_desc->hdr.bh1.block_status & TP_STATUS_USER) != 0) {
-    struct tpacket3_hdr* hdr = reinterpret_cast<struct tpacket3_hdr*>(
-                                 reinterpret_cast<uint8_t*>(block_desc) +
-                                 block_desc->hdr.bh1.offset_to_first_pkt
+  for (size_t i = 0; i < _M_count; i++) {
+    const struct tpacket_block_desc* block_desc =
+                               reinterpret_cast<struct tpacket_block_desc*>(
+                                 _M_rx_frames[i].iov_base
                                );
 
-    struct iovec pkts[max_pkts];
-    size_t npkts = 0;
+    if ((__atomic_load_n(&block_desc->hdr.bh1.block_status,
+                         __ATOMIC_RELAXED) & TP_STATUS_USER) != 0) {
+      nblocks++;
+    }
+  }
+
+  return static_cast<double>(nblocks) / _M_count;
+}
 
-    uint32_t num_pkts = block_desc->hdr.bh1.num_pkts;
+size_t net::ring_buffer::writable(size_t n) const
+{
+  if ((!_M_tx_frames) || (_M_version == TPACKET_V3)) {
+    return 0;
+  }
 
-    // Process packets in the block.
-    for (uint32_t i = 0; i < num_pkts; i++) {
-      if (npkts == max_pkts) {
-        // Process packets.
-        _M_fnpackets(pkts, npkts, _M_user);
+  if (n > _M_nframes) {
+    n = _M_nframes;
+  }
 
-        npkts = 0;
-      }
+  size_t idx = _M_tx_idx;
 
-      pkts[npkts].iov_base = reinterpret_cast<uint8_t*>(hdr) + hdr->tp_mac;
-      pkts[npkts++].iov_len = hdr->tp_snaplen;
+  for (size_t i = 0; i < n; i++) {
+    const void* frame = _M_tx_frames[idx].iov_base;
 
-      hdr = reinterpret_cast<struct tpacket3_hdr*>(
-              reinterpret_cast<uint8_t*>(hdr) + hdr->tp_next_offset
-            );
+    unsigned long status = (_M_version == TPACKET_V2) ?
+      __atomic_load_n(&reinterpret_cast<const struct tpacket2_hdr*>(
+                         frame
+                       )->tp_status,
+                      __ATOMIC_ACQUIRE) :
+      __atomic_load_n(&reinterpret_cast<const struct tpacket_hdr*>(
+                         frame
+                       )->tp_status,
+                      __ATOMIC_ACQUIRE);
 
-      __sync_synchronize();
+    if (status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+      return i;
     }
 
-    // Process packets.
-    _M_fnpackets(pkts, npkts, _M_user);
+    idx = (idx + 1) % _M_nframes;
+  }
 
-    // Mark block as free.
-    block_desc->hdr.bh1.block_status = TP_STATUS_KERNEL;
+  return n;
+}
 
-    __sync_synchronize();
+void net::ring_buffer::release(size_t block)
+{
+  uint32_t n = __atomic_load_n(&_M_holds[block], __ATOMIC_ACQUIRE);
 
-    _M_rx_idx = (_M_rx_idx + 1) % _M_count;
+  do {
+    // If this is the last holder...
+    if (n == 1) {
+      struct tpacket_block_desc* block_desc =
+                                 reinterpret_cast<struct tpacket_block_desc*>(
+                                   _M_rx_frames[block].iov_base
+                                 );
 
-    return true;
-  } else {
-    return false;
-  }
+      // Mark block as free (before clearing the count, so the receiver
+      // doesn't take the block for a new one meanwhile).
+      __atomic_store_n(&block_desc->hdr.bh1.block_status,
+                       TP_STATUS_KERNEL,
+                       __ATOMIC_RELEASE);
+
+      __atomic_store_n(&_M_holds[block], 0, __ATOMIC_RELEASE);
+
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&_M_holds[block],
+                                        &n,
+                                        n - 1,
+                                        true,
+                                        __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE));
 }
 
 bool net::ring_buffer::send_v1(const void* pkt, size_t pktlen)
@@ -467,7 +706,8 @@ bool net::ring_buffer::send_v1(const void* pkt, size_t pktlen)
                             );
 
   // If there is a packet available...
-  if (!(hdr->tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
+  if (!(__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) &
+        (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
     // Set packet length.
     hdr->tp_snaplen = pktlen;
     hdr->tp_len = pktlen;
@@ -480,9 +720,7 @@ bool net::ring_buffer::send_v1(const void* pkt, size_t pktlen)
            pktlen);
 
     // Mark packet as ready to be sent.
-    hdr->tp_status = TP_STATUS_SEND_REQUEST;
-
-    __sync_synchronize();
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
 
     _M_tx_idx = (_M_tx_idx + 1) % _M_nframes;
 
@@ -500,7 +738,8 @@ bool net::ring_buffer::sendv_v1(const struct iovec* iov, size_t iovcnt)
                             );
 
   // If there is a packet available...
-  if (!(hdr->tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
+  if (!(__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) &
+        (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
     // Copy packet.
     uint8_t* begin = reinterpret_cast<uint8_t*>(hdr) +
                      TPACKET_HDRLEN -
@@ -520,9 +759,7 @@ bool net::ring_buffer::sendv_v1(const struct iovec* iov, size_t iovcnt)
     hdr->tp_len = pktlen;
 
     // Mark packet as ready to be sent.
-    hdr->tp_status = TP_STATUS_SEND_REQUEST;
-
-    __sync_synchronize();
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
 
     _M_tx_idx = (_M_tx_idx + 1) % _M_nframes;
 
@@ -534,33 +771,42 @@ bool net::ring_buffer::sendv_v1(const struct iovec* iov, size_t iovcnt)
 }
 
 bool net::ring_buffer::sendmmsg_v1(const struct iovec* pkts,
+                                   size_t iovcnt,
                                    size_t npkts,
                                    int timeout)
 {
   // For each packet...
-  for (size_t i = 0; i < npkts; i++, pkts++) {
+  for (size_t i = 0; i < npkts; i++, pkts += iovcnt) {
     struct tpacket_hdr* hdr = reinterpret_cast<struct tpacket_hdr*>(
                                 _M_tx_frames[_M_tx_idx].iov_base
                               );
 
     do {
       // If there is a packet available...
-      if (!(hdr->tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
-        // Set packet length.
-        hdr->tp_snaplen = pkts->iov_len;
-        hdr->tp_len = pkts->iov_len;
-
+      if (!(__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) &
+            (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
         // Copy packet.
-        memcpy(reinterpret_cast<uint8_t*>(hdr) +
-               TPACKET_HDRLEN -
-               sizeof(struct sockaddr_ll),
-               pkts->iov_base,
-               pkts->iov_len);
+        uint8_t* begin = reinterpret_cast<uint8_t*>(hdr) +
+                         TPACKET_HDRLEN -
+                         sizeof(struct sockaddr_ll);
 
-        // Mark packet as ready to be sent.
-        hdr->tp_status = TP_STATUS_SEND_REQUEST;
+        uint8_t* p = begin;
 
-        __sync_synchronize();
+        for (size_t j = 0; j < iovcnt; j++) {
+          memcpy(p, pkts[j].iov_base, pkts[j].iov_len);
+          p += pkts[j].iov_len;
+        }
+
+        size_t pktlen = p - begin;
+
+        // Set packet length.
+        hdr->tp_snaplen = pktlen;
+        hdr->tp_len = pktlen;
+
+        // Mark packet as ready to be sent.
+        __atomic_store_n(&hdr->tp_status,
+                         TP_STATUS_SEND_REQUEST,
+                         __ATOMIC_RELEASE);
 
         _M_tx_idx = (_M_tx_idx + 1) % _M_nframes;
 
@@ -582,7 +828,8 @@ bool net::ring_buffer::send_v2(const void* pkt, size_t pktlen)
                              );
 
   // If there is a packet available...
-  if (!(hdr->tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
+  if (!(__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) &
+        (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
     // Set packet length.
     hdr->tp_snaplen = pktlen;
     hdr->tp_len = pktlen;
@@ -595,9 +842,7 @@ bool net::ring_buffer::send_v2(const void* pkt, size_t pktlen)
            pktlen);
 
     // Mark packet as ready to be sent.
-    hdr->tp_status = TP_STATUS_SEND_REQUEST;
-
-    __sync_synchronize();
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
 
     _M_tx_idx = (_M_tx_idx + 1) % _M_nframes;
 
@@ -615,7 +860,8 @@ bool net::ring_buffer::sendv_v2(const struct iovec* iov, size_t iovcnt)
                              );
 
   // If there is a packet available...
-  if (!(hdr->tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
+  if (!(__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) &
+        (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
     // Copy packet.
     uint8_t* begin = reinterpret_cast<uint8_t*>(hdr) +
                      TPACKET2_HDRLEN -
@@ -635,9 +881,7 @@ bool net::ring_buffer::sendv_v2(const struct iovec* iov, size_t iovcnt)
     hdr->tp_len = pktlen;
 
     // Mark packet as ready to be sent.
-    hdr->tp_status = TP_STATUS_SEND_REQUEST;
-
-    __sync_synchronize();
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
 
     _M_tx_idx = (_M_tx_idx + 1) % _M_nframes;
 
@@ -649,33 +893,42 @@ bool net::ring_buffer::sendv_v2(const struct iovec* iov, size_t iovcnt)
 }
 
 bool net::ring_buffer::sendmmsg_v2(const struct iovec* pkts,
+                                   size_t iovcnt,
                                    size_t npkts,
                                    int timeout)
 {
   // For each packet...
-  for (size_t i = 0; i < npkts; i++, pkts++) {
+  for (size_t i = 0; i < npkts; i++, pkts += iovcnt) {
     struct tpacket2_hdr* hdr = reinterpret_cast<struct tpacket2_hdr*>(
                                  _M_tx_frames[_M_tx_idx].iov_base
                                );
 
     do {
       // If there is a packet available...
-      if (!(hdr->tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
-        // Set packet length.
-        hdr->tp_snaplen = pkts->iov_len;
-        hdr->tp_len = pkts->iov_len;
-
+      if (!(__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) &
+            (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
         // Copy packet.
-        memcpy(reinterpret_cast<uint8_t*>(hdr) +
-               TPACKET2_HDRLEN -
-               sizeof(struct sockaddr_ll),
-               pkts->iov_base,
-               pkts->iov_len);
+        uint8_t* begin = reinterpret_cast<uint8_t*>(hdr) +
+                         TPACKET2_HDRLEN -
+                         sizeof(struct sockaddr_ll);
 
-        // Mark packet as ready to be sent.
-        hdr->tp_status = TP_STATUS_SEND_REQUEST;
+        uint8_t* p = begin;
+
+        for (size_t j = 0; j < iovcnt; j++) {
+          memcpy(p, pkts[j].iov_base, pkts[j].iov_len);
+          p += pkts[j].iov_len;
+        }
+
+        size_t pktlen = p - begin;
+
+        // Set packet length.
+        hdr->tp_snaplen = pktlen;
+        hdr->tp_len = pktlen;
 
-        __sync_synchronize();
+        // Mark packet as ready to be sent.
+        __atomic_store_n(&hdr->tp_status,
+                         TP_STATUS_SEND_REQUEST,
+                         __ATOMIC_RELEASE);
 
         _M_tx_idx = (_M_tx_idx + 1) % _M_nframes;
 
@@ -700,7 +953,8 @@ bool net::ring_buffer::send_v3(const void* pkt, size_t pktlen)
                              );
 
   // If there is a packet available...
-  if (!(hdr->tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
+  if (!(__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) &
+        (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
     // Set packet length.
     hdr->tp_snaplen = pktlen;
     hdr->tp_len = pktlen;
@@ -714,9 +968,7 @@ bool net::ring_buffer::send_v3(const void* pkt, size_t pktlen)
            pktlen);
 
     // Mark packet as ready to be sent.
-    hdr->tp_status = TP_STATUS_SEND_REQUEST;
-
-    __sync_synchronize();
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
 
     _M_tx_idx = (_M_tx_idx + 1) % _M_nframes;
 
@@ -737,7 +989,8 @@ bool net::ring_buffer::sendv_v3(const struct iovec* iov, size_t iovcnt)
                              );
 
   // If there is a packet available...
-  if (!(hdr->tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
+  if (!(__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) &
+        (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
     // Copy packet.
     uint8_t* begin = reinterpret_cast<uint8_t*>(hdr) +
                      TPACKET3_HDRLEN -
@@ -758,9 +1011,7 @@ bool net::ring_buffer::sendv_v3(const struct iovec* iov, size_t iovcnt)
     hdr->tp_next_offset = 0;
 
     // Mark packet as ready to be sent.
-    hdr->tp_status = TP_STATUS_SEND_REQUEST;
-
-    __sync_synchronize();
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
 
     _M_tx_idx = (_M_tx_idx + 1) % _M_nframes;
 
@@ -772,11 +1023,12 @@ bool net::ring_buffer::sendv_v3(const struct iovec* iov, size_t iovcnt)
 }
 
 bool net::ring_buffer::sendmmsg_v3(const struct iovec* pkts,
+                                   size_t iovcnt,
                                    size_t npkts,
                                    int timeout)
 {
   // For each packet...
-  for (size_t i = 0; i < npkts; i++, pkts++) {
+  for (size_t i = 0; i < npkts; i++, pkts += iovcnt) {
     struct tpacket3_hdr* hdr = reinterpret_cast<struct tpacket3_hdr*>(
                                  reinterpret_cast<uint8_t*>(
                                    _M_tx_frames[0].iov_base
@@ -786,23 +1038,31 @@ bool net::ring_buffer::sendmmsg_v3(const struct iovec* pkts,
 
     do {
       // If there is a packet available...
-      if (!(hdr->tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
+      if (!(__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) &
+            (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
+        // Copy packet.
+        uint8_t* begin = reinterpret_cast<uint8_t*>(hdr) +
+                         TPACKET3_HDRLEN -
+                         sizeof(struct sockaddr_ll);
+
+        uint8_t* p = begin;
+
+        for (size_t j = 0; j < iovcnt; j++) {
+          memcpy(p, pkts[j].iov_base, pkts[j].iov_len);
+          p += pkts[j].iov_len;
+        }
+
+        size_t pktlen = p - begin;
+
         // Set packet length.
-        hdr->tp_snaplen = pkts->iov_len;
-        hdr->tp_len = pkts->iov_len;
+        hdr->tp_snaplen = pktlen;
+        hdr->tp_len = pktlen;
         hdr->tp_next_offset = 0;
 
-        // Copy packet.
-        memcpy(reinterpret_cast<uint8_t*>(hdr) +
-               TPACKET3_HDRLEN -
-               sizeof(struct sockaddr_ll),
-               pkts->iov_base,
-               pkts->iov_len);
-
         // Mark packet as ready to be sent.
-        hdr->tp_status = TP_STATUS_SEND_REQUEST;
-
-        __sync_synchronize();
+        __atomic_store_n(&hdr->tp_status,
+                         TP_STATUS_SEND_REQUEST,
+                         __ATOMIC_RELEASE);
 
         _M_tx_idx = (_M_tx_idx + 1) % _M_nframes;
 
@@ -817,6 +1077,206 @@ bool net::ring_buffer::sendmmsg_v3(const struct iovec* pkts,
   return (sendto(_M_fd, nullptr, 0, 0, nullptr, 0) != -1);
 }
 
+bool net::ring_buffer::share()
+{
+  if ((_M_version != TPACKET_V2) || (_M_type != type::tx) || (_M_shared)) {
+    return false;
+  }
+
+  // Allocate state (cache aligned, with the sequence number of each
+  // frame).
+  void* buf;
+  if (posix_memalign(&buf,
+                     CACHE_LINE_SIZE,
+                     sizeof(struct shared_tx) +
+                     (_M_nframes - 1) * sizeof(size_t)) != 0) {
+    return false;
+  }
+
+  _M_shared = reinterpret_cast<struct shared_tx*>(buf);
+
+  // Continue from the current frame.
+  _M_shared->claim = _M_tx_idx;
+  _M_shared->marked = 0;
+  _M_shared->kicking = false;
+
+  for (size_t i = 0; i < _M_nframes; i++) {
+    _M_shared->seq[(_M_tx_idx + i) % _M_nframes] = _M_tx_idx + i;
+  }
+
+  _M_send = &ring_buffer::send_shared;
+  _M_sendv = &ring_buffer::sendv_shared;
+  _M_sendmmsg = &ring_buffer::sendmmsg_shared;
+
+  return true;
+}
+
+bool net::ring_buffer::send_shared(const void* pkt, size_t pktlen, int timeout)
+{
+  struct iovec iov;
+  iov.iov_base = const_cast<void*>(pkt);
+  iov.iov_len = pktlen;
+
+  return sendv_shared(&iov, 1, timeout);
+}
+
+bool net::ring_buffer::sendv_shared(const struct iovec* iov,
+                                    size_t iovcnt,
+                                    int timeout)
+{
+  size_t idx;
+  struct tpacket2_hdr* hdr;
+  if ((hdr = claim(idx, timeout)) != nullptr) {
+    commit(hdr, idx, iov, iovcnt);
+    return kick();
+  }
+
+  return false;
+}
+
+bool net::ring_buffer::sendmmsg_shared(const struct iovec* pkts,
+                                       size_t iovcnt,
+                                       size_t npkts,
+                                       int timeout)
+{
+  bool ret = true;
+
+  // For each packet...
+  for (size_t i = 0; i < npkts; i++, pkts += iovcnt) {
+    size_t idx;
+    struct tpacket2_hdr* hdr;
+    if ((hdr = claim(idx, timeout)) == nullptr) {
+      ret = false;
+      break;
+    }
+
+    commit(hdr, idx, pkts, iovcnt);
+  }
+
+  // A single kick for all the packets.
+  return ((kick()) && (ret));
+}
+
+struct tpacket2_hdr* net::ring_buffer::claim(size_t& idx, int timeout)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &start);
+
+  idx = __atomic_load_n(&_M_shared->claim, __ATOMIC_RELAXED);
+
+  do {
+    size_t n = idx % _M_nframes;
+
+    struct tpacket2_hdr* hdr = reinterpret_cast<struct tpacket2_hdr*>(
+                                 _M_tx_frames[n].iov_base
+                               );
+
+    // If the frame has been filled by the thread which claimed it the
+    // previous time...
+    if (__atomic_load_n(&_M_shared->seq[n], __ATOMIC_ACQUIRE) == idx) {
+      // If the kernel has sent the frame...
+      if (!(__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) &
+            (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
+        // Claim frame (the frames are claimed with a compare-and-swap
+        // instead of a fetch-and-add, so a thread never has to give up a
+        // frame it has claimed, which would stop the kernel there).
+        if (__atomic_compare_exchange_n(&_M_shared->claim,
+                                        &idx,
+                                        idx + 1,
+                                        false,
+                                        __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED)) {
+          return hdr;
+        }
+
+        // Another thread has claimed the frame (`idx` has been updated).
+        continue;
+      }
+
+      // The ring buffer is full.
+      wait_writable(timeout);
+    } else {
+      // Another thread is filling the frame.
+      sched_yield();
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    if (((now.tv_sec - start.tv_sec) * 1000) +
+        ((now.tv_nsec - start.tv_nsec) / 1000000) >= timeout) {
+      errno = EAGAIN;
+      return nullptr;
+    }
+
+    idx = __atomic_load_n(&_M_shared->claim, __ATOMIC_RELAXED);
+  } while (true);
+}
+
+void net::ring_buffer::commit(struct tpacket2_hdr* hdr,
+                              size_t idx,
+                              const struct iovec* iov,
+                              size_t iovcnt)
+{
+  // Copy packet.
+  uint8_t* begin = reinterpret_cast<uint8_t*>(hdr) +
+                   TPACKET2_HDRLEN -
+                   sizeof(struct sockaddr_ll);
+
+  uint8_t* p = begin;
+
+  for (size_t i = 0; i < iovcnt; i++, iov++) {
+    memcpy(p, iov->iov_base, iov->iov_len);
+    p += iov->iov_len;
+  }
+
+  size_t pktlen = p - begin;
+
+  // Set packet length.
+  hdr->tp_snaplen = pktlen;
+  hdr->tp_len = pktlen;
+
+  // Mark packet as ready to be sent.
+  __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+  // The frame can be claimed again in the next lap.
+  __atomic_store_n(&_M_shared->seq[idx % _M_nframes],
+                   idx + _M_nframes,
+                   __ATOMIC_RELEASE);
+
+  __atomic_fetch_add(&_M_shared->marked, 1, __ATOMIC_SEQ_CST);
+}
+
+bool net::ring_buffer::kick()
+{
+  bool ret = true;
+  size_t marked;
+
+  do {
+    // If another thread is kicking the ring buffer, it will see the frames
+    // marked by this thread.
+    if (__atomic_exchange_n(&_M_shared->kicking, true, __ATOMIC_SEQ_CST)) {
+      return ret;
+    }
+
+    // Kick until no more frames have been marked meanwhile (the kernel
+    // sends all the frames which are ready, in order).
+    do {
+      marked = __atomic_load_n(&_M_shared->marked, __ATOMIC_SEQ_CST);
+
+      if (sendto(_M_fd, nullptr, 0, 0, nullptr, 0) == -1) {
+        ret = false;
+      }
+    } while (__atomic_load_n(&_M_shared->marked, __ATOMIC_SEQ_CST) != marked);
+
+    __atomic_store_n(&_M_shared->kicking, false, __ATOMIC_SEQ_CST);
+
+    // Frames marked after the last check and before releasing the flag.
+  } while (__atomic_load_n(&_M_shared->marked, __ATOMIC_SEQ_CST) != marked);
+
+  return ret;
+}
+
 bool net::ring_buffer::wait_readable(int timeout)
 {
   struct pollfd pfd;
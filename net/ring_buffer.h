@@ -8,6 +8,7 @@
 #include <linux/if_packet.h>
 #include <linux/filter.h>
 #include <errno.h>
+#include "macros/macros.h"
 
 namespace net {
   class ring_buffer {
@@ -31,6 +32,50 @@ namespace net {
 
       static const size_t default_size = 256 * 1024 * 1024; // 256 MB.
 
+      // State of the ring buffer (to hand the socket over to another
+      // process).
+      struct state {
+        tpacket_versions version;
+        type t;
+        size_t ring_size;
+
+        size_t rx_idx;
+        size_t tx_idx;
+      };
+
+      // Maximum number of packets and of blocks of a batch (a block has
+      // fewer packets).
+      static const size_t batch_packets = 1024;
+      static const size_t batch_blocks = 16;
+
+      // Packets of one or more blocks (TPACKET_V3 RX) with their metadata,
+      // an array per field.
+      struct batch {
+        // Packets (from the ethernet header).
+        struct iovec pkts[batch_packets];
+
+        // Flow hash (computed by the kernel).
+        uint32_t rxhash[batch_packets];
+
+        // Status (TP_STATUS_*).
+        uint32_t status[batch_packets];
+
+        // VLAN TCI (if the status has TP_STATUS_VLAN_VALID).
+        uint16_t vlan_tci[batch_packets];
+
+        // Timestamp.
+        uint32_t sec[batch_packets];
+        uint32_t nsec[batch_packets];
+
+        size_t npkts;
+
+        // Blocks of the packets and index of the first packet after each
+        // block.
+        size_t blocks[batch_blocks];
+        size_t ends[batch_blocks];
+        size_t nblocks;
+      };
+
       typedef void (*fnpacket_t)(const void* pkt, size_t pktlen, void* user);
       typedef void (*fnpackets_t)(const struct iovec* pkts,
                                   size_t npkts,
@@ -64,24 +109,109 @@ namespace net {
                   size_t fanout_size,
                   uint16_t fanout_id);
 
+      // Join fanout group (RX, after creating the ring buffer without
+      // fanout group).
+      bool fanout(int fanout, uint16_t fanout_id);
+
+      // Is there a fanout group with the identifier (in the network
+      // namespace)?
+      static bool fanout_in_use(uint16_t fanout_id, bool& in_use);
+
+      // Replace the socket filter (null: no filter).
+      bool filter(const struct sock_fprog* fprog);
+
+      // Set the program of the fanout group (PACKET_FANOUT_CBPF).
+      bool fanout_data(const struct sock_fprog* fprog);
+
+      // Get the state of the ring buffer.
+      void get_state(struct state& st) const;
+
+      // Map the ring of a socket created by another process and continue
+      // from its current position (the ring buffer takes ownership of the
+      // socket, even on failure).
+      bool adopt(int fd, const struct state& st);
+
       // Receive packet.
       bool recv(int timeout);
 
+      // Receive packet (don't wait).
+      bool recv();
+
+      // Receive packet (don't wait) without indirect calls: the ring buffer
+      // is a `version` one and the packets are passed to
+      // `receiver.packet()` (TPACKET_V1 / TPACKET_V2) or, a block at a
+      // time, to `receiver.packets()` (TPACKET_V3), which can be inlined.
+      template<tpacket_versions version, typename Receiver>
+      bool recv(Receiver& receiver);
+
+      // Get the packets of the blocks which are ready, up to `max_blocks`
+      // (TPACKET_V3 RX, don't wait), returns false if there are none. The
+      // blocks are held until the batch is released.
+      bool next(struct batch& b, size_t max_blocks);
+
+      // Release the blocks of a batch got from next().
+      void release(const struct batch& b);
+
       // Send packet.
       bool send(const void* pkt, size_t pktlen, int timeout);
 
       // Send packet.
       bool send(const struct iovec* iov, size_t iovcnt, int timeout);
 
+      // Send packet without indirect calls (the ring buffer is a `version`
+      // one).
+      template<tpacket_versions version>
+      bool send(const struct iovec* iov, size_t iovcnt, int timeout);
+
       // Send packets.
       bool sendmmsg(const struct iovec* pkts, size_t npkts, int timeout);
 
+      // Send packets made of `iovcnt` consecutive iovecs each.
+      bool sendmmsg(const struct iovec* pkts,
+                    size_t iovcnt,
+                    size_t npkts,
+                    int timeout);
+
+      // Let several threads send through the TX ring buffer (TPACKET_V2,
+      // after creating it): each one claims its frames and one kick sends
+      // the frames of all of them.
+      bool share();
+
       // Set callbacks.
       void callbacks(fnpacket_t fnpacket, fnpackets_t fnpackets, void* user);
 
-      // Show statistics.
+      // Keep a block of the batch being processed (TPACKET_V3), it is
+      // returned to the kernel when it has been released as many times as
+      // it has been held.
+      void hold(size_t block);
+
+      // Release a block held by hold() (from any thread).
+      void release(size_t block);
+
+      // Is the next block ready too (TPACKET_V3, while processing a batch)?
+      bool backlog() const;
+
+      // Get the fraction of the blocks which are waiting to be processed
+      // (TPACKET_V3 RX, from any thread).
+      double fill() const;
+
+      // Get the number of frames (up to `n`) which can be sent without
+      // waiting (TPACKET_V1 / TPACKET_V2 TX).
+      size_t writable(size_t n) const;
+
+      // Show statistics (since the socket was created, the counts of
+      // PACKET_STATISTICS are reset when read).
       bool show_statistics();
 
+      // Get socket descriptor.
+      int fd() const;
+
+      // Get size of the mapped ring (locked memory).
+      size_t size() const;
+
+      // Add the memory of the ring buffer to its NUMA node.
+      void memory(size_t* nodes) const;
+
     private:
       tpacket_versions _M_version;
       type _M_type;
@@ -110,7 +240,34 @@ namespace net {
       size_t _M_rx_idx;
       size_t _M_tx_idx;
 
+      // Number of holders of each block (TPACKET_V3).
+      uint32_t* _M_holds;
+
+      // Packets received and dropped by the kernel (accumulated).
+      uint64_t _M_packets;
+      uint64_t _M_drops;
+
+      // State of a TX ring buffer shared by several threads.
+      struct shared_tx {
+        // Next frame to claim (it only grows, the frame is
+        // `claim % _M_nframes`).
+        alignas(CACHE_LINE_SIZE) size_t claim;
+
+        // Number of frames marked as ready to be sent.
+        alignas(CACHE_LINE_SIZE) size_t marked;
+
+        // Is a thread kicking the ring buffer?
+        alignas(CACHE_LINE_SIZE) bool kicking;
+
+        // Value of `claim` for which each frame can be claimed again (the
+        // thread which claimed it the previous time has filled it).
+        alignas(CACHE_LINE_SIZE) size_t seq[1];
+      };
+
+      struct shared_tx* _M_shared;
+
       typedef bool (ring_buffer::*fnrecv)(int timeout);
+      typedef bool (ring_buffer::*fnrecvnowait)();
       typedef bool (ring_buffer::*fnsend)(const void* pkt,
                                           size_t pktlen,
                                           int timeout);
@@ -120,10 +277,12 @@ namespace net {
                                            int timeout);
 
       typedef bool (ring_buffer::*fnsendmmsg)(const struct iovec* pkts,
+                                              size_t iovcnt,
                                               size_t npkts,
                                               int timeout);
 
       fnrecv _M_recv;
+      fnrecvnowait _M_recv_nowait;
       fnsend _M_send;
       fnsendv _M_sendv;
       fnsendmmsg _M_sendmmsg;
@@ -132,6 +291,14 @@ namespace net {
       fnpackets_t _M_fnpackets;
       void* _M_user;
 
+      // Receiver which passes the packets to the callbacks.
+      struct callback_receiver {
+        ring_buffer* rb;
+
+        void packet(const void* pkt, size_t pktlen);
+        void packets(const struct batch& b);
+      };
+
       // Set up socket.
       bool setup_socket(tpacket_versions version, type t);
 
@@ -155,6 +322,18 @@ namespace net {
       // Discard packet loss.
       bool discard_packet_loss();
 
+      // Show rollover statistics.
+      void show_rollover_statistics();
+
+      // Receive packet for TPACKET_V1 / TPACKET_V2 (`Header` is the header
+      // of the frames).
+      template<typename Header, typename Receiver>
+      bool recv_frame(Receiver& receiver);
+
+      // Receive block for TPACKET_V3.
+      template<typename Receiver>
+      bool recv_block(Receiver& receiver);
+
       // Receive packet for TPACKET_V1.
       bool recv_v1();
       bool recv_v1(int timeout);
@@ -175,7 +354,10 @@ namespace net {
       bool sendv_v1(const struct iovec* iov, size_t iovcnt, int timeout);
 
       // Send packets for TPACKET_V1.
-      bool sendmmsg_v1(const struct iovec* pkts, size_t npkts, int timeout);
+      bool sendmmsg_v1(const struct iovec* pkts,
+                       size_t iovcnt,
+                       size_t npkts,
+                       int timeout);
 
       // Send packet for TPACKET_V2.
       bool send_v2(const void* pkt, size_t pktlen);
@@ -185,7 +367,10 @@ namespace net {
       bool sendv_v2(const struct iovec* iov, size_t iovcnt, int timeout);
 
       // Send packets for TPACKET_V2.
-      bool sendmmsg_v2(const struct iovec* pkts, size_t npkts, int timeout);
+      bool sendmmsg_v2(const struct iovec* pkts,
+                       size_t iovcnt,
+                       size_t npkts,
+                       int timeout);
 
       // Send packet for TPACKET_V3.
       bool send_v3(const void* pkt, size_t pktlen);
@@ -195,7 +380,34 @@ namespace net {
       bool sendv_v3(const struct iovec* iov, size_t iovcnt, int timeout);
 
       // Send packets for TPACKET_V3.
-      bool sendmmsg_v3(const struct iovec* pkts, size_t npkts, int timeout);
+      bool sendmmsg_v3(const struct iovec* pkts,
+                       size_t iovcnt,
+                       size_t npkts,
+                       int timeout);
+
+      // Send packet through the shared ring buffer (TPACKET_V2).
+      bool send_shared(const void* pkt, size_t pktlen, int timeout);
+      bool sendv_shared(const struct iovec* iov, size_t iovcnt, int timeout);
+
+      // Send packets through the shared ring buffer (TPACKET_V2).
+      bool sendmmsg_shared(const struct iovec* pkts,
+                           size_t iovcnt,
+                           size_t npkts,
+                           int timeout);
+
+      // Claim frame of the shared ring buffer (waits up to `timeout`
+      // milliseconds when the ring buffer is full).
+      struct tpacket2_hdr* claim(size_t& idx, int timeout);
+
+      // Copy packet to the claimed frame and mark it as ready to be sent.
+      void commit(struct tpacket2_hdr* hdr,
+                  size_t idx,
+                  const struct iovec* iov,
+                  size_t iovcnt);
+
+      // Kick the shared ring buffer (if another thread is kicking it, it
+      // sends the frames of this thread too).
+      bool kick();
 
       // Wait readable.
       bool wait_readable(int timeout);
@@ -215,6 +427,10 @@ namespace net {
       _M_tx_frames(nullptr),
       _M_rx_idx(0),
       _M_tx_idx(0),
+      _M_holds(nullptr),
+      _M_packets(0),
+      _M_drops(0),
+      _M_shared(nullptr),
       _M_fnpacket(nullptr),
       _M_fnpackets(nullptr),
       _M_user(nullptr)
@@ -250,6 +466,24 @@ namespace net {
     return (this->*_M_recv)(timeout);
   }
 
+  inline bool ring_buffer::recv()
+  {
+    return (this->*_M_recv_nowait)();
+  }
+
+  template<tpacket_versions version, typename Receiver>
+  inline bool ring_buffer::recv(Receiver& receiver)
+  {
+    switch (version) {
+      case TPACKET_V1:
+        return recv_frame<struct tpacket_hdr>(receiver);
+      case TPACKET_V2:
+        return recv_frame<struct tpacket2_hdr>(receiver);
+      default:
+        return recv_block(receiver);
+    }
+  }
+
   inline bool ring_buffer::send(const void* pkt, size_t pktlen, int timeout)
   {
     return (this->*_M_send)(pkt, pktlen, timeout);
@@ -262,11 +496,36 @@ namespace net {
     return (this->*_M_sendv)(iov, iovcnt, timeout);
   }
 
+  template<tpacket_versions version>
+  inline bool ring_buffer::send(const struct iovec* iov,
+                                size_t iovcnt,
+                                int timeout)
+  {
+    switch (version) {
+      case TPACKET_V1:
+        return sendv_v1(iov, iovcnt, timeout);
+      case TPACKET_V2:
+        // The ring buffer might be shared by several threads.
+        return _M_shared ? sendv_shared(iov, iovcnt, timeout) :
+                           sendv_v2(iov, iovcnt, timeout);
+      default:
+        return sendv_v3(iov, iovcnt, timeout);
+    }
+  }
+
+  inline bool ring_buffer::sendmmsg(const struct iovec* pkts,
+                                    size_t npkts,
+                                    int timeout)
+  {
+    return (this->*_M_sendmmsg)(pkts, 1, npkts, timeout);
+  }
+
   inline bool ring_buffer::sendmmsg(const struct iovec* pkts,
+                                    size_t iovcnt,
                                     size_t npkts,
                                     int timeout)
   {
-    return (this->*_M_sendmmsg)(pkts, npkts, timeout);
+    return (this->*_M_sendmmsg)(pkts, iovcnt, npkts, timeout);
   }
 
   inline void ring_buffer::callbacks(fnpacket_t fnpacket,
@@ -279,6 +538,110 @@ namespace net {
     _M_user = user;
   }
 
+  inline void ring_buffer::release(const struct batch& b)
+  {
+    for (size_t i = 0; i < b.nblocks; i++) {
+      release(b.blocks[i]);
+    }
+  }
+
+  inline void ring_buffer::hold(size_t block)
+  {
+    __atomic_fetch_add(&_M_holds[block], 1, __ATOMIC_RELAXED);
+  }
+
+  inline bool ring_buffer::backlog() const
+  {
+    const struct tpacket_block_desc* block_desc =
+                               reinterpret_cast<struct tpacket_block_desc*>(
+                                 _M_rx_frames[_M_rx_idx].iov_base
+                               );
+
+    return ((__atomic_load_n(&block_desc->hdr.bh1.block_status,
+                             __ATOMIC_ACQUIRE) & TP_STATUS_USER) != 0);
+  }
+
+  inline int ring_buffer::fd() const
+  {
+    return _M_fd;
+  }
+
+  inline size_t ring_buffer::size() const
+  {
+    return (_M_buf != MAP_FAILED) ? _M_ring_size : 0;
+  }
+
+  inline void ring_buffer::callback_receiver::packet(const void* pkt,
+                                                     size_t pktlen)
+  {
+    rb->_M_fnpacket(pkt, pktlen, rb->_M_user);
+  }
+
+  inline void ring_buffer::callback_receiver::packets(const struct batch& b)
+  {
+    rb->_M_fnpackets(b.pkts, b.npkts, rb->_M_user);
+  }
+
+  template<typename Header, typename Receiver>
+  inline bool ring_buffer::recv_frame(Receiver& receiver)
+  {
+    Header* hdr = reinterpret_cast<Header*>(_M_rx_frames[_M_rx_idx].iov_base);
+
+    // If there is a new packet (the packet is read after the status)...
+    if ((__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) &
+         TP_STATUS_USER) == TP_STATUS_USER) {
+      // Process packet.
+      receiver.packet(reinterpret_cast<const uint8_t*>(hdr) + hdr->tp_mac,
+                      hdr->tp_snaplen);
+
+      // Mark frame as free (once the packet has been read).
+      __atomic_store_n(&hdr->tp_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+
+      if (++_M_rx_idx == _M_count) {
+        _M_rx_idx = 0;
+      }
+
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  template<typename Receiver>
+  inline bool ring_buffer::recv_block(Receiver& receiver)
+  {
+    struct batch b;
+    if (next(b, 1)) {
+      // Process packets.
+      receiver.packets(b);
+
+      // Mark block as free (unless it is still held).
+      release(b);
+
+      return true;
+    }
+
+    return false;
+  }
+
+  inline bool ring_buffer::recv_v1()
+  {
+    struct callback_receiver receiver = {this};
+    return recv_frame<struct tpacket_hdr>(receiver);
+  }
+
+  inline bool ring_buffer::recv_v2()
+  {
+    struct callback_receiver receiver = {this};
+    return recv_frame<struct tpacket2_hdr>(receiver);
+  }
+
+  inline bool ring_buffer::recv_v3()
+  {
+    struct callback_receiver receiver = {this};
+    return recv_block(receiver);
+  }
+
   inline bool ring_buffer::recv_v1(int timeout)
   {
     return ((recv_v1()) || ((wait_readable(timeout)) && (recv_v1())));
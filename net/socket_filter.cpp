@@ -13,6 +13,9 @@ void net::socket_filter::clear()
   _M_ipv4 = false;
   _M_ipv6 = false;
 
+  _M_fragments = false;
+  _M_nfragment_addresses = 0;
+
   _M_nportranges = 0;
 
   _M_nfilters = 0;
@@ -29,7 +32,7 @@ bool net::socket_filter::port_range(in_port_t from, in_port_t to)
 
     // Beyond the last position?
     if (i == _M_nportranges) {
-      if (_M_nportranges < max_port_ranges) {
+      if (reserve_port_range()) {
         _M_portranges[i].from = from;
         _M_portranges[i].to = to;
 
@@ -49,7 +52,7 @@ bool net::socket_filter::port_range(in_port_t from, in_port_t to)
 
     if (i == j) {
       if (static_cast<size_t>(to) + 1 < _M_portranges[i].from) {
-        if (_M_nportranges < max_port_ranges) {
+        if (reserve_port_range()) {
           memmove(_M_portranges + i + 1,
                   _M_portranges + i,
                   (_M_nportranges - i) * sizeof(struct portrange));
@@ -97,6 +100,84 @@ bool net::socket_filter::port_range(in_port_t from, in_port_t to)
   return false;
 }
 
+bool net::socket_filter::remove_port_range(in_port_t from, in_port_t to)
+{
+  if ((from > 0) && (from <= to)) {
+    size_t i = 0;
+    while (i < _M_nportranges) {
+      struct portrange* r = _M_portranges + i;
+
+      // If the port range doesn't overlap...
+      if ((r->to < from) || (r->from > to)) {
+        i++;
+      } else if ((r->from >= from) && (r->to <= to)) {
+        // Remove the whole port range.
+        memmove(r, r + 1, (_M_nportranges - i - 1) * sizeof(struct portrange));
+        _M_nportranges--;
+      } else if ((r->from < from) && (r->to > to)) {
+        // Split the port range.
+        if (reserve_port_range()) {
+          memmove(r + 1, r, (_M_nportranges - i) * sizeof(struct portrange));
+
+          r->to = from - 1;
+          (r + 1)->from = to + 1;
+
+          _M_nportranges++;
+
+          return true;
+        }
+
+        return false;
+      } else {
+        // Trim the port range.
+        if (r->from < from) {
+          r->to = from - 1;
+        } else {
+          r->from = to + 1;
+        }
+
+        i++;
+      }
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
+bool net::socket_filter::remove_port_ranges(const socket_filter& filter)
+{
+  for (size_t i = 0; i < filter._M_nportranges; i++) {
+    if (!remove_port_range(filter._M_portranges[i].from,
+                           filter._M_portranges[i].to)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool net::socket_filter::overlaps(const socket_filter& filter) const
+{
+  // Both lists of port ranges are sorted.
+  size_t i = 0, j = 0;
+  while ((i < _M_nportranges) && (j < filter._M_nportranges)) {
+    const struct portrange* r1 = _M_portranges + i;
+    const struct portrange* r2 = filter._M_portranges + j;
+
+    if (r1->to < r2->from) {
+      i++;
+    } else if (r2->to < r1->from) {
+      j++;
+    } else {
+      return true;
+    }
+  }
+
+  return false;
+}
+
 bool net::socket_filter::compile(struct sock_fprog& fprog)
 {
   // Clear filters.
@@ -107,15 +188,12 @@ bool net::socket_filter::compile(struct sock_fprog& fprog)
     _M_ipv6 = true;
   }
 
-  struct jmp {
-    size_t idx;
-    bool jt;
-  };
-
-  jmp accepts[max_filters];
-  size_t naccepts = 0;
+  // The conditional jumps have 8-bit offsets, so the checks which ignore
+  // the packet are followed by an unconditional jump (32-bit offset) to the
+  // final "ret #0", and each port range returns on its own.
+  static const size_t max_ignores = 16;
 
-  jmp ignores[max_filters];
+  size_t ignores[max_ignores];
   size_t nignores = 0;
 
   static const size_t minlenipv4 = sizeof(struct ether_header) +
@@ -130,83 +208,78 @@ bool net::socket_filter::compile(struct sock_fprog& fprog)
   size_t minlen = _M_ipv4 ? minlenipv4 : minlenipv6;
 
   // A <- len.
-  stmt(BPF_LD + BPF_W + BPF_LEN, 0);
-
-  ignores[nignores].idx = _M_nfilters;
-  ignores[nignores++].jt = false;
+  if (!stmt(BPF_LD + BPF_W + BPF_LEN, 0)) {
+    return false;
+  }
 
   // Ignore packet if too small.
-  jump(BPF_JMP + BPF_JGE + BPF_K, minlen, 0, 0);
+  if (!jump(BPF_JMP + BPF_JGE + BPF_K, minlen, 1, 0)) {
+    return false;
+  }
+
+  ignores[nignores++] = _M_nfilters;
+  if (!stmt(BPF_JMP + BPF_JA, 0)) {
+    return false;
+  }
 
   // A <- ethernet type.
-  stmt(BPF_LD + BPF_H + BPF_ABS, offsetof(struct ether_header, ether_type));
+  if (!stmt(BPF_LD + BPF_H + BPF_ABS,
+            offsetof(struct ether_header, ether_type))) {
+    return false;
+  }
 
   size_t next = 0;
 
   // If there is IPv6...
   if (_M_ipv6) {
-    next = _M_nfilters;
-
-    jump(BPF_JMP + BPF_JEQ + BPF_K, ETHERTYPE_IPV6, 0, 0);
+    if (!jump(BPF_JMP + BPF_JEQ + BPF_K, ETHERTYPE_IPV6, 1, 0)) {
+      return false;
+    }
 
     if (_M_ipv4) {
-      // A <- len.
-      stmt(BPF_LD + BPF_W + BPF_LEN, 0);
+      // Jump to the IPv4 checks.
+      next = _M_nfilters;
+      if (!stmt(BPF_JMP + BPF_JA, 0)) {
+        return false;
+      }
 
-      ignores[nignores].idx = _M_nfilters;
-      ignores[nignores++].jt = false;
+      // A <- len.
+      if (!stmt(BPF_LD + BPF_W + BPF_LEN, 0)) {
+        return false;
+      }
 
       // Ignore packet if too small.
-      jump(BPF_JMP + BPF_JGE + BPF_K, minlenipv6, 0, 0);
+      if (!jump(BPF_JMP + BPF_JGE + BPF_K, minlenipv6, 1, 0)) {
+        return false;
+      }
+    }
+
+    ignores[nignores++] = _M_nfilters;
+    if (!stmt(BPF_JMP + BPF_JA, 0)) {
+      return false;
     }
 
     // A <- next header.
-    stmt(BPF_LD + BPF_B + BPF_ABS,
-         sizeof(struct ether_header) +
-         offsetof(struct ip6_hdr, ip6_nxt));
-
-    ignores[nignores].idx = _M_nfilters;
-    ignores[nignores++].jt = false;
-
-    jump(BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_UDP, 0, 0);
-
-    // If there are destination ports...
-    if (_M_nportranges > 0) {
-      // Load destination port.
-      stmt(BPF_LD + BPF_H + BPF_ABS,
-           sizeof(struct ether_header) +
-           sizeof(struct ip6_hdr) +
-           offsetof(struct udphdr, dest));
-
-      // Add destination ports.
-      for (size_t i = 0; i < _M_nportranges; i++) {
-        if (_M_portranges[i].from == _M_portranges[i].to) {
-          accepts[naccepts].idx = _M_nfilters;
-          accepts[naccepts++].jt = true;
-
-          if (!jump(BPF_JMP + BPF_JEQ + BPF_K, _M_portranges[i].from, 0, 0)) {
-            return false;
-          }
-        } else {
-          if (jump(BPF_JMP + BPF_JGE + BPF_K, _M_portranges[i].from, 0, 1)) {
-            accepts[naccepts].idx = _M_nfilters;
-            accepts[naccepts++].jt = false;
-
-            if (!jump(BPF_JMP + BPF_JGT + BPF_K, _M_portranges[i].to, 0, 0)) {
-              return false;
-            }
-          } else {
-            return false;
-          }
-        }
-      }
+    if (!stmt(BPF_LD + BPF_B + BPF_ABS,
+              sizeof(struct ether_header) +
+              offsetof(struct ip6_hdr, ip6_nxt))) {
+      return false;
+    }
 
-      // If we are still here, it didn't match the filter.
-      if (!stmt(BPF_RET + BPF_K, 0)) {
-        return false;
-      }
-    } else {
-      stmt(BPF_RET + BPF_K, 0x40000);
+    if (!jump(BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_UDP, 1, 0)) {
+      return false;
+    }
+
+    ignores[nignores++] = _M_nfilters;
+    if (!stmt(BPF_JMP + BPF_JA, 0)) {
+      return false;
+    }
+
+    // Add destination ports.
+    if (!ports(sizeof(struct ether_header) +
+               sizeof(struct ip6_hdr) +
+               offsetof(struct udphdr, dest))) {
+      return false;
     }
   }
 
@@ -215,91 +288,114 @@ bool net::socket_filter::compile(struct sock_fprog& fprog)
     // If there is IPv6...
     if (next != 0) {
       // Jump here.
-      _M_filters[next].jf = _M_nfilters - next - 1;
+      _M_filters[next].k = _M_nfilters - next - 1;
     }
 
-    ignores[nignores].idx = _M_nfilters;
-    ignores[nignores++].jt = false;
+    if (!jump(BPF_JMP + BPF_JEQ + BPF_K, ETHERTYPE_IP, 1, 0)) {
+      return false;
+    }
 
-    jump(BPF_JMP + BPF_JEQ + BPF_K, ETHERTYPE_IP, 0, 0);
+    ignores[nignores++] = _M_nfilters;
+    if (!stmt(BPF_JMP + BPF_JA, 0)) {
+      return false;
+    }
 
     // A <- protocol.
-    stmt(BPF_LD + BPF_B + BPF_ABS,
-         sizeof(struct ether_header) +
-         offsetof(struct iphdr, protocol));
+    if (!stmt(BPF_LD + BPF_B + BPF_ABS,
+              sizeof(struct ether_header) +
+              offsetof(struct iphdr, protocol))) {
+      return false;
+    }
 
-    ignores[nignores].idx = _M_nfilters;
-    ignores[nignores++].jt = false;
+    if (!jump(BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_UDP, 1, 0)) {
+      return false;
+    }
 
-    jump(BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_UDP, 0, 0);
+    ignores[nignores++] = _M_nfilters;
+    if (!stmt(BPF_JMP + BPF_JA, 0)) {
+      return false;
+    }
 
     // A <- flags + fragment offset.
-    stmt(BPF_LD + BPF_H + BPF_ABS,
-         sizeof(struct ether_header) +
-         offsetof(struct iphdr, frag_off));
-
-    ignores[nignores].idx = _M_nfilters;
-    ignores[nignores++].jt = true;
-
-    // Ignore fragmented packets.
-    jump(BPF_JMP + BPF_JSET + BPF_K, 0x3fff, 0, 0);
-
-    // If there are destination ports...
-    if (_M_nportranges > 0) {
-      // Load destination port.
-      stmt(BPF_LD + BPF_H + BPF_ABS,
-           sizeof(struct ether_header) +
-           sizeof(struct iphdr) +
-           offsetof(struct udphdr, dest));
-
-      // Add destination ports.
-      for (size_t i = 0; i < _M_nportranges; i++) {
-        if (_M_portranges[i].from == _M_portranges[i].to) {
-          accepts[naccepts].idx = _M_nfilters;
-          accepts[naccepts++].jt = true;
-
-          if (!jump(BPF_JMP + BPF_JEQ + BPF_K, _M_portranges[i].from, 0, 0)) {
-            return false;
-          }
-        } else {
-          if (jump(BPF_JMP + BPF_JGE + BPF_K, _M_portranges[i].from, 0, 1)) {
-            accepts[naccepts].idx = _M_nfilters;
-            accepts[naccepts++].jt = false;
-
-            if (!jump(BPF_JMP + BPF_JGT + BPF_K, _M_portranges[i].to, 0, 0)) {
-              return false;
-            }
-          } else {
-            return false;
-          }
+    if (!stmt(BPF_LD + BPF_H + BPF_ABS,
+              sizeof(struct ether_header) +
+              offsetof(struct iphdr, frag_off))) {
+      return false;
+    }
+
+    if (_M_fragments) {
+      // If the packet is a fragment, its destination address must be one
+      // of the destination addresses of the fragments.
+      size_t naddrs = _M_nfragment_addresses;
+
+      if (!jump(BPF_JMP + BPF_JSET + BPF_K,
+                0x3fff,
+                0,
+                static_cast<uint8_t>(naddrs + 5))) {
+        return false;
+      }
+
+      // A <- destination address.
+      if (!stmt(BPF_LD + BPF_W + BPF_ABS,
+                sizeof(struct ether_header) +
+                offsetof(struct iphdr, daddr))) {
+        return false;
+      }
+
+      for (size_t i = 0; i < naddrs; i++) {
+        if (!jump(BPF_JMP + BPF_JEQ + BPF_K,
+                  _M_fragment_addresses[i],
+                  static_cast<uint8_t>(naddrs - i),
+                  0)) {
+          return false;
         }
       }
-    } else {
-      stmt(BPF_RET + BPF_K, 0x40000);
-    }
-  }
 
-  for (size_t i = 0; i < nignores; i++) {
-    if (ignores[i].jt) {
-      _M_filters[ignores[i].idx].jt = _M_nfilters - ignores[i].idx - 1;
+      ignores[nignores++] = _M_nfilters;
+      if (!stmt(BPF_JMP + BPF_JA, 0)) {
+        return false;
+      }
+
+      // A <- flags + fragment offset.
+      if (!stmt(BPF_LD + BPF_H + BPF_ABS,
+                sizeof(struct ether_header) +
+                offsetof(struct iphdr, frag_off))) {
+        return false;
+      }
+
+      // Accept non-first fragments (they don't carry the UDP header, the
+      // first fragment goes through the port checks).
+      if (!jump(BPF_JMP + BPF_JSET + BPF_K, 0x1fff, 0, 1)) {
+        return false;
+      }
+      if (!stmt(BPF_RET + BPF_K, 0x40000)) {
+        return false;
+      }
     } else {
-      _M_filters[ignores[i].idx].jf = _M_nfilters - ignores[i].idx - 1;
+      // Ignore fragmented packets.
+      if (!jump(BPF_JMP + BPF_JSET + BPF_K, 0x3fff, 0, 1)) {
+        return false;
+      }
+
+      ignores[nignores++] = _M_nfilters;
+      if (!stmt(BPF_JMP + BPF_JA, 0)) {
+        return false;
+      }
     }
-  }
 
-  if (!stmt(BPF_RET + BPF_K, 0)) {
-    return false;
+    // Add destination ports.
+    if (!ports(sizeof(struct ether_header) +
+               sizeof(struct iphdr) +
+               offsetof(struct udphdr, dest))) {
+      return false;
+    }
   }
 
-  for (size_t i = 0; i < naccepts; i++) {
-    if (accepts[i].jt) {
-      _M_filters[accepts[i].idx].jt = _M_nfilters - accepts[i].idx - 1;
-    } else {
-      _M_filters[accepts[i].idx].jf = _M_nfilters - accepts[i].idx - 1;
-    }
+  for (size_t i = 0; i < nignores; i++) {
+    _M_filters[ignores[i]].k = _M_nfilters - ignores[i] - 1;
   }
 
-  if (stmt(BPF_RET + BPF_K, 0x40000)) {
+  if (stmt(BPF_RET + BPF_K, 0)) {
     fprog.filter = _M_filters;
     fprog.len = static_cast<unsigned short>(_M_nfilters);
 
@@ -309,6 +405,39 @@ bool net::socket_filter::compile(struct sock_fprog& fprog)
   return false;
 }
 
+bool net::socket_filter::ports(uint32_t offset)
+{
+  // If there are no destination ports...
+  if (_M_nportranges == 0) {
+    return stmt(BPF_RET + BPF_K, 0x40000);
+  }
+
+  // Load destination port.
+  if (!stmt(BPF_LD + BPF_H + BPF_ABS, offset)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < _M_nportranges; i++) {
+    if (_M_portranges[i].from == _M_portranges[i].to) {
+      if (!jump(BPF_JMP + BPF_JEQ + BPF_K, _M_portranges[i].from, 0, 1)) {
+        return false;
+      }
+    } else {
+      if ((!jump(BPF_JMP + BPF_JGE + BPF_K, _M_portranges[i].from, 0, 2)) ||
+          (!jump(BPF_JMP + BPF_JGT + BPF_K, _M_portranges[i].to, 1, 0))) {
+        return false;
+      }
+    }
+
+    if (!stmt(BPF_RET + BPF_K, 0x40000)) {
+      return false;
+    }
+  }
+
+  // If we are still here, it didn't match the filter.
+  return stmt(BPF_RET + BPF_K, 0);
+}
+
 void net::socket_filter::print() const
 {
   static const int widths[] = {8, 16};
@@ -378,6 +507,9 @@ void net::socket_filter::print() const
                "jf ",
                i + 1 + f->jf);
 
+        break;
+      case BPF_JMP | BPF_JA:
+        printf("%-*s %zu\n", widths[0], "ja", i + 1 + f->k);
         break;
       case BPF_RET | BPF_K:
         printf("%-*s #%u\n", widths[0], "ret", f->k);
@@ -2,12 +2,17 @@
 #define NET_SOCKET_FILTER_H
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <netinet/in.h>
 #include <linux/filter.h>
 
 namespace net {
   class socket_filter {
     public:
+      // Maximum number of destination addresses of the IPv4 fragments (the
+      // conditional jumps have 8-bit offsets).
+      static const size_t max_fragment_addresses = 64;
+
       // Constructor.
       socket_filter();
 
@@ -23,12 +28,31 @@ namespace net {
       // Enable IPv6.
       void ipv6();
 
+      // Accept IPv4 fragments (only those sent to the addresses added
+      // with fragment_address()).
+      void fragments(bool accept);
+
+      // Add destination address of the IPv4 fragments.
+      bool fragment_address(const struct in_addr& addr);
+
       // Add port.
       bool port(in_port_t p);
 
       // Add port range.
       bool port_range(in_port_t from, in_port_t to);
 
+      // Remove port range.
+      bool remove_port_range(in_port_t from, in_port_t to);
+
+      // Remove the port ranges of another filter.
+      bool remove_port_ranges(const socket_filter& filter);
+
+      // Does a port range overlap a port range of another filter?
+      bool overlaps(const socket_filter& filter) const;
+
+      // Number of port ranges.
+      size_t count() const;
+
       // Compile.
       bool compile(struct sock_fprog& fprog);
 
@@ -36,35 +60,70 @@ namespace net {
       void print() const;
 
   private:
-    static const size_t max_port_ranges = 32;
-    static const size_t max_filters = 255;
+    static const size_t max_filters = BPF_MAXINSNS;
+
+    // Allocation step of the tables.
+    static const size_t allocation = 32;
 
     bool _M_ipv4;
     bool _M_ipv6;
 
+    bool _M_fragments;
+
+    // Destination addresses of the IPv4 fragments (host byte order).
+    uint32_t _M_fragment_addresses[max_fragment_addresses];
+    size_t _M_nfragment_addresses;
+
     struct portrange {
       in_port_t from;
       in_port_t to;
     };
 
-    portrange _M_portranges[max_port_ranges];
+    portrange* _M_portranges;
+    size_t _M_size;
     size_t _M_nportranges;
 
-    struct sock_filter _M_filters[max_filters];
+    struct sock_filter* _M_filters;
+    size_t _M_filters_size;
     size_t _M_nfilters;
 
+    // Make room for one more port range.
+    bool reserve_port_range();
+
     // Add socket filter.
     bool stmt(uint16_t code, uint32_t k);
     bool jump(uint16_t code, uint32_t k, uint8_t jt, uint8_t jf);
+
+    // Add socket filter with room for one more.
+    struct sock_filter* add();
+
+    // Add the checks of the destination ports (the destination port is at
+    // `offset`).
+    bool ports(uint32_t offset);
+
+    // Disable copy constructor and assignment operator.
+    socket_filter(const socket_filter&) = delete;
+    socket_filter& operator=(const socket_filter&) = delete;
   };
 
   inline socket_filter::socket_filter()
+    : _M_portranges(nullptr),
+      _M_size(0),
+      _M_filters(nullptr),
+      _M_filters_size(0)
   {
     clear();
   }
 
   inline socket_filter::~socket_filter()
   {
+    if (_M_portranges) {
+      free(_M_portranges);
+    }
+
+    if (_M_filters) {
+      free(_M_filters);
+    }
   }
 
   inline void socket_filter::ipv4()
@@ -77,25 +136,56 @@ namespace net {
     _M_ipv6 = true;
   }
 
+  inline void socket_filter::fragments(bool accept)
+  {
+    _M_fragments = accept;
+  }
+
+  inline bool socket_filter::fragment_address(const struct in_addr& addr)
+  {
+    if (_M_nfragment_addresses < max_fragment_addresses) {
+      _M_fragment_addresses[_M_nfragment_addresses++] = ntohl(addr.s_addr);
+      return true;
+    }
+
+    return false;
+  }
+
   inline bool socket_filter::port(in_port_t p)
   {
     return port_range(p, p);
   }
 
-  inline bool socket_filter::stmt(uint16_t code, uint32_t k)
+  inline size_t socket_filter::count() const
   {
-    if (_M_nfilters < max_filters) {
-      struct sock_filter* f = _M_filters + _M_nfilters++;
+    return _M_nportranges;
+  }
 
-      f->code = code;
-      f->k = k;
-      f->jt = 0;
-      f->jf = 0;
+  inline bool socket_filter::reserve_port_range()
+  {
+    if (_M_nportranges < _M_size) {
+      return true;
+    }
+
+    size_t size = _M_size + allocation;
+
+    portrange* portranges = reinterpret_cast<portrange*>(
+                              realloc(_M_portranges, size * sizeof(portrange))
+                            );
+
+    if (portranges) {
+      _M_portranges = portranges;
+      _M_size = size;
 
       return true;
-    } else {
-      return false;
     }
+
+    return false;
+  }
+
+  inline bool socket_filter::stmt(uint16_t code, uint32_t k)
+  {
+    return jump(code, k, 0, 0);
   }
 
   inline bool socket_filter::jump(uint16_t code,
@@ -103,9 +193,8 @@ namespace net {
                                   uint8_t jt,
                                   uint8_t jf)
   {
-    if (_M_nfilters < max_filters) {
-      struct sock_filter* f = _M_filters + _M_nfilters++;
-
+    struct sock_filter* f;
+    if ((f = add()) != nullptr) {
       f->code = code;
       f->k = k;
       f->jt = jt;
@@ -116,6 +205,34 @@ namespace net {
       return false;
     }
   }
+
+  inline struct sock_filter* socket_filter::add()
+  {
+    if (_M_nfilters == _M_filters_size) {
+      if (_M_filters_size == max_filters) {
+        return nullptr;
+      }
+
+      size_t size = _M_filters_size + (allocation << 3);
+      if (size > max_filters) {
+        size = max_filters;
+      }
+
+      struct sock_filter* filters = reinterpret_cast<struct sock_filter*>(
+                                      realloc(_M_filters,
+                                              size * sizeof(struct sock_filter))
+                                    );
+
+      if (!filters) {
+        return nullptr;
+      }
+
+      _M_filters = filters;
+      _M_filters_size = size;
+    }
+
+    return _M_filters + _M_nfilters++;
+  }
 }
 
 #endif // NET_SOCKET_FILTER_H
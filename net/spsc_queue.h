@@ -0,0 +1,245 @@
+#ifndef NET_SPSC_QUEUE_H
+#define NET_SPSC_QUEUE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include <net/ethernet.h>
+#include "net/numa.h"
+#include "macros/macros.h"
+
+namespace net {
+  // Lock-free single-producer single-consumer queue of frames (the frames
+  // are copied into the queue, so the producer can release its buffers).
+  class spsc_queue {
+    public:
+      // Size of a slot (frame + length).
+      static const size_t slot_size = 2048;
+
+      // Maximum frame length.
+      static const size_t max_frame_length = slot_size - sizeof(uint32_t);
+
+      // Maximum MTU of the interfaces (the frames have the ethernet header
+      // and, when mirrored, a VLAN tag).
+      static const size_t max_mtu = max_frame_length -
+                                    sizeof(struct ether_header) -
+                                    4;
+
+      // Number of frames (power of 2).
+      static const size_t min_frames = 64;
+      static const size_t max_frames = 1024 * 1024;
+      static const size_t default_frames = 1024;
+
+      // Constructor.
+      spsc_queue();
+
+      // Destructor.
+      ~spsc_queue();
+
+      // Create.
+      bool create(size_t nframes);
+
+      // Push frame (producer), waits up to `timeout` milliseconds when the
+      // queue is full.
+      bool push(const struct iovec* iov, size_t iovcnt, int timeout);
+
+      // Get up to `n` frames (consumer), returns the number of frames.
+      size_t peek(struct iovec* frames, size_t n);
+
+      // Remove `n` frames (consumer), after peek().
+      void pop(size_t n);
+
+      // Is the queue empty? (consumer).
+      bool empty() const;
+
+      // Number of frames dropped because the queue was full.
+      uint64_t drops() const;
+
+      // Get size of the queue.
+      size_t size() const;
+
+      // Add the memory of the queue to its NUMA node.
+      void memory(size_t* nodes) const;
+
+    private:
+      struct slot {
+        uint32_t len;
+        uint8_t data[max_frame_length];
+      };
+
+      struct slot* _M_slots;
+      size_t _M_mask;
+
+      // Written by the producer.
+      alignas(CACHE_LINE_SIZE) size_t _M_head;
+      size_t _M_cached_tail;
+      uint64_t _M_drops;
+
+      // Written by the consumer.
+      alignas(CACHE_LINE_SIZE) size_t _M_tail;
+      size_t _M_cached_head;
+
+      // Push frame (don't wait).
+      bool push(const struct iovec* iov, size_t iovcnt);
+
+      // Disable copy constructor and assignment operator.
+      spsc_queue(const spsc_queue&) = delete;
+      spsc_queue& operator=(const spsc_queue&) = delete;
+  };
+
+  inline spsc_queue::spsc_queue()
+    : _M_slots(nullptr),
+      _M_mask(0),
+      _M_head(0),
+      _M_cached_tail(0),
+      _M_drops(0),
+      _M_tail(0),
+      _M_cached_head(0)
+  {
+  }
+
+  inline spsc_queue::~spsc_queue()
+  {
+    if (_M_slots) {
+      free(_M_slots);
+    }
+  }
+
+  inline bool spsc_queue::create(size_t nframes)
+  {
+    if ((nframes >= min_frames) &&
+        (nframes <= max_frames) &&
+        (IS_POWER_2(nframes))) {
+      void* buf;
+      if (posix_memalign(&buf, CACHE_LINE_SIZE, nframes * slot_size) == 0) {
+        _M_slots = reinterpret_cast<struct slot*>(buf);
+        _M_mask = nframes - 1;
+
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  inline bool spsc_queue::push(const struct iovec* iov,
+                               size_t iovcnt,
+                               int timeout)
+  {
+    if (push(iov, iovcnt)) {
+      return true;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &start);
+
+    do {
+      sched_yield();
+
+      if (push(iov, iovcnt)) {
+        return true;
+      }
+
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+      if (((now.tv_sec - start.tv_sec) * 1000) +
+          ((now.tv_nsec - start.tv_nsec) / 1000000) >= timeout) {
+        _M_drops++;
+        return false;
+      }
+    } while (true);
+  }
+
+  inline bool spsc_queue::push(const struct iovec* iov, size_t iovcnt)
+  {
+    // If the queue seems to be full...
+    if (_M_head - _M_cached_tail > _M_mask) {
+      _M_cached_tail = __atomic_load_n(&_M_tail, __ATOMIC_ACQUIRE);
+
+      // If the queue is full...
+      if (_M_head - _M_cached_tail > _M_mask) {
+        return false;
+      }
+    }
+
+    struct slot* s = _M_slots + (_M_head & _M_mask);
+
+    // Copy frame.
+    size_t len = 0;
+    for (size_t i = 0; i < iovcnt; i++, iov++) {
+      if (len + iov->iov_len > max_frame_length) {
+        // Frame too long (it wouldn't fit in the queue either later).
+        _M_drops++;
+        return true;
+      }
+
+      memcpy(s->data + len, iov->iov_base, iov->iov_len);
+      len += iov->iov_len;
+    }
+
+    s->len = static_cast<uint32_t>(len);
+
+    // Publish frame.
+    __atomic_store_n(&_M_head, _M_head + 1, __ATOMIC_RELEASE);
+
+    return true;
+  }
+
+  inline size_t spsc_queue::peek(struct iovec* frames, size_t n)
+  {
+    size_t count = _M_cached_head - _M_tail;
+
+    if (count < n) {
+      _M_cached_head = __atomic_load_n(&_M_head, __ATOMIC_ACQUIRE);
+
+      if ((count = _M_cached_head - _M_tail) > n) {
+        count = n;
+      }
+    } else {
+      count = n;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      struct slot* s = _M_slots + ((_M_tail + i) & _M_mask);
+
+      frames[i].iov_base = s->data;
+      frames[i].iov_len = s->len;
+    }
+
+    return count;
+  }
+
+  inline void spsc_queue::pop(size_t n)
+  {
+    // Release the slots.
+    __atomic_store_n(&_M_tail, _M_tail + n, __ATOMIC_RELEASE);
+  }
+
+  inline bool spsc_queue::empty() const
+  {
+    return (__atomic_load_n(&_M_head, __ATOMIC_ACQUIRE) == _M_tail);
+  }
+
+  inline uint64_t spsc_queue::drops() const
+  {
+    return __atomic_load_n(&_M_drops, __ATOMIC_RELAXED);
+  }
+
+  inline size_t spsc_queue::size() const
+  {
+    return _M_slots ? (_M_mask + 1) * slot_size : 0;
+  }
+
+  inline void spsc_queue::memory(size_t* nodes) const
+  {
+    if (_M_slots) {
+      numa::memory(_M_slots, size(), nodes);
+    }
+  }
+}
+
+#endif // NET_SPSC_QUEUE_H
@@ -0,0 +1,200 @@
+#ifndef NET_TIMER_WHEEL_H
+#define NET_TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "macros/macros.h"
+
+namespace net {
+  // Hashed timer wheel (single thread, no allocations: the timers are
+  // linked in the slot of their tick). The timers further than the
+  // horizon of the wheel wait in its last slot and are moved forward when
+  // it is reached.
+  class timer_wheel {
+    public:
+      // Resolution (nanoseconds, power of 2).
+      static const uint64_t tick = 8192;
+
+      // Number of slots (power of 2).
+      static const size_t nslots = 512;
+
+      struct timer {
+        // Expiration time (nanoseconds).
+        uint64_t expires;
+
+        // Owner of the timer.
+        void* data;
+
+        // Next timer in the slot.
+        struct timer* next;
+
+        // Is the timer in the wheel?
+        bool pending;
+      };
+
+      // Constructor.
+      timer_wheel();
+
+      // Clear.
+      void clear(uint64_t now);
+
+      // Add timer (not pending).
+      void add(struct timer* t, uint64_t expires);
+
+      // Set the current time (nanoseconds) and call `handler(t)` for each
+      // timer which has expired (the handler can add it again).
+      template<typename Handler>
+      void expire(uint64_t now, Handler& handler);
+
+      // Get the current time (nanoseconds).
+      uint64_t now() const;
+
+      // Get the expiration time of the next timer (UINT64_MAX if none).
+      uint64_t next() const;
+
+      // Is any timer pending?
+      bool empty() const;
+
+    private:
+      static const size_t tick_shift = 13;
+      static const size_t mask = nslots - 1;
+
+      struct timer* _M_slots[nslots];
+
+      // Current time and tick.
+      uint64_t _M_now;
+      uint64_t _M_tick;
+
+      // Number of pending timers.
+      size_t _M_count;
+
+      // Disable copy constructor and assignment operator.
+      timer_wheel(const timer_wheel&) = delete;
+      timer_wheel& operator=(const timer_wheel&) = delete;
+  };
+
+  inline timer_wheel::timer_wheel()
+  {
+    clear(0);
+  }
+
+  inline void timer_wheel::clear(uint64_t now)
+  {
+    for (size_t i = 0; i < nslots; i++) {
+      _M_slots[i] = nullptr;
+    }
+
+    _M_now = now;
+    _M_tick = now >> tick_shift;
+
+    _M_count = 0;
+  }
+
+  inline void timer_wheel::add(struct timer* t, uint64_t expires)
+  {
+    uint64_t tick = expires >> tick_shift;
+
+    // The timers which have already expired go to the current slot, those
+    // beyond the horizon to the last one.
+    if (tick < _M_tick) {
+      tick = _M_tick;
+    } else if (tick - _M_tick > mask) {
+      tick = _M_tick + mask;
+    }
+
+    struct timer** slot = _M_slots + (tick & mask);
+
+    t->expires = expires;
+    t->next = *slot;
+    t->pending = true;
+
+    *slot = t;
+
+    _M_count++;
+  }
+
+  template<typename Handler>
+  inline void timer_wheel::expire(uint64_t now, Handler& handler)
+  {
+    _M_now = now;
+
+    uint64_t tick = now >> tick_shift;
+
+    if ((_M_count > 0) && (tick >= _M_tick)) {
+      // Go through the slots up to the current tick (each slot once at
+      // most).
+      uint64_t first = (tick - _M_tick > mask) ? tick - mask : _M_tick;
+
+      for (uint64_t i = first; i <= tick; i++) {
+        _M_tick = i;
+
+        struct timer** slot = _M_slots + (i & mask);
+
+        // Detach the timers of the slot (the handler might add them
+        // again).
+        struct timer* t = *slot;
+        *slot = nullptr;
+
+        while (t) {
+          struct timer* next = t->next;
+
+          _M_count--;
+
+          // If the timer hasn't expired yet (later in the current tick or
+          // beyond the horizon)...
+          if (t->expires > now) {
+            add(t, t->expires);
+          } else {
+            t->pending = false;
+            handler(t);
+          }
+
+          t = next;
+        }
+      }
+    }
+
+    if (tick > _M_tick) {
+      _M_tick = tick;
+    }
+  }
+
+  inline uint64_t timer_wheel::now() const
+  {
+    return _M_now;
+  }
+
+  inline uint64_t timer_wheel::next() const
+  {
+    if (_M_count > 0) {
+      for (size_t i = 0; i < nslots; i++) {
+        const struct timer* t = _M_slots[(_M_tick + i) & mask];
+
+        if (t) {
+          // The timers beyond the horizon have to be moved when the slot
+          // is reached.
+          uint64_t start = (_M_tick + i) << tick_shift;
+          uint64_t expires = UINT64_MAX;
+
+          do {
+            expires = MIN(expires,
+                          ((t->expires >> tick_shift) > _M_tick + i) ?
+                            start :
+                            t->expires);
+          } while ((t = t->next) != nullptr);
+
+          return expires;
+        }
+      }
+    }
+
+    return UINT64_MAX;
+  }
+
+  inline bool timer_wheel::empty() const
+  {
+    return (_M_count == 0);
+  }
+}
+
+#endif // NET_TIMER_WHEEL_H
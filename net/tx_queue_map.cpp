@@ -0,0 +1,259 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <net/if.h>
+#include "net/tx_queue_map.h"
+#include "macros/macros.h"
+
+bool net::tx_queue_map::map(unsigned ifindex, const int* cpus, size_t ncpus)
+{
+  char ifname[IF_NAMESIZE];
+  if (!if_indextoname(ifindex, ifname)) {
+    return false;
+  }
+
+  size_t nqueues;
+  if ((nqueues = tx_queues(ifname)) == 0) {
+    return false;
+  } else if (nqueues == 1) {
+    // Single TX queue (no XPS map).
+    return true;
+  }
+
+  // CPUs of the workers and of the workers of each queue.
+  cpu_set_t workers;
+  CPU_ZERO(&workers);
+
+  cpu_set_t* queues = reinterpret_cast<cpu_set_t*>(
+                        calloc(nqueues, sizeof(cpu_set_t))
+                      );
+
+  if (!queues) {
+    return false;
+  }
+
+  for (size_t i = 0; i < ncpus; i++) {
+    if ((cpus[i] < 0) || (cpus[i] >= CPU_SETSIZE)) {
+      free(queues);
+      return false;
+    }
+
+    if (!CPU_ISSET(cpus[i], &workers)) {
+      CPU_SET(cpus[i], &workers);
+      CPU_SET(cpus[i], &queues[i % nqueues]);
+    }
+  }
+
+  // Make room for the masks of the interface.
+  struct mask* masks = reinterpret_cast<struct mask*>(
+                         realloc(_M_masks,
+                                 (_M_nmasks + nqueues) * sizeof(struct mask))
+                       );
+
+  if (!masks) {
+    free(queues);
+    return false;
+  }
+
+  _M_masks = masks;
+
+  // Save the current masks (all of them before writing any).
+  for (size_t q = 0; q < nqueues; q++) {
+    struct mask* m = _M_masks + _M_nmasks;
+
+    snprintf(m->filename,
+             sizeof(m->filename),
+             "/sys/class/net/%s/queues/tx-%zu/xps_cpus",
+             ifname,
+             q);
+
+    cpu_set_t set;
+    if (!read_mask(m->filename, set, m->value, sizeof(m->value))) {
+      free(queues);
+      return false;
+    }
+
+    _M_nmasks++;
+
+    // The CPUs of the workers move to their queues, the other ones stay.
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if ((CPU_ISSET(cpu, &set)) && (!CPU_ISSET(cpu, &workers))) {
+        CPU_SET(cpu, &queues[q]);
+      }
+    }
+  }
+
+  // Write the new masks.
+  for (size_t q = 0; q < nqueues; q++) {
+    if (!write_mask(_M_masks[_M_nmasks - nqueues + q].filename, queues[q])) {
+      free(queues);
+      return false;
+    }
+  }
+
+  free(queues);
+
+  return true;
+}
+
+bool net::tx_queue_map::adopt(const struct mask& m)
+{
+  static const char prefix[] = "/sys/class/net/";
+
+  // Sanity checks.
+  if ((strncmp(m.filename, prefix, sizeof(prefix) - 1) != 0) ||
+      (!memchr(m.filename, 0, sizeof(m.filename))) ||
+      (!memchr(m.value, 0, sizeof(m.value)))) {
+    return false;
+  }
+
+  // Search the mask of the same file.
+  for (size_t i = 0; i < _M_nmasks; i++) {
+    if (strncmp(_M_masks[i].filename,
+                m.filename,
+                sizeof(m.filename)) == 0) {
+      _M_masks[i] = m;
+      return true;
+    }
+  }
+
+  // The queue is not mapped by this process, restore it anyway.
+  struct mask* masks = reinterpret_cast<struct mask*>(
+                         realloc(_M_masks,
+                                 (_M_nmasks + 1) * sizeof(struct mask))
+                       );
+
+  if (!masks) {
+    return false;
+  }
+
+  _M_masks = masks;
+  _M_masks[_M_nmasks++] = m;
+
+  return true;
+}
+
+void net::tx_queue_map::restore()
+{
+  for (size_t i = 0; i < _M_nmasks; i++) {
+    write_value(_M_masks[i].filename, _M_masks[i].value);
+  }
+
+  forget();
+}
+
+size_t net::tx_queue_map::tx_queues(const char* ifname)
+{
+  char dirname[PATH_MAX];
+  snprintf(dirname, sizeof(dirname), "/sys/class/net/%s/queues", ifname);
+
+  size_t nqueues = 0;
+
+  DIR* dir;
+  if ((dir = opendir(dirname)) != nullptr) {
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+      if (strncmp(entry->d_name, "tx-", 3) == 0) {
+        nqueues++;
+      }
+    }
+
+    closedir(dir);
+  }
+
+  return nqueues;
+}
+
+bool net::tx_queue_map::read_mask(const char* filename,
+                                  cpu_set_t& set,
+                                  char* value,
+                                  size_t size)
+{
+  FILE* file;
+  if ((file = fopen(filename, "r")) == nullptr) {
+    return false;
+  }
+
+  if (!fgets(value, size, file)) {
+    fclose(file);
+    return false;
+  }
+
+  fclose(file);
+
+  // Strip trailing new line.
+  size_t len = strlen(value);
+  while ((len > 0) && ((value[len - 1] == '\n') || (value[len - 1] == '\r'))) {
+    value[--len] = 0;
+  }
+
+  CPU_ZERO(&set);
+
+  // Groups of 32 bits separated by commas, the last digit is the one of
+  // the first CPUs.
+  int cpu = 0;
+  for (size_t i = len; i > 0; i--) {
+    char c = value[i - 1];
+
+    if (c == ',') {
+      continue;
+    } else if (!IS_XDIGIT(c)) {
+      return false;
+    }
+
+    unsigned digit = IS_DIGIT(c) ? c - '0' : (c | 0x20) - 'a' + 10;
+
+    for (unsigned bit = 0; bit < 4; bit++, cpu++) {
+      if ((digit & (1u << bit)) && (cpu < CPU_SETSIZE)) {
+        CPU_SET(cpu, &set);
+      }
+    }
+  }
+
+  return true;
+}
+
+bool net::tx_queue_map::write_mask(const char* filename, const cpu_set_t& set)
+{
+  // Number of groups of 32 bits.
+  int ngroups = 1;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &set)) {
+      ngroups = (cpu / 32) + 1;
+    }
+  }
+
+  char value[(CPU_SETSIZE / 32) * 9 + 1];
+  size_t len = 0;
+
+  for (int g = ngroups - 1; g >= 0; g--) {
+    uint32_t bits = 0;
+    for (int bit = 0; bit < 32; bit++) {
+      if (CPU_ISSET((g * 32) + bit, &set)) {
+        bits |= (1u << bit);
+      }
+    }
+
+    len += snprintf(value + len,
+                    sizeof(value) - len,
+                    (g > 0) ? "%08x," : "%08x",
+                    bits);
+  }
+
+  return write_value(filename, value);
+}
+
+bool net::tx_queue_map::write_value(const char* filename, const char* value)
+{
+  FILE* file;
+  if ((file = fopen(filename, "w")) == nullptr) {
+    return false;
+  }
+
+  // The value is written (and checked by the kernel) when flushed.
+  bool ret = (fputs(value, file) >= 0);
+
+  return ((fclose(file) == 0) && (ret));
+}
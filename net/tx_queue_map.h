@@ -0,0 +1,110 @@
+#ifndef NET_TX_QUEUE_MAP_H
+#define NET_TX_QUEUE_MAP_H
+
+#include <stdlib.h>
+#include <sched.h>
+
+namespace net {
+  // Mapping of the workers to the hardware TX queues of the interfaces.
+  //
+  // The kernel picks the TX queue of the frames sent through a packet
+  // socket (PACKET_QDISC_BYPASS included) from the XPS map of the CPU which
+  // sends them, so the CPU of each worker is moved to the CPU mask of its
+  // queue (/sys/class/net/<interface>/queues/tx-<n>/xps_cpus): each worker
+  // sends through its own queue instead of contending on the lock of the
+  // queue of another one. The other CPUs keep their queues and the masks
+  // are restored when destroyed.
+  class tx_queue_map {
+    public:
+      // Saved CPU mask of a TX queue.
+      struct mask {
+        char filename[96];
+        char value[320];
+      };
+
+      // Constructor.
+      tx_queue_map();
+
+      // Destructor.
+      ~tx_queue_map();
+
+      // Map worker `i` (running on `cpus[i]`) to the TX queue `i` (modulo
+      // the number of TX queues) of the interface, a CPU shared by several
+      // workers goes with the first one (nothing to do with a single TX
+      // queue).
+      bool map(unsigned ifindex, const int* cpus, size_t ncpus);
+
+      // Restore the CPU masks.
+      void restore();
+
+      // Forget the CPU masks (they are not restored).
+      void forget();
+
+      // Number of saved CPU masks.
+      size_t count() const;
+
+      // Get saved CPU mask.
+      const struct mask& saved(size_t i) const;
+
+      // Adopt a CPU mask saved by the previous process (hot upgrade): it
+      // replaces the one saved from the same file, which the previous
+      // process had already rewritten.
+      bool adopt(const struct mask& m);
+
+      // Get the number of TX queues of the interface.
+      static size_t tx_queues(const char* ifname);
+
+    private:
+      struct mask* _M_masks;
+      size_t _M_nmasks;
+
+      // Read the CPU mask of a TX queue.
+      static bool read_mask(const char* filename,
+                            cpu_set_t& set,
+                            char* value,
+                            size_t size);
+
+      // Write the CPU mask of a TX queue.
+      static bool write_mask(const char* filename, const cpu_set_t& set);
+
+      // Write the value of a file.
+      static bool write_value(const char* filename, const char* value);
+
+      // Disable copy constructor and assignment operator.
+      tx_queue_map(const tx_queue_map&) = delete;
+      tx_queue_map& operator=(const tx_queue_map&) = delete;
+  };
+
+  inline tx_queue_map::tx_queue_map()
+    : _M_masks(nullptr),
+      _M_nmasks(0)
+  {
+  }
+
+  inline tx_queue_map::~tx_queue_map()
+  {
+    restore();
+  }
+
+  inline void tx_queue_map::forget()
+  {
+    if (_M_masks) {
+      free(_M_masks);
+      _M_masks = nullptr;
+    }
+
+    _M_nmasks = 0;
+  }
+
+  inline size_t tx_queue_map::count() const
+  {
+    return _M_nmasks;
+  }
+
+  inline const struct tx_queue_map::mask& tx_queue_map::saved(size_t i) const
+  {
+    return _M_masks[i];
+  }
+}
+
+#endif // NET_TX_QUEUE_MAP_H
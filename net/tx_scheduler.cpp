@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <string.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include "net/tx_scheduler.h"
+#include "net/numa.h"
+#include "macros/macros.h"
+
+net::tx_scheduler::~tx_scheduler()
+{
+  for (size_t i = 0; i < _M_nqueues; i++) {
+    free(_M_queues[i].slots);
+  }
+}
+
+bool net::tx_scheduler::create(const priority_class* classes,
+                               size_t nclasses,
+                               size_t nframes,
+                               const void* addr4,
+                               const void* addr6)
+{
+  // Sanity checks.
+  if ((_M_nqueues > 0) ||
+      (nclasses > max_classes) ||
+      (nframes < min_frames) ||
+      (nframes > max_frames)) {
+    return false;
+  }
+
+  for (size_t i = 0; i <= nclasses; i++) {
+    struct queue* q = _M_queues + i;
+
+    if (i < nclasses) {
+      q->definition = classes[i];
+    } else {
+      // Default class.
+      q->definition.clear();
+      q->definition.frames = nframes;
+    }
+
+    size_t n = q->definition.frames;
+    if ((n < min_frames) || (n > max_frames)) {
+      return false;
+    }
+
+    void* buf;
+    if (posix_memalign(&buf, CACHE_LINE_SIZE, n * sizeof(struct slot)) != 0) {
+      return false;
+    }
+
+    q->slots = reinterpret_cast<struct slot*>(buf);
+
+    // All the slots are free.
+    for (size_t j = 0; j < n; j++) {
+      q->slots[j].next = static_cast<uint32_t>(j + 1);
+    }
+
+    q->slots[n - 1].next = none;
+    q->free = 0;
+
+    // No active flows.
+    q->first = none;
+    q->last = none;
+
+    for (size_t j = 0; j < nflows; j++) {
+      q->flows[j].head = none;
+      q->flows[j].tail = none;
+      q->flows[j].next = none;
+      q->flows[j].deficit = 0;
+    }
+
+    q->frames = 0;
+    q->drops = 0;
+
+    _M_nqueues++;
+  }
+
+  memcpy(_M_addr4, addr4, sizeof(_M_addr4));
+  memcpy(_M_addr6, addr6, sizeof(_M_addr6));
+
+  return true;
+}
+
+bool net::tx_scheduler::enqueue(const void* frame, size_t len)
+{
+  uint32_t hash;
+  struct queue* q = _M_queues + classify(reinterpret_cast<const uint8_t*>(
+                                           frame
+                                         ),
+                                         len,
+                                         hash);
+
+  // If the frame is too long or the queue of the class is full...
+  if ((len > sizeof(q->slots->data)) || (q->free == none)) {
+    q->drops++;
+    return false;
+  }
+
+  // Take a free slot.
+  uint32_t idx = q->free;
+  struct slot* s = q->slots + idx;
+  q->free = s->next;
+
+  memcpy(s->data, frame, len);
+  s->len = static_cast<uint32_t>(len);
+  s->next = none;
+
+  // Append the frame to its flow (the high bits of the hash are the best
+  // mixed ones).
+  uint32_t f = hash >> (32 - flow_bits);
+  struct flow* fl = q->flows + f;
+
+  if (fl->head != none) {
+    q->slots[fl->tail].next = idx;
+    fl->tail = idx;
+  } else {
+    fl->head = idx;
+    fl->tail = idx;
+
+    // The flow becomes active, it gets its quantum at the end of the round.
+    fl->deficit = quantum;
+    fl->next = none;
+
+    if (q->last != none) {
+      q->flows[q->last].next = f;
+    } else {
+      q->first = f;
+    }
+
+    q->last = f;
+  }
+
+  _M_nframes++;
+
+  return true;
+}
+
+size_t net::tx_scheduler::dequeue(struct iovec* frames, size_t n)
+{
+  // The frames of the last dequeue() should have been released.
+  release();
+
+  n = MIN(n, max_batch);
+
+  // Strict priority between the classes.
+  size_t count = 0;
+  for (size_t i = 0; (i < _M_nqueues) && (count < n); i++) {
+    count += dequeue(i, frames + count, n - count);
+  }
+
+  return count;
+}
+
+size_t net::tx_scheduler::dequeue(size_t cls, struct iovec* frames, size_t n)
+{
+  struct queue* q = _M_queues + cls;
+
+  size_t count = 0;
+
+  // Deficit round robin between the active flows.
+  while ((count < n) && (q->first != none)) {
+    uint32_t f = q->first;
+    struct flow* fl = q->flows + f;
+
+    const struct slot* s = q->slots + fl->head;
+
+    if (s->len <= fl->deficit) {
+      // Send the first frame of the flow.
+      fl->deficit -= s->len;
+
+      frames[count].iov_base = const_cast<uint8_t*>(s->data);
+      frames[count].iov_len = s->len;
+
+      _M_dequeued[_M_ndequeued].cls = static_cast<uint32_t>(cls);
+      _M_dequeued[_M_ndequeued].slot = fl->head;
+      _M_ndequeued++;
+
+      count++;
+
+      // If the flow is empty, it is no longer active.
+      if ((fl->head = s->next) == none) {
+        fl->tail = none;
+
+        if ((q->first = fl->next) == none) {
+          q->last = none;
+        }
+      }
+    } else if (fl->next != none) {
+      // Move the flow to the end of the round with a new quantum.
+      fl->deficit += quantum;
+
+      q->first = fl->next;
+      q->flows[q->last].next = f;
+      q->last = f;
+      fl->next = none;
+    } else {
+      // Single active flow.
+      fl->deficit += quantum;
+    }
+  }
+
+  q->frames += count;
+  _M_nframes -= count;
+
+  return count;
+}
+
+void net::tx_scheduler::release()
+{
+  // Return the slots to the free lists of their classes.
+  for (size_t i = 0; i < _M_ndequeued; i++) {
+    struct queue* q = _M_queues + _M_dequeued[i].cls;
+    uint32_t idx = _M_dequeued[i].slot;
+
+    q->slots[idx].next = q->free;
+    q->free = idx;
+  }
+
+  _M_ndequeued = 0;
+}
+
+void net::tx_scheduler::show_statistics() const
+{
+  for (size_t i = 0; i < _M_nqueues; i++) {
+    if (i + 1 < _M_nqueues) {
+      printf("  Class %zu: ", i + 1);
+    } else {
+      printf("  Default class: ");
+    }
+
+    printf("%llu frames sent, %llu frames dropped (queue full).\n",
+           static_cast<unsigned long long>(_M_queues[i].frames),
+           static_cast<unsigned long long>(_M_queues[i].drops));
+  }
+}
+
+void net::tx_scheduler::memory(size_t* nodes) const
+{
+  numa::memory(this, sizeof(tx_scheduler), nodes);
+
+  for (size_t i = 0; i < _M_nqueues; i++) {
+    numa::memory(_M_queues[i].slots,
+                 _M_queues[i].definition.frames * sizeof(struct slot),
+                 nodes);
+  }
+}
+
+size_t net::tx_scheduler::classify(const uint8_t* frame,
+                                   size_t len,
+                                   uint32_t& hash)
+{
+  hash = 0;
+
+  if (len < sizeof(struct ether_header)) {
+    return _M_nqueues - 1;
+  }
+
+  size_t off = sizeof(struct ether_header);
+  uint16_t type = (static_cast<uint16_t>(frame[12]) << 8) | frame[13];
+
+  // VLAN tag (mirror ports).
+  if ((type == ETHERTYPE_VLAN) && (len >= off + 4)) {
+    type = (static_cast<uint16_t>(frame[16]) << 8) | frame[17];
+    off += 4;
+  }
+
+  const uint8_t* ip = frame + off;
+  len -= off;
+
+  if ((type == ETHERTYPE_IP) && (len >= sizeof(struct iphdr))) {
+    const struct iphdr* iphdr = reinterpret_cast<const struct iphdr*>(ip);
+
+    unsigned dscp = iphdr->tos >> 2;
+    size_t iphdrlen = iphdr->ihl << 2;
+
+    // The fragments of a datagram are in the same flow.
+    hash = (iphdr->saddr ^ iphdr->daddr) * 0x9e3779b1;
+
+    uint16_t frag_off = ntohs(iphdr->frag_off);
+
+    // If not the first fragment...
+    if ((frag_off & IP_OFFMASK) != 0) {
+      // Class of the first fragment (if seen).
+      const struct fragment* fragment =
+                             _M_fragments + ((iphdr->saddr ^ iphdr->id) &
+                                             (nfragments - 1));
+
+      if ((fragment->cls != 0) &&
+          (fragment->saddr == iphdr->saddr) &&
+          (fragment->daddr == iphdr->daddr) &&
+          (fragment->id == iphdr->id)) {
+        return fragment->cls - 1;
+      }
+
+      return classify(-1, dscp);
+    }
+
+    int port = -1;
+    if ((iphdr->protocol == IPPROTO_UDP) &&
+        (iphdrlen >= sizeof(struct iphdr)) &&
+        (len >= iphdrlen + sizeof(struct udphdr))) {
+      const struct udphdr* udphdr = reinterpret_cast<const struct udphdr*>(
+                                      ip + iphdrlen
+                                    );
+
+      port = ntohs((memcmp(&iphdr->saddr, _M_addr4, sizeof(_M_addr4)) == 0) ?
+                     udphdr->source :
+                     udphdr->dest);
+
+      // Unfragmented datagram: the ports are part of the flow.
+      if ((frag_off & IP_MF) == 0) {
+        hash ^= ((static_cast<uint32_t>(udphdr->source) << 16) |
+                 udphdr->dest) * 0x9e3779b1;
+      }
+    }
+
+    size_t cls = classify(port, dscp);
+
+    // If first fragment, remember its class for the next ones.
+    if ((frag_off & IP_MF) != 0) {
+      struct fragment* fragment = _M_fragments + ((iphdr->saddr ^ iphdr->id) &
+                                                  (nfragments - 1));
+
+      fragment->saddr = iphdr->saddr;
+      fragment->daddr = iphdr->daddr;
+      fragment->id = iphdr->id;
+      fragment->cls = static_cast<uint16_t>(cls + 1);
+    }
+
+    return cls;
+  } else if ((type == ETHERTYPE_IPV6) && (len >= sizeof(struct ip6_hdr))) {
+    const struct ip6_hdr* ip6hdr = reinterpret_cast<const struct ip6_hdr*>(ip);
+
+    // Traffic class: bits 20 .. 27 of the first word.
+    unsigned dscp = (ntohl(ip6hdr->ip6_flow) >> 22) & 0x3f;
+
+    const uint32_t* saddr = reinterpret_cast<const uint32_t*>(
+                              &ip6hdr->ip6_src
+                            );
+
+    const uint32_t* daddr = reinterpret_cast<const uint32_t*>(
+                              &ip6hdr->ip6_dst
+                            );
+
+    hash = (saddr[0] ^ saddr[1] ^ saddr[2] ^ saddr[3] ^
+            daddr[0] ^ daddr[1] ^ daddr[2] ^ daddr[3]) * 0x9e3779b1;
+
+    int port = -1;
+    if ((ip6hdr->ip6_nxt == IPPROTO_UDP) &&
+        (len >= sizeof(struct ip6_hdr) + sizeof(struct udphdr))) {
+      const struct udphdr* udphdr = reinterpret_cast<const struct udphdr*>(
+                                      ip + sizeof(struct ip6_hdr)
+                                    );
+
+      port = ntohs((memcmp(&ip6hdr->ip6_src,
+                           _M_addr6,
+                           sizeof(_M_addr6)) == 0) ?
+                     udphdr->source :
+                     udphdr->dest);
+
+      hash ^= ((static_cast<uint32_t>(udphdr->source) << 16) |
+               udphdr->dest) * 0x9e3779b1;
+    }
+
+    return classify(port, dscp);
+  }
+
+  return _M_nqueues - 1;
+}
+
+size_t net::tx_scheduler::classify(int port, unsigned dscp) const
+{
+  // First class which matches the ingress port or the DSCP.
+  for (size_t i = 0; i + 1 < _M_nqueues; i++) {
+    const priority_class& c = _M_queues[i].definition;
+
+    if ((c.match_dscp(dscp)) ||
+        ((port >= 0) && (c.match_port(static_cast<in_port_t>(port))))) {
+      return i;
+    }
+  }
+
+  // Default class.
+  return _M_nqueues - 1;
+}
@@ -0,0 +1,288 @@
+#ifndef NET_TX_SCHEDULER_H
+#define NET_TX_SCHEDULER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "net/spsc_queue.h"
+
+namespace net {
+  // Scheduler of the frames sent through the TX ring buffer of an interface
+  // (TX thread): the frames are classified into priority classes by ingress
+  // port (destination port of the received packet) or DSCP, the classes are
+  // served by strict priority and the flows of a class by deficit round
+  // robin, so a flood in a class or a flow doesn't starve the others. Each
+  // class has a bounded queue of preallocated slots (no allocation per
+  // frame), the frames which don't fit are dropped.
+  class tx_scheduler {
+    public:
+      // Maximum number of priority classes (the default class not
+      // included).
+      static const size_t max_classes = 8;
+
+      // Maximum number of port ranges per priority class.
+      static const size_t max_port_ranges = 32;
+
+      // Maximum number of frames sent per call to dequeue().
+      static const size_t max_batch = 64;
+
+      // Number of frames per priority class.
+      static const size_t min_frames = 64;
+      static const size_t max_frames = 64 * 1024;
+      static const size_t default_frames = 1024;
+
+      // Priority class.
+      class priority_class {
+        public:
+          // Clear (no ports, no DSCPs, default number of frames).
+          void clear();
+
+          // Add ingress port.
+          bool port(unsigned port);
+
+          // Add ingress port range.
+          bool port_range(unsigned from, unsigned to);
+
+          // Add DSCP.
+          bool dscp(unsigned dscp);
+
+          // Add DSCP range.
+          bool dscp_range(unsigned from, unsigned to);
+
+          // Does the class match the ingress port?
+          bool match_port(in_port_t port) const;
+
+          // Does the class match the DSCP?
+          bool match_dscp(unsigned dscp) const;
+
+          // Number of frames of the queue of the class.
+          size_t frames;
+
+        private:
+          struct {
+            in_port_t from;
+            in_port_t to;
+          } _M_ports[max_port_ranges];
+
+          size_t _M_nports;
+
+          // DSCPs (bit `n` set: DSCP `n`).
+          uint64_t _M_dscps;
+      };
+
+      // Constructor.
+      tx_scheduler();
+
+      // Destructor.
+      ~tx_scheduler();
+
+      // Create (`classes` in decreasing order of priority, the frames which
+      // match none go to a default class of `nframes` frames with the lowest
+      // priority). `addr4` and `addr6` are the addresses of the interface:
+      // the ingress port of the frames sent from them is their source port
+      // (rewritten frames), the one of the other frames is their
+      // destination port (direct server return, mirror ports).
+      bool create(const priority_class* classes,
+                  size_t nclasses,
+                  size_t nframes,
+                  const void* addr4,
+                  const void* addr6);
+
+      // Enqueue frame (copied), returns false if it has been dropped.
+      bool enqueue(const void* frame, size_t len);
+
+      // Dequeue up to `n` frames (up to `max_batch`) in scheduled order,
+      // they are valid until release().
+      size_t dequeue(struct iovec* frames, size_t n);
+
+      // Release the frames of the last dequeue().
+      void release();
+
+      // Is the scheduler empty?
+      bool empty() const;
+
+      // Show statistics.
+      void show_statistics() const;
+
+      // Add the memory of the scheduler to its NUMA node.
+      void memory(size_t* nodes) const;
+
+    private:
+      // Number of flows per class (hash buckets).
+      static const unsigned flow_bits = 8;
+      static const size_t nflows = 1 << flow_bits;
+
+      // Quantum of the deficit round robin (bytes, not smaller than the
+      // longest frame, so each flow sends at least one frame per round).
+      static const uint32_t quantum = spsc_queue::max_frame_length;
+
+      // Number of IPv4 datagrams whose class is remembered for their next
+      // fragments (power of 2).
+      static const size_t nfragments = 256;
+
+      // No slot / no flow.
+      static const uint32_t none = UINT32_MAX;
+
+      // Slot (it holds any frame of the queues of the workers).
+      struct slot {
+        uint32_t next;
+        uint32_t len;
+        uint8_t data[spsc_queue::max_frame_length];
+      };
+
+      struct flow {
+        // Frames of the flow (first and last slot).
+        uint32_t head;
+        uint32_t tail;
+
+        // Next active flow.
+        uint32_t next;
+
+        // Bytes the flow can still send in this round.
+        uint32_t deficit;
+      };
+
+      struct queue {
+        priority_class definition;
+
+        struct slot* slots;
+
+        // Free slots.
+        uint32_t free;
+
+        // Active flows (round robin).
+        uint32_t first;
+        uint32_t last;
+
+        struct flow flows[nflows];
+
+        // Statistics.
+        uint64_t frames;
+        uint64_t drops;
+      };
+
+      // Class of the fragments of an IPv4 datagram.
+      struct fragment {
+        uint32_t saddr;
+        uint32_t daddr;
+        uint16_t id;
+
+        // Class + 1 (0: none).
+        uint16_t cls;
+      };
+
+      struct queue _M_queues[max_classes + 1];
+      size_t _M_nqueues;
+
+      // Addresses of the interface.
+      uint8_t _M_addr4[sizeof(struct in_addr)];
+      uint8_t _M_addr6[sizeof(struct in6_addr)];
+
+      struct fragment _M_fragments[nfragments];
+
+      // Frames of the last dequeue() (class and slot).
+      struct {
+        uint32_t cls;
+        uint32_t slot;
+      } _M_dequeued[max_batch];
+
+      size_t _M_ndequeued;
+
+      // Number of frames queued.
+      size_t _M_nframes;
+
+      // Classify frame, sets the hash of its flow.
+      size_t classify(const uint8_t* frame, size_t len, uint32_t& hash);
+
+      // Class of the ingress port and the DSCP.
+      size_t classify(int port, unsigned dscp) const;
+
+      // Dequeue up to `n` frames of a class.
+      size_t dequeue(size_t cls, struct iovec* frames, size_t n);
+
+      // Disable copy constructor and assignment operator.
+      tx_scheduler(const tx_scheduler&) = delete;
+      tx_scheduler& operator=(const tx_scheduler&) = delete;
+  };
+
+  inline void tx_scheduler::priority_class::clear()
+  {
+    frames = default_frames;
+    _M_nports = 0;
+    _M_dscps = 0;
+  }
+
+  inline bool tx_scheduler::priority_class::port(unsigned port)
+  {
+    return port_range(port, port);
+  }
+
+  inline bool tx_scheduler::priority_class::port_range(unsigned from,
+                                                       unsigned to)
+  {
+    if ((from <= to) && (to <= 65535) && (_M_nports < max_port_ranges)) {
+      _M_ports[_M_nports].from = static_cast<in_port_t>(from);
+      _M_ports[_M_nports].to = static_cast<in_port_t>(to);
+
+      _M_nports++;
+
+      return true;
+    }
+
+    return false;
+  }
+
+  inline bool tx_scheduler::priority_class::dscp(unsigned dscp)
+  {
+    return dscp_range(dscp, dscp);
+  }
+
+  inline bool tx_scheduler::priority_class::dscp_range(unsigned from,
+                                                       unsigned to)
+  {
+    if ((from <= to) && (to < 64)) {
+      for (unsigned dscp = from; dscp <= to; dscp++) {
+        _M_dscps |= (1ULL << dscp);
+      }
+
+      return true;
+    }
+
+    return false;
+  }
+
+  inline bool tx_scheduler::priority_class::match_port(in_port_t port) const
+  {
+    for (size_t i = 0; i < _M_nports; i++) {
+      if ((port >= _M_ports[i].from) && (port <= _M_ports[i].to)) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  inline bool tx_scheduler::priority_class::match_dscp(unsigned dscp) const
+  {
+    return ((_M_dscps & (1ULL << dscp)) != 0);
+  }
+
+  inline tx_scheduler::tx_scheduler()
+    : _M_nqueues(0),
+      _M_ndequeued(0),
+      _M_nframes(0)
+  {
+    memset(_M_addr4, 0, sizeof(_M_addr4));
+    memset(_M_addr6, 0, sizeof(_M_addr6));
+    memset(_M_fragments, 0, sizeof(_M_fragments));
+  }
+
+  inline bool tx_scheduler::empty() const
+  {
+    return (_M_nframes == 0);
+  }
+}
+
+#endif // NET_TX_SCHEDULER_H
@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <new>
+#include "net/tx_thread.h"
+
+// Get the MTU of the interface.
+static bool interface_mtu(unsigned ifindex, size_t& mtu);
+
+net::tx_thread::~tx_thread()
+{
+  stop();
+
+  if (_M_queues) {
+    for (size_t i = 0; i < _M_nqueues; i++) {
+      _M_queues[i]->~spsc_queue();
+      free(_M_queues[i]);
+    }
+
+    free(_M_queues);
+  }
+
+  if (_M_scheduler) {
+    _M_scheduler->~tx_scheduler();
+    free(_M_scheduler);
+  }
+}
+
+bool net::tx_thread::create(size_t ring_size,
+                            unsigned ifindex,
+                            size_t queue_size)
+{
+  // Sanity checks.
+  if ((ring_size >= ring_buffer::min_size) &&
+      (ring_size <= ring_buffer::max_size) &&
+      (ifindex > 0) &&
+      (queue_size >= spsc_queue::min_frames) &&
+      (queue_size <= spsc_queue::max_frames) &&
+      (IS_POWER_2(queue_size))) {
+    // The frames are copied into the slots of the queues.
+    size_t mtu;
+    if (!interface_mtu(ifindex, mtu)) {
+      return false;
+    }
+
+    if (mtu > spsc_queue::max_mtu) {
+      char name[IF_NAMESIZE];
+      if (!if_indextoname(ifindex, name)) {
+        snprintf(name, sizeof(name), "%u", ifindex);
+      }
+
+      fprintf(stderr,
+              "The MTU of the interface '%s' (%zu) is too high for the TX "
+              "threads (maximum: %zu).\n",
+              name,
+              mtu,
+              spsc_queue::max_mtu);
+
+      return false;
+    }
+
+    _M_ring_size = ring_size;
+    _M_ifindex = ifindex;
+    _M_queue_size = queue_size;
+
+    return true;
+  }
+
+  return false;
+}
+
+net::spsc_queue* net::tx_thread::add_queue()
+{
+  spsc_queue** queues = reinterpret_cast<spsc_queue**>(
+                          realloc(_M_queues,
+                                  (_M_nqueues + 1) * sizeof(spsc_queue*))
+                        );
+
+  if (!queues) {
+    return nullptr;
+  }
+
+  _M_queues = queues;
+
+  // Allocate queue (cache aligned, the producer and the consumer use
+  // different cache lines).
+  void* buf;
+  if (posix_memalign(&buf, CACHE_LINE_SIZE, sizeof(spsc_queue)) != 0) {
+    return nullptr;
+  }
+
+  spsc_queue* queue = new (buf) spsc_queue();
+
+  if (!queue->create(_M_queue_size)) {
+    queue->~spsc_queue();
+    free(queue);
+
+    return nullptr;
+  }
+
+  _M_queues[_M_nqueues++] = queue;
+
+  return queue;
+}
+
+bool net::tx_thread::schedule(const tx_scheduler::priority_class* classes,
+                              size_t nclasses,
+                              size_t nframes,
+                              const void* addr4,
+                              const void* addr6)
+{
+  if (_M_scheduler) {
+    return false;
+  }
+
+  void* buf;
+  if (posix_memalign(&buf, CACHE_LINE_SIZE, sizeof(tx_scheduler)) != 0) {
+    return false;
+  }
+
+  _M_scheduler = new (buf) tx_scheduler();
+
+  if (_M_scheduler->create(classes, nclasses, nframes, addr4, addr6)) {
+    return true;
+  }
+
+  _M_scheduler->~tx_scheduler();
+  free(_M_scheduler);
+
+  _M_scheduler = nullptr;
+
+  return false;
+}
+
+bool net::tx_thread::start()
+{
+  // Create the TX ring buffer (it is kept when the thread is restarted).
+  if ((_M_tx.fd() == -1) &&
+      (!_M_tx.create(TPACKET_V2,
+                     ring_buffer::type::tx,
+                     _M_ring_size,
+                     _M_ifindex,
+                     nullptr,
+                     0,
+                     0,
+                     0))) {
+    _M_tx.clear();
+    return false;
+  }
+
+  _M_running = true;
+
+  if (pthread_create(&_M_thread, nullptr, run, this) == 0) {
+    return true;
+  }
+
+  _M_running = false;
+
+  return false;
+}
+
+void net::tx_thread::stop()
+{
+  if (_M_running) {
+    _M_running = false;
+    pthread_join(_M_thread, nullptr);
+  }
+}
+
+void net::tx_thread::show_statistics() const
+{
+  uint64_t drops = 0;
+  for (size_t i = 0; i < _M_nqueues; i++) {
+    drops += _M_queues[i]->drops();
+  }
+
+  printf("%llu frames sent in %llu batches.\n",
+         static_cast<unsigned long long>(_M_frames),
+         static_cast<unsigned long long>(_M_batches));
+
+  printf("%llu batches not completely sent (TX ring buffer full), "
+         "%llu frames lost.\n",
+         static_cast<unsigned long long>(_M_errors),
+         static_cast<unsigned long long>(_M_lost));
+
+  printf("%llu frames dropped (queues full).\n",
+         static_cast<unsigned long long>(drops));
+
+  if (_M_scheduler) {
+    printf("TX scheduler:\n");
+    _M_scheduler->show_statistics();
+  }
+}
+
+void net::tx_thread::memory(size_t* nodes) const
+{
+  _M_tx.memory(nodes);
+
+  for (size_t i = 0; i < _M_nqueues; i++) {
+    _M_queues[i]->memory(nodes);
+  }
+
+  if (_M_scheduler) {
+    _M_scheduler->memory(nodes);
+  }
+}
+
+size_t net::tx_thread::show_ring_buffer() const
+{
+  char name[IF_NAMESIZE];
+  if (!if_indextoname(_M_ifindex, name)) {
+    snprintf(name, sizeof(name), "%u", _M_ifindex);
+  }
+
+  size_t size = _M_tx.size();
+
+  printf("  TX ring buffer (%s): %zu KB.\n", name, size / 1024);
+
+  return size;
+}
+
+void net::tx_thread::run()
+{
+  if (_M_scheduler) {
+    run_scheduled();
+    return;
+  }
+
+  struct iovec frames[batch_size];
+  unsigned idle = 0;
+
+  do {
+    bool sent = false;
+
+    // Service the queues of the workers in turn, sending up to
+    // `batch_size` frames from each one with a single kick.
+    for (size_t i = 0; i < _M_nqueues; i++) {
+      spsc_queue* queue = _M_queues[i];
+
+      size_t n;
+      if ((n = queue->peek(frames, batch_size)) > 0) {
+        if (_M_tx.sendmmsg(frames, n, send_timeout)) {
+          _M_frames += n;
+        } else {
+          _M_errors++;
+          _M_lost += n;
+        }
+
+        _M_batches++;
+
+        queue->pop(n);
+
+        sent = true;
+      }
+    }
+
+    if (sent) {
+      idle = 0;
+    } else if (!_M_running) {
+      // The queues have been drained.
+      return;
+    } else if (++idle < max_idle_rounds) {
+      sched_yield();
+    } else {
+      usleep(idle_sleep);
+    }
+  } while (true);
+}
+
+void net::tx_thread::run_scheduled()
+{
+  struct iovec frames[batch_size];
+  unsigned idle = 0;
+
+  do {
+    bool busy = false;
+
+    // Move the frames queued by the workers to the scheduler (up to a
+    // queue length per worker, so the queues of the classes are the ones
+    // which overflow).
+    for (size_t i = 0; i < _M_nqueues; i++) {
+      spsc_queue* queue = _M_queues[i];
+
+      size_t n;
+      for (size_t k = 0;
+           (k < _M_queue_size) &&
+           ((n = queue->peek(frames, batch_size)) > 0);
+           k += n) {
+        for (size_t j = 0; j < n; j++) {
+          _M_scheduler->enqueue(frames[j].iov_base, frames[j].iov_len);
+        }
+
+        queue->pop(n);
+
+        busy = true;
+      }
+    }
+
+    // Send as many frames as fit in the TX ring buffer without waiting
+    // (the other ones stay in the scheduler, where the next frames of
+    // higher priority can overtake them). When stopping, the scheduler is
+    // drained.
+    size_t n = _M_running ? _M_tx.writable(batch_size) : batch_size;
+
+    if ((n = _M_scheduler->dequeue(frames, n)) > 0) {
+      if (_M_tx.sendmmsg(frames, n, send_timeout)) {
+        _M_frames += n;
+      } else {
+        _M_errors++;
+        _M_lost += n;
+      }
+
+      _M_batches++;
+
+      _M_scheduler->release();
+
+      busy = true;
+    }
+
+    if (busy) {
+      idle = 0;
+    } else if (!_M_running) {
+      // The queues and the scheduler have been drained.
+      return;
+    } else if (++idle < max_idle_rounds) {
+      sched_yield();
+    } else {
+      usleep(idle_sleep);
+    }
+  } while (true);
+}
+
+bool interface_mtu(unsigned ifindex, size_t& mtu)
+{
+  struct ifreq ifr;
+  if (if_indextoname(ifindex, ifr.ifr_name)) {
+    int fd;
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) != -1) {
+      if (ioctl(fd, SIOCGIFMTU, &ifr) == 0) {
+        close(fd);
+
+        mtu = static_cast<size_t>(ifr.ifr_mtu);
+        return true;
+      }
+
+      close(fd);
+    }
+  }
+
+  return false;
+}
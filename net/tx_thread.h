@@ -0,0 +1,136 @@
+#ifndef NET_TX_THREAD_H
+#define NET_TX_THREAD_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "net/ring_buffer.h"
+#include "net/spsc_queue.h"
+#include "net/tx_scheduler.h"
+#include "macros/macros.h"
+
+namespace net {
+  // Thread which sends the frames queued by the workers through the TX ring
+  // buffer of an interface (one TX ring buffer per interface instead of one
+  // per worker and interface).
+  class alignas(CACHE_LINE_SIZE) tx_thread {
+    public:
+      // Maximum number of frames sent with a single kick of the ring buffer.
+      static const size_t batch_size = 64;
+
+      // Constructor.
+      tx_thread();
+
+      // Destructor.
+      ~tx_thread();
+
+      // Create (the TX ring buffer is created when the thread is started),
+      // fails if the MTU of the interface is higher than
+      // spsc_queue::max_mtu.
+      bool create(size_t ring_size, unsigned ifindex, size_t queue_size);
+
+      // Add queue (one per worker with destinations on the interface).
+      spsc_queue* add_queue();
+
+      // Send the frames in the order of a TX scheduler (see tx_scheduler)
+      // instead of in the order of the queues.
+      bool schedule(const tx_scheduler::priority_class* classes,
+                    size_t nclasses,
+                    size_t nframes,
+                    const void* addr4,
+                    const void* addr6);
+
+      // Start.
+      bool start();
+
+      // Stop (after the workers, the queues are drained first).
+      void stop();
+
+      // Get interface index.
+      unsigned ifindex() const;
+
+      // Show statistics.
+      void show_statistics() const;
+
+      // Add the memory of the TX thread to its NUMA node.
+      void memory(size_t* nodes) const;
+
+      // Show the locked memory of the ring buffer, returns it.
+      size_t show_ring_buffer() const;
+
+    private:
+      static const int send_timeout = 100; // Milliseconds.
+
+      // Number of rounds without frames before sleeping.
+      static const unsigned max_idle_rounds = 64;
+
+      // Time to sleep when there are no frames (microseconds).
+      static const unsigned idle_sleep = 50;
+
+      ring_buffer _M_tx;
+
+      // Parameters of the TX ring buffer.
+      size_t _M_ring_size;
+      unsigned _M_ifindex;
+
+      // Queues of the workers.
+      spsc_queue** _M_queues;
+      size_t _M_nqueues;
+
+      // Number of frames per queue.
+      size_t _M_queue_size;
+
+      // TX scheduler (null: the frames are sent in the order of the
+      // queues).
+      tx_scheduler* _M_scheduler;
+
+      // Statistics.
+      uint64_t _M_frames;
+      uint64_t _M_batches;
+      uint64_t _M_errors;
+      uint64_t _M_lost;
+
+      pthread_t _M_thread;
+
+      bool _M_running;
+
+      // Run.
+      static void* run(void* arg);
+      void run();
+
+      // Run with the TX scheduler.
+      void run_scheduled();
+
+      // Disable copy constructor and assignment operator.
+      tx_thread(const tx_thread&) = delete;
+      tx_thread& operator=(const tx_thread&) = delete;
+  };
+
+  inline tx_thread::tx_thread()
+    : _M_ring_size(0),
+      _M_ifindex(0),
+      _M_queues(nullptr),
+      _M_nqueues(0),
+      _M_queue_size(0),
+      _M_scheduler(nullptr),
+      _M_frames(0),
+      _M_batches(0),
+      _M_errors(0),
+      _M_lost(0),
+      _M_running(false)
+  {
+  }
+
+  inline unsigned tx_thread::ifindex() const
+  {
+    return _M_ifindex;
+  }
+
+  inline void* tx_thread::run(void* arg)
+  {
+    reinterpret_cast<tx_thread*>(arg)->run();
+    return nullptr;
+  }
+}
+
+#endif // NET_TX_THREAD_H
@@ -1,7 +1,13 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <net/if.h>
+#include <new>
 #include "net/udp_distributor.h"
+#include "net/numa.h"
+#include "net/handover.h"
 
 bool net::udp_distributor::create(type t,
                                   size_t ring_size,
@@ -16,12 +22,41 @@ bool net::udp_distributor::create(type t,
       (ifindex > 0) &&
       (nworkers >= min_workers) &&
       (nworkers <= max_workers)) {
+    // Fanout identifier (from the PID on, the ones of other processes are
+    // skipped).
     uint16_t fanout_id = static_cast<uint16_t>(getpid() & 0xffff);
+    if (!free_fanout_id(fanout_id)) {
+      return false;
+    }
+
+    if ((_M_workers = reinterpret_cast<worker**>(
+                        calloc(nworkers, sizeof(worker*))
+                      )) == nullptr) {
+      return false;
+    }
 
     // For each worker...
     for (size_t i = 0; i < nworkers; i++) {
+      int cpu = (_M_ncpus > 0) ? _M_cpus[i % _M_ncpus] : -1;
+
+      // Allocate worker (cache aligned, on the NUMA node of its CPU).
+      void* buf;
+
+      {
+        numa::scoped_node node((cpu >= 0) ? cpu_affinity::node(cpu) : -1);
+
+        if (posix_memalign(&buf, CACHE_LINE_SIZE, sizeof(worker)) != 0) {
+          return false;
+        }
+      }
+
+      _M_workers[i] = new (buf) worker();
+      _M_nworkers = i + 1;
+
+      _M_workers[i]->affinity(cpu);
+
       // Create worker.
-      if (!_M_workers[i].create(t,
+      if (!_M_workers[i]->create(t,
                                 TPACKET_V3,
                                 ring_size,
                                 ifindex,
@@ -31,11 +66,112 @@ bool net::udp_distributor::create(type t,
                                 fanout_id)) {
         return false;
       }
+
+      // The worker joins the fanout groups in its turn, so its index in
+      // the fanout groups is its index.
+      _M_workers[i]->fanout_turn(i, &_M_fanout_turn);
     }
 
     _M_type = t;
 
-    _M_nworkers = nworkers;
+    _M_nactive = nworkers;
+
+    _M_ifindex = ifindex;
+
+    _M_fanout = fanout;
+    _M_fanout_id = fanout_id;
+    _M_class_fanout_id = fanout_id;
+
+    return true;
+  }
+
+  return false;
+}
+
+bool net::udp_distributor::helpers(size_t nhelpers)
+{
+  // Sanity checks.
+  if ((_M_nworkers > 0) &&
+      (_M_type == type::broadcaster) &&
+      (nhelpers > 0) &&
+      (nhelpers <= worker::max_helpers) &&
+      (!_M_helpers) &&
+      (_M_ndests == 0)) {
+    if ((_M_helpers = reinterpret_cast<worker**>(
+                        calloc(_M_nworkers * nhelpers, sizeof(worker*))
+                      )) == nullptr) {
+      return false;
+    }
+
+    _M_nhelpers = nhelpers;
+
+    // For each worker...
+    for (size_t i = 0; i < _M_nworkers; i++) {
+      int cpu = (_M_ncpus > 0) ? _M_cpus[i % _M_ncpus] : -1;
+
+      // For each helper of the worker...
+      for (size_t k = 0; k < nhelpers; k++) {
+        // Allocate helper (cache aligned, on the NUMA node of the CPU of
+        // its worker, the helper itself is not pinned).
+        void* buf;
+
+        {
+          numa::scoped_node node((cpu >= 0) ? cpu_affinity::node(cpu) : -1);
+
+          if (posix_memalign(&buf, CACHE_LINE_SIZE, sizeof(worker)) != 0) {
+            return false;
+          }
+        }
+
+        worker* w = new (buf) worker();
+        _M_helpers[(i * nhelpers) + k] = w;
+
+        if (!w->create_helper(_M_workers[i])) {
+          return false;
+        }
+      }
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
+bool net::udp_distributor::add_class(size_t ring_size,
+                                     const struct sock_fprog* fprog,
+                                     size_t weight)
+{
+  // Sanity checks.
+  if ((ring_size >= ring_buffer::min_size) &&
+      (ring_size <= ring_buffer::max_size) &&
+      (_M_nworkers > 0) &&
+      (_M_nclasses < max_classes)) {
+    // Each traffic class has its own fanout group (the identifiers follow
+    // the one of the default class).
+    uint16_t fanout_id = static_cast<uint16_t>(_M_class_fanout_id + 1);
+    if (!free_fanout_id(fanout_id)) {
+      return false;
+    }
+
+    // For each worker...
+    for (size_t i = 0; i < _M_nworkers; i++) {
+      // Add traffic class.
+      if (!_M_workers[i]->add_class(TPACKET_V3,
+                                   ring_size,
+                                   _M_ifindex,
+                                   fprog,
+                                   _M_fanout,
+                                   _M_nworkers,
+                                   fanout_id,
+                                   weight)) {
+        return false;
+      }
+    }
+
+    _M_class_fanout_id = fanout_id;
+
+    _M_nclasses++;
 
     return true;
   }
@@ -53,18 +189,167 @@ bool net::udp_distributor::add_interface(size_t ring_size,
   if ((ring_size >= ring_buffer::min_size) &&
       (ring_size <= ring_buffer::max_size) &&
       (ifindex > 0)) {
-    // For each worker...
-    for (size_t i = 0; i < _M_nworkers; i++) {
-      // Add interface.
-      if (!_M_workers[i].add_interface(TPACKET_V2,
-                                       ring_size,
-                                       ifindex,
-                                       macaddr,
-                                       addr4,
-                                       addr6)) {
+    // Search interface.
+    for (size_t i = 0; i < _M_ninterfaces; i++) {
+      if (ifindex == _M_interfaces[i].ifindex) {
+        // Already added.
+        return true;
+      }
+    }
+
+    struct interface* interfaces = reinterpret_cast<struct interface*>(
+                                     realloc(_M_interfaces,
+                                             (_M_ninterfaces + 1) *
+                                             sizeof(struct interface))
+                                   );
+
+    if (interfaces) {
+      _M_interfaces = interfaces;
+
+      struct interface* iface = _M_interfaces + _M_ninterfaces++;
+
+      iface->ring_size = ring_size;
+      iface->ifindex = ifindex;
+
+      iface->tx = nullptr;
+      iface->shared = nullptr;
+
+      memcpy(iface->macaddr, macaddr, ETHER_ADDR_LEN);
+      memcpy(iface->addr4, addr4, sizeof(struct in_addr));
+      memcpy(iface->addr6, addr6, sizeof(struct in6_addr));
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool net::udp_distributor::fragments(fragment_mode mode,
+                                     size_t ndatagrams,
+                                     unsigned timeout)
+{
+  // For each worker...
+  for (size_t i = 0; i < _M_nworkers; i++) {
+    // Set up handling of IPv4 fragments.
+    if (!_M_workers[i]->fragments(mode, ndatagrams, timeout)) {
+      return false;
+    }
+
+    // The helpers send the fragments of the blocks of their worker.
+    for (size_t k = 0; k < _M_nhelpers; k++) {
+      if (!helper(i, k)->fragments(mode, ndatagrams, timeout)) {
         return false;
       }
     }
+  }
+
+  return true;
+}
+
+bool net::udp_distributor::work_stealing(bool flow_affinity)
+{
+  // The batches are processed by the workers, not by their helpers.
+  if (_M_nhelpers > 0) {
+    return false;
+  }
+
+  // For each worker...
+  for (size_t i = 0; i < _M_nworkers; i++) {
+    if (!_M_workers[i]->work_stealing(_M_workers,
+                                      _M_nworkers,
+                                      flow_affinity)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool net::udp_distributor::tx_queues()
+{
+  // Sanity checks.
+  if ((_M_nworkers == 0) ||
+      (_M_ncpus == 0) ||
+      (_M_ninterfaces == 0) ||
+      (_M_queue_size > 0) ||
+      (_M_shared_tx)) {
+    return false;
+  }
+
+  // CPU of each worker.
+  int cpus[max_workers];
+  for (size_t i = 0; i < _M_nworkers; i++) {
+    cpus[i] = _M_cpus[i % _M_ncpus];
+  }
+
+  for (size_t i = 0; i < _M_ninterfaces; i++) {
+    if (!_M_tx_queue_map.map(_M_interfaces[i].ifindex, cpus, _M_nworkers)) {
+      _M_tx_queue_map.restore();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool net::udp_distributor::tx_classes(
+                             const tx_scheduler::priority_class* classes,
+                             size_t nclasses,
+                             size_t nframes
+                           )
+{
+  // Sanity checks.
+  if ((nclasses == 0) ||
+      (nclasses > tx_scheduler::max_classes) ||
+      (nframes < tx_scheduler::min_frames) ||
+      (nframes > tx_scheduler::max_frames) ||
+      (_M_queue_size == 0) ||
+      (_M_ndests > 0) ||
+      (_M_nmirrors > 0)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < nclasses; i++) {
+    if ((classes[i].frames < tx_scheduler::min_frames) ||
+        (classes[i].frames > tx_scheduler::max_frames)) {
+      return false;
+    }
+
+    _M_tx_classes[i] = classes[i];
+  }
+
+  _M_ntx_classes = nclasses;
+  _M_tx_frames = nframes;
+
+  return true;
+}
+
+bool net::udp_distributor::elastic(size_t min_active,
+                                   unsigned scale_up,
+                                   unsigned scale_down,
+                                   bool release_memory)
+{
+  // Sanity checks.
+  if ((_M_type == type::broadcaster) &&
+      (min_active >= min_workers) &&
+      (min_active <= _M_nworkers) &&
+      (scale_down < scale_up) &&
+      (scale_up <= 100) &&
+      (!_M_cpu_times)) {
+    if ((_M_cpu_times = reinterpret_cast<uint64_t*>(
+                          calloc(_M_nworkers, sizeof(uint64_t))
+                        )) == nullptr) {
+      return false;
+    }
+
+    _M_min_active = min_active;
+    _M_nactive = min_active;
+
+    _M_scale_up = scale_up;
+    _M_scale_down = scale_down;
+
+    _M_release_memory = release_memory;
 
     return true;
   }
@@ -72,10 +357,99 @@ bool net::udp_distributor::add_interface(size_t ring_size,
   return false;
 }
 
-bool net::udp_distributor::add_destination(unsigned ifindex,
-                                           const void* macaddr,
-                                           const char* host,
-                                           in_port_t port)
+void net::udp_distributor::scale()
+{
+  if (_M_min_active == 0) {
+    return;
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  uint64_t now = (static_cast<uint64_t>(ts.tv_sec) * 1000000ULL) +
+                 (ts.tv_nsec / 1000);
+
+  uint64_t elapsed = now - _M_scale_time;
+  bool first = (_M_scale_time == 0);
+
+  _M_scale_time = now;
+
+  // Average CPU utilization and fill of the RX ring buffers of the active
+  // workers.
+  double cpu = 0.0;
+  double fill = 0.0;
+
+  for (size_t i = 0; i < _M_nactive; i++) {
+    uint64_t t = _M_workers[i]->cpu_time();
+
+    // The CPU time starts from 0 when the worker is started again.
+    cpu += (t >= _M_cpu_times[i]) ? t - _M_cpu_times[i] : t;
+
+    _M_cpu_times[i] = t;
+
+    fill += _M_workers[i]->fill();
+  }
+
+  // The first evaluation only takes the CPU times.
+  if ((first) || (elapsed == 0)) {
+    return;
+  }
+
+  cpu = (cpu * 100.0) / (static_cast<double>(elapsed) * _M_nactive);
+  fill = (fill * 100.0) / _M_nactive;
+
+  double load = MAX(cpu, fill);
+
+  if (load >= _M_scale_up) {
+    _M_rounds_below = 0;
+
+    if ((++_M_rounds_above >= scale_up_rounds) &&
+        (_M_nactive < _M_nworkers)) {
+      printf("Scaling up to %zu workers (CPU: %.1f %%, RX ring buffers: "
+             "%.1f %% full).\n",
+             _M_nactive + 1,
+             cpu,
+             fill);
+
+      if (!activate(_M_nactive + 1)) {
+        fprintf(stderr, "Error starting worker %zu.\n", _M_nactive);
+      }
+
+      _M_rounds_above = 0;
+    }
+  } else if (load <= _M_scale_down) {
+    _M_rounds_above = 0;
+
+    if ((++_M_rounds_below >= scale_down_rounds) &&
+        (_M_nactive > _M_min_active)) {
+      // The load spread over one worker less has to stay below the
+      // scale-up threshold.
+      if (load * _M_nactive / (_M_nactive - 1) < _M_scale_up) {
+        printf("Scaling down to %zu workers (CPU: %.1f %%, RX ring buffers: "
+               "%.1f %% full).\n",
+               _M_nactive - 1,
+               cpu,
+               fill);
+
+        deactivate(_M_nactive - 1);
+      }
+
+      _M_rounds_below = 0;
+    }
+  } else {
+    _M_rounds_above = 0;
+    _M_rounds_below = 0;
+  }
+}
+
+bool net::udp_distributor::add_destination(
+                             unsigned ifindex,
+                             const void* macaddr,
+                             const char* host,
+                             in_port_t port,
+                             const struct rate_limiter::parameters* limit,
+                             bool dsr
+                           )
 {
   uint8_t buf[sizeof(struct in6_addr)];
 
@@ -85,50 +459,75 @@ bool net::udp_distributor::add_destination(unsigned ifindex,
                            macaddr,
                            buf,
                            static_cast<socklen_t>(sizeof(struct in_addr)),
-                           port);
+                           port,
+                           limit,
+                           dsr);
   } else if (inet_pton(AF_INET6, host, buf) == 1) {
     return add_destination(ifindex,
                            macaddr,
                            buf,
                            static_cast<socklen_t>(sizeof(struct in6_addr)),
-                           port);
+                           port,
+                           limit,
+                           dsr);
   } else {
     return false;
   }
 }
 
-bool net::udp_distributor::add_destination(unsigned ifindex,
-                                           const void* macaddr,
-                                           const void* addr,
-                                           socklen_t addrlen,
-                                           in_port_t port)
+bool net::udp_distributor::add_destination(
+                             unsigned ifindex,
+                             const void* macaddr,
+                             const void* addr,
+                             socklen_t addrlen,
+                             in_port_t port,
+                             const struct rate_limiter::parameters* limit,
+                             bool dsr
+                           )
 {
-  // Sanity check.
-  if (ifindex > 0) {
-    if (_M_type == type::load_balancer) {
-      // Add destination.
-      if (_M_workers[_M_idx].add_destination(ifindex,
-                                             macaddr,
-                                             addr,
-                                             addrlen,
-                                             port)) {
-        _M_idx = (_M_idx + 1) % _M_nworkers;
+  // Search interface.
+  for (size_t i = 0; i < _M_ninterfaces; i++) {
+    struct interface* iface = _M_interfaces + i;
 
-        return true;
+    if (ifindex == iface->ifindex) {
+      size_t first, count;
+      destination_workers(_M_type, _M_ndests, _M_nworkers, first, count);
+
+      // Member of the group of each worker which sends to the destination
+      // (the worker or one of its helpers).
+      size_t m = destination_member(_M_ndests, _M_nhelpers);
+
+      // Share of the rate limit of each worker (rounded up).
+      struct rate_limiter::parameters share;
+      if (limit) {
+        share = *limit;
+        share.packets = (limit->packets + count - 1) / count;
+        share.bytes = (limit->bytes + count - 1) / count;
+        share.burst = MAX((limit->burst + count - 1) / count,
+                          rate_limiter::min_burst);
       }
-    } else {
-      // For each worker...
-      for (size_t i = 0; i < _M_nworkers; i++) {
-        // Add destination.
-        if (!_M_workers[i].add_destination(ifindex,
-                                           macaddr,
-                                           addr,
-                                           addrlen,
-                                           port)) {
+
+      // For each worker which receives the destination...
+      for (size_t j = first; j < first + count; j++) {
+        worker* w = (m == 0) ? _M_workers[j] : helper(j, m - 1);
+
+        // Add interface and destination.
+        if ((!attach(iface, w)) ||
+            (!w->add_destination(ifindex,
+                                 macaddr,
+                                 addr,
+                                 addrlen,
+                                 port,
+                                 limit ? &share : nullptr,
+                                 dsr))) {
           return false;
         }
       }
 
+      _M_ndests++;
+
+      _M_last_ifindex = ifindex;
+
       return true;
     }
   }
@@ -136,15 +535,670 @@ bool net::udp_distributor::add_destination(unsigned ifindex,
   return false;
 }
 
-bool net::udp_distributor::start()
+bool net::udp_distributor::add_link(unsigned ifindex, const void* macaddr)
 {
+  if (_M_ndests == 0) {
+    return false;
+  }
+
+  // Destination added last.
+  size_t n = _M_ndests - 1;
+
+  // Search interface.
+  for (size_t i = 0; i < _M_ninterfaces; i++) {
+    struct interface* iface = _M_interfaces + i;
+
+    if (ifindex == iface->ifindex) {
+      // Watch the carrier of the interfaces of the destination and of the
+      // link (the netlink socket is created with the first link, the links
+      // are on the TX interfaces).
+      const bool* carrier;
+      const bool* first_carrier;
+      if ((!_M_monitor.create(_M_ninterfaces)) ||
+          ((carrier = _M_monitor.watch(ifindex)) == nullptr) ||
+          ((first_carrier = _M_monitor.watch(_M_last_ifindex)) == nullptr)) {
+        return false;
+      }
+
+      size_t first, count;
+      destination_workers(_M_type, n, _M_nworkers, first, count);
+
+      size_t m = destination_member(n, _M_nhelpers);
+
+      // For each worker which receives the destination...
+      for (size_t j = first; j < first + count; j++) {
+        worker* w = (m == 0) ? _M_workers[j] : helper(j, m - 1);
+
+        // Add interface and link.
+        if ((!attach(iface, w)) ||
+            (!w->carrier(_M_last_ifindex, first_carrier)) ||
+            (!w->carrier(ifindex, carrier)) ||
+            (!w->add_link(ifindex, macaddr))) {
+          return false;
+        }
+      }
+
+      _M_nlinks++;
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool net::udp_distributor::add_mirror(unsigned ifindex,
+                                      size_t snaplen,
+                                      int vlan)
+{
+  // Search interface.
+  for (size_t i = 0; i < _M_ninterfaces; i++) {
+    struct interface* iface = _M_interfaces + i;
+
+    if (ifindex == iface->ifindex) {
+      // Each worker mirrors the frames it receives.
+      for (size_t j = 0; j < _M_nworkers; j++) {
+        if ((!attach(iface, _M_workers[j])) ||
+            (!_M_workers[j]->add_mirror(ifindex, snaplen, vlan))) {
+          return false;
+        }
+      }
+
+      _M_nmirrors++;
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool net::udp_distributor::attach(struct interface* iface, worker* w)
+{
+  // Create the TX thread of the interface (if enabled).
+  if ((_M_queue_size > 0) && (!iface->tx)) {
+    void* buf;
+    if (posix_memalign(&buf, CACHE_LINE_SIZE, sizeof(tx_thread)) != 0) {
+      return false;
+    }
+
+    iface->tx = new (buf) tx_thread();
+
+    if (!iface->tx->create(iface->ring_size, iface->ifindex, _M_queue_size)) {
+      return false;
+    }
+
+    // TX scheduler (if enabled).
+    if ((_M_ntx_classes > 0) &&
+        (!iface->tx->schedule(_M_tx_classes,
+                              _M_ntx_classes,
+                              _M_tx_frames,
+                              iface->addr4,
+                              iface->addr6))) {
+      return false;
+    }
+  }
+
+  // Allocate the shared TX ring buffer of the interface (if enabled, it is
+  // created when starting).
+  if ((_M_shared_tx) && (!iface->shared)) {
+    void* buf;
+    if (posix_memalign(&buf, CACHE_LINE_SIZE, sizeof(ring_buffer)) != 0) {
+      return false;
+    }
+
+    iface->shared = new (buf) ring_buffer();
+  }
+
+  // Queue of the worker in the TX thread (the first time).
+  spsc_queue* queue = nullptr;
+  if ((iface->tx) &&
+      (!w->has_interface(iface->ifindex)) &&
+      ((queue = iface->tx->add_queue()) == nullptr)) {
+    return false;
+  }
+
+  // Add interface (the TX ring buffer is created the first time, unless
+  // there is a TX thread or a shared TX ring buffer).
+  return w->add_interface(TPACKET_V2,
+                          iface->ring_size,
+                          iface->ifindex,
+                          iface->macaddr,
+                          iface->addr4,
+                          iface->addr6,
+                          queue,
+                          iface->shared);
+}
+
+void net::udp_distributor::show_statistics()
+{
+  size_t total[numa::max_nodes] = {0};
+
   // For each worker...
   for (size_t i = 0; i < _M_nworkers; i++) {
-    // Start.
-    if (!_M_workers[i].start()) {
+    printf("Worker %zu%s:\n", i, (i < _M_nactive) ? "" : " (parked)");
+    _M_workers[i]->show_statistics();
+
+    // Memory per NUMA node.
+    size_t nodes[numa::max_nodes] = {0};
+    _M_workers[i]->memory(nodes);
+
+    numa::show_memory(nodes);
+
+    for (size_t j = 0; j < numa::max_nodes; j++) {
+      total[j] += nodes[j];
+    }
+
+    // For each helper of the worker...
+    for (size_t k = 0; k < _M_nhelpers; k++) {
+      printf("Helper %zu of worker %zu:\n", k, i);
+      helper(i, k)->show_statistics();
+
+      size_t hnodes[numa::max_nodes] = {0};
+      helper(i, k)->memory(hnodes);
+
+      numa::show_memory(hnodes);
+
+      for (size_t j = 0; j < numa::max_nodes; j++) {
+        total[j] += hnodes[j];
+      }
+    }
+  }
+
+  // For each TX thread...
+  for (size_t i = 0; i < _M_ninterfaces; i++) {
+    const tx_thread* tx = _M_interfaces[i].tx;
+
+    if (tx) {
+      char name[IF_NAMESIZE];
+      if (!if_indextoname(tx->ifindex(), name)) {
+        snprintf(name, sizeof(name), "%u", tx->ifindex());
+      }
+
+      printf("TX thread (%s):\n", name);
+      tx->show_statistics();
+
+      size_t nodes[numa::max_nodes] = {0};
+      tx->memory(nodes);
+
+      numa::show_memory(nodes);
+
+      for (size_t j = 0; j < numa::max_nodes; j++) {
+        total[j] += nodes[j];
+      }
+    }
+  }
+
+  // Shared TX ring buffers.
+  if (_M_shared_tx) {
+    size_t nodes[numa::max_nodes] = {0};
+
+    for (size_t i = 0; i < _M_ninterfaces; i++) {
+      if (_M_interfaces[i].shared) {
+        _M_interfaces[i].shared->memory(nodes);
+      }
+    }
+
+    printf("Shared TX ring buffers:\n");
+    numa::show_memory(nodes);
+
+    for (size_t j = 0; j < numa::max_nodes; j++) {
+      total[j] += nodes[j];
+    }
+  }
+
+  printf("Total:\n");
+  numa::show_memory(total);
+}
+
+void net::udp_distributor::show_ring_buffers()
+{
+  size_t total = 0;
+
+  printf("Locked memory of the ring buffers:\n");
+
+  // For each worker...
+  for (size_t i = 0; i < _M_nworkers; i++) {
+    printf("Worker %zu%s:\n", i, (i < _M_nactive) ? "" : " (parked)");
+    total += _M_workers[i]->show_ring_buffers();
+
+    for (size_t k = 0; k < _M_nhelpers; k++) {
+      printf("Helper %zu of worker %zu:\n", k, i);
+      total += helper(i, k)->show_ring_buffers();
+    }
+  }
+
+  if (_M_queue_size > 0) {
+    printf("TX threads:\n");
+
+    for (size_t i = 0; i < _M_ninterfaces; i++) {
+      if (_M_interfaces[i].tx) {
+        total += _M_interfaces[i].tx->show_ring_buffer();
+      }
+    }
+  } else if (_M_shared_tx) {
+    printf("Shared TX ring buffers:\n");
+
+    for (size_t i = 0; i < _M_ninterfaces; i++) {
+      const ring_buffer* shared = _M_interfaces[i].shared;
+
+      if (shared) {
+        char name[IF_NAMESIZE];
+        if (!if_indextoname(_M_interfaces[i].ifindex, name)) {
+          snprintf(name, sizeof(name), "%u", _M_interfaces[i].ifindex);
+        }
+
+        printf("  TX ring buffer (%s): %zu KB.\n", name, shared->size() / 1024);
+
+        total += shared->size();
+      }
+    }
+  }
+
+  printf("Total locked memory: %zu KB.\n", total / 1024);
+}
+
+bool net::udp_distributor::hand_over(int fd)
+{
+  // Start the parked workers (the new process takes over the ring buffers
+  // of all the workers).
+  if ((_M_nactive < _M_nworkers) && (!activate(_M_nworkers))) {
+    return false;
+  }
+
+  // Stop the workers (the kernel keeps filling the RX rings).
+  stop();
+
+  struct handover_header hdr;
+  hdr.magic = handover_magic;
+  hdr.ring_size = static_cast<uint32_t>(sizeof(worker::handed_ring));
+  hdr.nworkers = static_cast<uint32_t>(_M_nworkers);
+  hdr.nmasks = static_cast<uint32_t>(_M_tx_queue_map.count());
+
+  if (!handover::send(fd, &hdr, sizeof(struct handover_header), nullptr, 0)) {
+    return false;
+  }
+
+  // Send the ring buffers of each worker.
+  for (size_t i = 0; i < _M_nworkers; i++) {
+    const worker* w = _M_workers[i];
+
+    worker::handed_ring ring;
+    int ringfd;
+
+    struct handover_worker msg;
+    msg.nrings = 0;
+
+    for (size_t n = 0; n < w->nrings(); n++) {
+      if (w->ring(n, ring, ringfd)) {
+        msg.nrings++;
+      }
+    }
+
+    if (!handover::send(fd, &msg, sizeof(struct handover_worker), nullptr, 0)) {
       return false;
     }
+
+    for (size_t n = 0; n < w->nrings(); n++) {
+      if ((w->ring(n, ring, ringfd)) &&
+          (!handover::send(fd,
+                           &ring,
+                           sizeof(worker::handed_ring),
+                           &ringfd,
+                           1))) {
+        return false;
+      }
+    }
+  }
+
+  // Wait for the new process to be ready, without time limit: it may have
+  // adopted the ring buffers already, so this process cannot resume unless
+  // the new process refuses them or exits.
+  uint8_t reply;
+  int fds[handover::max_fds];
+  size_t nfds;
+  if (handover::receive(fd, &reply, sizeof(uint8_t), fds, nfds, -1)) {
+    for (size_t i = 0; i < nfds; i++) {
+      close(fds[i]);
+    }
+
+    // If the new process is ready, let it process packets (this process
+    // never resumes afterwards).
+    if (reply == 1) {
+      uint8_t commit = 1;
+      if (handover::send(fd, &commit, sizeof(uint8_t), nullptr, 0)) {
+        // Send the original CPU masks of the TX queues (the current ones
+        // have been rewritten by this process), the new process restores
+        // them on exit.
+        for (size_t i = 0; i < _M_tx_queue_map.count(); i++) {
+          if (!handover::send(fd,
+                              &_M_tx_queue_map.saved(i),
+                              sizeof(tx_queue_map::mask),
+                              nullptr,
+                              0)) {
+            fprintf(stderr,
+                    "Error handing over the CPU masks of the TX queues.\n");
+
+            break;
+          }
+        }
+
+        _M_tx_queue_map.forget();
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+bool net::udp_distributor::take_over(int fd)
+{
+  int fds[handover::max_fds];
+  size_t nfds;
+
+  struct handover_header hdr;
+  bool ret = handover::receive(fd,
+                               &hdr,
+                               sizeof(struct handover_header),
+                               fds,
+                               nfds);
+
+  if (ret) {
+    for (size_t i = 0; i < nfds; i++) {
+      close(fds[i]);
+    }
+
+    if ((hdr.magic != handover_magic) ||
+        (hdr.ring_size != sizeof(worker::handed_ring))) {
+      fprintf(stderr, "Incompatible handover protocol.\n");
+      ret = false;
+    } else if (hdr.nworkers != _M_nworkers) {
+      fprintf(stderr,
+              "The running process has %u workers (%zu configured).\n",
+              hdr.nworkers,
+              _M_nworkers);
+
+      ret = false;
+    }
   }
 
+  // Take over the ring buffers of each worker.
+  for (size_t i = 0; (ret) && (i < _M_nworkers); i++) {
+    worker* w = _M_workers[i];
+
+    struct handover_worker msg;
+    ret = ((handover::receive(fd,
+                              &msg,
+                              sizeof(struct handover_worker),
+                              fds,
+                              nfds)) &&
+           (nfds == 0));
+
+    if (ret) {
+      for (size_t n = 0; (ret) && (n < msg.nrings); n++) {
+        worker::handed_ring ring;
+        if ((handover::receive(fd,
+                               &ring,
+                               sizeof(worker::handed_ring),
+                               fds,
+                               nfds)) &&
+            (nfds == 1)) {
+          // The worker takes ownership of the socket.
+          ret = w->adopt(ring, fds[0]);
+          nfds = 0;
+        } else {
+          ret = false;
+        }
+      }
+
+      ret = ((ret) && (w->adopted()));
+    }
+
+    // Close the sockets which have not been adopted.
+    for (size_t j = 0; (!ret) && (j < nfds); j++) {
+      close(fds[j]);
+    }
+
+    if (!ret) {
+      fprintf(stderr,
+              "Error taking over the ring buffers of worker %zu (the "
+              "traffic classes and the RX interface must be the same).\n",
+              i);
+    }
+  }
+
+  // Create the missing ring buffers (the workers don't process packets
+  // until the running process has been told to exit, all of them are
+  // active).
+  if (ret) {
+    _M_nactive = _M_nworkers;
+    ret = prepare();
+  }
+
+  // Tell the running process whether the new process is ready, and don't
+  // process packets before it confirms it won't resume (if it exits
+  // without confirming, it may have resumed).
+  uint8_t reply = ret ? 1 : 0;
+  if ((handover::send(fd, &reply, sizeof(uint8_t), nullptr, 0)) && (ret)) {
+    uint8_t commit;
+    if ((handover::receive(fd, &commit, sizeof(uint8_t), fds, nfds, -1)) &&
+        (nfds == 0) &&
+        (commit == 1)) {
+      release();
+
+      // Adopt the original CPU masks of the TX queues, so they are
+      // restored on exit.
+      for (size_t i = 0; i < hdr.nmasks; i++) {
+        tx_queue_map::mask m;
+        if ((!handover::receive(fd,
+                                &m,
+                                sizeof(tx_queue_map::mask),
+                                fds,
+                                nfds)) ||
+            (nfds != 0) ||
+            (!_M_tx_queue_map.adopt(m))) {
+          for (size_t j = 0; j < nfds; j++) {
+            close(fds[j]);
+          }
+
+          fprintf(stderr,
+                  "Error taking over the CPU masks of the TX queues.\n");
+
+          break;
+        }
+      }
+
+      return true;
+    }
+
+    for (size_t i = 0; i < nfds; i++) {
+      close(fds[i]);
+    }
+  }
+
+  stop();
+
+  return false;
+}
+
+bool net::udp_distributor::prepare()
+{
+  struct timespec begin;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+
+  // Start the TX threads (the frames queued by the workers are sent as
+  // soon as they start processing packets).
+  for (size_t i = 0; i < _M_ninterfaces; i++) {
+    if ((_M_interfaces[i].tx) && (!_M_interfaces[i].tx->start())) {
+      stop();
+      return false;
+    }
+  }
+
+  // Follow the carrier of the interfaces of the links.
+  if ((_M_nlinks > 0) && (!_M_monitor.start())) {
+    stop();
+    return false;
+  }
+
+  // Create the shared TX ring buffers (they are kept when restarting).
+  for (size_t i = 0; i < _M_ninterfaces; i++) {
+    const struct interface* iface = _M_interfaces + i;
+
+    if ((iface->shared) &&
+        (iface->shared->fd() == -1) &&
+        ((!iface->shared->create(TPACKET_V2,
+                                 ring_buffer::type::tx,
+                                 iface->ring_size,
+                                 iface->ifindex,
+                                 nullptr,
+                                 0,
+                                 0,
+                                 0)) ||
+         (!iface->shared->share()))) {
+      iface->shared->clear();
+      stop();
+
+      return false;
+    }
+  }
+
+  // Start all the active workers and their helpers first, so they create
+  // their ring buffers in parallel (they join the fanout groups in turn,
+  // starting with the first worker).
+  _M_fanout_turn = 0;
+
+  for (size_t i = 0; i < _M_nactive; i++) {
+    if (!_M_workers[i]->start()) {
+      stop();
+      return false;
+    }
+
+    for (size_t k = 0; k < _M_nhelpers; k++) {
+      if (!helper(i, k)->start()) {
+        stop();
+        return false;
+      }
+    }
+  }
+
+  // Wait for the workers and their helpers to be ready.
+  for (size_t i = 0; i < _M_nactive; i++) {
+    if (!_M_workers[i]->wait_ready()) {
+      stop();
+      return false;
+    }
+
+    for (size_t k = 0; k < _M_nhelpers; k++) {
+      if (!helper(i, k)->wait_ready()) {
+        stop();
+        return false;
+      }
+    }
+  }
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  _M_setup_time = ((end.tv_sec - begin.tv_sec) * 1000000LL) +
+                  ((end.tv_nsec - begin.tv_nsec) / 1000);
+
+  return true;
+}
+
+bool net::udp_distributor::free_fanout_id(uint16_t& fanout_id)
+{
+  for (size_t i = 0; i <= UINT16_MAX; i++, fanout_id++) {
+    bool in_use;
+    if (!ring_buffer::fanout_in_use(fanout_id, in_use)) {
+      return false;
+    }
+
+    if (!in_use) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool net::udp_distributor::activate(size_t n)
+{
+  // Start the workers and their helpers (the parked workers are the last
+  // ones, they join the fanout groups after the active workers).
+  _M_fanout_turn = _M_nactive;
+
+  for (size_t i = _M_nactive; i < n; i++) {
+    _M_cpu_times[i] = 0;
+
+    if (!_M_workers[i]->start()) {
+      deactivate(_M_nactive);
+      return false;
+    }
+
+    for (size_t k = 0; k < _M_nhelpers; k++) {
+      if (!helper(i, k)->start()) {
+        deactivate(_M_nactive);
+        return false;
+      }
+    }
+  }
+
+  // Wait for them to be ready (the RX sockets join the fanout groups).
+  for (size_t i = _M_nactive; i < n; i++) {
+    if (!_M_workers[i]->wait_ready()) {
+      deactivate(_M_nactive);
+      return false;
+    }
+
+    for (size_t k = 0; k < _M_nhelpers; k++) {
+      if (!helper(i, k)->wait_ready()) {
+        deactivate(_M_nactive);
+        return false;
+      }
+    }
+  }
+
+  for (size_t i = _M_nactive; i < n; i++) {
+    for (size_t k = 0; k < _M_nhelpers; k++) {
+      helper(i, k)->release();
+    }
+
+    _M_workers[i]->release();
+  }
+
+  _M_nactive = n;
+
   return true;
 }
+
+void net::udp_distributor::deactivate(size_t n)
+{
+  // Park the workers which have been started (from the last one), then
+  // their helpers.
+  for (size_t i = _M_nworkers; i > n; i--) {
+    _M_workers[i - 1]->park(_M_release_memory);
+
+    for (size_t k = 0; k < _M_nhelpers; k++) {
+      helper(i - 1, k)->park(_M_release_memory);
+    }
+  }
+
+  _M_nactive = n;
+}
+
+void net::udp_distributor::show_setup_times() const
+{
+  for (size_t i = 0; i < _M_nworkers; i++) {
+    printf("Worker %zu:\n", i);
+    _M_workers[i]->show_setup_times();
+
+    for (size_t k = 0; k < _M_nhelpers; k++) {
+      printf("Helper %zu of worker %zu:\n", k, i);
+      helper(i, k)->show_setup_times();
+    }
+  }
+
+  printf("Startup time: %.1f ms.\n", _M_setup_time / 1000.0);
+}
@@ -2,15 +2,32 @@
 #define NET_UDP_DISTRIBUTOR_H
 
 #include "net/worker.h"
+#include "net/tx_thread.h"
+#include "net/link_monitor.h"
+#include "net/tx_queue_map.h"
 
 namespace net {
   class udp_distributor {
     public:
       static const size_t min_workers = 1;
-      static const size_t max_workers = 32;
+
+      // Maximum number of members of a fanout group (PACKET_FANOUT_DEF_MAX
+      // in the kernel).
+      static const size_t max_workers = 256;
       static const size_t default_workers = 1;
 
+      static const size_t max_classes = worker::max_classes - 1;
+
+      // Thresholds of the elastic scaling (load of the active workers,
+      // percentage).
+      static const unsigned default_scale_up = 75;
+      static const unsigned default_scale_down = 25;
+
+      // Interval between two evaluations of the load (seconds).
+      static const unsigned scale_interval = 1;
+
       typedef worker::type type;
+      typedef worker::fragment_mode fragment_mode;
 
       // Constructor.
       udp_distributor();
@@ -26,38 +43,326 @@ namespace net {
                   int fanout,
                   size_t nworkers);
 
-      // Add interface for TX.
+      // Add traffic class (each traffic class has its own RX ring buffer
+      // and socket filter in each worker).
+      bool add_class(size_t ring_size,
+                     const struct sock_fprog* fprog,
+                     size_t weight);
+
+      // Add interface for TX (the TX ring buffer of the interface is only
+      // created in the workers which have destinations on the interface).
       bool add_interface(size_t ring_size,
                          unsigned ifindex,
                          const void* macaddr,
                          const void* addr4,
                          const void* addr6);
 
-      // Add destination.
+      // Add `nhelpers` helpers to each worker (broadcaster, before setting
+      // up the handling of IPv4 fragments and adding the destinations): the
+      // destinations of the worker are split among the worker and its
+      // helpers, which send each block of packets in parallel.
+      bool helpers(size_t nhelpers);
+
+      // Set up handling of IPv4 fragments.
+      bool fragments(fragment_mode mode, size_t ndatagrams, unsigned timeout);
+
+      // Let the idle workers take batches of packets from the workers which
+      // fall behind (after setting up the handling of IPv4 fragments). With
+      // `flow_affinity`, the packets of a flow are sent in order (broadcaster
+      // only, the IPv4 fragments must be discarded).
+      bool work_stealing(bool flow_affinity);
+
+      // Send through one TX thread per interface (before adding the
+      // destinations and the mirror ports): the workers queue the frames
+      // (`queue_size` frames per worker and interface) and the TX thread
+      // sends them in batches through a single TX ring buffer.
+      bool tx_threads(size_t queue_size);
+
+      // Schedule the frames of the TX threads by priority class (after
+      // tx_threads(), before adding the destinations and the mirror ports):
+      // `classes` in decreasing order of priority, the frames which match
+      // none go to a default class of `nframes` frames (see tx_scheduler).
+      bool tx_classes(const tx_scheduler::priority_class* classes,
+                      size_t nclasses,
+                      size_t nframes);
+
+      // Share one TX ring buffer per interface among the workers (before
+      // adding the destinations and the mirror ports): each worker claims
+      // its frames of the ring buffer atomically.
+      bool shared_tx_rings();
+
+      // Send through one hardware TX queue per worker (after adding the
+      // interfaces, the workers must have their CPUs, see affinity()):
+      // worker `i` sends through the TX queue `i` (modulo the number of TX
+      // queues) of each interface, the kernel picks it from the XPS map of
+      // the CPU of the worker (see tx_queue_map). Not available with the TX
+      // threads or the shared TX ring buffers.
+      bool tx_queues();
+
+      // Scale the number of active workers between `min_active` and the
+      // number of workers (after create(), only `min_active` are started).
+      // The load is the highest of the CPU utilization and the fill of the
+      // RX ring buffers, averaged over the active workers: a worker is added
+      // when the load has been at or above `scale_up` percent for a few
+      // evaluations and the last one is parked (it leaves the fanout group
+      // and releases its CPU) when it has been at or below `scale_down`
+      // percent for longer. If `release_memory` is set, the parked workers
+      // close their TX ring buffers too. Broadcaster only: the destinations
+      // of the load balancer belong to one worker each.
+      bool elastic(size_t min_active,
+                   unsigned scale_up,
+                   unsigned scale_down,
+                   bool release_memory);
+
+      // Evaluate the load and add or park a worker if needed (every
+      // `scale_interval` seconds, with elastic scaling).
+      void scale();
+
+      // Add destination (`limit`: rate limit of the destination, null if
+      // none; `dsr`: direct server return). When several workers send to
+      // the destination (broadcaster), each of them gets an equal share of
+      // the limit.
       bool add_destination(unsigned ifindex,
                            const void* macaddr,
                            const char* host,
-                           in_port_t port);
+                           in_port_t port,
+                           const struct rate_limiter::parameters* limit =
+                             nullptr,
+                           bool dsr = false);
 
       bool add_destination(unsigned ifindex,
                            const void* macaddr,
                            const void* addr,
                            socklen_t addrlen,
-                           in_port_t port);
+                           in_port_t port,
+                           const struct rate_limiter::parameters* limit =
+                             nullptr,
+                           bool dsr = false);
+
+      // Add link to the destination added last (up to worker::max_links
+      // links, the first one being the interface and the ethernet address
+      // of the destination): the flows are spread over the links and, when
+      // the carrier of an interface drops (netlink) or the TX ring of a
+      // link stalls, over the other links.
+      bool add_link(unsigned ifindex, const void* macaddr);
+
+      // Add mirror port to each worker: the frames received are sent
+      // through the interface byte for byte, truncated to `snaplen` bytes
+      // (0: whole frame) and with an 802.1Q tag if `vlan` is not -1.
+      bool add_mirror(unsigned ifindex, size_t snaplen, int vlan);
 
-      // Start.
+      // Get the workers which receive the destination `n` (the n-th
+      // destination added).
+      static void destination_workers(type t,
+                                      size_t n,
+                                      size_t nworkers,
+                                      size_t& first,
+                                      size_t& count);
+
+      // Get which member of the group of a worker sends to the destination
+      // `n` (0: the worker, 1 .. `nhelpers`: its helpers).
+      static size_t destination_member(size_t n, size_t nhelpers);
+
+      // Set the program which selects the worker (PACKET_FANOUT_CBPF), it
+      // can be replaced while running.
+      bool steer(const struct sock_fprog* fprog);
+
+      // Set the CPUs the workers run on (worker `i` runs on the CPU
+      // `cpus[i % ncpus]`), it has to be called before create() for the
+      // memory of the workers to be allocated on their NUMA nodes.
+      bool affinity(const int* cpus, size_t ncpus);
+
+      // Start (the active workers create their ring buffers in parallel,
+      // the call returns when all of them are ready to receive, the TX
+      // threads are started before).
       bool start();
 
+      // Hand the packet sockets over to a new process (connected to `fd`).
+      // The parked workers are started first. Then the workers are
+      // stopped, the RX sockets stay in their fanout groups (the kernel
+      // keeps filling the rings) and the new process continues from the
+      // current position of each ring.
+      // Returns true when the new process has confirmed the handover,
+      // otherwise the workers are left stopped (start() resumes them).
+      bool hand_over(int fd);
+
+      // Take over the packet sockets of a running process (connected to
+      // `fd`) and start (the configuration must have the same number of
+      // workers and traffic classes and the same RX interface).
+      // The TX ring buffers of the TX threads, the shared TX ring buffers
+      // and those of the helpers are not taken over.
+      bool take_over(int fd);
+
       // Stop.
       void stop();
 
+      // Show statistics.
+      void show_statistics();
+
+      // Show the locked memory of each ring buffer.
+      void show_ring_buffers();
+
+      // Show the time spent creating the ring buffers.
+      void show_setup_times() const;
+
     private:
+      // Identifier of the handover messages.
+      static const uint32_t handover_magic = 0x75647064; // "udpd"
+
+      // First message of the handover.
+      struct handover_header {
+        uint32_t magic;
+        uint32_t ring_size; // Size of the description of a ring buffer.
+        uint32_t nworkers;
+
+        // Number of saved CPU masks of the TX queues (one message per mask
+        // after the ring buffers).
+        uint32_t nmasks;
+      };
+
+      // Number of ring buffers of a worker (one message per worker,
+      // followed by one message per ring buffer with its socket).
+      struct handover_worker {
+        uint32_t nrings;
+      };
+
       type _M_type;
 
-      worker _M_workers[max_workers];
+      // Workers (each one allocated on its NUMA node).
+      worker** _M_workers;
       size_t _M_nworkers;
 
-      size_t _M_idx;
+      // Number of evaluations of the load in a row above (below) the
+      // thresholds before adding (parking) a worker.
+      static const unsigned scale_up_rounds = 3;
+      static const unsigned scale_down_rounds = 10;
+
+      // Active workers (the first `_M_nactive` ones, the other ones are
+      // parked).
+      size_t _M_nactive;
+
+      // Minimum number of active workers (0: no elastic scaling).
+      size_t _M_min_active;
+
+      unsigned _M_scale_up;
+      unsigned _M_scale_down;
+
+      bool _M_release_memory;
+
+      // Number of evaluations in a row above / below the thresholds.
+      unsigned _M_rounds_above;
+      unsigned _M_rounds_below;
+
+      // CPU time of each worker at the previous evaluation (microseconds).
+      uint64_t* _M_cpu_times;
+
+      // Time of the previous evaluation (microseconds).
+      uint64_t _M_scale_time;
+
+      // Helpers (`_M_nhelpers` per worker, allocated on the NUMA node of
+      // their worker).
+      worker** _M_helpers;
+      size_t _M_nhelpers;
+
+      // CPUs of the workers.
+      int* _M_cpus;
+      size_t _M_ncpus;
+
+      // Interfaces for TX.
+      struct interface {
+        size_t ring_size;
+        unsigned ifindex;
+
+        uint8_t macaddr[ETHER_ADDR_LEN];
+        uint8_t addr4[sizeof(struct in_addr)];
+        uint8_t addr6[sizeof(struct in6_addr)];
+
+        // TX thread (allocated with the first destination on the
+        // interface, if the TX threads are enabled).
+        tx_thread* tx;
+
+        // TX ring buffer shared by the workers (allocated with the first
+        // destination on the interface, if enabled).
+        ring_buffer* shared;
+      };
+
+      struct interface* _M_interfaces;
+      size_t _M_ninterfaces;
+
+      // Number of destinations.
+      size_t _M_ndests;
+
+      // Interface of the destination added last.
+      unsigned _M_last_ifindex;
+
+      // Number of mirror ports.
+      size_t _M_nmirrors;
+
+      // Number of links added to the destinations.
+      size_t _M_nlinks;
+
+      // Carrier of the interfaces of the links (started with the workers).
+      link_monitor _M_monitor;
+
+      // Number of frames per queue of the TX threads (0: no TX threads).
+      size_t _M_queue_size;
+
+      // Priority classes of the TX threads (none: no TX scheduler) and
+      // number of frames of the default class.
+      tx_scheduler::priority_class _M_tx_classes[tx_scheduler::max_classes];
+      size_t _M_ntx_classes;
+      size_t _M_tx_frames;
+
+      // Share one TX ring buffer per interface among the workers?
+      bool _M_shared_tx;
+
+      // CPU masks of the TX queues of the interfaces (one TX queue per
+      // worker).
+      tx_queue_map _M_tx_queue_map;
+
+      // RX interface.
+      unsigned _M_ifindex;
+
+      int _M_fanout;
+      uint16_t _M_fanout_id;
+
+      // Fanout identifier of the traffic class added last (the one of the
+      // default class if none).
+      uint16_t _M_class_fanout_id;
+
+      // Index of the worker whose turn it is to join the fanout groups.
+      size_t _M_fanout_turn;
+
+      // Number of traffic classes (the default class not included).
+      size_t _M_nclasses;
+
+      // Time spent starting the workers (microseconds).
+      int64_t _M_setup_time;
+
+      // Start the workers and wait until their ring buffers are ready.
+      bool prepare();
+
+      // Let the workers process packets.
+      void release();
+
+      // Search the first fanout identifier which is not in use, from
+      // `fanout_id` on.
+      static bool free_fanout_id(uint16_t& fanout_id);
+
+      // Add the interface to the worker (the TX thread or the shared TX
+      // ring buffer of the interface, if enabled, is allocated the first
+      // time).
+      bool attach(struct interface* iface, worker* w);
+
+      // Get helper `k` of worker `i`.
+      worker* helper(size_t i, size_t k) const;
+
+      // Start the parked workers up to `n` active workers.
+      bool activate(size_t n);
+
+      // Park the active workers from the last one down to `n` active
+      // workers.
+      void deactivate(size_t n);
 
       // Disable copy constructor and assignment operator.
       udp_distributor(const udp_distributor&) = delete;
@@ -65,21 +370,205 @@ namespace net {
   };
 
   inline udp_distributor::udp_distributor()
-    : _M_nworkers(0),
-      _M_idx(0)
+    : _M_workers(nullptr),
+      _M_nworkers(0),
+      _M_nactive(0),
+      _M_min_active(0),
+      _M_scale_up(default_scale_up),
+      _M_scale_down(default_scale_down),
+      _M_release_memory(false),
+      _M_rounds_above(0),
+      _M_rounds_below(0),
+      _M_cpu_times(nullptr),
+      _M_scale_time(0),
+      _M_helpers(nullptr),
+      _M_nhelpers(0),
+      _M_cpus(nullptr),
+      _M_ncpus(0),
+      _M_interfaces(nullptr),
+      _M_ninterfaces(0),
+      _M_ndests(0),
+      _M_last_ifindex(0),
+      _M_nmirrors(0),
+      _M_nlinks(0),
+      _M_queue_size(0),
+      _M_ntx_classes(0),
+      _M_tx_frames(0),
+      _M_shared_tx(false),
+      _M_fanout_turn(0),
+      _M_nclasses(0),
+      _M_setup_time(0)
   {
   }
 
   inline udp_distributor::~udp_distributor()
   {
     stop();
+
+    if (_M_workers) {
+      for (size_t i = 0; i < _M_nworkers; i++) {
+        _M_workers[i]->~worker();
+        free(_M_workers[i]);
+      }
+
+      free(_M_workers);
+    }
+
+    if (_M_helpers) {
+      for (size_t i = 0; i < _M_nworkers * _M_nhelpers; i++) {
+        if (_M_helpers[i]) {
+          _M_helpers[i]->~worker();
+          free(_M_helpers[i]);
+        }
+      }
+
+      free(_M_helpers);
+    }
+
+    if (_M_cpu_times) {
+      free(_M_cpu_times);
+    }
+
+    if (_M_cpus) {
+      free(_M_cpus);
+    }
+
+    if (_M_interfaces) {
+      for (size_t i = 0; i < _M_ninterfaces; i++) {
+        if (_M_interfaces[i].tx) {
+          _M_interfaces[i].tx->~tx_thread();
+          free(_M_interfaces[i].tx);
+        }
+
+        if (_M_interfaces[i].shared) {
+          _M_interfaces[i].shared->~ring_buffer();
+          free(_M_interfaces[i].shared);
+        }
+      }
+
+      free(_M_interfaces);
+    }
+  }
+
+  inline bool udp_distributor::steer(const struct sock_fprog* fprog)
+  {
+    // The program is shared by the fanout group.
+    return ((_M_nworkers > 0) && (_M_workers[0]->steer(fprog)));
+  }
+
+  inline void udp_distributor::destination_workers(type t,
+                                                  size_t n,
+                                                  size_t nworkers,
+                                                  size_t& first,
+                                                  size_t& count)
+  {
+    if (t == type::load_balancer) {
+      // The destinations are distributed among the workers.
+      first = n % nworkers;
+      count = 1;
+    } else {
+      // All the workers send to all the destinations.
+      first = 0;
+      count = nworkers;
+    }
+  }
+
+  inline size_t udp_distributor::destination_member(size_t n,
+                                                   size_t nhelpers)
+  {
+    return n % (nhelpers + 1);
+  }
+
+  inline worker* udp_distributor::helper(size_t i, size_t k) const
+  {
+    return _M_helpers[(i * _M_nhelpers) + k];
+  }
+
+  inline bool udp_distributor::affinity(const int* cpus, size_t ncpus)
+  {
+    int* c;
+    if ((ncpus > 0) &&
+        ((c = reinterpret_cast<int*>(
+                 realloc(_M_cpus, ncpus * sizeof(int))
+               )) != nullptr)) {
+      memcpy(c, cpus, ncpus * sizeof(int));
+
+      _M_cpus = c;
+      _M_ncpus = ncpus;
+
+      return true;
+    }
+
+    return false;
+  }
+
+  inline bool udp_distributor::start()
+  {
+    if (prepare()) {
+      release();
+      return true;
+    }
+
+    return false;
+  }
+
+  inline bool udp_distributor::tx_threads(size_t queue_size)
+  {
+    if ((queue_size >= spsc_queue::min_frames) &&
+        (queue_size <= spsc_queue::max_frames) &&
+        (IS_POWER_2(queue_size)) &&
+        (!_M_shared_tx) &&
+        (_M_ndests == 0) &&
+        (_M_nmirrors == 0)) {
+      _M_queue_size = queue_size;
+      return true;
+    }
+
+    return false;
+  }
+
+  inline bool udp_distributor::shared_tx_rings()
+  {
+    if ((_M_queue_size == 0) && (_M_ndests == 0) && (_M_nmirrors == 0)) {
+      _M_shared_tx = true;
+      return true;
+    }
+
+    return false;
   }
 
   inline void udp_distributor::stop()
   {
     // Stop workers.
     for (size_t i = 0; i < _M_nworkers; i++) {
-      _M_workers[i].stop();
+      _M_workers[i]->stop();
+    }
+
+    // Stop the helpers (after their workers, which wait for them).
+    for (size_t i = 0; i < _M_nworkers; i++) {
+      for (size_t k = 0; k < _M_nhelpers; k++) {
+        helper(i, k)->stop();
+      }
+    }
+
+    // Stop the TX threads (after sending the frames queued by the workers).
+    for (size_t i = 0; i < _M_ninterfaces; i++) {
+      if (_M_interfaces[i].tx) {
+        _M_interfaces[i].tx->stop();
+      }
+    }
+
+    _M_monitor.stop();
+  }
+
+  inline void udp_distributor::release()
+  {
+    for (size_t i = 0; i < _M_nactive; i++) {
+      for (size_t k = 0; k < _M_nhelpers; k++) {
+        helper(i, k)->release();
+      }
+
+      _M_workers[i]->release();
     }
   }
 }
@@ -0,0 +1,248 @@
+#ifndef NET_WORK_QUEUE_H
+#define NET_WORK_QUEUE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "net/ring_buffer.h"
+#include "net/numa.h"
+#include "macros/macros.h"
+
+namespace net {
+  // Bounded queue of batches of packets published by a worker (the only
+  // producer) and taken by any worker (several consumers). The packets stay
+  // in the block of the RX ring buffer, which is held until the batch has
+  // been processed.
+  class work_queue {
+    public:
+      // Maximum number of packets per batch.
+      static const size_t batch_size = 256;
+
+      // Number of batches (power of 2).
+      static const size_t min_batches = 2;
+      static const size_t max_batches = 1024;
+      static const size_t default_batches = 16;
+
+      // Batch of packets.
+      struct batch {
+        // RX ring buffer and block of the packets.
+        ring_buffer* rx;
+        size_t block;
+
+        struct iovec pkts[batch_size];
+        size_t npkts;
+      };
+
+      // Constructor.
+      work_queue();
+
+      // Destructor.
+      ~work_queue();
+
+      // Create (if `ordered` is set, the batches are processed one at a
+      // time, in the order they were published).
+      bool create(size_t nbatches, bool ordered);
+
+      // Get the next batch to fill (producer), null if the queue is full.
+      struct batch* reserve();
+
+      // Publish the batch got from reserve() (producer).
+      void publish();
+
+      // Take the oldest batch (consumer), null if the queue is empty (or,
+      // if ordered, another consumer is processing a batch).
+      struct batch* take();
+
+      // Return the batch got from take() once it has been processed
+      // (consumer).
+      void complete(struct batch* b);
+
+      // Have all the batches published been processed? (producer).
+      bool idle() const;
+
+      // Get size of the queue.
+      size_t size() const;
+
+      // Add the memory of the queue to its NUMA node.
+      void memory(size_t* nodes) const;
+
+    private:
+      struct slot {
+        // The slot can be filled when `seq` is the position of the producer
+        // and taken when it is the position of the consumers plus one.
+        size_t seq;
+
+        // Position the slot was taken at.
+        size_t position;
+
+        struct batch b;
+      };
+
+      struct slot* _M_slots;
+      size_t _M_mask;
+
+      bool _M_ordered;
+
+      // Written by the producer.
+      alignas(CACHE_LINE_SIZE) size_t _M_head;
+
+      // Written by the consumers.
+      alignas(CACHE_LINE_SIZE) size_t _M_tail;
+
+      // Number of batches processed.
+      alignas(CACHE_LINE_SIZE) size_t _M_completed;
+
+      // Is a consumer processing a batch? (ordered).
+      alignas(CACHE_LINE_SIZE) bool _M_busy;
+
+      // Disable copy constructor and assignment operator.
+      work_queue(const work_queue&) = delete;
+      work_queue& operator=(const work_queue&) = delete;
+  };
+
+  inline work_queue::work_queue()
+    : _M_slots(nullptr),
+      _M_mask(0),
+      _M_ordered(false),
+      _M_head(0),
+      _M_tail(0),
+      _M_completed(0),
+      _M_busy(false)
+  {
+  }
+
+  inline work_queue::~work_queue()
+  {
+    if (_M_slots) {
+      free(_M_slots);
+    }
+  }
+
+  inline bool work_queue::create(size_t nbatches, bool ordered)
+  {
+    if ((nbatches >= min_batches) &&
+        (nbatches <= max_batches) &&
+        (IS_POWER_2(nbatches))) {
+      void* buf;
+      if (posix_memalign(&buf,
+                         CACHE_LINE_SIZE,
+                         nbatches * sizeof(struct slot)) == 0) {
+        _M_slots = reinterpret_cast<struct slot*>(buf);
+        _M_mask = nbatches - 1;
+
+        for (size_t i = 0; i < nbatches; i++) {
+          _M_slots[i].seq = i;
+        }
+
+        _M_ordered = ordered;
+
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  inline struct work_queue::batch* work_queue::reserve()
+  {
+    struct slot* s = _M_slots + (_M_head & _M_mask);
+
+    // If the slot has not been returned yet...
+    if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != _M_head) {
+      return nullptr;
+    }
+
+    s->b.npkts = 0;
+
+    return &s->b;
+  }
+
+  inline void work_queue::publish()
+  {
+    struct slot* s = _M_slots + (_M_head & _M_mask);
+
+    __atomic_store_n(&s->seq, _M_head + 1, __ATOMIC_RELEASE);
+
+    _M_head++;
+  }
+
+  inline struct work_queue::batch* work_queue::take()
+  {
+    // If ordered, only one consumer at a time.
+    if ((_M_ordered) &&
+        (__atomic_exchange_n(&_M_busy, true, __ATOMIC_ACQUIRE))) {
+      return nullptr;
+    }
+
+    size_t pos = __atomic_load_n(&_M_tail, __ATOMIC_RELAXED);
+
+    do {
+      struct slot* s = _M_slots + (pos & _M_mask);
+
+      ssize_t diff = static_cast<ssize_t>(
+                       __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - (pos + 1)
+                     );
+
+      if (diff == 0) {
+        // Claim the slot.
+        if (__atomic_compare_exchange_n(&_M_tail,
+                                        &pos,
+                                        pos + 1,
+                                        true,
+                                        __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+          s->position = pos;
+          return &s->b;
+        }
+      } else if (diff < 0) {
+        // The queue is empty (the slot hasn't been published yet or, from
+        // the previous round, hasn't been returned yet).
+        if (_M_ordered) {
+          __atomic_store_n(&_M_busy, false, __ATOMIC_RELEASE);
+        }
+
+        return nullptr;
+      } else {
+        // Another consumer has taken the slot.
+        pos = __atomic_load_n(&_M_tail, __ATOMIC_RELAXED);
+      }
+    } while (true);
+  }
+
+  inline void work_queue::complete(struct batch* b)
+  {
+    struct slot* s = reinterpret_cast<struct slot*>(
+                       reinterpret_cast<uint8_t*>(b) - offsetof(struct slot, b)
+                     );
+
+    // Return the slot to the producer.
+    __atomic_store_n(&s->seq, s->position + _M_mask + 1, __ATOMIC_RELEASE);
+
+    __atomic_fetch_add(&_M_completed, 1, __ATOMIC_RELEASE);
+
+    if (_M_ordered) {
+      __atomic_store_n(&_M_busy, false, __ATOMIC_RELEASE);
+    }
+  }
+
+  inline bool work_queue::idle() const
+  {
+    return (__atomic_load_n(&_M_completed, __ATOMIC_ACQUIRE) == _M_head);
+  }
+
+  inline size_t work_queue::size() const
+  {
+    return _M_slots ? (_M_mask + 1) * sizeof(struct slot) : 0;
+  }
+
+  inline void work_queue::memory(size_t* nodes) const
+  {
+    if (_M_slots) {
+      numa::memory(_M_slots, size(), nodes);
+    }
+  }
+}
+
+#endif // NET_WORK_QUEUE_H
@@ -1,15 +1,50 @@
 #include <stddef.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
 #include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <limits.h>
+#include <new>
 #include "net/worker.h"
+#include "net/numa.h"
 #include "macros/macros.h"
 
 #define CALCULATE_UDP_CHECKSUM 1
 
+// Get the MTU of the interface.
+static bool interface_mtu(unsigned ifindex, size_t& mtu);
+
+// Copy socket filter program.
+static bool copy_program(const struct sock_fprog* fprog,
+                         struct sock_fprog& copy);
+
+// Get current time (microseconds).
+static uint64_t now_usec();
+
+// Get current time (nanoseconds).
+static uint64_t now_nsec();
+
+// Sum the 16-bit words of the buffer (host byte order, not folded, an odd
+// byte is padded with zero).
+static uint32_t sum_words(const uint8_t* buf, size_t len);
+
+// Fold the sum to 16 bits.
+static uint16_t fold(uint32_t sum);
+
+// Calculate checksum of the IPv4 header using the given addresses.
+static uint16_t ipv4_header_checksum(const uint8_t* ip,
+                                     size_t iphdrlen,
+                                     const uint8_t* saddr,
+                                     const uint8_t* daddr);
+
 bool net::worker::create(type t,
                          tpacket_versions version,
                          size_t ring_size,
@@ -19,17 +54,36 @@ bool net::worker::create(type t,
                          size_t fanout_size,
                          uint16_t fanout_id)
 {
-  // Create RX ring buffer.
-  if (_M_rx.create(version,
-                   ring_buffer::type::rx,
-                   ring_size,
-                   ifindex,
-                   fprog,
-                   fanout,
-                   fanout_size,
-                   fanout_id)) {
-    _M_ipv4_destinations.init(t);
-    _M_ipv6_destinations.init(t);
+  struct traffic_class* c = _M_classes;
+
+  // Save the parameters of the RX ring buffer of the default traffic class.
+  if (copy_program(fprog, c->fprog)) {
+    c->weight = default_weight;
+
+    c->version = version;
+    c->ring_size = ring_size;
+    c->ifindex = ifindex;
+    c->fanout = fanout;
+    c->fanout_size = fanout_size;
+    c->fanout_id = fanout_id;
+
+    _M_nclasses = 1;
+
+    _M_type = t;
+
+    return true;
+  }
+
+  return false;
+}
+
+bool net::worker::create_helper(worker* parent)
+{
+  if ((parent->_M_nhelpers < max_helpers) && (!parent->_M_parent)) {
+    _M_type = type::broadcaster;
+
+    _M_parent = parent;
+    parent->_M_helpers[parent->_M_nhelpers++] = this;
 
     return true;
   }
@@ -37,53 +91,217 @@ bool net::worker::create(type t,
   return false;
 }
 
+bool net::worker::add_class(tpacket_versions version,
+                            size_t ring_size,
+                            unsigned ifindex,
+                            const struct sock_fprog* fprog,
+                            int fanout,
+                            size_t fanout_size,
+                            uint16_t fanout_id,
+                            size_t weight)
+{
+  // Sanity checks.
+  if ((_M_nclasses > 0) &&
+      (_M_nclasses < max_classes) &&
+      (version == _M_classes[0].version) &&
+      (weight >= min_weight) &&
+      (weight <= max_weight)) {
+    struct traffic_class* c = _M_classes + _M_nclasses;
+
+    // Save the parameters of the RX ring buffer.
+    if (copy_program(fprog, c->fprog)) {
+      c->weight = weight;
+
+      c->version = version;
+      c->ring_size = ring_size;
+      c->ifindex = ifindex;
+      c->fanout = fanout;
+      c->fanout_size = fanout_size;
+      c->fanout_id = fanout_id;
+
+      _M_nclasses++;
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
 bool net::worker::add_interface(tpacket_versions version,
                                 size_t ring_size,
                                 unsigned ifindex,
                                 const void* macaddr,
                                 const void* addr4,
-                                const void* addr6)
+                                const void* addr6,
+                                spsc_queue* queue,
+                                ring_buffer* shared)
+{
+  if (has_interface(ifindex)) {
+    // Already added.
+    return true;
+  }
+
+  // Allocate the memory on the NUMA node of the worker.
+  numa::scoped_node node(_M_node);
+
+  // Make room for one more interface.
+  if (_M_ninterfaces == _M_interfaces_size) {
+    size_t size = (_M_interfaces_size > 0) ? _M_interfaces_size << 1 : 4;
+
+    struct interface** interfaces = reinterpret_cast<struct interface**>(
+                                      realloc(_M_interfaces,
+                                              size * sizeof(struct interface*))
+                                    );
+
+    if (!interfaces) {
+      return false;
+    }
+
+    _M_interfaces = interfaces;
+    _M_interfaces_size = size;
+  }
+
+  // Allocate interface (cache aligned, the destinations point to it).
+  void* buf;
+  if (posix_memalign(&buf, CACHE_LINE_SIZE, sizeof(struct interface)) != 0) {
+    return false;
+  }
+
+  struct interface* iface = new (buf) interface();
+
+  // Get MTU (the TX ring buffer is created by the worker thread).
+  if (interface_mtu(ifindex, iface->mtu)) {
+    iface->version = version;
+    iface->ring_size = ring_size;
+
+    iface->queue = queue;
+    iface->shared = shared;
+
+    iface->carrier = nullptr;
+
+    iface->index = ifindex;
+
+    memcpy(iface->macaddr, macaddr, ETHER_ADDR_LEN);
+    memcpy(iface->addr4, addr4, sizeof(struct in_addr));
+    memcpy(iface->addr6, addr6, sizeof(struct in6_addr));
+
+    _M_interfaces[_M_ninterfaces++] = iface;
+
+    return true;
+  }
+
+  iface->~interface();
+  free(iface);
+
+  return false;
+}
+
+bool net::worker::has_interface(unsigned ifindex) const
 {
   // Search interface.
   for (size_t i = 0; i < _M_ninterfaces; i++) {
-    if (ifindex == _M_interfaces[i].index) {
-      // Already added.
+    if (ifindex == _M_interfaces[i]->index) {
       return true;
     }
   }
 
-  // If there are not too many interfaces...
-  if (_M_ninterfaces < max_interfaces) {
-    struct interface* iface = _M_interfaces + _M_ninterfaces;
+  return false;
+}
+
+bool net::worker::fragments(fragment_mode mode,
+                            size_t ndatagrams,
+                            unsigned timeout)
+{
+  // The helpers and the workers which take batches don't see the
+  // datagrams reassembled by the worker.
+  if ((mode == fragment_mode::reassemble) &&
+      ((_M_parent) || (_M_nhelpers > 0) || (_M_nqueues > 0))) {
+    return false;
+  }
+
+  // Allocate the memory on the NUMA node of the worker.
+  numa::scoped_node node(_M_node);
+
+  if (mode == fragment_mode::reassemble) {
+    if (!_M_reassembler.create(ndatagrams, timeout)) {
+      return false;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    _M_now = ts.tv_sec;
+  } else {
+    _M_reassembler.clear();
+  }
+
+  _M_fragment_mode = mode;
 
-    // Create TX ring buffer.
-    if (iface->tx.create(version,
-                         ring_buffer::type::tx,
-                         ring_size,
-                         ifindex,
-                         nullptr,
-                         0,
-                         0,
-                         0)) {
-      iface->index = ifindex;
+  return true;
+}
 
-      memcpy(iface->macaddr, macaddr, ETHER_ADDR_LEN);
-      memcpy(iface->addr4, addr4, sizeof(struct in_addr));
-      memcpy(iface->addr6, addr6, sizeof(struct in6_addr));
+bool net::worker::work_stealing(worker* const* peers,
+                                size_t npeers,
+                                bool flow_affinity)
+{
+  // Sanity checks (the batches are sent to the destinations of the worker
+  // which takes them, so only the broadcaster, whose workers send to all
+  // the destinations, can steal work, and the IPv4 fragments of a datagram
+  // would be sent by different workers).
+  if ((npeers < 2) ||
+      (_M_nqueues > 0) ||
+      (_M_parent) ||
+      (_M_nhelpers > 0) ||
+      (_M_type != type::broadcaster) ||
+      (_M_fragment_mode != fragment_mode::discard)) {
+    return false;
+  }
 
-      _M_ninterfaces++;
+  // Search this worker.
+  size_t self;
+  for (self = 0; (self < npeers) && (peers[self] != this); self++);
 
-      return true;
+  if (self == npeers) {
+    return false;
+  }
+
+  // Allocate the memory on the NUMA node of the worker.
+  numa::scoped_node node(_M_node);
+
+  size_t nqueues = flow_affinity ? MIN(npeers, max_lanes) - 1 : 1;
+
+  for (size_t i = 0; i < nqueues; i++) {
+    void* buf;
+    if (posix_memalign(&buf, CACHE_LINE_SIZE, sizeof(work_queue)) != 0) {
+      return false;
+    }
+
+    _M_queues[i] = new (buf) work_queue();
+    _M_batches[i] = nullptr;
+
+    _M_nqueues = i + 1;
+
+    if (!_M_queues[i]->create(work_queue::default_batches, flow_affinity)) {
+      return false;
     }
   }
 
-  return false;
+  _M_peers = peers;
+  _M_npeers = npeers;
+  _M_self = self;
+
+  _M_flow_affinity = flow_affinity;
+
+  return true;
 }
 
 bool net::worker::add_destination(unsigned ifindex,
                                   const void* macaddr,
                                   const char* host,
-                                  in_port_t port)
+                                  in_port_t port,
+                                  const struct rate_limiter::parameters* limit,
+                                  bool dsr)
 {
   uint8_t buf[sizeof(struct in6_addr)];
 
@@ -93,13 +311,17 @@ bool net::worker::add_destination(unsigned ifindex,
                            macaddr,
                            buf,
                            static_cast<socklen_t>(sizeof(struct in_addr)),
-                           port);
+                           port,
+                           limit,
+                           dsr);
   } else if (inet_pton(AF_INET6, host, buf) == 1) {
     return add_destination(ifindex,
                            macaddr,
                            buf,
                            static_cast<socklen_t>(sizeof(struct in6_addr)),
-                           port);
+                           port,
+                           limit,
+                           dsr);
   } else {
     return false;
   }
@@ -109,336 +331,2033 @@ bool net::worker::add_destination(unsigned ifindex,
                                   const void* macaddr,
                                   const void* addr,
                                   socklen_t addrlen,
-                                  in_port_t port)
+                                  in_port_t port,
+                                  const struct rate_limiter::parameters* limit,
+                                  bool dsr)
 {
+  // Allocate the memory on the NUMA node of the worker.
+  numa::scoped_node node(_M_node);
+
   // Search interface.
   for (size_t i = 0; i < _M_ninterfaces; i++) {
-    if (ifindex == _M_interfaces[i].index) {
+    if (ifindex == _M_interfaces[i]->index) {
+      destinations* dests;
       switch (addrlen) {
         case sizeof(struct in_addr):
-          return _M_ipv4_destinations.add(macaddr,
-                                          addr,
-                                          addrlen,
-                                          port,
-                                          _M_interfaces + i);
+          dests = &_M_ipv4_destinations;
+          break;
         case sizeof(struct in6_addr):
-          return _M_ipv6_destinations.add(macaddr,
-                                          addr,
-                                          addrlen,
-                                          port,
-                                          _M_interfaces + i);
+          dests = &_M_ipv6_destinations;
+          break;
         default:
           return false;
       }
+
+      if (!dests->add(macaddr,
+                      addr,
+                      addrlen,
+                      port,
+                      _M_interfaces[i],
+                      limit,
+                      &_M_wheel,
+                      dsr)) {
+        return false;
+      }
+
+      if (limit) {
+        _M_nlimiters++;
+      }
+
+      _M_ndests++;
+
+      _M_last = dests;
+
+      return true;
     }
   }
 
   return false;
 }
 
-bool net::worker::start()
+bool net::worker::add_link(unsigned ifindex, const void* macaddr)
 {
-  _M_running = true;
-
-  if (pthread_create(&_M_thread, nullptr, run, this) == 0) {
-    return true;
+  if (!_M_last) {
+    return false;
   }
 
-  _M_running = false;
+  // Search interface.
+  for (size_t i = 0; i < _M_ninterfaces; i++) {
+    if (ifindex == _M_interfaces[i]->index) {
+      return _M_last->add_link(_M_interfaces[i], macaddr);
+    }
+  }
 
   return false;
 }
 
-bool net::worker::destinations::add(const void* macaddr,
-                                    const void* addr,
-                                    socklen_t addrlen,
-                                    in_port_t port,
-                                    struct interface* iface)
+bool net::worker::carrier(unsigned ifindex, const bool* running)
 {
-  if (_M_used == _M_size) {
-    size_t size = (_M_size > 0) ? _M_size * 2 : 4;
-
-    struct destination* dest;
-    if ((dest = reinterpret_cast<struct destination*>(
-                  realloc(_M_destinations, size * sizeof(struct destination))
-                )) != nullptr) {
-      _M_destinations = dest;
-      _M_size = size;
-    } else {
-      return false;
+  // Search interface.
+  for (size_t i = 0; i < _M_ninterfaces; i++) {
+    if (ifindex == _M_interfaces[i]->index) {
+      _M_interfaces[i]->carrier = running;
+      return true;
     }
   }
 
-  struct destination* dest = _M_destinations + _M_used++;
+  return false;
+}
 
-  memcpy(dest->macaddr, macaddr, ETHER_ADDR_LEN);
+bool net::worker::multicast_macaddr(const void* addr,
+                                    socklen_t addrlen,
+                                    uint8_t* macaddr)
+{
+  const uint8_t* a = reinterpret_cast<const uint8_t*>(addr);
+
+  switch (addrlen) {
+    case sizeof(struct in_addr):
+      // 224.0.0.0/4.
+      if ((a[0] & 0xf0) == 0xe0) {
+        macaddr[0] = 0x01;
+        macaddr[1] = 0x00;
+        macaddr[2] = 0x5e;
+        macaddr[3] = a[1] & 0x7f;
+        macaddr[4] = a[2];
+        macaddr[5] = a[3];
+
+        return true;
+      }
 
-  memcpy(dest->addr, addr, addrlen);
-  dest->addrlen = addrlen;
+      break;
+    case sizeof(struct in6_addr):
+      // ff00::/8.
+      if (a[0] == 0xff) {
+        macaddr[0] = 0x33;
+        macaddr[1] = 0x33;
+        memcpy(macaddr + 2, a + 12, 4);
 
-  dest->port = htons(port);
+        return true;
+      }
 
-  dest->iface = iface;
+      break;
+  }
 
-  return true;
+  return false;
 }
 
-void net::worker::destinations::send_ipv4(struct destination* dest,
-                                          const void* pkt,
-                                          size_t pktlen)
+bool net::worker::add_mirror(unsigned ifindex, size_t snaplen, int vlan)
 {
-  const uint8_t* ip = reinterpret_cast<const uint8_t*>(pkt) +
-                      sizeof(struct ether_header);
-
-  size_t iphdrlen = reinterpret_cast<const struct iphdr*>(ip)->ihl << 2;
-
   // Sanity checks.
-  if (sizeof(struct ether_header) + iphdrlen + sizeof(struct udphdr) <=
-      pktlen) {
-    const struct udphdr* udphdr = reinterpret_cast<const struct udphdr*>(
-                                    ip + iphdrlen
-                                  );
-
-    size_t udplen = ntohs(udphdr->len);
-
-    if (sizeof(struct ether_header) + iphdrlen + udplen == pktlen) {
-      // Calculate checksum of the IPv4 header.
-      uint32_t sum = 0;
+  if ((_M_nmirrors == max_mirrors) ||
+      ((snaplen > 0) && (snaplen < sizeof(struct ether_header))) ||
+      (vlan < -1) ||
+      (vlan > static_cast<int>(max_vlan))) {
+    return false;
+  }
 
-      for (size_t i = 0; i < offsetof(struct iphdr, check); i += 2) {
-        sum += ntohs(*reinterpret_cast<const uint16_t*>(ip + i));
-      }
+  // Search interface.
+  for (size_t i = 0; i < _M_ninterfaces; i++) {
+    if (ifindex == _M_interfaces[i]->index) {
+      struct mirror* m = _M_mirrors + _M_nmirrors++;
 
-      // Source address.
-      sum += ntohs(*reinterpret_cast<const uint16_t*>(dest->iface->addr4));
-      sum += ntohs(*reinterpret_cast<const uint16_t*>(dest->iface->addr4 + 2));
+      m->iface = _M_interfaces[i];
+      m->snaplen = (snaplen > 0) ? snaplen : SIZE_MAX;
 
-      // Destination address.
-      sum += ntohs(*reinterpret_cast<const uint16_t*>(dest->addr));
-      sum += ntohs(*reinterpret_cast<const uint16_t*>(dest->addr + 2));
+      // 802.1Q tag (priority 0).
+      if (vlan != -1) {
+        uint16_t tpid = htons(ETHERTYPE_VLAN);
+        uint16_t tci = htons(static_cast<uint16_t>(vlan));
 
-      // Checksum of the options (if any).
-      for (size_t i = sizeof(struct iphdr); i < iphdrlen; i += 2) {
-        sum += ntohs(*reinterpret_cast<const uint16_t*>(ip + i));
-      }
+        memcpy(m->tag, &tpid, sizeof(uint16_t));
+        memcpy(m->tag + sizeof(uint16_t), &tci, sizeof(uint16_t));
 
-      while (sum > USHRT_MAX) {
-        sum = (sum >> 16) + (sum & 0xffff);
+        m->tagged = true;
+      } else {
+        m->tagged = false;
       }
 
-      uint16_t ipv4_checksum = htons(static_cast<uint16_t>(~sum));
-
-      const uint8_t* udpdata = reinterpret_cast<const uint8_t*>(udphdr) +
-                               sizeof(struct udphdr);
+      return true;
+    }
+  }
 
-      size_t udpdatalen = udplen - sizeof(struct udphdr);
+  return false;
+}
 
-#if CALCULATE_UDP_CHECKSUM
-      // Calculate UDP checksum (optional for IPv4).
+bool net::worker::start()
+{
+  pthread_attr_t attr;
+  if (pthread_attr_init(&attr) != 0) {
+    return false;
+  }
 
-      // Source address.
-      sum = ntohs(*reinterpret_cast<const uint16_t*>(dest->iface->addr4));
-      sum += ntohs(*reinterpret_cast<const uint16_t*>(dest->iface->addr4 + 2));
+  // If the worker has to run on a given CPU...
+  if (_M_cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(_M_cpu, &set);
 
-      // Destination address.
-      sum += ntohs(*reinterpret_cast<const uint16_t*>(dest->addr));
-      sum += ntohs(*reinterpret_cast<const uint16_t*>(dest->addr + 2));
+    if (pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &set) != 0) {
+      pthread_attr_destroy(&attr);
+      return false;
+    }
+  }
 
-      // Protocol.
-      sum += IPPROTO_UDP;
+  _M_state = state::setting_up;
+  _M_running = true;
 
-      // UDP length.
-      sum += udplen;
+  if (pthread_create(&_M_thread, &attr, run, this) == 0) {
+    pthread_attr_destroy(&attr);
+    return true;
+  }
 
-      // The source port of the packet to be sent is the destination port of the
-      // received packet.
-      sum += ntohs(udphdr->dest);
+  _M_running = false;
+  _M_state = state::stopped;
 
-      // Destination port.
-      sum += ntohs(dest->port);
+  pthread_attr_destroy(&attr);
 
-      // Length.
-      sum += udplen;
+  return false;
+}
 
-      // Data.
-      for (size_t i = 0; i + 1 < udpdatalen; i += 2) {
-        sum += ntohs(*reinterpret_cast<const uint16_t*>(udpdata + i));
-      }
+bool net::worker::wait_ready()
+{
+  pthread_mutex_lock(&_M_mutex);
 
-      // If the length of the data is odd...
-      if ((udpdatalen & 0x01) != 0) {
-        sum += ntohs(udpdata[udpdatalen - 1]);
-      }
+  while (_M_state == state::setting_up) {
+    pthread_cond_wait(&_M_cond, &_M_mutex);
+  }
 
-      while (sum > USHRT_MAX) {
-        sum = (sum >> 16) + (sum & 0xffff);
-      }
+  bool ready = (_M_state == state::ready);
 
-      uint16_t udp_checksum = htons(static_cast<uint16_t>(~sum));
-#else
-      uint16_t udp_checksum = 0;
-#endif
+  pthread_mutex_unlock(&_M_mutex);
 
-      // Compose UDP packet.
+  return ready;
+}
 
-      struct iovec vec[] = {
-        // Destination ethernet address.
-        {dest->macaddr, ETHER_ADDR_LEN},
+void net::worker::release()
+{
+  pthread_mutex_lock(&_M_mutex);
 
-        // Source ethernet address.
-        {dest->iface->macaddr, ETHER_ADDR_LEN},
+  if (_M_state == state::ready) {
+    _M_state = state::running;
+    pthread_cond_broadcast(&_M_cond);
+  }
 
-        // Packet type ID and IPv4 header until IPv4 checksum.
-        {const_cast<uint8_t*>(
-           reinterpret_cast<const uint8_t*>(pkt) +
-           offsetof(struct ether_header, ether_type)
-         ),
-         2 + offsetof(struct iphdr, check)},
+  pthread_mutex_unlock(&_M_mutex);
+}
 
-        // Header checksum.
-        {&ipv4_checksum, 2},
+void net::worker::stop()
+{
+  if (_M_running) {
+    pthread_mutex_lock(&_M_mutex);
 
-        // Source IPv4 address.
-        {dest->iface->addr4, sizeof(struct in_addr)},
+    _M_running = false;
+    pthread_cond_broadcast(&_M_cond);
 
-        // Destination IPv4 address.
-        {dest->addr, sizeof(struct in_addr)},
+    pthread_mutex_unlock(&_M_mutex);
 
-        // IPv4 options (if any).
-        {const_cast<uint8_t*>(ip) + sizeof(struct iphdr),
-         iphdrlen - sizeof(struct iphdr)},
+    pthread_join(_M_thread, nullptr);
 
-        // Source port (destination port of the received packet).
-        {const_cast<uint16_t*>(&udphdr->dest), 2},
+    _M_state = state::stopped;
+  }
+}
 
-        // Destination port.
-        {&dest->port, 2},
+void net::worker::park(bool release_memory)
+{
+  _M_parking = true;
 
-        // Length.
-        {const_cast<uint16_t*>(&udphdr->len), 2},
+  stop();
 
-        // Checksum.
-        {&udp_checksum, 2},
+  _M_parking = false;
 
-        // Data (if present).
-        {const_cast<uint8_t*>(udpdata), udpdatalen}
-      };
+  // Leave the fanout groups.
+  for (size_t i = 0; i < _M_nclasses; i++) {
+    _M_classes[i].rx.clear();
+  }
 
-      // Send packet.
-      dest->iface->tx.send(vec, ARRAY_SIZE(vec), send_timeout);
+  if (release_memory) {
+    for (size_t i = 0; i < _M_ninterfaces; i++) {
+      _M_interfaces[i]->tx.clear();
     }
   }
 }
 
-void net::worker::destinations::send_ipv6(struct destination* dest,
-                                          const void* pkt,
-                                          size_t pktlen)
+uint64_t net::worker::cpu_time() const
 {
-  const uint8_t* ip = reinterpret_cast<const uint8_t*>(pkt) +
-                      sizeof(struct ether_header);
-
-  const struct udphdr* udphdr = reinterpret_cast<const struct udphdr*>(
-                                  ip + sizeof(struct ip6_hdr)
-                                );
+  clockid_t clock;
+  struct timespec ts;
+
+  if ((_M_running) &&
+      (pthread_getcpuclockid(_M_thread, &clock) == 0) &&
+      (clock_gettime(clock, &ts) == 0)) {
+    return (static_cast<uint64_t>(ts.tv_sec) * 1000000ULL) +
+           (ts.tv_nsec / 1000);
+  }
 
-  size_t udplen = ntohs(udphdr->len);
+  return 0;
+}
 
-  // Sanity check.
-  if (sizeof(struct ether_header) + sizeof(struct ip6_hdr) + udplen == pktlen) {
-    // Calculate UDP checksum (mandatory for IPv6).
-    uint32_t sum = 0;
+double net::worker::fill() const
+{
+  double max = 0.0;
 
-    // Source and destination addresses.
-    for (size_t i = 0; i < sizeof(struct in6_addr); i += 2) {
-      sum += ntohs(*reinterpret_cast<const uint16_t*>(dest->iface->addr6 + i));
-      sum += ntohs(*reinterpret_cast<const uint16_t*>(dest->addr + i));
+  for (size_t i = 0; i < _M_nclasses; i++) {
+    double f;
+    if ((f = _M_classes[i].rx.fill()) > max) {
+      max = f;
     }
+  }
 
-    // UDP length.
-    sum += udplen;
+  return max;
+}
 
-    // Next header.
-    sum += IPPROTO_UDP;
+bool net::worker::ring(size_t n, struct handed_ring& ring, int& fd) const
+{
+  const ring_buffer* rb;
 
-    // The source port of the packet to be sent is the destination port of the
-    // received packet.
-    sum += ntohs(udphdr->dest);
+  if (n < _M_nclasses) {
+    ring.ifindex = _M_classes[n].ifindex;
+    ring.cls = n;
 
-    // Destination port.
-    sum += ntohs(dest->port);
+    rb = &_M_classes[n].rx;
+  } else if ((n -= _M_nclasses) < _M_ninterfaces) {
+    ring.ifindex = _M_interfaces[n]->index;
+    ring.cls = 0;
 
-    // Length.
-    sum += udplen;
+    rb = &_M_interfaces[n]->tx;
+  } else {
+    return false;
+  }
 
-    // Data.
-    const uint8_t* udpdata = reinterpret_cast<const uint8_t*>(udphdr) +
-                             sizeof(struct udphdr);
+  if ((fd = rb->fd()) != -1) {
+    rb->get_state(ring.state);
+    return true;
+  }
 
-    size_t udpdatalen = udplen - sizeof(struct udphdr);
+  return false;
+}
 
-    for (size_t i = 0; i + 1 < udpdatalen; i += 2) {
-      sum += ntohs(*reinterpret_cast<const uint16_t*>(udpdata + i));
+bool net::worker::adopt(const struct handed_ring& ring, int fd)
+{
+  ring_buffer* rb = nullptr;
+
+  if (ring.state.t == ring_buffer::type::rx) {
+    // The RX ring buffers must match the traffic classes.
+    if ((ring.cls < _M_nclasses) &&
+        (ring.ifindex == _M_classes[ring.cls].ifindex) &&
+        (ring.state.version == _M_classes[ring.cls].version) &&
+        (_M_classes[ring.cls].rx.fd() == -1)) {
+      rb = &_M_classes[ring.cls].rx;
+    }
+  } else if (ring.state.t == ring_buffer::type::tx) {
+    // Search interface.
+    for (size_t i = 0; i < _M_ninterfaces; i++) {
+      if ((ring.ifindex == _M_interfaces[i]->index) &&
+          (ring.state.version == _M_interfaces[i]->version) &&
+          (!_M_interfaces[i]->queue) &&
+          (!_M_interfaces[i]->shared) &&
+          (_M_interfaces[i]->tx.fd() == -1)) {
+        rb = &_M_interfaces[i]->tx;
+        break;
+      }
     }
 
-    // If the length of the data is odd...
-    if ((udpdatalen & 0x01) != 0) {
-      sum += ntohs(udpdata[udpdatalen - 1]);
+    // If the interface is not used anymore (or it is used through a TX
+    // thread or a shared TX ring buffer)...
+    if (!rb) {
+      close(fd);
+      return true;
     }
+  }
 
-    while (sum > USHRT_MAX) {
-      sum = (sum >> 16) + (sum & 0xffff);
+  if (rb) {
+    if (rb->adopt(fd, ring.state)) {
+      return true;
     }
 
-    uint16_t udp_checksum = htons(static_cast<uint16_t>(~sum));
+    rb->clear();
+  } else {
+    close(fd);
+  }
 
-    // Compose UDP packet.
+  return false;
+}
 
-    struct iovec vec[] = {
-      // Destination ethernet address.
-      {dest->macaddr, ETHER_ADDR_LEN},
+bool net::worker::adopted() const
+{
+  // All the traffic classes must have been taken over (a new traffic class
+  // would have its own fanout group).
+  for (size_t i = 0; i < _M_nclasses; i++) {
+    if (_M_classes[i].rx.fd() == -1) {
+      return false;
+    }
+  }
 
-      // Source ethernet address.
-      {dest->iface->macaddr, ETHER_ADDR_LEN},
+  return true;
+}
 
-      // Packet type ID and IPv6 header until IPv6 source address.
-      {const_cast<uint8_t*>(
-         reinterpret_cast<const uint8_t*>(pkt) +
-         offsetof(struct ether_header, ether_type)
-       ),
-       2 + offsetof(struct ip6_hdr, ip6_src)},
+void net::worker::show_setup_times() const
+{
+  printf("  TX ring buffers: %.1f ms.\n", _M_tx_setup_time / 1000.0);
+  printf("  RX ring buffers: %.1f ms.\n", _M_rx_setup_time / 1000.0);
 
-      // Source IPv6 address.
-      {dest->iface->addr6, sizeof(struct in6_addr)},
+  if (_M_fanout_turn) {
+    printf("  Fanout index: %zu.\n", _M_fanout_index);
+  }
+}
 
-      // Destination IPv6 address.
-      {dest->addr, sizeof(struct in6_addr)},
+bool net::worker::destinations::add(
+                                   const void* macaddr,
+                                   const void* addr,
+                                   socklen_t addrlen,
+                                   in_port_t port,
+                                   struct interface* iface,
+                                   const struct rate_limiter::parameters* limit,
+                                   timer_wheel* wheel,
+                                   bool dsr
+                                 )
+{
+  if (_M_used == _M_size) {
+    // The table has its own pages (instead of sharing them with other
+    // allocations), so they are faulted in on the NUMA node of the worker.
+    size_t pagesize = static_cast<size_t>(getpagesize());
 
-      // Source port (destination port of the received packet).
-      {const_cast<uint16_t*>(&udphdr->dest), 2},
+    size_t len = (_M_size * sizeof(struct destination) + pagesize - 1) &
+                 ~(pagesize - 1);
 
-      // Destination port.
-      {&dest->port, 2},
+    size_t newlen = (len > 0) ? len * 2 : pagesize;
 
-      // Length.
-      {const_cast<uint16_t*>(&udphdr->len), 2},
+    void* dest;
+    if (_M_destinations) {
+      dest = mremap(_M_destinations, len, newlen, MREMAP_MAYMOVE);
+    } else {
+      dest = mmap(nullptr,
+                  newlen,
+                  PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS,
+                  -1,
+                  0);
+    }
 
-      // Checksum.
-      {&udp_checksum, 2},
+    if (dest != MAP_FAILED) {
+      _M_destinations = reinterpret_cast<struct destination*>(dest);
+      _M_size = newlen / sizeof(struct destination);
+    } else {
+      return false;
+    }
+  }
 
-      // Data (if present).
-      {const_cast<uint8_t*>(udpdata), udpdatalen}
-    };
+  struct destination* dest = _M_destinations + _M_used;
 
-    // Send packet.
-    dest->iface->tx.send(vec, ARRAY_SIZE(vec), send_timeout);
-  }
-}
+  memcpy(dest->macaddr, macaddr, ETHER_ADDR_LEN);
 
-void net::worker::run()
-{
-  static const int timeout = 250; // Milliseconds.
+  memcpy(dest->addr, addr, addrlen);
+  dest->addrlen = addrlen;
 
-  do {
-    _M_rx.recv(timeout);
-  } while (_M_running);
+  dest->port = htons(port);
+
+  dest->iface = iface;
+  dest->out = iface;
+
+  // The first link is the interface and the ethernet address of the
+  // destination.
+  dest->links[0].iface = iface;
+  memcpy(dest->links[0].macaddr, macaddr, ETHER_ADDR_LEN);
+  dest->links[0].retry = 0;
+
+  dest->nlinks = 1;
+  dest->current = 0;
+
+  // Source and destination addresses (the same for the pseudo-header and
+  // the IPv4 header).
+  dest->addrsum = sum_words((addrlen == sizeof(struct in_addr)) ?
+                              iface->addr4 :
+                              iface->addr6,
+                            addrlen) +
+                  sum_words(dest->addr, addrlen);
+
+  dest->dsr = dsr;
+
+  dest->limiter = nullptr;
+
+  if (limit) {
+    // Allocate rate limiter (the frames paced have the MTU of the
+    // interface at most).
+    void* buf;
+    if (posix_memalign(&buf, CACHE_LINE_SIZE, sizeof(rate_limiter)) != 0) {
+      return false;
+    }
+
+    rate_limiter* limiter = new (buf) rate_limiter();
+
+    if (!limiter->create(*limit,
+                         sizeof(struct ether_header) + iface->mtu,
+                         wheel)) {
+      limiter->~rate_limiter();
+      free(limiter);
+
+      return false;
+    }
+
+    dest->limiter = limiter;
+  }
+
+  if (dsr) {
+    _M_ndsr++;
+  }
+
+  _M_used++;
+
+  return true;
+}
+
+bool net::worker::destinations::add_link(struct interface* iface,
+                                         const void* macaddr)
+{
+  if (_M_used == 0) {
+    return false;
+  }
+
+  struct destination* dest = _M_destinations + (_M_used - 1);
+
+  // The packets are built for the MTU of the first link.
+  if ((dest->nlinks == max_links) || (iface->mtu < dest->iface->mtu)) {
+    return false;
+  }
+
+  struct link* link = dest->links + dest->nlinks++;
+
+  link->iface = iface;
+  memcpy(link->macaddr, macaddr, ETHER_ADDR_LEN);
+  link->retry = 0;
+
+  return true;
+}
+
+void net::worker::destinations::memory(size_t* nodes) const
+{
+  if (_M_destinations) {
+    numa::memory(_M_destinations,
+                 _M_size * sizeof(struct destination),
+                 nodes);
+
+    for (size_t i = 0; i < _M_used; i++) {
+      if (_M_destinations[i].limiter) {
+        _M_destinations[i].limiter->memory(nodes);
+      }
+    }
+  }
+}
+
+void net::worker::destinations::rate_limits(uint64_t& drops,
+                                            uint64_t& paced) const
+{
+  for (size_t i = 0; i < _M_used; i++) {
+    if (_M_destinations[i].limiter) {
+      drops += _M_destinations[i].limiter->drops();
+      paced += _M_destinations[i].limiter->paced();
+    }
+  }
+}
+
+bool net::worker::destinations::limit(struct destination* dest,
+                                      const struct iovec* iov,
+                                      size_t iovcnt)
+{
+  size_t len = 0;
+  for (size_t i = 0; i < iovcnt; i++) {
+    len += iov[i].iov_len;
+  }
+
+  // If the frame is within the limit...
+  if (dest->limiter->admit(len)) {
+    return output(dest, iov, iovcnt);
+  }
+
+  // Drop the frame or pace it.
+  return dest->limiter->hold(iov, iovcnt, len, dest);
+}
+
+void net::worker::destinations::release(struct destination* dest)
+{
+  rate_limiter* limiter = dest->limiter;
+
+  // Send the frames which are within the limit.
+  struct iovec frame;
+  while (limiter->front(frame)) {
+    if (dest->nlinks == 1) {
+      send(dest->out, &frame, 1);
+    } else {
+      // Send the frame through the link it was built for.
+      struct link* link = dest->links;
+      for (size_t i = 1; i < dest->nlinks; i++) {
+        if ((memcmp(frame.iov_base,
+                    dest->links[i].macaddr,
+                    ETHER_ADDR_LEN) == 0) &&
+            (memcmp(reinterpret_cast<const uint8_t*>(frame.iov_base) +
+                    ETHER_ADDR_LEN,
+                    dest->links[i].iface->macaddr,
+                    ETHER_ADDR_LEN) == 0)) {
+          link = dest->links + i;
+          break;
+        }
+      }
+
+      if (!send(link->iface, &frame, 1)) {
+        stalled(link);
+      }
+    }
+
+    limiter->pop();
+  }
+
+  // Set the timer for the next frame (if any).
+  limiter->schedule(dest);
+}
+
+void net::worker::destinations::select(struct destination* dest,
+                                       uint32_t hash)
+{
+  size_t first = (hash >> 16) % dest->nlinks;
+  size_t i = first;
+
+  // The clock is only read when a link has stalled.
+  uint64_t now = 0;
+
+  // Search the first link which can send, starting with the one of the
+  // flow (if none can, the one of the flow is used).
+  do {
+    struct link* link = dest->links + i;
+
+    if ((!link->iface->carrier) ||
+        (__atomic_load_n(link->iface->carrier, __ATOMIC_RELAXED))) {
+      if (link->retry == 0) {
+        break;
+      }
+
+      if (now == 0) {
+        now = now_nsec();
+      }
+
+      // Try again the link.
+      if (now >= link->retry) {
+        link->retry = 0;
+        break;
+      }
+    }
+
+    if (++i == dest->nlinks) {
+      i = 0;
+    }
+  } while (i != first);
+
+  if (i != dest->current) {
+    memcpy(dest->macaddr, dest->links[i].macaddr, ETHER_ADDR_LEN);
+    dest->out = dest->links[i].iface;
+    dest->current = i;
+  }
+}
+
+void net::worker::destinations::stalled(struct link* link)
+{
+  link->retry = now_nsec() + link_retry;
+}
+
+bool net::worker::destinations::parse_ipv4(const void* pkt,
+                                           size_t pktlen,
+                                           struct packet& p)
+{
+  p.pkt = reinterpret_cast<const uint8_t*>(pkt);
+  p.ip = p.pkt + sizeof(struct ether_header);
+
+  p.iphdrlen = reinterpret_cast<const struct iphdr*>(p.ip)->ihl << 2;
+
+  // Sanity checks.
+  if ((p.iphdrlen >= sizeof(struct iphdr)) &&
+      (sizeof(struct ether_header) + p.iphdrlen + sizeof(struct udphdr) <=
+       pktlen)) {
+    p.udphdr = reinterpret_cast<const struct udphdr*>(p.ip + p.iphdrlen);
+    p.udplen = ntohs(p.udphdr->len);
+
+    return ((p.udplen >= sizeof(struct udphdr)) &&
+            (sizeof(struct ether_header) + p.iphdrlen + p.udplen == pktlen));
+  }
+
+  return false;
+}
+
+void net::worker::destinations::sum_ipv4(struct packet& p)
+{
+  // IPv4 header until the checksum and options (if any).
+  p.iphdrsum = sum_words(p.ip, offsetof(struct iphdr, check)) +
+               sum_words(p.ip + sizeof(struct iphdr),
+                         p.iphdrlen - sizeof(struct iphdr));
+
+#if CALCULATE_UDP_CHECKSUM
+  // UDP checksum (optional for IPv4): protocol, UDP length, source port
+  // (the destination port of the received packet), length and data.
+  p.udpsum = IPPROTO_UDP +
+             p.udplen +
+             ntohs(p.udphdr->dest) +
+             p.udplen +
+             sum_words(reinterpret_cast<const uint8_t*>(p.udphdr) +
+                       sizeof(struct udphdr),
+                       p.udplen - sizeof(struct udphdr));
+#endif
+}
+
+void net::worker::destinations::send_ipv4(struct destination* dest,
+                                          const struct packet& p)
+{
+  // Checksum of the IPv4 header.
+  uint16_t ipv4_checksum = htons(static_cast<uint16_t>(
+                             ~fold(p.iphdrsum + dest->addrsum)
+                           ));
+
+#if CALCULATE_UDP_CHECKSUM
+  // UDP checksum (the addresses and the destination port are added to the
+  // sum of the packet).
+  uint16_t udp_checksum = htons(static_cast<uint16_t>(
+                            ~fold(p.udpsum + dest->addrsum + ntohs(dest->port))
+                          ));
+
+  // A checksum of 0 means no checksum.
+  if (udp_checksum == 0) {
+    udp_checksum = 0xffff;
+  }
+#else
+  uint16_t udp_checksum = 0;
+#endif
+
+  // If the datagram doesn't fit in the MTU of the interface...
+  if (p.iphdrlen + p.udplen > dest->iface->mtu) {
+    send_ipv4_fragments(dest, p.ip, p.iphdrlen, p.udphdr, udp_checksum);
+    return;
+  }
+
+  // Compose UDP packet.
+
+  struct iovec vec[] = {
+    // Destination ethernet address.
+    {dest->macaddr, ETHER_ADDR_LEN},
+
+    // Source ethernet address.
+    {dest->out->macaddr, ETHER_ADDR_LEN},
+
+    // Packet type ID and IPv4 header until IPv4 checksum.
+    {const_cast<uint8_t*>(p.pkt) + offsetof(struct ether_header, ether_type),
+     2 + offsetof(struct iphdr, check)},
+
+    // Header checksum.
+    {&ipv4_checksum, 2},
+
+    // Source IPv4 address.
+    {dest->iface->addr4, sizeof(struct in_addr)},
+
+    // Destination IPv4 address.
+    {dest->addr, sizeof(struct in_addr)},
+
+    // IPv4 options (if any).
+    {const_cast<uint8_t*>(p.ip) + sizeof(struct iphdr),
+     p.iphdrlen - sizeof(struct iphdr)},
+
+    // Source port (destination port of the received packet).
+    {const_cast<uint16_t*>(&p.udphdr->dest), 2},
+
+    // Destination port.
+    {&dest->port, 2},
+
+    // Length.
+    {const_cast<uint16_t*>(&p.udphdr->len), 2},
+
+    // Checksum.
+    {&udp_checksum, 2},
+
+    // Data (if present).
+    {const_cast<struct udphdr*>(p.udphdr) + 1,
+     p.udplen - sizeof(struct udphdr)}
+  };
+
+  // Send packet.
+  transmit(dest, vec, ARRAY_SIZE(vec));
+}
+
+void net::worker::destinations::send_ipv4_fragments(
+                                           struct destination* dest,
+                                           const uint8_t* ip,
+                                           size_t iphdrlen,
+                                           const struct udphdr* udphdr,
+                                           uint16_t udp_checksum
+                                         )
+{
+  // If the "Don't Fragment" flag is set, drop the datagram.
+  if ((reinterpret_cast<const struct iphdr*>(ip)->frag_off &
+       htons(IP_DF)) != 0) {
+    return;
+  }
+
+  // UDP header of the packet to be sent.
+  struct udphdr udp;
+  udp.source = udphdr->dest;
+  udp.dest = dest->port;
+  udp.len = udphdr->len;
+  udp.check = udp_checksum;
+
+  const uint8_t* udpdata = reinterpret_cast<const uint8_t*>(udphdr) +
+                           sizeof(struct udphdr);
+
+  size_t udplen = ntohs(udphdr->len);
+
+  // IPv4 header of the fragments (the options are only sent in the first
+  // fragment).
+  uint8_t hdr[15 << 2];
+  memcpy(hdr, ip, iphdrlen);
+
+  struct iphdr* iphdr = reinterpret_cast<struct iphdr*>(hdr);
+  memcpy(&iphdr->saddr, dest->iface->addr4, sizeof(struct in_addr));
+  memcpy(&iphdr->daddr, dest->addr, sizeof(struct in_addr));
+
+  size_t offset = 0;
+
+  do {
+    size_t hdrlen = (offset == 0) ? iphdrlen : sizeof(struct iphdr);
+
+    size_t len = MIN((dest->iface->mtu - hdrlen) & ~static_cast<size_t>(7),
+                     udplen - offset);
+
+    iphdr->ihl = hdrlen >> 2;
+    iphdr->tot_len = htons(static_cast<uint16_t>(hdrlen + len));
+    iphdr->frag_off = htons(static_cast<uint16_t>(
+                              (offset >> 3) |
+                              ((offset + len < udplen) ? IP_MF : 0)
+                            ));
+
+    iphdr->check = ipv4_header_checksum(hdr,
+                                        hdrlen,
+                                        dest->iface->addr4,
+                                        dest->addr);
+
+    // The UDP header is only sent in the first fragment.
+    size_t udphdrlen = (offset == 0) ? sizeof(struct udphdr) : 0;
+
+    struct iovec vec[] = {
+      // Destination ethernet address.
+      {dest->macaddr, ETHER_ADDR_LEN},
+
+      // Source ethernet address.
+      {dest->out->macaddr, ETHER_ADDR_LEN},
+
+      // Packet type ID.
+      {const_cast<uint8_t*>(ip) -
+       sizeof(struct ether_header) +
+       offsetof(struct ether_header, ether_type),
+       2},
+
+      // IPv4 header.
+      {hdr, hdrlen},
+
+      // UDP header (first fragment).
+      {&udp, udphdrlen},
+
+      // Data.
+      {const_cast<uint8_t*>(udpdata) + offset + udphdrlen -
+       sizeof(struct udphdr),
+       len - udphdrlen}
+    };
+
+    // Send fragment.
+    if (!transmit(dest, vec, ARRAY_SIZE(vec))) {
+      return;
+    }
+
+    offset += len;
+  } while (offset < udplen);
+}
+
+void net::worker::destinations::send_ipv4_fragment(struct destination* dest,
+                                                   const void* pkt,
+                                                   size_t pktlen)
+{
+  const uint8_t* ip = reinterpret_cast<const uint8_t*>(pkt) +
+                      sizeof(struct ether_header);
+
+  const struct iphdr* iphdr = reinterpret_cast<const struct iphdr*>(ip);
+
+  size_t iphdrlen = iphdr->ihl << 2;
+  size_t totlen = ntohs(iphdr->tot_len);
+
+  // Sanity checks.
+  if ((iphdrlen < sizeof(struct iphdr)) ||
+      (totlen <= iphdrlen) ||
+      (sizeof(struct ether_header) + totlen > pktlen)) {
+    return;
+  }
+
+  // All the fragments of a datagram are sent through the same link.
+  if (dest->nlinks > 1) {
+    select(dest, (iphdr->saddr ^ iphdr->id) * 0x9e3779b1);
+  }
+
+  // Direct server return: the fragment is sent as received.
+  if (dest->dsr) {
+    send_dsr(dest, pkt, sizeof(struct ether_header) + totlen);
+    return;
+  }
+
+  // Calculate checksum of the IPv4 header.
+  uint16_t ipv4_checksum = ipv4_header_checksum(ip,
+                                                iphdrlen,
+                                                dest->iface->addr4,
+                                                dest->addr);
+
+  const struct udphdr* udphdr = reinterpret_cast<const struct udphdr*>(
+                                  ip + iphdrlen
+                                );
+
+  struct udphdr udp;
+  size_t udphdrlen;
+
+  // If this is the first fragment (it carries the UDP header)...
+  if ((iphdr->frag_off & htons(IP_OFFMASK)) == 0) {
+    if (totlen < iphdrlen + sizeof(struct udphdr)) {
+      return;
+    }
+
+    udp.source = udphdr->dest;
+    udp.dest = dest->port;
+    udp.len = udphdr->len;
+
+    // The checksum covers the whole datagram, update it incrementally
+    // (RFC 1624) if present.
+    if (udphdr->check != 0) {
+      uint32_t sum = static_cast<uint16_t>(~ntohs(udphdr->check));
+
+      for (size_t i = 0; i < sizeof(struct in_addr); i += 2) {
+        // Old source and destination addresses.
+        sum += static_cast<uint16_t>(
+                 ~ntohs(*reinterpret_cast<const uint16_t*>(
+                          reinterpret_cast<const uint8_t*>(&iphdr->saddr) + i
+                        ))
+               );
+
+        sum += static_cast<uint16_t>(
+                 ~ntohs(*reinterpret_cast<const uint16_t*>(
+                          reinterpret_cast<const uint8_t*>(&iphdr->daddr) + i
+                        ))
+               );
+
+        // New source and destination addresses.
+        sum += ntohs(
+                 *reinterpret_cast<const uint16_t*>(dest->iface->addr4 + i)
+               );
+
+        sum += ntohs(*reinterpret_cast<const uint16_t*>(dest->addr + i));
+      }
+
+      // The old destination port becomes the new source port, so only the
+      // old source port has to be replaced by the new destination port.
+      sum += static_cast<uint16_t>(~ntohs(udphdr->source));
+      sum += ntohs(dest->port);
+
+      while (sum > USHRT_MAX) {
+        sum = (sum >> 16) + (sum & 0xffff);
+      }
+
+      udp.check = htons(static_cast<uint16_t>(~sum));
+
+      if (udp.check == 0) {
+        udp.check = 0xffff;
+      }
+    } else {
+      udp.check = 0;
+    }
+
+    udphdrlen = sizeof(struct udphdr);
+  } else {
+    udphdrlen = 0;
+  }
+
+  // Compose fragment.
+
+  struct iovec vec[] = {
+    // Destination ethernet address.
+    {dest->macaddr, ETHER_ADDR_LEN},
+
+    // Source ethernet address.
+    {dest->out->macaddr, ETHER_ADDR_LEN},
+
+    // Packet type ID and IPv4 header until IPv4 checksum.
+    {const_cast<uint8_t*>(
+       reinterpret_cast<const uint8_t*>(pkt) +
+       offsetof(struct ether_header, ether_type)
+     ),
+     2 + offsetof(struct iphdr, check)},
+
+    // Header checksum.
+    {&ipv4_checksum, 2},
+
+    // Source IPv4 address.
+    {dest->iface->addr4, sizeof(struct in_addr)},
+
+    // Destination IPv4 address.
+    {dest->addr, sizeof(struct in_addr)},
+
+    // IPv4 options (if any).
+    {const_cast<uint8_t*>(ip) + sizeof(struct iphdr),
+     iphdrlen - sizeof(struct iphdr)},
+
+    // UDP header (first fragment).
+    {&udp, udphdrlen},
+
+    // Data.
+    {const_cast<uint8_t*>(ip) + iphdrlen + udphdrlen,
+     totlen - iphdrlen - udphdrlen}
+  };
+
+  // Send fragment.
+  transmit(dest, vec, ARRAY_SIZE(vec));
+}
+
+bool net::worker::destinations::parse_ipv6(const void* pkt,
+                                           size_t pktlen,
+                                           struct packet& p)
+{
+  p.pkt = reinterpret_cast<const uint8_t*>(pkt);
+  p.ip = p.pkt + sizeof(struct ether_header);
+  p.iphdrlen = sizeof(struct ip6_hdr);
+
+  // Sanity checks.
+  if (sizeof(struct ether_header) + p.iphdrlen + sizeof(struct udphdr) <=
+      pktlen) {
+    p.udphdr = reinterpret_cast<const struct udphdr*>(p.ip + p.iphdrlen);
+    p.udplen = ntohs(p.udphdr->len);
+
+    return ((p.udplen >= sizeof(struct udphdr)) &&
+            (sizeof(struct ether_header) + p.iphdrlen + p.udplen == pktlen));
+  }
+
+  return false;
+}
+
+void net::worker::destinations::sum_ipv6(struct packet& p)
+{
+  // UDP checksum (mandatory for IPv6): UDP length, next header, source port
+  // (the destination port of the received packet), length and data.
+  p.udpsum = p.udplen +
+             IPPROTO_UDP +
+             ntohs(p.udphdr->dest) +
+             p.udplen +
+             sum_words(reinterpret_cast<const uint8_t*>(p.udphdr) +
+                       sizeof(struct udphdr),
+                       p.udplen - sizeof(struct udphdr));
+}
+
+void net::worker::destinations::send_ipv6(struct destination* dest,
+                                          const struct packet& p)
+{
+  // UDP checksum (the addresses and the destination port are added to the
+  // sum of the packet).
+  uint16_t udp_checksum = htons(static_cast<uint16_t>(
+                            ~fold(p.udpsum + dest->addrsum + ntohs(dest->port))
+                          ));
+
+  // A checksum of 0 is transmitted as all ones.
+  if (udp_checksum == 0) {
+    udp_checksum = 0xffff;
+  }
+
+  // Compose UDP packet.
+
+  struct iovec vec[] = {
+    // Destination ethernet address.
+    {dest->macaddr, ETHER_ADDR_LEN},
+
+    // Source ethernet address.
+    {dest->out->macaddr, ETHER_ADDR_LEN},
+
+    // Packet type ID and IPv6 header until IPv6 source address.
+    {const_cast<uint8_t*>(p.pkt) + offsetof(struct ether_header, ether_type),
+     2 + offsetof(struct ip6_hdr, ip6_src)},
+
+    // Source IPv6 address.
+    {dest->iface->addr6, sizeof(struct in6_addr)},
+
+    // Destination IPv6 address.
+    {dest->addr, sizeof(struct in6_addr)},
+
+    // Source port (destination port of the received packet).
+    {const_cast<uint16_t*>(&p.udphdr->dest), 2},
+
+    // Destination port.
+    {&dest->port, 2},
+
+    // Length.
+    {const_cast<uint16_t*>(&p.udphdr->len), 2},
+
+    // Checksum.
+    {&udp_checksum, 2},
+
+    // Data (if present).
+    {const_cast<struct udphdr*>(p.udphdr) + 1,
+     p.udplen - sizeof(struct udphdr)}
+  };
+
+  // Send packet.
+  transmit(dest, vec, ARRAY_SIZE(vec));
+}
+
+void net::worker::classify(const struct iovec* pkts, size_t npkts)
+{
+  struct classified_packets& c = _M_classified;
+
+  // Gather the fields of the headers (only those within the frame).
+  for (size_t i = 0; i < npkts; i++) {
+    if (i + prefetch_distance < npkts) {
+      __builtin_prefetch(pkts[i + prefetch_distance].iov_base);
+    }
+
+    const uint8_t* ip = reinterpret_cast<const uint8_t*>(pkts[i].iov_base) +
+                        sizeof(struct ether_header);
+
+    size_t len = pkts[i].iov_len;
+
+    c.len[i] = len;
+
+    if (sizeof(struct ether_header) + sizeof(struct iphdr) <= len) {
+      c.vihl[i] = *ip;
+      c.frag_off[i] = reinterpret_cast<const struct iphdr*>(ip)->frag_off;
+
+      size_t iphdrlen = ((*ip & 0xf0) == 0x40) ? (*ip & 0x0f) << 2 :
+                                                  sizeof(struct ip6_hdr);
+
+      if (sizeof(struct ether_header) + iphdrlen + sizeof(struct udphdr) <=
+          len) {
+        c.udplen[i] = ntohs(
+                        reinterpret_cast<const struct udphdr*>(
+                          ip + iphdrlen
+                        )->len
+                      );
+      } else {
+        c.udplen[i] = 0;
+      }
+    } else {
+      c.vihl[i] = 0;
+      c.frag_off[i] = 0;
+      c.udplen[i] = 0;
+    }
+  }
+
+  // Classify the packets (without branches, the loop is vectorized; the
+  // sizes are 32-bit).
+  static const uint32_t ethhdrlen = sizeof(struct ether_header);
+  static const uint32_t ipv4hdrlen = sizeof(struct iphdr);
+  static const uint32_t ipv6hdrlen = sizeof(struct ip6_hdr);
+  static const uint32_t udphdrlen = sizeof(struct udphdr);
+
+#pragma omp simd
+  for (size_t i = 0; i < npkts; i++) {
+    uint32_t vihl = c.vihl[i];
+    uint32_t ipv4 = ((vihl & 0xf0) == 0x40);
+    uint32_t ipv6 = ((vihl & 0xf0) == 0x60);
+
+    // IPv4: IHL * 4, IPv6: fixed header.
+    uint32_t iphdrlen = (-ipv4 & ((vihl & 0x0f) << 2)) |
+                        (~-ipv4 & ipv6hdrlen);
+
+    uint32_t valid = (iphdrlen >= ipv4hdrlen) &
+                     (c.udplen[i] >= udphdrlen) &
+                     (ethhdrlen + iphdrlen + c.udplen[i] == c.len[i]);
+
+    uint32_t fragment = ipv4 &
+                        ((c.frag_off[i] & htons(IP_MF | IP_OFFMASK)) != 0);
+
+    c.iphdrlen[i] = iphdrlen;
+
+    // The conditions are exclusive (a fragment is IPv4).
+    c.kind[i] = static_cast<packet_kind>(
+                  (fragment *
+                   static_cast<uint32_t>(packet_kind::ipv4_fragment)) +
+                  ((ipv4 & valid & (fragment ^ 1)) *
+                   static_cast<uint32_t>(packet_kind::ipv4)) +
+                  ((ipv6 & valid) *
+                   static_cast<uint32_t>(packet_kind::ipv6))
+                );
+  }
+
+  // Build the lists of packets of each address family (the malformed
+  // packets are discarded).
+  c.nipv4 = 0;
+  c.nipv6 = 0;
+
+  for (size_t i = 0; i < npkts; i++) {
+    c.ipv4[c.nipv4] = i;
+    c.nipv4 += (c.kind[i] == packet_kind::ipv4) |
+               (c.kind[i] == packet_kind::ipv4_fragment);
+
+    c.ipv6[c.nipv6] = i;
+    c.nipv6 += (c.kind[i] == packet_kind::ipv6);
+  }
+
+  _M_malformed += npkts - c.nipv4 - c.nipv6;
+}
+
+void net::worker::mirror(const struct iovec* pkts, size_t npkts)
+{
+  // Frames of a batch (the tagged ones are made of the ethernet addresses,
+  // the tag and the rest of the frame).
+  struct iovec frames[max_mirrored * 3];
+
+  // For each mirror port...
+  for (size_t i = 0; i < _M_nmirrors; i++) {
+    struct mirror* m = _M_mirrors + i;
+
+    // Longest frame the interface can send (without the tag).
+    size_t maxlen = sizeof(struct ether_header) + m->iface->mtu;
+
+    size_t iovcnt = m->tagged ? 3 : 1;
+
+    for (size_t j = 0; j < npkts; ) {
+      size_t n = 0;
+
+      // Fill a batch.
+      for (; (j < npkts) && (n < max_mirrored); j++) {
+        uint8_t* pkt = reinterpret_cast<uint8_t*>(pkts[j].iov_base);
+        size_t len = MIN(pkts[j].iov_len, m->snaplen);
+
+        if (len > maxlen) {
+          _M_mirror_drops++;
+          continue;
+        }
+
+        struct iovec* frame = frames + (n++ * iovcnt);
+
+        if (m->tagged) {
+          frame[0].iov_base = pkt;
+          frame[0].iov_len = ETHER_ADDR_LEN * 2;
+
+          frame[1].iov_base = m->tag;
+          frame[1].iov_len = sizeof(m->tag);
+
+          frame[2].iov_base = pkt + (ETHER_ADDR_LEN * 2);
+          frame[2].iov_len = len - (ETHER_ADDR_LEN * 2);
+        } else {
+          frame->iov_base = pkt;
+          frame->iov_len = len;
+        }
+      }
+
+      if (n > 0) {
+        if (send(m->iface, frames, iovcnt, n)) {
+          _M_mirrored += n;
+        } else {
+          _M_mirror_drops += n;
+        }
+      }
+    }
+  }
+}
+
+void net::worker::dispatch(const struct iovec* pkts, size_t npkts)
+{
+  // Publish the block.
+  uint64_t seq = _M_block.seq + 1;
+
+  _M_block.pkts = pkts;
+  _M_block.npkts = npkts;
+
+  __atomic_store_n(&_M_block.seq, seq, __ATOMIC_RELEASE);
+
+  // Send the packets to the destinations of the worker (the helpers send
+  // them to theirs meanwhile).
+  handle<type::broadcaster>(pkts, npkts);
+
+  // Wait for the helpers (the block is returned to the kernel afterwards)
+  // unless the worker is being stopped.
+  while (__atomic_load_n(&_M_block.done, __ATOMIC_ACQUIRE) !=
+         seq * _M_nhelpers) {
+    if (!__atomic_load_n(&_M_running, __ATOMIC_RELAXED)) {
+      return;
+    }
+
+    sched_yield();
+  }
+}
+
+void net::worker::assist()
+{
+  struct block* b = &_M_parent->_M_block;
+
+  // Last block sent by all the helpers (a block published before the
+  // helper started is still sent, the worker waits for it).
+  uint64_t seen = __atomic_load_n(&b->done, __ATOMIC_ACQUIRE) /
+                  _M_parent->_M_nhelpers;
+
+  unsigned idle = 0;
+
+  do {
+    if (_M_nlimiters > 0) {
+      pace();
+    }
+
+    uint64_t seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+
+    // If there is a new block...
+    if (seq != seen) {
+      handle<type::broadcaster>(b->pkts, b->npkts);
+
+      seen = seq;
+
+      __atomic_fetch_add(&b->done, 1, __ATOMIC_RELEASE);
+
+      idle = 0;
+    } else if (++idle < max_idle_rounds) {
+      sched_yield();
+    } else {
+      usleep(idle_sleep);
+    }
+  } while (_M_running);
+}
+
+void net::worker::share(const struct iovec* pkts,
+                        const uint32_t* hashes,
+                        size_t npkts,
+                        size_t block,
+                        bool backlog)
+{
+  if (!_M_flow_affinity) {
+    // If the worker is falling behind...
+    if (backlog) {
+      work_queue* queue = _M_queues[0];
+
+      // Publish the packets in batches (the rest are processed by the
+      // worker if the queue is full).
+      while (npkts > 0) {
+        work_queue::batch* b;
+        if ((b = queue->reserve()) == nullptr) {
+          break;
+        }
+
+        size_t n = MIN(npkts, work_queue::batch_size);
+
+        memcpy(b->pkts, pkts, n * sizeof(struct iovec));
+        b->npkts = n;
+
+        // The block is returned to the kernel when the batch has been
+        // processed.
+        b->rx = _M_rx;
+        b->block = block;
+
+        _M_rx->hold(block);
+
+        queue->publish();
+
+        _M_published++;
+
+        pkts += n;
+        npkts -= n;
+      }
+    }
+
+    deliver(pkts, npkts);
+
+    return;
+  }
+
+  // For each packet...
+  for (size_t i = 0; i < npkts; i++) {
+    // Lane of the flow (by the flow hash computed by the kernel).
+    size_t lane = hashes[i] % (_M_nqueues + 1);
+
+    // The worker processes the first lane.
+    if (lane == 0) {
+      packet(pkts[i].iov_base, pkts[i].iov_len);
+      continue;
+    }
+
+    work_queue* queue = _M_queues[lane - 1];
+    work_queue::batch* b = _M_batches[lane - 1];
+
+    if (!b) {
+      // If the worker is not falling behind and the packets of the lane
+      // published before have been processed, the worker processes the
+      // packet itself.
+      if ((!backlog) && (queue->idle())) {
+        packet(pkts[i].iov_base, pkts[i].iov_len);
+        continue;
+      }
+
+      b = reserve(queue);
+
+      b->rx = _M_rx;
+      b->block = block;
+
+      _M_rx->hold(block);
+
+      _M_batches[lane - 1] = b;
+    }
+
+    b->pkts[b->npkts++] = pkts[i];
+
+    // If the batch is full...
+    if (b->npkts == work_queue::batch_size) {
+      queue->publish();
+
+      _M_published++;
+
+      _M_batches[lane - 1] = nullptr;
+    }
+  }
+
+  // Publish the batches being filled.
+  for (size_t i = 0; i < _M_nqueues; i++) {
+    if (_M_batches[i]) {
+      _M_queues[i]->publish();
+
+      _M_published++;
+
+      _M_batches[i] = nullptr;
+    }
+  }
+}
+
+net::work_queue::batch* net::worker::reserve(work_queue* queue)
+{
+  do {
+    work_queue::batch* b;
+    if ((b = queue->reserve()) != nullptr) {
+      return b;
+    }
+
+    // The queue is full, process its oldest batch (the lane might be being
+    // processed by another worker).
+    if ((b = queue->take()) != nullptr) {
+      process(queue, b);
+    } else {
+      sched_yield();
+    }
+  } while (true);
+}
+
+void net::worker::process(work_queue* queue, work_queue::batch* b)
+{
+  deliver(b->pkts, b->npkts);
+
+  ring_buffer* rx = b->rx;
+  size_t block = b->block;
+
+  queue->complete(b);
+
+  rx->release(block);
+}
+
+bool net::worker::steal()
+{
+  // For each worker (this one first)...
+  for (size_t i = 0; i < _M_npeers; i++) {
+    worker* w = _M_peers[(_M_self + i) % _M_npeers];
+
+    // For each queue of the worker...
+    for (size_t j = 0; j < w->_M_nqueues; j++) {
+      work_queue::batch* b;
+      if ((b = w->_M_queues[j]->take()) != nullptr) {
+        process(w->_M_queues[j], b);
+
+        if (w != this) {
+          _M_taken++;
+        }
+
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+void net::worker::drain()
+{
+  for (size_t i = 0; i < _M_nqueues; i++) {
+    work_queue* queue = _M_queues[i];
+
+    // Wait also for the batches being processed by other workers (their
+    // blocks are held until then).
+    while (!queue->idle()) {
+      work_queue::batch* b;
+      if ((b = queue->take()) != nullptr) {
+        process(queue, b);
+      } else {
+        sched_yield();
+      }
+    }
+  }
+}
+
+bool net::worker::show_statistics()
+{
+  if (_M_nclasses == 1) {
+    if (!_M_classes[0].rx.show_statistics()) {
+      return false;
+    }
+  } else {
+    // For each traffic class...
+    for (size_t i = 0; i < _M_nclasses; i++) {
+      if (i == 0) {
+        printf("Default class:\n");
+      } else {
+        printf("Class %zu:\n", i);
+      }
+
+      if (!_M_classes[i].rx.show_statistics()) {
+        return false;
+      }
+    }
+  }
+
+  if (_M_nqueues > 0) {
+    printf("%llu batches published.\n",
+           static_cast<unsigned long long>(
+             __atomic_load_n(&_M_published, __ATOMIC_RELAXED)
+           ));
+
+    printf("%llu batches taken from other workers.\n",
+           static_cast<unsigned long long>(
+             __atomic_load_n(&_M_taken, __ATOMIC_RELAXED)
+           ));
+  }
+
+  printf("%llu malformed packets discarded.\n",
+         static_cast<unsigned long long>(
+           __atomic_load_n(&_M_malformed, __ATOMIC_RELAXED)
+         ));
+
+  if (_M_fragment_mode == fragment_mode::reassemble) {
+    printf("%llu IPv4 datagrams (%llu fragments) expired without "
+           "completing.\n",
+           static_cast<unsigned long long>(_M_reassembler.expired()),
+           static_cast<unsigned long long>(
+             _M_reassembler.expired_fragments()
+           ));
+  }
+
+  if (_M_nlimiters > 0) {
+    uint64_t drops = 0, paced = 0;
+    _M_ipv4_destinations.rate_limits(drops, paced);
+    _M_ipv6_destinations.rate_limits(drops, paced);
+
+    printf("%llu frames paced, %llu frames dropped (rate limits).\n",
+           static_cast<unsigned long long>(paced),
+           static_cast<unsigned long long>(drops));
+  }
+
+  if (_M_nmirrors > 0) {
+    printf("%llu frames mirrored, %llu frames dropped (mirror ports).\n",
+           static_cast<unsigned long long>(
+             __atomic_load_n(&_M_mirrored, __ATOMIC_RELAXED)
+           ),
+           static_cast<unsigned long long>(
+             __atomic_load_n(&_M_mirror_drops, __ATOMIC_RELAXED)
+           ));
+  }
+
+  return true;
+}
+
+size_t net::worker::show_ring_buffers() const
+{
+  size_t total = 0;
+
+  for (size_t i = 0; i < _M_nclasses; i++) {
+    size_t size = _M_classes[i].rx.size();
+
+    if (i == 0) {
+      printf("  RX ring buffer (default class): %zu KB.\n", size / 1024);
+    } else {
+      printf("  RX ring buffer (class %zu): %zu KB.\n", i, size / 1024);
+    }
+
+    total += size;
+  }
+
+  for (size_t i = 0; i < _M_ninterfaces; i++) {
+    const struct interface* iface = _M_interfaces[i];
+
+    char name[IF_NAMESIZE];
+    if (!if_indextoname(iface->index, name)) {
+      snprintf(name, sizeof(name), "%u", iface->index);
+    }
+
+    // The queues of the TX threads are not locked.
+    if (iface->queue) {
+      printf("  TX queue (%s): %zu KB.\n", name, iface->queue->size() / 1024);
+      continue;
+    }
+
+    // The shared TX ring buffers are shown once.
+    if (iface->shared) {
+      printf("  TX ring buffer (%s): shared.\n", name);
+      continue;
+    }
+
+    size_t size = iface->tx.size();
+
+    printf("  TX ring buffer (%s): %zu KB.\n", name, size / 1024);
+
+    total += size;
+  }
+
+  return total;
+}
+
+void net::worker::memory(size_t* nodes) const
+{
+  for (size_t i = 0; i < _M_nclasses; i++) {
+    _M_classes[i].rx.memory(nodes);
+  }
+
+  for (size_t i = 0; i < _M_ninterfaces; i++) {
+    _M_interfaces[i]->tx.memory(nodes);
+  }
+
+  _M_ipv4_destinations.memory(nodes);
+  _M_ipv6_destinations.memory(nodes);
+
+  _M_reassembler.memory(nodes);
+
+  for (size_t i = 0; i < _M_nqueues; i++) {
+    _M_queues[i]->memory(nodes);
+  }
+}
+
+bool net::worker::setup()
+{
+  // Allocate the memory on the NUMA node of the worker (the thread is
+  // already running on its CPU, so the pages are faulted in locally anyway).
+  numa::scoped_node node(_M_node);
+
+  uint64_t start = now_usec();
+
+  // Create the TX ring buffers first, so the packets can be sent as soon as
+  // they are received (the ring buffers which already exist, because the
+  // worker is restarted or they have been taken over from another process,
+  // are kept).
+  for (size_t i = 0; i < _M_ninterfaces; i++) {
+    struct interface* iface = _M_interfaces[i];
+
+    // The interfaces with a TX thread or a shared TX ring buffer don't have
+    // TX ring buffer.
+    if ((!iface->queue) &&
+        (!iface->shared) &&
+        (iface->tx.fd() == -1) &&
+        (!iface->tx.create(iface->version,
+                           ring_buffer::type::tx,
+                           iface->ring_size,
+                           iface->index,
+                           nullptr,
+                           0,
+                           0,
+                           0))) {
+      iface->tx.clear();
+      return false;
+    }
+  }
+
+  uint64_t now = now_usec();
+
+  _M_tx_setup_time = now - start;
+
+  start = now;
+
+  // Until a socket joins its fanout group, it would receive a copy of
+  // every packet: it drops them.
+  static struct sock_filter drop[] = {BPF_STMT(BPF_RET | BPF_K, 0)};
+  static const struct sock_fprog drop_all = {ARRAY_SIZE(drop), drop};
+
+  // Create the RX ring buffers (in parallel with the other workers). The
+  // sockets join their fanout groups afterwards, in the order of the
+  // workers.
+  bool join[max_classes];
+  bool joining = false;
+
+  for (size_t i = 0; i < _M_nclasses; i++) {
+    struct traffic_class* c = _M_classes + i;
+
+    if ((join[i] = ((c->rx.fd() == -1) && (c->fanout_size > 0)))) {
+      if (!c->rx.create(c->version,
+                        ring_buffer::type::rx,
+                        c->ring_size,
+                        c->ifindex,
+                        &drop_all,
+                        c->fanout,
+                        0,
+                        c->fanout_id)) {
+        c->rx.clear();
+        return false;
+      }
+
+      joining = true;
+    } else if ((c->rx.fd() == -1) &&
+               (!c->rx.create(c->version,
+                              ring_buffer::type::rx,
+                              c->ring_size,
+                              c->ifindex,
+                              c->fprog.filter ? &c->fprog : nullptr,
+                              c->fanout,
+                              c->fanout_size,
+                              c->fanout_id))) {
+      c->rx.clear();
+      return false;
+    }
+  }
+
+  if (((joining) || (_M_fanout_turn)) && (!join_fanout(join))) {
+    return false;
+  }
+
+  _M_rx_setup_time = now_usec() - start;
+
+  return true;
+}
+
+bool net::worker::join_fanout(const bool* join)
+{
+  // Wait for the turn of the worker.
+  if (_M_fanout_turn) {
+    while (__atomic_load_n(_M_fanout_turn, __ATOMIC_ACQUIRE) !=
+           _M_fanout_index) {
+      if (!__atomic_load_n(&_M_running, __ATOMIC_RELAXED)) {
+        return false;
+      }
+
+      usleep(fanout_sleep);
+    }
+  }
+
+  // Join the fanout groups, then let the packets in.
+  for (size_t i = 0; i < _M_nclasses; i++) {
+    struct traffic_class* c = _M_classes + i;
+
+    if ((join[i]) &&
+        ((!c->rx.fanout(c->fanout, c->fanout_id)) ||
+         (!c->rx.filter(c->fprog.filter ? &c->fprog : nullptr)))) {
+      return false;
+    }
+  }
+
+  // Next worker.
+  if (_M_fanout_turn) {
+    __atomic_store_n(_M_fanout_turn, _M_fanout_index + 1, __ATOMIC_RELEASE);
+  }
+
+  return true;
+}
+
+template<tpacket_versions version, net::worker::type t>
+size_t net::worker::receive(struct traffic_class* c, size_t max_blocks)
+{
+  size_t n = 0;
+
+  _M_rx = &c->rx;
+
+  if (version == TPACKET_V3) {
+    // Receive the blocks in batches of several blocks.
+    while ((n < max_blocks) && (c->rx.next(_M_batch, max_blocks - n))) {
+      packets<t>(_M_batch);
+
+      // Return the blocks to the kernel once the packets have been copied
+      // to the TX ring buffers or queues (or the blocks are still held by
+      // the batches published for the idle workers).
+      c->rx.release(_M_batch);
+
+      n += _M_batch.nblocks;
+    }
+  } else {
+    struct receiver<t> r = {this};
+
+    while ((n < max_blocks) && (c->rx.recv<version>(r))) {
+      n++;
+    }
+  }
+
+  return n;
+}
+
+void net::worker::pace()
+{
+  struct pacer handler;
+  _M_wheel.expire(now_nsec(), handler);
+}
+
+void net::worker::wait(struct pollfd* fds, size_t nfds, int timeout)
+{
+  // If no frames are paced...
+  if (_M_wheel.empty()) {
+    poll(fds, nfds, timeout);
+    return;
+  }
+
+  // Wait until the next frame paced is due at most.
+  uint64_t now = now_nsec();
+  uint64_t next = _M_wheel.next();
+
+  uint64_t ns = MIN(static_cast<uint64_t>(timeout) * 1000000ULL,
+                    (next > now) ? next - now : 0);
+
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000ULL;
+  ts.tv_nsec = ns % 1000000000ULL;
+
+  ppoll(fds, nfds, &ts, nullptr);
+}
+
+template<tpacket_versions version, net::worker::type t>
+void net::worker::loop()
+{
+  static const int timeout = 250; // Milliseconds.
+
+  struct pollfd fds[max_classes];
+  for (size_t i = 0; i < _M_nclasses; i++) {
+    fds[i].fd = _M_classes[i].rx.fd();
+    fds[i].events = POLLIN | POLLERR;
+  }
+
+  do {
+    bool received = false;
+
+    // Send the frames paced which are due (the clock of the rate limiters
+    // is advanced meanwhile).
+    if (_M_nlimiters > 0) {
+      pace();
+    }
+
+    // Service the traffic classes in order (the default class is the last
+    // one), receiving up to `weight` blocks from each of them.
+    for (size_t i = 1; i <= _M_nclasses; i++) {
+      struct traffic_class* c = _M_classes + (i % _M_nclasses);
+
+      if (receive<version, t>(c, c->weight) > 0) {
+        received = true;
+      }
+    }
+
+    // If nothing has been received...
+    if (!received) {
+      // If the worker takes batches from the other workers...
+      if (_M_nqueues > 0) {
+        if (!steal()) {
+          // Wait for packets (briefly, to look for batches again).
+          wait(fds, _M_nclasses, steal_timeout);
+        }
+      } else {
+        // Wait for packets.
+        wait(fds, _M_nclasses, timeout);
+      }
+    }
+
+    if (_M_fragment_mode == fragment_mode::reassemble) {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+      _M_now = ts.tv_sec;
+
+      // Expire incomplete datagrams.
+      _M_reassembler.expire(_M_now);
+    }
+  } while (_M_running);
+
+  // If the worker is being parked, process the packets left in the RX ring
+  // buffers (they are closed afterwards).
+  if (_M_parking) {
+    for (size_t i = 0; i < _M_nclasses; i++) {
+      while (receive<version, t>(_M_classes + i, SIZE_MAX) > 0);
+    }
+  }
+}
+
+void net::worker::run()
+{
+  // Create the ring buffers.
+  bool ready = setup();
+
+  pthread_mutex_lock(&_M_mutex);
+
+  // Set the program of the fanout groups (under the lock, so a program
+  // passed to steer() while the ring buffers were created is not lost).
+  for (size_t i = 0; (ready) && (i < _M_nclasses); i++) {
+    if ((_M_steering) && (!_M_classes[i].rx.fanout_data(_M_steering))) {
+      ready = false;
+    }
+  }
+
+  _M_state = ready ? state::ready : state::failed;
+
+  pthread_cond_broadcast(&_M_cond);
+  pthread_mutex_unlock(&_M_mutex);
+
+  if (!ready) {
+    return;
+  }
+
+  // Wait until all the workers are ready.
+  pthread_mutex_lock(&_M_mutex);
+
+  while ((_M_state == state::ready) && (_M_running)) {
+    pthread_cond_wait(&_M_cond, &_M_mutex);
+  }
+
+  pthread_mutex_unlock(&_M_mutex);
+
+  // With pacing, let the worker be woken up on time (the default timer
+  // slack is 50 microseconds).
+  if (_M_nlimiters > 0) {
+    prctl(PR_SET_TIMERSLACK, pacing_timer_slack);
+  }
+
+  // If the worker is a helper...
+  if (_M_parent) {
+    assist();
+    return;
+  }
+
+  // Select the loop of the configuration of the worker (the traffic
+  // classes have the version of the default class).
+  if (_M_type == type::load_balancer) {
+    switch (_M_classes[0].version) {
+      case TPACKET_V1:
+        loop<TPACKET_V1, type::load_balancer>();
+        break;
+      case TPACKET_V2:
+        loop<TPACKET_V2, type::load_balancer>();
+        break;
+      default:
+        loop<TPACKET_V3, type::load_balancer>();
+    }
+  } else {
+    switch (_M_classes[0].version) {
+      case TPACKET_V1:
+        loop<TPACKET_V1, type::broadcaster>();
+        break;
+      case TPACKET_V2:
+        loop<TPACKET_V2, type::broadcaster>();
+        break;
+      default:
+        loop<TPACKET_V3, type::broadcaster>();
+    }
+  }
+
+  // Return the blocks held by the batches published by the worker.
+  drain();
+}
+
+bool copy_program(const struct sock_fprog* fprog, struct sock_fprog& copy)
+{
+  if (copy.filter) {
+    free(copy.filter);
+    copy.filter = nullptr;
+  }
+
+  if (fprog) {
+    size_t size = fprog->len * sizeof(struct sock_filter);
+
+    if ((copy.filter = reinterpret_cast<struct sock_filter*>(
+                         malloc(size)
+                       )) == nullptr) {
+      return false;
+    }
+
+    memcpy(copy.filter, fprog->filter, size);
+    copy.len = fprog->len;
+  }
+
+  return true;
+}
+
+uint64_t now_usec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (static_cast<uint64_t>(ts.tv_sec) * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+uint64_t now_nsec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+}
+
+bool interface_mtu(unsigned ifindex, size_t& mtu)
+{
+  struct ifreq ifr;
+  if (if_indextoname(ifindex, ifr.ifr_name)) {
+    int fd;
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) != -1) {
+      if (ioctl(fd, SIOCGIFMTU, &ifr) == 0) {
+        close(fd);
+
+        mtu = static_cast<size_t>(ifr.ifr_mtu);
+        return true;
+      }
+
+      close(fd);
+    }
+  }
+
+  return false;
+}
+
+uint16_t ipv4_header_checksum(const uint8_t* ip,
+                              size_t iphdrlen,
+                              const uint8_t* saddr,
+                              const uint8_t* daddr)
+{
+  uint32_t sum = 0;
+
+  for (size_t i = 0; i < offsetof(struct iphdr, check); i += 2) {
+    sum += ntohs(*reinterpret_cast<const uint16_t*>(ip + i));
+  }
+
+  // Source address.
+  sum += ntohs(*reinterpret_cast<const uint16_t*>(saddr));
+  sum += ntohs(*reinterpret_cast<const uint16_t*>(saddr + 2));
+
+  // Destination address.
+  sum += ntohs(*reinterpret_cast<const uint16_t*>(daddr));
+  sum += ntohs(*reinterpret_cast<const uint16_t*>(daddr + 2));
+
+  // Checksum of the options (if any).
+  for (size_t i = sizeof(struct iphdr); i < iphdrlen; i += 2) {
+    sum += ntohs(*reinterpret_cast<const uint16_t*>(ip + i));
+  }
+
+  while (sum > USHRT_MAX) {
+    sum = (sum >> 16) + (sum & 0xffff);
+  }
+
+  return htons(static_cast<uint16_t>(~sum));
+}
+
+uint32_t sum_words(const uint8_t* buf, size_t len)
+{
+  uint32_t sum = 0;
+
+  for (size_t i = 0; i + 1 < len; i += 2) {
+    sum += ntohs(*reinterpret_cast<const uint16_t*>(buf + i));
+  }
+
+  // If the length is odd...
+  if ((len & 0x01) != 0) {
+    sum += static_cast<uint32_t>(buf[len - 1]) << 8;
+  }
+
+  return sum;
+}
+
+uint16_t fold(uint32_t sum)
+{
+  while (sum > USHRT_MAX) {
+    sum = (sum >> 16) + (sum & 0xffff);
+  }
+
+  return static_cast<uint16_t>(sum);
 }
@@ -2,28 +2,78 @@
 #define NET_WORKER_H
 
 #include <stdlib.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
 #include <net/ethernet.h>
 #include "net/ring_buffer.h"
+#include "net/ipv4_reassembler.h"
+#include "net/spsc_queue.h"
+#include "net/work_queue.h"
+#include "net/rate_limiter.h"
+#include "net/timer_wheel.h"
+#include "net/cpu_affinity.h"
+#include "macros/macros.h"
 
 namespace net {
-  class worker {
+  class alignas(CACHE_LINE_SIZE) worker {
     public:
-      static const size_t max_interfaces = 32;
+      // Traffic classes (the default class included).
+      static const size_t max_classes = 8;
+
+      // Helpers of a worker (broadcaster).
+      static const size_t max_helpers = 16;
+
+      // Lanes of a worker with work stealing and flow affinity.
+      static const size_t max_lanes = 16;
+
+      // Weight of a traffic class (maximum number of blocks received from
+      // the ring buffer of the class in each round).
+      static const size_t min_weight = 1;
+      static const size_t max_weight = 1024;
+      static const size_t default_weight = 1;
+
+      // Mirror ports of a worker.
+      static const size_t max_mirrors = 16;
+
+      // Highest VLAN identifier of a mirror port.
+      static const unsigned max_vlan = 4094;
+
+      // Links of a destination.
+      static const size_t max_links = 4;
 
       enum class type {
         load_balancer,
         broadcaster
       };
 
+      enum class fragment_mode {
+        discard,
+        reassemble,
+        forward
+      };
+
+      // Ring buffer handed over to another process.
+      struct handed_ring {
+        unsigned ifindex;
+        size_t cls; // Traffic class (RX ring buffers).
+
+        ring_buffer::state state;
+      };
+
       // Constructor.
       worker();
 
       // Destructor.
       ~worker();
 
-      // Create RX ring buffer.
+      // Create (the ring buffers are created by the worker thread when the
+      // worker is started).
       bool create(type t,
                   tpacket_versions version,
                   size_t ring_size,
@@ -33,57 +83,258 @@ namespace net {
                   size_t fanout_size,
                   uint16_t fanout_id);
 
-      // Add interface for TX.
+      // Create as helper of `parent` (broadcaster): the helper has no RX
+      // ring buffers, it sends each block of packets received by the
+      // worker to its own destinations (a share of the destinations) while
+      // the worker sends it to the other ones.
+      bool create_helper(worker* parent);
+
+      // Add traffic class (RX ring buffer with its own socket filter, of
+      // the same version as the one of the default class). The traffic
+      // classes are serviced in the order they were added and the default
+      // class is serviced the last one.
+      bool add_class(tpacket_versions version,
+                     size_t ring_size,
+                     unsigned ifindex,
+                     const struct sock_fprog* fprog,
+                     int fanout,
+                     size_t fanout_size,
+                     uint16_t fanout_id,
+                     size_t weight);
+
+      // Add interface for TX (if `queue` is not null, the frames are sent
+      // through the queue of a TX thread and, if `shared` is not null,
+      // through a TX ring buffer shared with other workers, instead of a TX
+      // ring buffer of the worker).
       bool add_interface(tpacket_versions version,
                          size_t ring_size,
                          unsigned ifindex,
                          const void* macaddr,
                          const void* addr4,
-                         const void* addr6);
+                         const void* addr6,
+                         spsc_queue* queue = nullptr,
+                         ring_buffer* shared = nullptr);
+
+      // Has the interface been added?
+      bool has_interface(unsigned ifindex) const;
+
+      // Set up handling of IPv4 fragments (the helpers cannot reassemble
+      // them).
+      bool fragments(fragment_mode mode, size_t ndatagrams, unsigned timeout);
+
+      // Let the idle workers of `peers` (this one included) take batches
+      // of packets from this worker when it falls behind (before starting).
+      // With `flow_affinity`, the flows are spread over up to `max_lanes`
+      // lanes by hash: the first lane is always processed by this worker
+      // and the batches of each other lane are processed one at a time, so
+      // the packets of a flow are sent in order. Broadcaster only, without
+      // IPv4 fragments.
+      bool work_stealing(worker* const* peers,
+                         size_t npeers,
+                         bool flow_affinity);
 
-      // Add destination.
+      // Add destination (`limit`: rate limit of the destination, null if
+      // none; `dsr`: direct server return, the packets are sent as
+      // received, only the ethernet addresses are rewritten).
       bool add_destination(unsigned ifindex,
                            const void* macaddr,
                            const char* host,
-                           in_port_t port);
+                           in_port_t port,
+                           const struct rate_limiter::parameters* limit =
+                             nullptr,
+                           bool dsr = false);
 
       bool add_destination(unsigned ifindex,
                            const void* macaddr,
                            const void* addr,
                            socklen_t addrlen,
-                           in_port_t port);
+                           in_port_t port,
+                           const struct rate_limiter::parameters* limit =
+                             nullptr,
+                           bool dsr = false);
+
+      // Add link to the destination added last: its packets are spread by
+      // flow over its links (the first one is the interface and the
+      // ethernet address of the destination), the links whose interface has
+      // no carrier or whose TX ring stalled are skipped.
+      bool add_link(unsigned ifindex, const void* macaddr);
+
+      // Set the flag which tells whether the interface has carrier (null:
+      // always).
+      bool carrier(unsigned ifindex, const bool* running);
+
+      // Get the ethernet address of a multicast group (IPv4: 01:00:5e and
+      // the low 23 bits of the group, IPv6: 33:33 and its low 32 bits),
+      // returns false if the address is not a multicast one.
+      static bool multicast_macaddr(const void* addr,
+                                    socklen_t addrlen,
+                                    uint8_t* macaddr);
+
+      // Add mirror port: the frames received are sent through the interface
+      // byte for byte before being distributed, truncated to `snaplen`
+      // bytes (0: whole frame) and with an 802.1Q tag if `vlan` is not -1.
+      bool add_mirror(unsigned ifindex, size_t snaplen, int vlan);
+
+      // Set the program of the fanout group.
+      bool steer(const struct sock_fprog* fprog);
+
+      // Set the CPU the worker runs on (-1: any).
+      // The memory of the worker is allocated on the NUMA node of the CPU.
+      void affinity(int cpu);
+
+      // Join the fanout groups as member `index`: the ring buffers of the
+      // workers are created in parallel, but each worker waits until `turn`
+      // (the number of members which have joined, shared by the workers)
+      // reaches its index, so its index in the fanout groups is `index`.
+      void fanout_turn(size_t index, size_t* turn);
 
       // Start.
       bool start();
 
+      // Wait until the ring buffers have been created.
+      bool wait_ready();
+
+      // Start processing packets (after wait_ready()).
+      void release();
+
       // Stop.
       void stop();
 
-      // Receive packet.
-      static void fnpacket(const void* pkt, size_t pktlen, void* user);
+      // Park: stop after processing the packets left in the RX ring
+      // buffers and close them (the worker leaves the fanout groups). If
+      // `release_memory` is set, the TX ring buffers are closed too.
+      // start() creates the ring buffers again.
+      void park(bool release_memory);
+
+      // Get the CPU time used by the worker thread (microseconds, 0 if the
+      // worker is stopped).
+      uint64_t cpu_time() const;
+
+      // Get the fraction of the blocks of the RX ring buffers which are
+      // waiting to be processed (the fullest traffic class).
+      double fill() const;
+
+      // Number of ring buffers (RX ring buffers of the traffic classes and
+      // TX ring buffers).
+      size_t nrings() const;
+
+      // Get the ring buffer `n` (and its socket) to hand it over to another
+      // process, returns false if the ring buffer has not been created.
+      // The worker must be stopped.
+      bool ring(size_t n, struct handed_ring& ring, int& fd) const;
+
+      // Take over a ring buffer of another process (before starting), the
+      // worker takes ownership of the socket (the TX ring buffers of the
+      // interfaces which are not used anymore are closed).
+      bool adopt(const struct handed_ring& ring, int fd);
+
+      // Have the RX ring buffers of all the traffic classes been taken over?
+      bool adopted() const;
+
+      // Show the time spent creating the ring buffers.
+      void show_setup_times() const;
 
-      // Receive packets.
-      static void fnpackets(const struct iovec* pkts, size_t npkts, void* user);
+      // Show statistics.
+      bool show_statistics();
+
+      // Add the memory of the worker to its NUMA node.
+      void memory(size_t* nodes) const;
+
+      // Show the locked memory of each ring buffer, returns the total.
+      size_t show_ring_buffers() const;
 
     private:
       static const int send_timeout = 100; // Milliseconds.
 
-      ring_buffer _M_rx;
+      // Time a link whose TX ring stalled is skipped (nanoseconds).
+      static const uint64_t link_retry = 1000000000ULL;
+
+      // Number of rounds without blocks before a helper sleeps.
+      static const unsigned max_idle_rounds = 64;
+
+      // Time a helper sleeps when there are no blocks (microseconds).
+      static const unsigned idle_sleep = 50;
+
+      // Time a worker sleeps while waiting for its turn to join the fanout
+      // groups (microseconds).
+      static const unsigned fanout_sleep = 100;
+
+      // Time an idle worker waits for packets before looking for batches
+      // to take from the other workers (milliseconds).
+      static const int steal_timeout = 1;
+
+      // Timer slack of the workers with pacing (nanoseconds).
+      static const unsigned long pacing_timer_slack = 1000;
+
+      // Number of packets whose headers are prefetched ahead.
+      static const size_t prefetch_distance = 4;
+
+      // Maximum number of packets classified at a time.
+      static const size_t max_classified = ring_buffer::batch_packets;
+
+      // Maximum number of frames sent to a mirror port at a time.
+      static const size_t max_mirrored = ring_buffer::batch_packets;
 
-      struct interface {
+      struct traffic_class {
+        ring_buffer rx;
+        size_t weight;
+
+        // Parameters of the RX ring buffer.
+        tpacket_versions version;
+        size_t ring_size;
+        unsigned ifindex;
+        struct sock_fprog fprog; // Copy of the socket filter.
+        int fanout;
+        size_t fanout_size;
+        uint16_t fanout_id;
+      };
+
+      // The first traffic class is the default one.
+      struct traffic_class _M_classes[max_classes];
+      size_t _M_nclasses;
+
+      struct alignas(CACHE_LINE_SIZE) interface {
         unsigned index;
         uint8_t macaddr[ETHER_ADDR_LEN];
 
+        size_t mtu;
+
         uint8_t addr4[sizeof(struct in_addr)];
         uint8_t addr6[sizeof(struct in6_addr)];
 
         ring_buffer tx;
+
+        // Parameters of the TX ring buffer.
+        tpacket_versions version;
+        size_t ring_size;
+
+        // Queue of the TX thread of the interface (null: TX ring buffer).
+        spsc_queue* queue;
+
+        // TX ring buffer shared by the workers (null: own TX ring buffer).
+        ring_buffer* shared;
+
+        // Has the interface carrier? (null: always).
+        const bool* carrier;
       };
 
-      struct interface _M_interfaces[max_interfaces];
+      // Interfaces for TX (allocated on demand).
+      struct interface** _M_interfaces;
+      size_t _M_interfaces_size;
       size_t _M_ninterfaces;
 
+      // Link to the next hop of a destination.
+      struct link {
+        struct interface* iface;
+        uint8_t macaddr[ETHER_ADDR_LEN];
+
+        // Time until which the link is skipped after its TX ring stalled
+        // (nanoseconds, 0: none).
+        uint64_t retry;
+      };
+
       struct destination {
+        // Ethernet address of the current link.
         uint8_t macaddr[ETHER_ADDR_LEN];
 
         uint8_t addr[sizeof(struct in6_addr)];
@@ -91,7 +342,56 @@ namespace net {
 
         in_port_t port;
 
+        // Interface of the source addresses and of the MTU (the one of the
+        // first link).
         struct interface* iface;
+
+        // Interface of the current link.
+        struct interface* out;
+
+        struct link links[max_links];
+        size_t nlinks;
+        size_t current;
+
+        // Sum of the source and destination addresses (host byte order, not
+        // folded), the checksums of each packet only add it.
+        uint32_t addrsum;
+
+        // Rate limit (null: none).
+        rate_limiter* limiter;
+
+        // Direct server return (the address and the port are not used).
+        bool dsr;
+      };
+
+      // Mirror port.
+      struct mirror {
+        struct interface* iface;
+
+        // Maximum length of the frames (without the tag).
+        size_t snaplen;
+
+        // 802.1Q tag (TPID and TCI, network byte order), if `tagged`.
+        uint8_t tag[4];
+        bool tagged;
+      };
+
+      // Received packet (parsed once for all the destinations).
+      struct packet {
+        const uint8_t* pkt;
+
+        const uint8_t* ip;
+        size_t iphdrlen;
+
+        const struct udphdr* udphdr;
+        size_t udplen;
+
+        // Partial sums (host byte order, not folded):
+        //   iphdrsum: IPv4 header without the addresses.
+        //   udpsum: UDP pseudo-header, header and data without the
+        //           addresses and the destination port.
+        uint32_t iphdrsum;
+        uint32_t udpsum;
       };
 
       enum class family {
@@ -99,27 +399,87 @@ namespace net {
         ipv6
       };
 
+      enum class packet_kind : uint8_t {
+        malformed,
+        ipv4,
+        ipv4_fragment,
+        ipv6
+      };
+
+      // Packets classified by the first pass over a batch (an array per
+      // field, in the order of the packets).
+      struct classified_packets {
+        // Length of the frame.
+        uint32_t len[max_classified];
+
+        // First byte of the IP header (version and IPv4 header length).
+        uint8_t vihl[max_classified];
+
+        // IPv4 flags and fragment offset (network byte order).
+        uint16_t frag_off[max_classified];
+
+        // Length of the IP header.
+        uint16_t iphdrlen[max_classified];
+
+        // UDP length (0 if the frame is too short).
+        uint16_t udplen[max_classified];
+
+        packet_kind kind[max_classified];
+
+        // Indices of the IPv4 packets (fragments included) and of the IPv6
+        // packets.
+        uint16_t ipv4[max_classified];
+        size_t nipv4;
+
+        uint16_t ipv6[max_classified];
+        size_t nipv6;
+      };
+
       class destinations {
         public:
           // Constructor.
-          destinations(family af);
+          destinations();
 
           // Destructor.
           ~destinations();
 
-          // Initialize.
-          void init(type t);
-
-          // Add destination.
+          // Add destination (the rate limiter, if any, uses the clock of
+          // `wheel`).
           bool add(const void* macaddr,
                    const void* addr,
                    socklen_t addrlen,
                    in_port_t port,
-                   struct interface* iface);
+                   struct interface* iface,
+                   const struct rate_limiter::parameters* limit,
+                   timer_wheel* wheel,
+                   bool dsr);
+
+          // Add link to the last destination.
+          bool add_link(struct interface* iface, const void* macaddr);
 
-          // Process packet.
+          // Process packet (`t` is the type of the worker and `af` the
+          // address family of the packet).
+          template<type t, family af>
           void process(const void* pkt, size_t pktlen);
 
+          // Process packet whose headers have been parsed and checked.
+          template<type t, family af>
+          void process(struct packet& p);
+
+          // Process IPv4 fragment.
+          template<type t>
+          void process_fragment(const void* pkt, size_t pktlen);
+
+          // Add the memory of the destinations to its NUMA node.
+          void memory(size_t* nodes) const;
+
+          // Add the frames dropped and paced by the rate limits.
+          void rate_limits(uint64_t& drops, uint64_t& paced) const;
+
+          // Send the frames paced which are within the limit (called when
+          // the timer of the rate limiter of `dest` expires).
+          static void release(struct destination* dest);
+
         private:
           struct destination* _M_destinations;
           size_t _M_size;
@@ -127,44 +487,358 @@ namespace net {
 
           size_t _M_idx;
 
-          typedef void (destinations::*fnprocess)(const void* pkt,
-                                                  size_t pktlen);
-
-          typedef void (*fnsend)(struct destination* dest,
-                                 const void* pkt,
-                                 size_t pktlen);
-
-          fnprocess _M_process;
-          fnsend _M_send;
+          // Number of direct server return destinations.
+          size_t _M_ndsr;
 
           // Forward packet.
-          void forward(const void* pkt, size_t pktlen);
+          template<family af>
+          void forward(const struct packet& p);
 
           // Broadcast packet.
-          void broadcast(const void* pkt, size_t pktlen);
+          template<family af>
+          void broadcast(const struct packet& p);
+
+          // Forward IPv4 fragment (all the fragments of a datagram are sent
+          // to the same destination).
+          void forward_fragment(const void* pkt, size_t pktlen);
+
+          // Broadcast IPv4 fragment.
+          void broadcast_fragment(const void* pkt, size_t pktlen);
+
+          // Parse packet (set and check its headers).
+          template<family af>
+          static bool parse(const void* pkt, size_t pktlen, struct packet& p);
+
+          // Sum up the checksums of the packet.
+          template<family af>
+          static void sum(struct packet& p);
+
+          // Select the link of the flow (the next one which can send if it
+          // cannot).
+          static void select(struct destination* dest, uint32_t hash);
+
+          // Hash of the flow of the packet (source address and port).
+          template<family af>
+          static uint32_t flow_hash(const struct packet& p);
+
+          // Send frame through the current link of the destination.
+          static bool output(struct destination* dest,
+                             const struct iovec* iov,
+                             size_t iovcnt);
+
+          // Skip the link for a while (its TX ring stalled).
+          static void stalled(struct link* link);
+
+          // Send frame to the destination (within its rate limit).
+          static bool transmit(struct destination* dest,
+                               const struct iovec* iov,
+                               size_t iovcnt);
+
+          // Send frame to a rate limited destination (the frames over the
+          // limit are dropped or paced).
+          static bool limit(struct destination* dest,
+                            const struct iovec* iov,
+                            size_t iovcnt);
+
+          // Send frame as received, with the ethernet addresses of the
+          // destination (direct server return).
+          static void send_dsr(struct destination* dest,
+                               const void* pkt,
+                               size_t pktlen);
+
+          // Send packet to the destination.
+          template<family af>
+          static void send_to(struct destination* dest,
+                              const struct packet& p);
+
+          // Parse IPv4 packet.
+          static bool parse_ipv4(const void* pkt,
+                                 size_t pktlen,
+                                 struct packet& p);
+
+          // Sum up the checksums of the IPv4 packet.
+          static void sum_ipv4(struct packet& p);
 
           // Send packet for IPv4.
           static void send_ipv4(struct destination* dest,
-                                const void* pkt,
-                                size_t pktlen);
+                                const struct packet& p);
+
+          // Send IPv4 datagram in fragments.
+          static void send_ipv4_fragments(struct destination* dest,
+                                          const uint8_t* ip,
+                                          size_t iphdrlen,
+                                          const struct udphdr* udphdr,
+                                          uint16_t udp_checksum);
+
+          // Send IPv4 fragment.
+          static void send_ipv4_fragment(struct destination* dest,
+                                         const void* pkt,
+                                         size_t pktlen);
+
+          // Parse IPv6 packet.
+          static bool parse_ipv6(const void* pkt,
+                                 size_t pktlen,
+                                 struct packet& p);
+
+          // Sum up the checksum of the IPv6 packet.
+          static void sum_ipv6(struct packet& p);
 
           // Send packet for IPv6.
           static void send_ipv6(struct destination* dest,
-                                const void* pkt,
-                                size_t pktlen);
+                                const struct packet& p);
 
           // Disable copy constructor and assignment operator.
           destinations(const destinations&) = delete;
           destinations& operator=(const destinations&) = delete;
       };
 
+      // Receiver of the packets of the RX ring buffers (`t` is the type of
+      // the worker).
+      template<type t>
+      struct receiver {
+        worker* w;
+
+        void packet(const void* pkt, size_t pktlen);
+        void packets(const ring_buffer::batch& b);
+      };
+
+      type _M_type;
+
       destinations _M_ipv4_destinations;
       destinations _M_ipv6_destinations;
 
+      // Number of destinations (both address families).
+      size_t _M_ndests;
+
+      // Destinations of the destination added last.
+      destinations* _M_last;
+
+      struct mirror _M_mirrors[max_mirrors];
+      size_t _M_nmirrors;
+
+      // Mirror statistics.
+      uint64_t _M_mirrored;
+      uint64_t _M_mirror_drops;
+
+      fragment_mode _M_fragment_mode;
+      ipv4_reassembler _M_reassembler;
+
+      // Current time (seconds).
+      uint64_t _M_now;
+
+      // Timers of the rate limiters of the destinations (pacing).
+      timer_wheel _M_wheel;
+
+      // Number of destinations with a rate limit.
+      size_t _M_nlimiters;
+
+      // Handler of the timers of the rate limiters.
+      struct pacer {
+        void operator()(struct timer_wheel::timer* t) const;
+      };
+
+      // CPU the worker runs on (-1: any).
+      int _M_cpu;
+
+      // NUMA node of the CPU (-1: any).
+      int _M_node;
+
+      // Program of the fanout group (set when the RX ring buffers are
+      // created).
+      const struct sock_fprog* _M_steering;
+
+      enum class state {
+        stopped,
+        setting_up,
+        ready,
+        running,
+        failed
+      };
+
+      state _M_state;
+
+      pthread_mutex_t _M_mutex;
+      pthread_cond_t _M_cond;
+
+      // Time spent creating the ring buffers (microseconds).
+      uint64_t _M_tx_setup_time;
+      uint64_t _M_rx_setup_time;
+
+      // Index in the fanout groups and number of members which have joined
+      // (null: join as soon as created).
+      size_t _M_fanout_index;
+      size_t* _M_fanout_turn;
+
+      // Worker this worker helps (null: not a helper).
+      worker* _M_parent;
+
+      // Helpers of this worker.
+      worker* _M_helpers[max_helpers];
+      size_t _M_nhelpers;
+
+      // Block of packets being sent by the worker and its helpers.
+      struct alignas(CACHE_LINE_SIZE) block {
+        const struct iovec* pkts;
+        size_t npkts;
+
+        // Sequence number of the block (written by the worker).
+        uint64_t seq;
+
+        // Number of blocks completed by the helpers (written by the
+        // helpers).
+        alignas(CACHE_LINE_SIZE) uint64_t done;
+      };
+
+      struct block _M_block;
+
+      // Workers the batches are taken from (work stealing).
+      worker* const* _M_peers;
+      size_t _M_npeers;
+
+      // Index of this worker in `_M_peers`.
+      size_t _M_self;
+
+      // Queues of the batches published by the worker (work stealing): a
+      // single one or, with flow affinity, one per lane but the first one.
+      work_queue* _M_queues[max_lanes];
+      size_t _M_nqueues;
+
+      bool _M_flow_affinity;
+
+      // Batches being filled (flow affinity, one per queue).
+      work_queue::batch* _M_batches[max_lanes];
+
+      // RX ring buffer being received from.
+      ring_buffer* _M_rx;
+
+      // Batch of packets being processed (TPACKET_V3).
+      ring_buffer::batch _M_batch;
+
+      // Packets being processed.
+      struct classified_packets _M_classified;
+
+      // Number of malformed packets discarded.
+      uint64_t _M_malformed;
+
+      // Work stealing statistics.
+      uint64_t _M_published;
+      uint64_t _M_taken;
+
       pthread_t _M_thread;
 
       bool _M_running;
 
+      // Is the worker being parked?
+      bool _M_parking;
+
+      // Process packet (`t` is the type of the worker).
+      template<type t>
+      void packet(const void* pkt, size_t pktlen);
+
+      // Process packet.
+      void packet(const void* pkt, size_t pktlen);
+
+      // Process batch of packets (`t` is the type of the worker).
+      template<type t>
+      void packets(const ring_buffer::batch& b);
+
+      // Process IPv4 fragment.
+      template<type t>
+      void fragment(const void* pkt, size_t pktlen);
+
+      // Classify the packets (first pass, up to `max_classified` packets).
+      void classify(const struct iovec* pkts, size_t npkts);
+
+      // Set the headers of the classified packet `idx`.
+      void headers(const struct iovec* pkts,
+                   size_t idx,
+                   struct packet& p) const;
+
+      // Process packets in two passes: classify them (the malformed ones
+      // are discarded), then send the packets of each address family (`t`
+      // is the type of the worker).
+      template<type t>
+      void handle(const struct iovec* pkts, size_t npkts);
+
+      // Send the frames to the mirror ports.
+      void mirror(const struct iovec* pkts, size_t npkts);
+
+      // Send block of packets with the helpers.
+      void dispatch(const struct iovec* pkts, size_t npkts);
+
+      // Run as helper.
+      void assist();
+
+      // Send packets to the destinations (with the helpers, if any).
+      template<type t>
+      void deliver(const struct iovec* pkts, size_t npkts);
+
+      void deliver(const struct iovec* pkts, size_t npkts);
+
+      // Send the packets of a block, publishing them for the idle workers
+      // when the worker falls behind (work stealing): `hashes` are the flow
+      // hashes of the packets and `backlog` tells whether there are more
+      // blocks waiting.
+      void share(const struct iovec* pkts,
+                 const uint32_t* hashes,
+                 size_t npkts,
+                 size_t block,
+                 bool backlog);
+
+      // Reserve the next batch of the queue (processing the oldest
+      // batches while the queue is full).
+      work_queue::batch* reserve(work_queue* queue);
+
+      // Process a batch taken from a queue and return it.
+      void process(work_queue* queue, work_queue::batch* b);
+
+      // Take a batch from the workers (this one first) and process it,
+      // returns whether a batch has been processed.
+      bool steal();
+
+      // Process the batches published by the worker until all of them have
+      // been processed (before stopping).
+      void drain();
+
+      // Send frame through the interface.
+      static bool send(struct interface* iface,
+                       const struct iovec* iov,
+                       size_t iovcnt);
+
+      // Send frames through the interface, each one made of `iovcnt`
+      // consecutive iovecs (a single kick for all of them).
+      static bool send(struct interface* iface,
+                       const struct iovec* frames,
+                       size_t iovcnt,
+                       size_t nframes);
+
+      // Advance the clock of the rate limiters and send the frames paced
+      // whose time has come.
+      void pace();
+
+      // Wait for packets up to `timeout` milliseconds (less if a frame
+      // paced is due earlier).
+      void wait(struct pollfd* fds, size_t nfds, int timeout);
+
+      // Create the ring buffers.
+      bool setup();
+
+      // Join the fanout groups of the traffic classes flagged in `join`
+      // (in turn, see fanout_turn(), the workers whose RX ring buffers
+      // already exist still take their turn).
+      bool join_fanout(const bool* join);
+
+      // Receive up to `max_blocks` blocks (TPACKET_V3) or packets from the
+      // RX ring buffer of the traffic class, returns how many have been
+      // received.
+      template<tpacket_versions version, type t>
+      size_t receive(struct traffic_class* c, size_t max_blocks);
+
+      // Receive packets until the worker is stopped (`version` is the
+      // version of the RX ring buffers and `t` the type of the worker).
+      template<tpacket_versions version, type t>
+      void loop();
+
       // Run.
       static void* run(void* arg);
       void run();
@@ -175,95 +849,562 @@ namespace net {
   };
 
   inline worker::worker()
-    : _M_ninterfaces(0),
-      _M_ipv4_destinations(family::ipv4),
-      _M_ipv6_destinations(family::ipv6),
-      _M_running(false)
+    : _M_nclasses(0),
+      _M_interfaces(nullptr),
+      _M_interfaces_size(0),
+      _M_ninterfaces(0),
+      _M_type(type::load_balancer),
+      _M_ndests(0),
+      _M_last(nullptr),
+      _M_nmirrors(0),
+      _M_mirrored(0),
+      _M_mirror_drops(0),
+      _M_fragment_mode(fragment_mode::discard),
+      _M_now(0),
+      _M_nlimiters(0),
+      _M_cpu(-1),
+      _M_node(-1),
+      _M_steering(nullptr),
+      _M_state(state::stopped),
+      _M_tx_setup_time(0),
+      _M_rx_setup_time(0),
+      _M_fanout_index(0),
+      _M_fanout_turn(nullptr),
+      _M_parent(nullptr),
+      _M_nhelpers(0),
+      _M_peers(nullptr),
+      _M_npeers(0),
+      _M_self(0),
+      _M_nqueues(0),
+      _M_flow_affinity(false),
+      _M_rx(nullptr),
+      _M_malformed(0),
+      _M_published(0),
+      _M_taken(0),
+      _M_running(false),
+      _M_parking(false)
   {
-    _M_rx.callbacks(fnpacket, fnpackets, this);
+    _M_block.pkts = nullptr;
+    _M_block.npkts = 0;
+    _M_block.seq = 0;
+    _M_block.done = 0;
+
+    for (size_t i = 0; i < max_classes; i++) {
+      _M_classes[i].fprog.filter = nullptr;
+    }
+
+    pthread_mutex_init(&_M_mutex, nullptr);
+    pthread_cond_init(&_M_cond, nullptr);
   }
 
   inline worker::~worker()
   {
     stop();
+
+    for (size_t i = 0; i < max_classes; i++) {
+      if (_M_classes[i].fprog.filter) {
+        free(_M_classes[i].fprog.filter);
+      }
+    }
+
+    if (_M_interfaces) {
+      for (size_t i = 0; i < _M_ninterfaces; i++) {
+        _M_interfaces[i]->~interface();
+        free(_M_interfaces[i]);
+      }
+
+      free(_M_interfaces);
+    }
+
+    for (size_t i = 0; i < _M_nqueues; i++) {
+      _M_queues[i]->~work_queue();
+      free(_M_queues[i]);
+    }
+
+    pthread_cond_destroy(&_M_cond);
+    pthread_mutex_destroy(&_M_mutex);
+  }
+
+  inline size_t worker::nrings() const
+  {
+    return _M_nclasses + _M_ninterfaces;
   }
 
-  inline void worker::stop()
+  inline void worker::affinity(int cpu)
   {
-    if (_M_running) {
-      _M_running = false;
-      pthread_join(_M_thread, nullptr);
+    _M_cpu = cpu;
+    _M_node = (cpu >= 0) ? cpu_affinity::node(cpu) : -1;
+  }
+
+  inline void worker::fanout_turn(size_t index, size_t* turn)
+  {
+    _M_fanout_index = index;
+    _M_fanout_turn = turn;
+  }
+
+  inline bool worker::steer(const struct sock_fprog* fprog)
+  {
+    bool ret = true;
+
+    // The worker thread sets the state (and the program of the fanout
+    // groups) under the lock.
+    pthread_mutex_lock(&_M_mutex);
+
+    // If the RX ring buffers have been created...
+    if ((_M_state == state::ready) || (_M_state == state::running)) {
+      // Each traffic class has its own fanout group.
+      for (size_t i = 0; i < _M_nclasses; i++) {
+        if (!_M_classes[i].rx.fanout_data(fprog)) {
+          ret = false;
+          break;
+        }
+      }
+    }
+
+    // Otherwise, the program will be set when they are created.
+    if (ret) {
+      _M_steering = fprog;
     }
+
+    pthread_mutex_unlock(&_M_mutex);
+
+    return ret;
   }
 
-  inline void worker::fnpacket(const void* pkt, size_t pktlen, void* user)
+  inline bool worker::send(struct interface* iface,
+                           const struct iovec* iov,
+                           size_t iovcnt)
   {
-    switch (reinterpret_cast<const uint8_t*>(
-              pkt
-            )[sizeof(struct ether_header)] & 0xf0) {
+    if (iface->queue) {
+      return iface->queue->push(iov, iovcnt, send_timeout);
+    } else if (iface->shared) {
+      // The shared TX ring buffers are TPACKET_V2 ones.
+      return iface->shared->send<TPACKET_V2>(iov, iovcnt, send_timeout);
+    }
+
+    switch (iface->version) {
+      case TPACKET_V1:
+        return iface->tx.send<TPACKET_V1>(iov, iovcnt, send_timeout);
+      case TPACKET_V2:
+        return iface->tx.send<TPACKET_V2>(iov, iovcnt, send_timeout);
+      default:
+        return iface->tx.send<TPACKET_V3>(iov, iovcnt, send_timeout);
+    }
+  }
+
+  inline bool worker::send(struct interface* iface,
+                           const struct iovec* frames,
+                           size_t iovcnt,
+                           size_t nframes)
+  {
+    if (iface->queue) {
+      // The TX thread sends the frames in batches.
+      for (size_t i = 0; i < nframes; i++, frames += iovcnt) {
+        if (!iface->queue->push(frames, iovcnt, send_timeout)) {
+          return false;
+        }
+      }
+
+      return true;
+    } else if (iface->shared) {
+      return iface->shared->sendmmsg(frames, iovcnt, nframes, send_timeout);
+    }
+
+    return iface->tx.sendmmsg(frames, iovcnt, nframes, send_timeout);
+  }
+
+  template<worker::type t>
+  inline void worker::receiver<t>::packet(const void* pkt, size_t pktlen)
+  {
+    w->packet<t>(pkt, pktlen);
+  }
+
+  template<worker::type t>
+  inline void worker::receiver<t>::packets(const ring_buffer::batch& b)
+  {
+    w->packets<t>(b);
+  }
+
+  template<worker::type t>
+  inline void worker::packet(const void* pkt, size_t pktlen)
+  {
+    if (_M_nmirrors > 0) {
+      struct iovec frame = {const_cast<void*>(pkt), pktlen};
+      mirror(&frame, 1);
+
+      // If the worker only mirrors, the packet is not parsed.
+      if (_M_ndests == 0) {
+        return;
+      }
+    }
+
+    const uint8_t* ip = reinterpret_cast<const uint8_t*>(pkt) +
+                        sizeof(struct ether_header);
+
+    switch (*ip & 0xf0) {
       case 0x40: // IPv4.
-        reinterpret_cast<worker*>(user)->_M_ipv4_destinations.process(pkt,
-                                                                      pktlen);
+        // If the packet is not a fragment...
+        if ((reinterpret_cast<const struct iphdr*>(ip)->frag_off &
+             htons(IP_MF | IP_OFFMASK)) == 0) {
+          _M_ipv4_destinations.process<t, family::ipv4>(pkt, pktlen);
+        } else {
+          fragment<t>(pkt, pktlen);
+        }
 
         break;
       case 0x60: // IPv6.
-        reinterpret_cast<worker*>(user)->_M_ipv6_destinations.process(pkt,
-                                                                      pktlen);
+        _M_ipv6_destinations.process<t, family::ipv6>(pkt, pktlen);
+        break;
+    }
+  }
 
+  inline void worker::packet(const void* pkt, size_t pktlen)
+  {
+    if (_M_type == type::load_balancer) {
+      packet<type::load_balancer>(pkt, pktlen);
+    } else {
+      packet<type::broadcaster>(pkt, pktlen);
+    }
+  }
+
+  template<worker::type t>
+  inline void worker::packets(const ring_buffer::batch& b)
+  {
+    // If the worker publishes batches for the idle workers...
+    if (_M_nqueues > 0) {
+      // The packets are published by block (the block is held until they
+      // have been processed), the worker is falling behind if there are
+      // more blocks after the block.
+      for (size_t i = 0, begin = 0; i < b.nblocks; begin = b.ends[i++]) {
+        share(b.pkts + begin,
+              b.rxhash + begin,
+              b.ends[i] - begin,
+              b.blocks[i],
+              (i + 1 < b.nblocks) || (_M_rx->backlog()));
+      }
+    } else {
+      deliver<t>(b.pkts, b.npkts);
+    }
+  }
+
+  template<worker::type t>
+  inline void worker::fragment(const void* pkt, size_t pktlen)
+  {
+    switch (_M_fragment_mode) {
+      case fragment_mode::reassemble:
+        {
+          const void* datagram;
+          size_t len;
+          if (_M_reassembler.add(pkt, pktlen, _M_now, datagram, len)) {
+            _M_ipv4_destinations.process<t, family::ipv4>(datagram, len);
+          }
+        }
+
+        break;
+      case fragment_mode::forward:
+        _M_ipv4_destinations.process_fragment<t>(pkt, pktlen);
+        break;
+      default:
         break;
     }
   }
 
-  inline void worker::fnpackets(const struct iovec* pkts,
-                                size_t npkts,
-                                void* user)
+  template<worker::type t>
+  inline void worker::deliver(const struct iovec* pkts, size_t npkts)
+  {
+    if (_M_nmirrors > 0) {
+      mirror(pkts, npkts);
+
+      // If the worker only mirrors, the packets are not parsed.
+      if (_M_ndests == 0) {
+        return;
+      }
+    }
+
+    // If the worker has helpers (broadcaster)...
+    if ((t == type::broadcaster) && (_M_nhelpers > 0)) {
+      dispatch(pkts, npkts);
+      return;
+    }
+
+    handle<t>(pkts, npkts);
+  }
+
+  inline void worker::deliver(const struct iovec* pkts, size_t npkts)
   {
-    // For each packet...
-    for (size_t i = 0; i < npkts; i++) {
-      fnpacket(pkts[i].iov_base, pkts[i].iov_len, user);
+    if (_M_type == type::load_balancer) {
+      deliver<type::load_balancer>(pkts, npkts);
+    } else {
+      deliver<type::broadcaster>(pkts, npkts);
     }
   }
 
-  inline worker::destinations::destinations(family af)
+  inline void worker::headers(const struct iovec* pkts,
+                              size_t idx,
+                              struct packet& p) const
+  {
+    p.pkt = reinterpret_cast<const uint8_t*>(pkts[idx].iov_base);
+    p.ip = p.pkt + sizeof(struct ether_header);
+    p.iphdrlen = _M_classified.iphdrlen[idx];
+    p.udphdr = reinterpret_cast<const struct udphdr*>(p.ip + p.iphdrlen);
+    p.udplen = _M_classified.udplen[idx];
+  }
+
+  template<worker::type t>
+  inline void worker::handle(const struct iovec* pkts, size_t npkts)
+  {
+    while (npkts > 0) {
+      size_t n = MIN(npkts, max_classified);
+
+      // First pass: classify the packets.
+      classify(pkts, n);
+
+      // Second pass: send the IPv4 packets, then the IPv6 ones (the order
+      // of the packets of each family is kept).
+      for (size_t i = 0; i < _M_classified.nipv4; i++) {
+        size_t idx = _M_classified.ipv4[i];
+
+        if (_M_classified.kind[idx] == packet_kind::ipv4) {
+          struct packet p;
+          headers(pkts, idx, p);
+
+          _M_ipv4_destinations.process<t, family::ipv4>(p);
+        } else {
+          fragment<t>(pkts[idx].iov_base, pkts[idx].iov_len);
+        }
+      }
+
+      for (size_t i = 0; i < _M_classified.nipv6; i++) {
+        struct packet p;
+        headers(pkts, _M_classified.ipv6[i], p);
+
+        _M_ipv6_destinations.process<t, family::ipv6>(p);
+      }
+
+      pkts += n;
+      npkts -= n;
+    }
+  }
+
+  inline worker::destinations::destinations()
     : _M_destinations(nullptr),
       _M_size(0),
       _M_used(0),
       _M_idx(0),
-      _M_send((af == family::ipv4) ? send_ipv4 : send_ipv6)
+      _M_ndsr(0)
   {
   }
 
   inline worker::destinations::~destinations()
   {
     if (_M_destinations) {
-      free(_M_destinations);
+      for (size_t i = 0; i < _M_used; i++) {
+        if (_M_destinations[i].limiter) {
+          _M_destinations[i].limiter->~rate_limiter();
+          free(_M_destinations[i].limiter);
+        }
+      }
+
+      munmap(_M_destinations,
+             (_M_size * sizeof(struct destination) + getpagesize() - 1) &
+             ~(getpagesize() - 1));
+    }
+  }
+
+  template<worker::type t, worker::family af>
+  inline void worker::destinations::process(const void* pkt, size_t pktlen)
+  {
+    struct packet p;
+    if (parse<af>(pkt, pktlen, p)) {
+      process<t, af>(p);
+    }
+  }
+
+  template<worker::type t, worker::family af>
+  inline void worker::destinations::process(struct packet& p)
+  {
+    if (_M_used > 0) {
+      // The checksums of the packet are summed up once, each destination
+      // only adds its addresses and port (the direct server return
+      // destinations don't need them).
+      if (_M_ndsr < _M_used) {
+        sum<af>(p);
+      }
+
+      if (t == type::load_balancer) {
+        forward<af>(p);
+      } else {
+        broadcast<af>(p);
+      }
     }
   }
 
-  inline void worker::destinations::init(type t)
+  template<worker::type t>
+  inline void worker::destinations::process_fragment(const void* pkt,
+                                                     size_t pktlen)
   {
     if (t == type::load_balancer) {
-      _M_process = &destinations::forward;
+      forward_fragment(pkt, pktlen);
     } else {
-      _M_process = &destinations::broadcast;
+      broadcast_fragment(pkt, pktlen);
     }
   }
 
-  inline void worker::destinations::process(const void* pkt, size_t pktlen)
+  template<worker::family af>
+  inline void worker::destinations::forward(const struct packet& p)
   {
-    (this->*_M_process)(pkt, pktlen);
+    send_to<af>(_M_destinations + _M_idx, p);
+
+    if (++_M_idx == _M_used) {
+      _M_idx = 0;
+    }
   }
 
-  inline void worker::destinations::forward(const void* pkt, size_t pktlen)
+  template<worker::family af>
+  inline void worker::destinations::broadcast(const struct packet& p)
   {
-    _M_send(_M_destinations + _M_idx, pkt, pktlen);
-    _M_idx = (_M_idx + 1) % _M_used;
+    for (size_t i = 0; i < _M_used; i++) {
+      send_to<af>(_M_destinations + i, p);
+    }
   }
 
-  inline void worker::destinations::broadcast(const void* pkt, size_t pktlen)
+  inline void worker::destinations::forward_fragment(const void* pkt,
+                                                     size_t pktlen)
+  {
+    // If the family has no destinations, the fragment is dropped (like the
+    // packets which are not fragments).
+    if (_M_used == 0) {
+      return;
+    }
+
+    const struct iphdr* iphdr = reinterpret_cast<const struct iphdr*>(
+                                  reinterpret_cast<const uint8_t*>(pkt) +
+                                  sizeof(struct ether_header)
+                                );
+
+    // Select destination based on the source and destination addresses and
+    // the IP identification.
+    uint32_t h = (iphdr->saddr ^ iphdr->daddr ^ iphdr->id) * 0x9e3779b1;
+
+    send_ipv4_fragment(_M_destinations + ((h >> 16) % _M_used), pkt, pktlen);
+  }
+
+  inline void worker::destinations::broadcast_fragment(const void* pkt,
+                                                       size_t pktlen)
   {
     for (size_t i = 0; i < _M_used; i++) {
-      _M_send(_M_destinations + i, pkt, pktlen);
+      send_ipv4_fragment(_M_destinations + i, pkt, pktlen);
+    }
+  }
+
+  template<worker::family af>
+  inline bool worker::destinations::parse(const void* pkt,
+                                          size_t pktlen,
+                                          struct packet& p)
+  {
+    return (af == family::ipv4) ? parse_ipv4(pkt, pktlen, p) :
+                                  parse_ipv6(pkt, pktlen, p);
+  }
+
+  template<worker::family af>
+  inline void worker::destinations::sum(struct packet& p)
+  {
+    if (af == family::ipv4) {
+      sum_ipv4(p);
+    } else {
+      sum_ipv6(p);
+    }
+  }
+
+  inline bool worker::destinations::transmit(struct destination* dest,
+                                             const struct iovec* iov,
+                                             size_t iovcnt)
+  {
+    return (!dest->limiter) ? output(dest, iov, iovcnt) :
+                              limit(dest, iov, iovcnt);
+  }
+
+  inline bool worker::destinations::output(struct destination* dest,
+                                           const struct iovec* iov,
+                                           size_t iovcnt)
+  {
+    if (send(dest->out, iov, iovcnt)) {
+      return true;
+    }
+
+    // Fail over to the other links.
+    if (dest->nlinks > 1) {
+      stalled(dest->links + dest->current);
+    }
+
+    return false;
+  }
+
+  template<worker::family af>
+  inline uint32_t worker::destinations::flow_hash(const struct packet& p)
+  {
+    uint32_t h = p.udphdr->source;
+
+    if (af == family::ipv4) {
+      const struct iphdr* iphdr = reinterpret_cast<const struct iphdr*>(p.ip);
+      h ^= iphdr->saddr;
+    } else {
+      const struct ip6_hdr* ip6hdr = reinterpret_cast<const struct ip6_hdr*>(
+                                       p.ip
+                                     );
+
+      for (size_t i = 0; i < 4; i++) {
+        h ^= ip6hdr->ip6_src.s6_addr32[i];
+      }
+    }
+
+    return h * 0x9e3779b1;
+  }
+
+  inline void worker::pacer::operator()(struct timer_wheel::timer* t) const
+  {
+    destinations::release(reinterpret_cast<struct destination*>(t->data));
+  }
+
+  inline void worker::destinations::send_dsr(struct destination* dest,
+                                             const void* pkt,
+                                             size_t pktlen)
+  {
+    // The packet cannot be fragmented (its headers are kept).
+    if (pktlen - sizeof(struct ether_header) > dest->iface->mtu) {
+      return;
+    }
+
+    struct iovec vec[] = {
+      // Destination ethernet address.
+      {dest->macaddr, ETHER_ADDR_LEN},
+
+      // Source ethernet address.
+      {dest->out->macaddr, ETHER_ADDR_LEN},
+
+      // Rest of the frame (from the packet type ID).
+      {const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(pkt)) +
+       offsetof(struct ether_header, ether_type),
+       pktlen - offsetof(struct ether_header, ether_type)}
+    };
+
+    transmit(dest, vec, ARRAY_SIZE(vec));
+  }
+
+  template<worker::family af>
+  inline void worker::destinations::send_to(struct destination* dest,
+                                            const struct packet& p)
+  {
+    if (dest->nlinks > 1) {
+      select(dest, flow_hash<af>(p));
+    }
+
+    if (dest->dsr) {
+      send_dsr(dest, p.pkt, (p.ip - p.pkt) + p.iphdrlen + p.udplen);
+    } else if (af == family::ipv4) {
+      send_ipv4(dest, p);
+    } else {
+      send_ipv6(dest, p);
     }
   }
 